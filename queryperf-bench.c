@@ -0,0 +1,725 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Microbenchmarks of queryperf's Hot Path  (queryperf-bench.c)
+ ***
+ ***	Times the functions the main loop spends its time in, taken
+ ***	unchanged from queryperf.c, over a generated corpus and a range of
+ ***	outstanding-query windows.  Runs are reproducible for a given seed.
+ ***/
+
+/* Build queryperf itself in, with its own mainline renamed */
+#define main queryperf_main
+#include "queryperf.c"
+#undef main
+
+/*
+ * Configuration defaults
+ */
+
+#define DEF_BENCH_WINDOWS		"64,4096,65536"
+#define DEF_BENCH_CORPORA		"1000,100000"
+#define DEF_BENCH_TIME			0.1		/* in seconds */
+#define DEF_BENCH_REPEATS		5
+#define DEF_BENCH_SEED			1
+
+/*
+ * Other constants / definitions
+ */
+
+#define MAX_BENCH_PARAMS		16
+#define MAX_BENCH_WINDOW		65536	/* one per message id */
+#define BENCH_RTT_SPREAD		0.05	/* in seconds */
+
+/*
+ * A benchmark: setup (untimed) prepares for a batch of operations, run
+ * (timed) performs n of them.  A batch of 0 means one of the window size;
+ * benchmarks with uses_window set are run at each window size, and all of
+ * them at each corpus size.
+ */
+struct benchmark {
+	const char *name;
+	int uses_window;
+	unsigned int batch;
+	void (*setup)(void);
+	void (*run)(unsigned int n);
+};
+
+/*
+ * Configuration options (global)
+ */
+
+unsigned int bench_windows[MAX_BENCH_PARAMS];
+unsigned int bench_num_windows;				/* init 0 */
+unsigned int bench_corpora[MAX_BENCH_PARAMS];
+unsigned int bench_num_corpora;				/* init 0 */
+double bench_time = DEF_BENCH_TIME;
+unsigned int bench_repeats = DEF_BENCH_REPEATS;
+unsigned long long bench_seed = DEF_BENCH_SEED;
+char *bench_only;					/* init NULL */
+int bench_csv = FALSE;
+
+/*
+ * Other global stuff
+ */
+
+unsigned int bench_window;				/* init 0 */
+unsigned int bench_max_window;				/* init 0 */
+unsigned int bench_corpus;				/* init 0 */
+char **corpus_line;					/* init NULL */
+char (*corpus_qname)[MAX_DOMAIN_LEN + 1];		/* init NULL */
+int *corpus_qtype;					/* init NULL */
+unsigned short *response_order;				/* init NULL */
+unsigned char (*window_packet)[MAX_QUERY_LEN];		/* init NULL */
+int *window_qlen;					/* init NULL */
+struct timeval *rtt_stamps;				/* init NULL */
+volatile int bench_sink;
+
+/*
+ * show_bench_usage:
+ *   Print out usage/syntax information
+ */
+void
+show_bench_usage(void) {
+	fprintf(stderr,
+"\n"
+"Usage: queryperf-bench [-w windows] [-n corpus-sizes] [-t seconds]\n"
+"                       [-r repeats] [-s seed] [-b benchmark] [-c] [-h]\n"
+"  -w outstanding-query windows, comma separated (default: %s)\n"
+"  -n corpus sizes, comma separated (default: %s)\n"
+"  -t least time to time each measurement for (default: %.1f)\n"
+"  -r measurements per benchmark; the median is shown (default: %d)\n"
+"  -s random seed for the corpus and orders (default: %d)\n"
+"  -b run only the benchmarks whose names contain this\n"
+"  -c print comma-separated values\n"
+"  -h print this usage\n"
+"\n",
+		DEF_BENCH_WINDOWS, DEF_BENCH_CORPORA, DEF_BENCH_TIME,
+		DEF_BENCH_REPEATS, DEF_BENCH_SEED);
+}
+
+/*
+ * parse_list:
+ *   Parse a comma separated list of positive numbers, at most max each
+ *
+ *   Return -1 on failure
+ *   Return the number of them otherwise
+ */
+int
+parse_list(const char *arg, unsigned int *list, unsigned int max) {
+	unsigned int n = 0;
+	unsigned long v;
+	const char *p = arg;
+	char *end;
+
+	do {
+		v = strtoul(p, &end, 10);
+		if (end == p || v == 0 || v > max || n == MAX_BENCH_PARAMS ||
+		    (*end != ',' && *end != '\0')) {
+			fprintf(stderr, "Invalid list (1-%u each): %s\n", max,
+				arg);
+			return (-1);
+		}
+		list[n++] = v;
+		p = end + 1;
+	} while (*end == ',');
+
+	return (n);
+}
+
+/*
+ * parse_bench_args:
+ *   Parse the command line
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_bench_args(int argc, char **argv) {
+	int c, n;
+	char *end;
+
+	while ((c = getopt(argc, argv, "w:n:t:r:s:b:ch")) != -1) {
+		switch (c) {
+		case 'w':
+			if ((n = parse_list(optarg, bench_windows,
+					    MAX_BENCH_WINDOW)) == -1)
+				return (-1);
+			bench_num_windows = n;
+			break;
+		case 'n':
+			if ((n = parse_list(optarg, bench_corpora,
+					    UINT_MAX / 2)) == -1)
+				return (-1);
+			bench_num_corpora = n;
+			break;
+		case 't':
+			bench_time = strtod(optarg, &end);
+			if (*end != '\0' || bench_time <= 0.0) {
+				fprintf(stderr, "Invalid time: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 'r':
+			bench_repeats = strtoul(optarg, &end, 10);
+			if (*end != '\0' || bench_repeats == 0) {
+				fprintf(stderr, "Invalid repeats: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 's':
+			bench_seed = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg) {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 'b':
+			bench_only = optarg;
+			break;
+		case 'c':
+			bench_csv = TRUE;
+			break;
+		case 'h':
+		default:
+			return (-1);
+		}
+	}
+
+	if (optind != argc)
+		return (-1);
+
+	if (bench_num_windows == 0)
+		bench_num_windows = parse_list(DEF_BENCH_WINDOWS,
+					       bench_windows,
+					       MAX_BENCH_WINDOW);
+	if (bench_num_corpora == 0)
+		bench_num_corpora = parse_list(DEF_BENCH_CORPORA,
+					       bench_corpora, UINT_MAX / 2);
+
+	return (0);
+}
+
+/*
+ * now_ns:
+ *   The monotonic clock in nsec
+ */
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * bench_random_below:
+ *   Return a random number in [0, n)
+ */
+static unsigned int
+bench_random_below(unsigned int n) {
+	return (random_below(&random_state, n));
+}
+
+/*
+ * make_corpus:
+ *   Generate n query lines like those of a real query file, and their
+ *   parsed names and types
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+make_corpus(unsigned int n) {
+	static const char *types[] = { "A", "A", "A", "AAAA", "AAAA", "MX",
+				       "NS", "TXT", "PTR", "SOA" };
+	static const char *tlds[] = { "com", "net", "org", "example" };
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	char line[MAX_INPUT_LEN + 1], label[64];
+	unsigned int i, j, len;
+
+	corpus_line = calloc(n, sizeof(corpus_line[0]));
+	corpus_qname = calloc(n, sizeof(corpus_qname[0]));
+	corpus_qtype = calloc(n, sizeof(corpus_qtype[0]));
+	if (corpus_line == NULL || corpus_qname == NULL ||
+	    corpus_qtype == NULL)
+		goto nomem;
+
+	for (i = 0; i < n; i++) {
+		len = 3 + bench_random_below(12);
+		for (j = 0; j < len; j++)
+			label[j] = chars[bench_random_below(sizeof(chars) - 1)];
+		label[len] = '\0';
+		snprintf(line, sizeof(line), "%s%s.%s %s",
+			 bench_random_below(2) ? "www." : "", label,
+			 tlds[bench_random_below(4)],
+			 types[bench_random_below(10)]);
+		if ((corpus_line[i] = strdup(line)) == NULL)
+			goto nomem;
+		if (parse_query(line, corpus_qname[i], MAX_DOMAIN_LEN,
+				&corpus_qtype[i]) == -1)
+			return (-1);
+	}
+
+	return (0);
+
+ nomem:
+	fprintf(stderr, "Error allocating memory for the corpus\n");
+	return (-1);
+}
+
+/*
+ * free_corpus:
+ *   Free the corpus made by make_corpus()
+ */
+void
+free_corpus(unsigned int n) {
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		free(corpus_line[i]);
+	free(corpus_line);
+	free(corpus_qname);
+	free(corpus_qtype);
+}
+
+/*
+ * fill_window:
+ *   Register a query with each id below bench_window, as if just sent,
+ *   and shuffle the order they are to be answered in
+ */
+static void
+fill_window(void) {
+	unsigned int i, j, k;
+	unsigned short t;
+
+	for (i = 0; i < bench_window; i++) {
+		k = i % bench_corpus;
+		register_query(i, window_packet[i], window_qlen[i],
+			       corpus_qtype[k], corpus_line[k]);
+		response_order[i] = i;
+	}
+	for (i = bench_window; i > 1; i--) {
+		j = bench_random_below(i);
+		t = response_order[i - 1];
+		response_order[i - 1] = response_order[j];
+		response_order[j] = t;
+	}
+}
+
+/*
+ * empty_window:
+ *   Forget all the outstanding queries, leaving status[] as a fresh
+ *   set_max_queries() of the window size would: status[] is allocated for
+ *   the largest window, and only shrunk here in what is scanned
+ */
+static void
+empty_window(void) {
+	unsigned int i;
+
+	for (i = 0; i < bench_max_window; i++)
+		QS(i, in_use) = FALSE;
+	query_status_allocated = max_queries_outstanding = bench_window;
+	num_free_slots = 0;
+	for (i = bench_window; i-- > 0;)
+		free_slots[num_free_slots++] = i;
+	num_queries_outstanding = 0;
+}
+
+/*
+ * run_parse_query:
+ *   Parse n lines of the corpus
+ */
+static void
+run_parse_query(unsigned int n) {
+	char qname[MAX_DOMAIN_LEN + 1];
+	unsigned int i;
+	int qtype, sum = 0;
+
+	for (i = 0; i < n; i++) {
+		parse_query(corpus_line[i % bench_corpus], qname,
+			    MAX_DOMAIN_LEN, &qtype);
+		sum += qtype;
+	}
+	bench_sink = sum;
+}
+
+/*
+ * run_build_query:
+ *   Build the query packets for n parsed lines of the corpus
+ */
+static void
+run_build_query(unsigned int n) {
+	unsigned char pkt[MAX_QUERY_LEN];
+	unsigned int i, k;
+	int qlen, sum = 0;
+
+	for (i = 0; i < n; i++) {
+		k = i % bench_corpus;
+		sum += build_query(i & 0xffff, corpus_qname[k],
+				   corpus_qtype[k], pkt, &qlen);
+	}
+	bench_sink = sum;
+}
+
+/*
+ * run_dispatch_query:
+ *   Build and send n queries, to a socket of our own nobody reads
+ */
+static void
+run_dispatch_query(unsigned int n) {
+	unsigned int i, k;
+	u_char *pkt;
+	int pktlen, qlen, sum = 0;
+
+	for (i = 0; i < n; i++) {
+		k = i % bench_corpus;
+		if (dispatch_query(i & 0xffff, corpus_qname[k],
+				   corpus_qtype[k], &pkt, &pktlen,
+				   &qlen) == 0)
+			sum += pktlen;
+	}
+	bench_sink = sum;
+}
+
+/*
+ * setup_rtt:
+ *   Make send times spread over the last BENCH_RTT_SPREAD seconds
+ */
+static void
+setup_rtt(void) {
+	struct timeval now;
+	unsigned int i;
+	long usec;
+
+	set_timenow(&now);
+	for (i = 0; i < bench_corpus; i++) {
+		usec = (long)bench_random_below((unsigned int)
+			(BENCH_RTT_SPREAD * 1000000.0));
+		rtt_stamps[i].tv_sec = now.tv_sec - usec / 1000000;
+		rtt_stamps[i].tv_usec = now.tv_usec - usec % 1000000;
+		if (rtt_stamps[i].tv_usec < 0) {
+			rtt_stamps[i].tv_sec--;
+			rtt_stamps[i].tv_usec += 1000000;
+		}
+	}
+}
+
+/*
+ * run_register_rtt:
+ *   Record n round trip times
+ */
+static void
+run_register_rtt(unsigned int n) {
+	unsigned int i, k;
+
+	for (i = 0; i < n; i++) {
+		k = i % bench_corpus;
+		register_rtt(&rtt_stamps[k], window_packet[0] + DNS_HEADERLEN,
+			     corpus_qtype[k], 0, 0, 64 + (k & 1023));
+	}
+}
+
+/*
+ * setup_window:
+ *   Fill the window with outstanding queries
+ */
+static void
+setup_window(void) {
+	empty_window();
+	fill_window();
+}
+
+/*
+ * run_register_response:
+ *   Match responses to n of the outstanding queries, in random order
+ */
+static void
+run_register_response(unsigned int n) {
+	unsigned int i, id;
+
+	for (i = 0; i < n; i++) {
+		id = response_order[i];
+		register_response(id, 0, window_packet[id] + DNS_HEADERLEN,
+				  window_qlen[id],
+				  DNS_HEADERLEN + window_qlen[id]);
+	}
+}
+
+/*
+ * run_retire_old_queries:
+ *   Scan the full window for expired queries n times, finding none
+ */
+static void
+run_retire_old_queries(unsigned int n) {
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		retire_old_queries(FALSE);
+}
+
+struct benchmark benchmarks[] = {
+	{ "parse_query", FALSE, 4096, NULL, run_parse_query },
+	{ "build_query", FALSE, 4096, NULL, run_build_query },
+	{ "dispatch_query", FALSE, 1024, NULL, run_dispatch_query },
+	{ "register_rtt", FALSE, 4096, setup_rtt, run_register_rtt },
+	{ "register_response", TRUE, 0, setup_window, run_register_response },
+	{ "retire_old_queries", TRUE, 16, setup_window,
+	  run_retire_old_queries },
+};
+
+#define NUM_BENCHMARKS	(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+ * compare_double:
+ *   qsort() comparison of doubles
+ */
+static int
+compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * measure:
+ *   Time a benchmark bench_repeats times, each time running batches of it
+ *   for at least bench_time seconds, and print the median time and
+ *   cycles per operation
+ */
+void
+measure(struct benchmark *b) {
+	double *ns, *cycles;
+	unsigned long long t0, t1, c0, c1, total_ns, total_cycles, ops;
+	unsigned int r, batch;
+
+	ns = calloc(bench_repeats, sizeof(ns[0]));
+	cycles = calloc(bench_repeats, sizeof(cycles[0]));
+	if (ns == NULL || cycles == NULL) {
+		fprintf(stderr, "Error allocating memory for results\n");
+		exit(1);
+	}
+
+	batch = b->batch != 0 ? b->batch : bench_window;
+	for (r = 0; r < bench_repeats; r++) {
+		total_ns = total_cycles = ops = 0;
+		do {
+			if (b->setup != NULL)
+				b->setup();
+			t0 = now_ns();
+			c0 = read_cycles();
+			b->run(batch);
+			c1 = read_cycles();
+			t1 = now_ns();
+			total_ns += t1 - t0;
+			total_cycles += c1 - c0;
+			ops += batch;
+		} while (total_ns < bench_time * 1000000000.0);
+		ns[r] = (double)total_ns / ops;
+		cycles[r] = (double)total_cycles / ops;
+	}
+	qsort(ns, bench_repeats, sizeof(ns[0]), compare_double);
+	qsort(cycles, bench_repeats, sizeof(cycles[0]), compare_double);
+
+	if (bench_csv)
+		printf("%s,", b->name);
+	else
+		printf("%-20s ", b->name);
+	if (b->uses_window)
+		printf(bench_csv ? "%u," : "%8u ", bench_window);
+	else
+		printf(bench_csv ? "," : "%8s ", "-");
+	printf(bench_csv ? "%u,%.2f," : "%8u %10.2f ", bench_corpus,
+	       ns[bench_repeats / 2]);
+#ifdef HAVE_CYCLE_COUNTER
+	printf(bench_csv ? "%.1f\n" : "%10.1f\n", cycles[bench_repeats / 2]);
+#else
+	printf(bench_csv ? "\n" : "%10s\n", "-");
+#endif
+	fflush(stdout);
+
+	free(ns);
+	free(cycles);
+}
+
+/*
+ * open_sink:
+ *   Point queryperf at a UDP socket of our own on the loopback interface,
+ *   which is never read, so dispatch_query() has somewhere to send
+ *
+ *   Return -1 on failure
+ *   Return the sink socket otherwise
+ */
+int
+open_sink(void) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char port[16];
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &len) == -1) {
+		perror("Error opening the sink socket");
+		return (-1);
+	}
+	snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+
+	if (set_server("127.0.0.1") == -1 || set_server_port(port) == -1 ||
+	    set_server_sa() == -1 || (query_socket = change_socket()) == -1)
+		return (-1);
+
+	return (fd);
+}
+
+/*
+ * setup_bench:
+ *   Set queryperf up as its mainline would, for the largest window
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+setup_bench(void) {
+	unsigned int i, max_window = 0;
+
+	for (i = 0; i < bench_num_windows; i++)
+		if (max_window < bench_windows[i])
+			max_window = bench_windows[i];
+	bench_max_window = max_window;
+
+	random_state = bench_seed != 0 ? bench_seed : 1;
+	if (set_max_queries(max_window) == -1 ||
+	    reset_rttarray(rttarray_size) == -1 || open_sink() == -1 ||
+	    build_query_templates() == -1)
+		return (-1);
+
+	timeout_queries = calloc(65536, sizeof(struct query_mininfo));
+	id_slots = calloc(65536, sizeof(id_slots[0]));
+	response_order = calloc(max_window, sizeof(response_order[0]));
+	window_packet = calloc(max_window, sizeof(window_packet[0]));
+	window_qlen = calloc(max_window, sizeof(window_qlen[0]));
+	if (timeout_queries == NULL || id_slots == NULL ||
+	    response_order == NULL || window_packet == NULL ||
+	    window_qlen == NULL) {
+		fprintf(stderr, "Error allocating memory for the window\n");
+		return (-1);
+	}
+
+	/* Queries are registered as sent, as the mainline does after one */
+	set_timenow(&time_of_first_query);
+	time_of_first_query_sec = (double)time_of_first_query.tv_sec +
+		((double)time_of_first_query.tv_usec / 1000000.0);
+	time_of_first_query_interval = time_of_first_query;
+	setup_phase = FALSE;
+
+	return (0);
+}
+
+/*
+ * check_hashes:
+ *   Check that a name hashes alike whatever its case, as query matching
+ *   and the hash server policy (-P hash) rely on
+ *
+ *   Return -1 if it does not
+ *   Return a non-negative integer otherwise
+ */
+int
+check_hashes(void) {
+	unsigned char lower[MAX_QUESTION_LEN], mixed[MAX_QUESTION_LEN];
+	int len;
+
+	if ((len = encode_qname("www.example.com", lower)) == -1 ||
+	    encode_qname("WwW.ExAmPlE.CoM", mixed) != len)
+		return (-1);
+	memcpy(lower + len, "\0\1\0\1", 4);
+	memcpy(mixed + len, "\0\1\0\1", 4);
+
+	if (name_hash(lower, len) != name_hash(mixed, len) ||
+	    question_hash(lower, len + 4) != question_hash(mixed, len + 4)) {
+		fprintf(stderr, "Error: name hashes depend on case\n");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * queryperf-bench Program Mainline
+ */
+int
+main(int argc, char **argv) {
+	unsigned int c, w, i, k, max_corpus = 0;
+	struct benchmark *b;
+
+	if (parse_bench_args(argc, argv) == -1) {
+		show_bench_usage();
+		return (1);
+	}
+	if (setup_bench() == -1 || check_hashes() == -1)
+		return (1);
+
+	if (bench_csv)
+		printf("benchmark,window,corpus,ns_per_op,cycles_per_op\n");
+	else
+		printf("%-20s %8s %8s %10s %10s\n", "Benchmark", "Window",
+		       "Corpus", "ns/op", "cycles/op");
+
+	for (c = 0; c < bench_num_corpora; c++) {
+		bench_corpus = bench_corpora[c];
+		if (make_corpus(bench_corpus) == -1)
+			return (1);
+		if (bench_corpus > max_corpus) {
+			free(rtt_stamps);
+			rtt_stamps = calloc(bench_corpus,
+					    sizeof(rtt_stamps[0]));
+			if (rtt_stamps == NULL) {
+				fprintf(stderr, "Error allocating memory "
+					"for send times\n");
+				return (1);
+			}
+			max_corpus = bench_corpus;
+		}
+
+		/* The window's packets come from the front of the corpus */
+		for (i = 0; i < bench_max_window; i++) {
+			k = i % bench_corpus;
+			if (build_query(i, corpus_qname[k], corpus_qtype[k],
+					window_packet[i], &window_qlen[i]) == -1)
+				return (1);
+		}
+
+		for (b = benchmarks; b < benchmarks + NUM_BENCHMARKS; b++) {
+			if (bench_only != NULL &&
+			    strstr(b->name, bench_only) == NULL)
+				continue;
+			for (w = 0; w < (b->uses_window ?
+					 bench_num_windows : 1); w++) {
+				bench_window = bench_windows[w];
+				measure(b);
+			}
+		}
+		free_corpus(bench_corpus);
+	}
+
+	return (0);
+}
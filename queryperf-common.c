@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Code shared by queryperf and queryperf-gen  (queryperf-common.c)
+ ***
+ ***	Query type lookup, domain name encoding, the random number
+ ***	generator and the alias tables used to draw weighted choices.
+ ***/
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "queryperf-corpus.h"
+
+#define QTYPE_HASH_SIZE			256	/* power of 2, > 2x types */
+
+#define FALSE				0
+#define TRUE				1
+
+/*
+ * qtype_hash:
+ *   Case-insensitive FNV-1a hash of a type mnemonic of length len
+ */
+static unsigned int
+qtype_hash(const char *str, size_t len) {
+	unsigned int h = 2166136261U;
+	unsigned char c;
+
+	while (len-- > 0) {
+		c = (unsigned char)*str++;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		h = (h ^ c) * 16777619U;
+	}
+
+	return (h);
+}
+
+/*
+ * lookup_qtype:
+ *   Find the code for a query type given as a mnemonic or in the RFC 3597
+ *   generic TYPEnnn form.  Mnemonics are looked up in an open-addressed
+ *   hash table built from QTYPE_STRINGS on first use, which is not
+ *   thread-safe: the first call must come before any threads start.
+ *
+ *   Return -1 if the type is not understood
+ *   Return the type code otherwise
+ */
+int
+lookup_qtype(const char *str, size_t len) {
+	static char *qtype_strings[] = QTYPE_STRINGS;
+	static int qtype_codes[] = QTYPE_CODES;
+	static int qtype_table[QTYPE_HASH_SIZE];	/* index + 1, 0 = free */
+	static int table_built = FALSE;
+	unsigned int num_types, index, h;
+	unsigned long value;
+	size_t i, plen = sizeof(QTYPE_GENERIC_PREFIX) - 1;
+
+	if (table_built == FALSE) {
+		num_types = sizeof(qtype_strings) / sizeof(qtype_strings[0]);
+		if (num_types > (sizeof(qtype_codes) / sizeof(int)))
+			num_types = sizeof(qtype_codes) / sizeof(int);
+
+		for (index = 0; index < num_types; index++) {
+			h = qtype_hash(qtype_strings[index],
+				       strlen(qtype_strings[index]));
+			while (qtype_table[h & (QTYPE_HASH_SIZE - 1)] != 0)
+				h++;
+			qtype_table[h & (QTYPE_HASH_SIZE - 1)] = index + 1;
+		}
+		table_built = TRUE;
+	}
+
+	h = qtype_hash(str, len);
+	while ((index = qtype_table[h & (QTYPE_HASH_SIZE - 1)]) != 0) {
+		index--;
+		if (strncasecmp(str, qtype_strings[index], len) == 0 &&
+		    qtype_strings[index][len] == '\0')
+			return (qtype_codes[index]);
+		h++;
+	}
+
+	if (len <= plen || len > plen + 5 ||
+	    strncasecmp(str, QTYPE_GENERIC_PREFIX, plen) != 0)
+		return (-1);
+
+	value = 0;
+	for (i = plen; i < len; i++) {
+		if (!isdigit((unsigned char)str[i]))
+			return (-1);
+		value = value * 10 + (str[i] - '0');
+	}
+	if (value > 65535)
+		return (-1);
+
+	return ((int)value);
+}
+
+/*
+ * encode_qname:
+ *   Convert a domain name from presentation format into uncompressed wire
+ *   format in buf, which must hold at least MAX_DOMAIN_LEN bytes.  The
+ *   \X and \DDD escapes are understood.
+ *
+ *   Return -1 if the name is invalid or too long
+ *   Return the length of the encoded name otherwise
+ */
+int
+encode_qname(const char *name, unsigned char *buf) {
+	unsigned char *label = buf, *p = buf + 1;
+	unsigned int c;
+
+	if (name[0] == '.' && name[1] == '\0') {
+		buf[0] = 0;
+		return (1);
+	}
+
+	for (; *name != '\0'; name++) {
+		c = (unsigned char)*name;
+		if (c == '.') {
+			if (p - label == 1)
+				return (-1);	/* empty label */
+			*label = p - label - 1;
+			label = p++;
+			continue;
+		}
+		if (c == '\\') {
+			if (isdigit((unsigned char)name[1]) &&
+			    isdigit((unsigned char)name[2]) &&
+			    isdigit((unsigned char)name[3])) {
+				c = (name[1] - '0') * 100 +
+				    (name[2] - '0') * 10 + (name[3] - '0');
+				if (c > 255)
+					return (-1);
+				name += 3;
+			} else if (name[1] != '\0')
+				c = (unsigned char)*++name;
+			else
+				return (-1);
+		}
+		if (p - label > MAX_LABEL_LEN || p - buf >= MAX_DOMAIN_LEN - 1)
+			return (-1);
+		*p++ = c;
+	}
+
+	if (p - label > 1) {
+		*label = p - label - 1;
+		label = p;
+	}
+	*label = 0;
+
+	return (label + 1 - buf);
+}
+
+/*
+ * next_random:
+ *   Return the next number from the xorshift64* generator whose (non-zero)
+ *   state is *state
+ */
+unsigned long long
+next_random(unsigned long long *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return (*state * 2685821657736338717ULL);
+}
+
+/*
+ * random_below:
+ *   Return a random number in [0, n)
+ */
+unsigned int
+random_below(unsigned long long *state, unsigned int n) {
+	return ((unsigned int)(((next_random(state) >> 32) * n) >> 32));
+}
+
+/*
+ * build_alias_table:
+ *   Set up *probp and *indexp to draw i with probability weights[i] /
+ *   (sum of weights), using Vose's method: draw i uniformly from n, then
+ *   keep it with probability (*probp)[i], or take (*indexp)[i] instead.
+ *   weights[] is overwritten.
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+build_alias_table(double *weights, unsigned int n, double **probp,
+		  unsigned int **indexp)
+{
+	unsigned int *small, *large, *alias_index;
+	unsigned int nsmall = 0, nlarge = 0, i, s, l;
+	double *alias_prob, total = 0.0;
+
+	for (i = 0; i < n; i++)
+		total += weights[i];
+	if (total <= 0.0) {
+		fprintf(stderr, "Error: all query weights are zero\n");
+		return (-1);
+	}
+
+	alias_prob = malloc(n * sizeof(alias_prob[0]));
+	alias_index = malloc(n * sizeof(alias_index[0]));
+	small = malloc(n * sizeof(small[0]));
+	large = malloc(n * sizeof(large[0]));
+	if (alias_prob == NULL || alias_index == NULL || small == NULL ||
+	    large == NULL) {
+		fprintf(stderr, "Error allocating memory for alias table\n");
+		free(alias_prob);
+		free(alias_index);
+		free(small);
+		free(large);
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		weights[i] = weights[i] * n / total;
+		if (weights[i] < 1.0)
+			small[nsmall++] = i;
+		else
+			large[nlarge++] = i;
+	}
+
+	while (nsmall > 0 && nlarge > 0) {
+		s = small[--nsmall];
+		l = large[nlarge - 1];
+		alias_prob[s] = weights[s];
+		alias_index[s] = l;
+		weights[l] -= 1.0 - weights[s];
+		if (weights[l] < 1.0) {
+			nlarge--;
+			small[nsmall++] = l;
+		}
+	}
+	/* Whatever is left is 1 up to rounding error */
+	while (nlarge > 0) {
+		l = large[--nlarge];
+		alias_prob[l] = 1.0;
+		alias_index[l] = l;
+	}
+	while (nsmall > 0) {
+		s = small[--nsmall];
+		alias_prob[s] = 1.0;
+		alias_index[s] = s;
+	}
+
+	free(small);
+	free(large);
+	*probp = alias_prob;
+	*indexp = alias_index;
+	return (0);
+}
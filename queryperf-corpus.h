@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Definitions shared by queryperf and queryperf-gen
+ ***/
+
+#ifndef QUERYPERF_CORPUS_H
+#define QUERYPERF_CORPUS_H 1
+
+/*
+ * Binary query corpus, as written by "queryperf-gen -b" and read by
+ * queryperf in place of a text query file.  All integers are in network
+ * byte order.
+ *
+ *   header:  8 bytes CORPUS_MAGIC, 4 bytes version, 4 bytes reserved (0)
+ *   record:  2 bytes qtype, 1 byte qname length, qname in uncompressed
+ *            wire format (including the root label)
+ *
+ * The records follow the header until the end of the file.  The class is
+ * always IN.
+ */
+#define CORPUS_MAGIC			"QPCORPUS"
+#define CORPUS_MAGIC_LEN		8
+#define CORPUS_VERSION			1
+#define CORPUS_HEADER_LEN		16
+#define CORPUS_RECORD_HEADER_LEN	3
+
+/*
+ * Domain name limits, in wire format bytes (RFC 1035)
+ */
+#define MAX_DOMAIN_LEN			255
+#define MAX_LABEL_LEN			63
+
+/*
+ * RR type mnemonics and their codes, in matching order, and the prefix of
+ * the generic form of a type
+ */
+#define QTYPE_GENERIC_PREFIX		"TYPE"	/* RFC 3597 TYPEnnn */
+
+#define QTYPE_STRINGS { \
+	"A", "NS", "MD", "MF", "CNAME", "SOA", "MB", "MG", "MR", \
+	"NULL", "WKS", "PTR", "HINFO", "MINFO", "MX", "TXT", "RP", \
+	"AFSDB", "X25", "ISDN", "RT", "NSAP", "NSAP-PTR", "SIG", \
+	"KEY", "PX", "GPOS", "AAAA", "LOC", "NXT", "EID", "NIMLOC", \
+	"SRV", "ATMA", "NAPTR", "KX", "CERT", "A6", "DNAME", "SINK", \
+	"OPT", "APL", "DS", "SSHFP", "IPSECKEY", "RRSIG", "NSEC", \
+	"DNSKEY", "DHCID", "NSEC3", "NSEC3PARAM", "TLSA", "SMIMEA", \
+	"HIP", "NINFO", "RKEY", "TALINK", "CDS", "CDNSKEY", \
+	"OPENPGPKEY", "CSYNC", "ZONEMD", "SVCB", "HTTPS", "SPF", \
+	"UINFO", "UID", "GID", "UNSPEC", "NID", "L32", "L64", "LP", \
+	"EUI48", "EUI64", "TKEY", "TSIG", "IXFR", "AXFR", "MAILB", \
+	"MAILA", "URI", "CAA", "AVC", "DOA", "AMTRELAY", "RESINFO", \
+	"*", "ANY", "TA", "DLV" \
+}
+
+#define QTYPE_CODES { \
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, \
+	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, \
+	34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, \
+	49, 50, 51, 52, 53, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, \
+	65, 99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, \
+	249, 250, 251, 252, 253, 254, 256, 257, 258, 259, 260, 261, \
+	255, 255, 32768, 32769 \
+}
+
+/*
+ * In queryperf-common.c
+ */
+int lookup_qtype(const char *str, size_t len);
+int encode_qname(const char *name, unsigned char *buf);
+unsigned long long next_random(unsigned long long *state);
+unsigned int random_below(unsigned long long *state, unsigned int n);
+int build_alias_table(double *weights, unsigned int n, double **probp,
+		      unsigned int **indexp);
+
+#endif /* QUERYPERF_CORPUS_H */
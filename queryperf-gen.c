@@ -0,0 +1,830 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Query File Generator for queryperf  (queryperf-gen.c)
+ ***
+ ***	Generates queries for random names (which should get NXDOMAIN)
+ ***	and for the delegations found in a zone file, like
+ ***	utils/gen-data-queryperf.py, as text or as a binary corpus.
+ ***/
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "queryperf-corpus.h"
+
+/*
+ * Configuration defaults
+ */
+
+#define DEF_NUM_QUERIES			4
+#define DEF_PERCENT_RANDOM		0.3
+#define DEF_TLD				"org"
+#define DEF_MAXSIZE			10
+#define DEF_TYPE_MIX			"A"
+#define DEF_THREADS			1
+
+/*
+ * Other constants / definitions
+ */
+
+#define MAX_TYPE_MIX			64
+#define MAX_LINE_LEN			(MAX_DOMAIN_LEN + 32)
+#define BLOCK_QUERIES			16384
+#define ZONE_READ_SIZE			(1024 * 1024)	/* in bytes */
+#define DOMAIN_HASH_INITIAL		65536	/* power of 2 */
+#define NAME_PREFIX			"www."
+#define C_IN				1
+
+#define FALSE				0
+#define TRUE				1
+
+#define WHITESPACE			" \t\r\n"
+
+/* Characters allowed in a random label */
+#define LDH_CHARS	"0123456789abcdefghijklmnopqrstuvwxyz-"
+
+/*
+ * Configuration options (global)
+ */
+
+unsigned long long num_queries = DEF_NUM_QUERIES;
+double percent_random = DEF_PERCENT_RANDOM;
+char *tld = DEF_TLD;
+unsigned int maxsize = DEF_MAXSIZE;
+char *zone_file;					/* init NULL */
+char *type_mix = DEF_TYPE_MIX;
+double zipf_exponent;					/* init 0 */
+unsigned int num_threads = DEF_THREADS;
+unsigned long long seed;				/* init 0 */
+int seed_set = FALSE;
+int binary_output = FALSE;
+char *output_file;					/* init NULL */
+
+/*
+ * Query type mix: the types to ask for and their cumulative probability
+ */
+unsigned int num_types;					/* init 0 */
+char type_names[MAX_TYPE_MIX][16];
+int type_codes[MAX_TYPE_MIX];
+double type_cumulative[MAX_TYPE_MIX];
+
+/*
+ * Domains found in the zone file, in order, without the trailing dot.
+ * They are kept in one arena and deduplicated with an open-addressed hash
+ * table of index + 1 (0 = free).
+ */
+char *domain_text;					/* init NULL */
+size_t domain_text_len, domain_text_size;		/* init 0 */
+size_t *domains;					/* init NULL */
+unsigned int num_domains, domains_size;			/* init 0 */
+unsigned int *domain_hash;				/* init NULL */
+unsigned int domain_hash_size;				/* init 0 */
+
+/* Zipf popularity over the domains, drawn with an alias table */
+double *alias_prob;					/* init NULL */
+unsigned int *alias_index;				/* init NULL */
+
+/*
+ * Output is produced in blocks of BLOCK_QUERIES queries.  Threads take
+ * blocks in turn and write them out in block order, so the output only
+ * depends on the seed, not on the number of threads.
+ */
+FILE *output_fp;
+unsigned long long num_blocks;				/* init 0 */
+unsigned long long next_block;				/* init 0 */
+unsigned long long write_turn;				/* init 0 */
+int write_failed = FALSE;
+pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * show_usage:
+ *   Print out usage/syntax information
+ */
+void
+show_usage(void) {
+	fprintf(stderr,
+"\n"
+"Usage: queryperf-gen [-n number] [-p percent-random] [-t TLD] [-m maxsize]\n"
+"                     [-f zone-file] [-T type-mix] [-Z exponent]\n"
+"                     [-j threads] [-s seed] [-b] [-o file] [-h]\n"
+"  -n number of queries to generate (default: %d)\n"
+"  -p fraction of queries for random names (default: %.1f)\n"
+"  -t TLD of the random names, and origin of the zone file (default: %s)\n"
+"  -m maximum length of a random label (default: %d)\n"
+"  -f zone file to take existing names from (the names with NS records)\n"
+"  -T query types and their weights, e.g. A:70,AAAA:20,MX:10\n"
+"     (default: %s)\n"
+"  -Z pick existing names with Zipf popularity in zone file order\n"
+"     (default: all equally popular)\n"
+"  -j number of threads generating queries (default: %d)\n"
+"  -s random seed (default: from the time)\n"
+"  -b write a binary corpus for queryperf instead of text\n"
+"  -o output file (default: stdout)\n"
+"  -h print this usage\n"
+"\n",
+		DEF_NUM_QUERIES, DEF_PERCENT_RANDOM, DEF_TLD, DEF_MAXSIZE,
+		DEF_TYPE_MIX, DEF_THREADS);
+}
+
+/*
+ * parse_type_mix:
+ *   Parse a type mix such as "A:70,AAAA:20,MX:10" (a missing weight is 1)
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_type_mix(char *mix) {
+	char *item, *colon, *end, *last;
+	double weight, total = 0.0;
+	unsigned int i;
+
+	for (item = strtok_r(mix, ",", &last); item != NULL;
+	     item = strtok_r(NULL, ",", &last)) {
+		if (num_types == MAX_TYPE_MIX) {
+			fprintf(stderr, "Too many types in the mix\n");
+			return (-1);
+		}
+
+		weight = 1.0;
+		if ((colon = strchr(item, ':')) != NULL) {
+			*colon = '\0';
+			weight = strtod(colon + 1, &end);
+			if (end == colon + 1 || *end != '\0' || weight < 0) {
+				fprintf(stderr, "Invalid type weight: %s\n",
+					colon + 1);
+				return (-1);
+			}
+		}
+
+		type_codes[num_types] = lookup_qtype(item, strlen(item));
+		if (type_codes[num_types] == -1 ||
+		    strlen(item) >= sizeof(type_names[0])) {
+			fprintf(stderr, "Unknown query type: %s\n", item);
+			return (-1);
+		}
+		for (i = 0; item[i] != '\0'; i++)
+			type_names[num_types][i] = toupper((unsigned char)item[i]);
+		type_names[num_types][i] = '\0';
+
+		total += weight;
+		type_cumulative[num_types] = total;
+		num_types++;
+	}
+
+	if (num_types == 0 || total <= 0.0) {
+		fprintf(stderr, "Empty type mix\n");
+		return (-1);
+	}
+	for (i = 0; i < num_types; i++)
+		type_cumulative[i] /= total;
+	type_cumulative[num_types - 1] = 1.0;
+
+	return (0);
+}
+
+/*
+ * parse_args:
+ *   Parse program arguments and set configuration options
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_args(int argc, char **argv) {
+	int c;
+	char *end;
+
+	while ((c = getopt(argc, argv, "n:p:t:m:f:T:Z:j:s:bo:h")) != -1) {
+		switch (c) {
+		case 'n':
+			num_queries = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg) {
+				fprintf(stderr, "Invalid number: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 'p':
+			percent_random = strtod(optarg, &end);
+			if (*end != '\0' || percent_random < 0.0 ||
+			    percent_random > 1.0) {
+				fprintf(stderr, "Invalid fraction of random "
+					"names: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 't':
+			tld = optarg;
+			break;
+		case 'm':
+			maxsize = strtoul(optarg, &end, 10);
+			if (*end != '\0' || maxsize == 0 ||
+			    maxsize > MAX_LABEL_LEN) {
+				fprintf(stderr, "Invalid label size: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'f':
+			zone_file = optarg;
+			break;
+		case 'T':
+			type_mix = optarg;
+			break;
+		case 'Z':
+			zipf_exponent = strtod(optarg, &end);
+			if (*end != '\0' || zipf_exponent <= 0.0) {
+				fprintf(stderr, "Invalid Zipf exponent: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'j':
+			num_threads = strtoul(optarg, &end, 10);
+			if (*end != '\0' || num_threads == 0) {
+				fprintf(stderr, "Invalid number of threads: "
+					"%s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 's':
+			seed = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg) {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				return (-1);
+			}
+			seed_set = TRUE;
+			break;
+		case 'b':
+			binary_output = TRUE;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'h':
+		default:
+			return (-1);
+		}
+	}
+
+	if (optind != argc)
+		return (-1);
+
+	if ((type_mix = strdup(type_mix)) == NULL) {
+		fprintf(stderr, "Error allocating memory for type mix\n");
+		return (-1);
+	}
+
+	return (parse_type_mix(type_mix));
+}
+
+/*
+ * add_domain:
+ *   Remember a domain from the zone file, unless it is already known
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+add_domain(const char *name, size_t len) {
+	unsigned int h = 2166136261U, i, *nh, slot;
+	const char *d;
+	size_t j;
+	void *np;
+
+	for (j = 0; j < len; j++)
+		h = (h ^ (unsigned char)name[j]) * 16777619U;
+
+	for (slot = h & (domain_hash_size - 1); domain_hash[slot] != 0;
+	     slot = (slot + 1) & (domain_hash_size - 1)) {
+		d = domain_text + domains[domain_hash[slot] - 1];
+		if (strlen(d) == len && memcmp(d, name, len) == 0)
+			return (0);
+	}
+
+	if (num_domains == domains_size) {
+		domains_size = domains_size ? domains_size * 2 : 4096;
+		np = realloc(domains, domains_size * sizeof(domains[0]));
+		if (np == NULL)
+			goto nomem;
+		domains = np;
+	}
+	if (domain_text_len + len + 1 > domain_text_size) {
+		domain_text_size = domain_text_size ?
+			domain_text_size * 2 : 65536;
+		if ((np = realloc(domain_text, domain_text_size)) == NULL)
+			goto nomem;
+		domain_text = np;
+	}
+
+	memcpy(domain_text + domain_text_len, name, len);
+	domain_text[domain_text_len + len] = '\0';
+	domains[num_domains++] = domain_text_len;
+	domain_text_len += len + 1;
+	domain_hash[slot] = num_domains;
+
+	/* Keep the table at most half full */
+	if (num_domains * 2 > domain_hash_size) {
+		nh = calloc(domain_hash_size * 2, sizeof(nh[0]));
+		if (nh == NULL)
+			goto nomem;
+		for (i = 0; i < num_domains; i++) {
+			d = domain_text + domains[i];
+			for (h = 2166136261U; *d != '\0'; d++)
+				h = (h ^ (unsigned char)*d) * 16777619U;
+			for (slot = h & (domain_hash_size * 2 - 1);
+			     nh[slot] != 0;
+			     slot = (slot + 1) & (domain_hash_size * 2 - 1))
+				;
+			nh[slot] = i + 1;
+		}
+		free(domain_hash);
+		domain_hash = nh;
+		domain_hash_size *= 2;
+	}
+
+	return (0);
+
+ nomem:
+	fprintf(stderr, "Error allocating memory for domains\n");
+	return (-1);
+}
+
+/*
+ * make_absolute:
+ *   Write name (len bytes) into buf as an absolute name without the
+ *   trailing dot, relative to origin (itself absolute, without the dot)
+ *
+ *   Return -1 if it is too long
+ *   Return the length of the result otherwise
+ */
+int
+make_absolute(const char *name, size_t len, const char *origin, char *buf) {
+	size_t olen = strlen(origin);
+	size_t i;
+
+	if (len == 1 && name[0] == '@') {
+		memcpy(buf, origin, olen + 1);
+		return ((int)olen);
+	}
+
+	if (len > 0 && name[len - 1] == '.' &&
+	    (len < 2 || name[len - 2] != '\\')) {
+		len--;
+		olen = 0;
+	}
+	if (len + 1 + olen > MAX_DOMAIN_LEN)
+		return (-1);
+
+	for (i = 0; i < len; i++)
+		buf[i] = tolower((unsigned char)name[i]);
+	if (olen > 0) {
+		buf[len++] = '.';
+		memcpy(buf + len, origin, olen);
+		len += olen;
+	}
+	buf[len] = '\0';
+
+	return ((int)len);
+}
+
+/*
+ * next_token:
+ *   Find the next whitespace-separated token at or after *pp
+ *
+ *   Return NULL if there is none
+ *   Return the token otherwise, setting *lenp and advancing *pp past it
+ */
+char *
+next_token(char **pp, size_t *lenp) {
+	char *p = *pp + strspn(*pp, WHITESPACE);
+	size_t len = strcspn(p, WHITESPACE);
+
+	if (len == 0)
+		return (NULL);
+	*pp = p + len;
+	*lenp = len;
+	return (p);
+}
+
+/*
+ * parse_zone_line:
+ *   Take the owner of an NS record from a zone file line.  Multi-line
+ *   records are skipped after their type, and $ORIGIN is followed.
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_zone_line(char *line, char *origin, char *owner, int *depthp) {
+	char name[MAX_DOMAIN_LEN + 1], *p, *tok;
+	int in_quote = FALSE, continuation = (*depthp > 0);
+	size_t len = 0;
+
+	/* Strip the comment and count parentheses */
+	for (p = line; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		else if (*p == '"')
+			in_quote = !in_quote;
+		else if (!in_quote && *p == ';') {
+			*p = '\0';
+			break;
+		} else if (!in_quote && *p == '(')
+			(*depthp)++;
+		else if (!in_quote && *p == ')' && *depthp > 0)
+			(*depthp)--;
+	}
+	if (continuation)
+		return (0);
+
+	p = line;
+	if (line[0] == '$') {
+		tok = next_token(&p, &len);
+		if (len == 7 && strncasecmp(tok, "$ORIGIN", 7) == 0 &&
+		    (tok = next_token(&p, &len)) != NULL) {
+			if (make_absolute(tok, len, origin, name) == -1) {
+				fprintf(stderr, "$ORIGIN too long\n");
+				return (-1);
+			}
+			strcpy(origin, name);
+		}
+		return (0);
+	}
+
+	if (line[0] != ' ' && line[0] != '\t') {
+		if ((tok = next_token(&p, &len)) == NULL)
+			return (0);
+		if (make_absolute(tok, len, origin, owner) == -1) {
+			owner[0] = '\0';
+			return (0);
+		}
+	}
+
+	/* Skip the TTL and class, whichever order they are in */
+	while ((tok = next_token(&p, &len)) != NULL) {
+		if (isdigit((unsigned char)tok[0]))
+			continue;
+		if ((len == 2 && (strncasecmp(tok, "IN", 2) == 0 ||
+				  strncasecmp(tok, "CH", 2) == 0 ||
+				  strncasecmp(tok, "HS", 2) == 0)) ||
+		    (len > 5 && strncasecmp(tok, "CLASS", 5) == 0))
+			continue;
+		break;
+	}
+
+	if (tok == NULL || len != 2 || strncasecmp(tok, "NS", 2) != 0)
+		return (0);
+
+	/* The zone's own NS records are not delegations */
+	if (owner[0] == '\0' || strcmp(owner, origin) == 0)
+		return (0);
+
+	return (add_domain(owner, strlen(owner)));
+}
+
+/*
+ * read_zone:
+ *   Read the delegations in the zone file, a large block at a time
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+read_zone(const char *file_name) {
+	char origin[MAX_DOMAIN_LEN + 1], owner[MAX_DOMAIN_LEN + 1];
+	char *buf, *line, *nl;
+	size_t have = 0, n;
+	int depth = 0, ret = 0;
+	FILE *fp;
+
+	if (make_absolute(tld, strlen(tld), "", origin) == -1) {
+		fprintf(stderr, "TLD too long: %s\n", tld);
+		return (-1);
+	}
+	owner[0] = '\0';
+
+	domain_hash_size = DOMAIN_HASH_INITIAL;
+	domain_hash = calloc(domain_hash_size, sizeof(domain_hash[0]));
+	buf = malloc(ZONE_READ_SIZE + 1);
+	if (domain_hash == NULL || buf == NULL) {
+		fprintf(stderr, "Error allocating memory for zone file\n");
+		free(buf);
+		return (-1);
+	}
+
+	if ((fp = fopen(file_name, "r")) == NULL) {
+		fprintf(stderr, "Error: unable to open zone file %s: %s\n",
+			file_name, strerror(errno));
+		free(buf);
+		return (-1);
+	}
+
+	for (;;) {
+		n = fread(buf + have, 1, ZONE_READ_SIZE - have, fp);
+		have += n;
+		if (have == 0)
+			break;
+		buf[have] = '\0';
+
+		line = buf;
+		while ((nl = memchr(line, '\n', have - (line - buf))) != NULL) {
+			*nl = '\0';
+			if ((ret = parse_zone_line(line, origin, owner,
+						   &depth)) == -1)
+				goto done;
+			line = nl + 1;
+		}
+
+		if (n == 0) {
+			/* The last line has no newline */
+			if (line < buf + have)
+				ret = parse_zone_line(line, origin, owner,
+						      &depth);
+			break;
+		}
+
+		have -= line - buf;
+		if (have == ZONE_READ_SIZE) {
+			fprintf(stderr, "Zone file line too long\n");
+			ret = -1;
+			break;
+		}
+		memmove(buf, line, have);
+	}
+
+ done:
+	if (ferror(fp)) {
+		fprintf(stderr, "Error reading zone file %s\n", file_name);
+		ret = -1;
+	}
+	fclose(fp);
+	free(buf);
+
+	if (ret != -1 && num_domains == 0) {
+		fprintf(stderr, "No domains found in '%s'\n", file_name);
+		ret = -1;
+	}
+
+	return (ret);
+}
+
+/*
+ * zipf_alias_table:
+ *   Set up alias_prob[] and alias_index[] to draw domain i with Zipf
+ *   probability proportional to 1 / (i + 1)^zipf_exponent
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+zipf_alias_table(void) {
+	double *w;
+	unsigned int i;
+	int ret;
+
+	if ((w = malloc(num_domains * sizeof(w[0]))) == NULL) {
+		fprintf(stderr, "Error allocating memory for alias table\n");
+		return (-1);
+	}
+	for (i = 0; i < num_domains; i++)
+		w[i] = pow(i + 1.0, -zipf_exponent);
+
+	ret = build_alias_table(w, num_domains, &alias_prob, &alias_index);
+	free(w);
+	return (ret);
+}
+
+/*
+ * random_fraction:
+ *   Return a random number in [0, 1)
+ */
+static double
+random_fraction(unsigned long long *state) {
+	return ((next_random(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * generate_query:
+ *   Append one query to out, as a text line or a binary corpus record
+ *
+ *   Return -1 if the name cannot be encoded for the corpus
+ *   Return the number of bytes written otherwise
+ */
+int
+generate_query(unsigned long long *state, char *out) {
+	char name[MAX_LINE_LEN], *p = name;
+	unsigned int i, len, t, d;
+	double r;
+	int nlen, qtype;
+
+	memcpy(p, NAME_PREFIX, sizeof(NAME_PREFIX) - 1);
+	p += sizeof(NAME_PREFIX) - 1;
+
+	if (num_domains > 0 && random_fraction(state) >= percent_random) {
+		if (alias_prob != NULL) {
+			d = random_below(state, num_domains);
+			if (random_fraction(state) >= alias_prob[d])
+				d = alias_index[d];
+		} else
+			d = random_below(state, num_domains);
+		strcpy(p, domain_text + domains[d]);
+	} else {
+		len = 1 + random_below(state, maxsize);
+		for (i = 0; i < len; i++)
+			*p++ = LDH_CHARS[random_below(state,
+						      sizeof(LDH_CHARS) - 1)];
+		*p++ = '.';
+		strcpy(p, tld);
+	}
+
+	r = random_fraction(state);
+	for (t = 0; t < num_types - 1 && r >= type_cumulative[t]; t++)
+		;
+
+	if (!binary_output)
+		return (sprintf(out, "%s %s\n", name, type_names[t]));
+
+	if ((nlen = encode_qname(name, (unsigned char *)out + 3)) == -1) {
+		fprintf(stderr, "Error: cannot encode name: %s\n", name);
+		return (-1);
+	}
+	qtype = type_codes[t];
+	out[0] = qtype >> 8;
+	out[1] = qtype & 0xff;
+	out[2] = nlen;
+
+	return (3 + nlen);
+}
+
+/*
+ * generator_main:
+ *   Generate blocks of queries and write them out in block order
+ */
+void *
+generator_main(void *arg) {
+	unsigned long long block, state, count, i;
+	char *buf;
+	size_t len;
+	int n;
+
+	(void)arg;
+
+	if ((buf = malloc(BLOCK_QUERIES * MAX_LINE_LEN)) == NULL) {
+		fprintf(stderr, "Error allocating memory for output\n");
+		pthread_mutex_lock(&block_lock);
+		write_failed = TRUE;
+		pthread_cond_broadcast(&turn_cond);
+		pthread_mutex_unlock(&block_lock);
+		return (NULL);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&block_lock);
+		block = next_block++;
+		pthread_mutex_unlock(&block_lock);
+		if (block >= num_blocks)
+			break;
+
+		/* Each block has its own stream of random numbers */
+		state = seed + (block + 1) * 0x9e3779b97f4a7c15ULL;
+		state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+		state ^= state >> 31;
+		if (state == 0)
+			state = 1;
+
+		count = num_queries - block * BLOCK_QUERIES;
+		if (count > BLOCK_QUERIES)
+			count = BLOCK_QUERIES;
+		for (i = 0, len = 0; i < count; i++) {
+			if ((n = generate_query(&state, buf + len)) == -1)
+				break;
+			len += n;
+		}
+
+		pthread_mutex_lock(&block_lock);
+		if (i < count) {
+			write_failed = TRUE;
+			pthread_cond_broadcast(&turn_cond);
+			pthread_mutex_unlock(&block_lock);
+			break;
+		}
+		while (write_turn != block && !write_failed)
+			pthread_cond_wait(&turn_cond, &block_lock);
+		pthread_mutex_unlock(&block_lock);
+
+		if (!write_failed && fwrite(buf, 1, len, output_fp) != len) {
+			fprintf(stderr, "Error writing output: %s\n",
+				strerror(errno));
+			write_failed = TRUE;
+		}
+
+		pthread_mutex_lock(&block_lock);
+		write_turn++;
+		pthread_cond_broadcast(&turn_cond);
+		pthread_mutex_unlock(&block_lock);
+	}
+
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * queryperf-gen Program Mainline
+ */
+int
+main(int argc, char **argv) {
+	unsigned char header[CORPUS_HEADER_LEN];
+	pthread_t *threads;
+	unsigned int i;
+
+	if (parse_args(argc, argv) == -1) {
+		show_usage();
+		return (1);
+	}
+
+	if (!seed_set)
+		seed = ((unsigned long long)time(NULL) << 32) ^ getpid();
+
+	if (zone_file != NULL) {
+		if (read_zone(zone_file) == -1)
+			return (1);
+		if (zipf_exponent > 0.0 && zipf_alias_table() == -1)
+			return (1);
+	}
+
+	if (output_file == NULL)
+		output_fp = stdout;
+	else if ((output_fp = fopen(output_file, "wb")) == NULL) {
+		fprintf(stderr, "Error: unable to open %s: %s\n",
+			output_file, strerror(errno));
+		return (1);
+	}
+
+	if (binary_output) {
+		memset(header, 0, sizeof(header));
+		memcpy(header, CORPUS_MAGIC, CORPUS_MAGIC_LEN);
+		header[11] = CORPUS_VERSION;
+		if (fwrite(header, sizeof(header), 1, output_fp) != 1) {
+			fprintf(stderr, "Error writing output: %s\n",
+				strerror(errno));
+			return (1);
+		}
+	}
+
+	num_blocks = (num_queries + BLOCK_QUERIES - 1) / BLOCK_QUERIES;
+	if (num_threads > num_blocks)
+		num_threads = num_blocks > 0 ? num_blocks : 1;
+
+	if ((threads = calloc(num_threads, sizeof(threads[0]))) == NULL) {
+		fprintf(stderr, "Error allocating memory for threads\n");
+		return (1);
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, generator_main,
+				   NULL) != 0) {
+			fprintf(stderr, "Error: unable to start thread\n");
+			return (1);
+		}
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fclose(output_fp) != 0) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		return (1);
+	}
+
+	return (write_failed ? 1 : 0);
+}
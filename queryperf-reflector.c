@@ -0,0 +1,958 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Loopback Reflector for queryperf  (queryperf-reflector.c)
+ ***
+ ***	A minimal DNS responder that answers every query itself, over UDP
+ ***	and TCP, with a chosen rcode, answer size and latency, so that
+ ***	queryperf can be measured against something that is never the
+ ***	bottleneck.
+ ***/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_GETADDRINFO
+#include "missing/addrinfo.h"
+#endif
+
+/*
+ * Configuration defaults
+ */
+
+#define DEF_ADDRESS			"127.0.0.1"
+#define DEF_PORT			"5300"
+#define DEF_THREADS			1
+#define DEF_RCODE			0		/* NOERROR */
+
+/*
+ * Other constants / definitions
+ */
+
+#define DNS_HEADERLEN			12
+#define MAX_UDP_LEN			4096
+#define MAX_MESSAGE_LEN			65535
+#define MAX_ANSWER_SIZE			60000
+#define DEF_UDP_PAYLOAD			512
+#define MAX_TCP_CONNECTIONS		64
+#define RECEIVE_BATCH			64
+#define IDLE_WAIT			0.1		/* in seconds */
+#define SPIN_WAIT			0.0002		/* in seconds */
+#define SOCKET_BUFFER_SIZE		(4 * 1024 * 1024)	/* in bytes */
+#define T_OPT				41
+#define T_TXT				16
+#define C_IN				1
+
+#define FALSE				0
+#define TRUE				1
+
+#ifndef M_PI
+#define M_PI				3.14159265358979323846
+#endif
+
+#define RCODE_STRINGS { \
+	"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", \
+	"NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET", \
+	"NXRRSET", "NOTAUTH", "NOTZONE" \
+}
+
+/*
+ * Artificial latency: how long to hold each response, in seconds
+ */
+enum latency_type { LATENCY_NONE, LATENCY_FIXED, LATENCY_UNIFORM,
+		    LATENCY_EXP, LATENCY_NORMAL };
+
+struct latency {
+	enum latency_type type;
+	double a, b;		/* fixed/mean/min, and max/sd */
+};
+
+/*
+ * A response held back until it is due, in a min-heap per thread
+ */
+struct pending {
+	double due;
+	int fd;
+	int tcp;
+	unsigned int generation;	/* of the TCP connection */
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	unsigned int len;
+	unsigned char msg[1];	/* len bytes, plus 2 for TCP */
+};
+
+struct delay_queue {
+	struct pending **heap;
+	unsigned int count, size;
+};
+
+struct tcp_connection {
+	int fd;			/* -1 if unused */
+	unsigned int generation;
+	unsigned int len;
+	unsigned char buf[2 + MAX_MESSAGE_LEN];
+};
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned long long random_state;
+	unsigned long long received;
+	unsigned long long answered;
+	struct delay_queue queue;
+};
+
+/*
+ * Configuration options (global)
+ */
+
+char *address = DEF_ADDRESS;
+char *port = DEF_PORT;
+unsigned int num_threads = DEF_THREADS;
+int rcode = DEF_RCODE;
+unsigned int answer_size;				/* init 0 */
+struct latency latency;					/* init LATENCY_NONE */
+int use_tcp = TRUE;
+
+/*
+ * Other global stuff
+ */
+
+volatile sig_atomic_t stop;				/* init 0 */
+struct worker *workers;					/* init NULL */
+struct worker tcp_worker;
+struct tcp_connection *tcp_connections;			/* init NULL */
+
+/*
+ * show_usage:
+ *   Print out usage/syntax information
+ */
+void
+show_usage(void) {
+	fprintf(stderr,
+"\n"
+"Usage: queryperf-reflector [-a address] [-p port] [-j threads] [-r rcode]\n"
+"                           [-s size] [-l latency] [-U] [-h]\n"
+"  -a address to listen on (default: %s)\n"
+"  -p port to listen on (default: %s)\n"
+"  -j number of UDP threads (default: %d)\n"
+"  -r rcode of the responses, by name or number (default: NOERROR)\n"
+"  -s bytes of TXT answer data to add to each NOERROR response\n"
+"     (default: 0 = none)\n"
+"  -l latency of the responses, in msec, as one of\n"
+"     fixed:T, uniform:MIN:MAX, exp:MEAN or normal:MEAN:SD\n"
+"     (default: none)\n"
+"  -U answer over UDP only\n"
+"  -h print this usage\n"
+"\n",
+		DEF_ADDRESS, DEF_PORT, DEF_THREADS);
+}
+
+/*
+ * parse_latency:
+ *   Parse a latency distribution such as "uniform:1:5" (in msec)
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_latency(const char *spec) {
+	char name[16];
+	double a = 0.0, b = 0.0;
+	int n;
+
+	n = sscanf(spec, "%15[a-z]:%lf:%lf", name, &a, &b);
+	if (n >= 2 && strcmp(name, "fixed") == 0 && a >= 0.0)
+		latency.type = LATENCY_FIXED;
+	else if (n == 3 && strcmp(name, "uniform") == 0 && a >= 0.0 &&
+		 b >= a)
+		latency.type = LATENCY_UNIFORM;
+	else if (n >= 2 && strcmp(name, "exp") == 0 && a > 0.0)
+		latency.type = LATENCY_EXP;
+	else if (n == 3 && strcmp(name, "normal") == 0 && a >= 0.0 &&
+		 b >= 0.0)
+		latency.type = LATENCY_NORMAL;
+	else {
+		fprintf(stderr, "Invalid latency: %s\n", spec);
+		return (-1);
+	}
+
+	latency.a = a / 1000.0;
+	latency.b = b / 1000.0;
+	return (0);
+}
+
+/*
+ * parse_rcode:
+ *   Parse an rcode given by name or number
+ *
+ *   Return -1 on failure
+ *   Return the rcode otherwise
+ */
+int
+parse_rcode(const char *str) {
+	static const char *rcode_strings[] = RCODE_STRINGS;
+	unsigned long v;
+	unsigned int i;
+	char *end;
+
+	for (i = 0; i < sizeof(rcode_strings) / sizeof(rcode_strings[0]); i++)
+		if (strcasecmp(str, rcode_strings[i]) == 0)
+			return (i);
+
+	v = strtoul(str, &end, 10);
+	if (*end != '\0' || end == str || v > 15)
+		return (-1);
+
+	return ((int)v);
+}
+
+/*
+ * parse_args:
+ *   Parse the command line
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_args(int argc, char **argv) {
+	int c;
+	char *end;
+
+	while ((c = getopt(argc, argv, "a:p:j:r:s:l:Uh")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'j':
+			num_threads = strtoul(optarg, &end, 10);
+			if (*end != '\0' || num_threads == 0) {
+				fprintf(stderr, "Invalid number of threads: "
+					"%s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 'r':
+			if ((rcode = parse_rcode(optarg)) == -1) {
+				fprintf(stderr, "Invalid rcode: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 's':
+			answer_size = strtoul(optarg, &end, 10);
+			if (*end != '\0' || answer_size > MAX_ANSWER_SIZE) {
+				fprintf(stderr, "Invalid answer size (0-%d): "
+					"%s\n", MAX_ANSWER_SIZE, optarg);
+				return (-1);
+			}
+			break;
+		case 'l':
+			if (parse_latency(optarg) == -1)
+				return (-1);
+			break;
+		case 'U':
+			use_tcp = FALSE;
+			break;
+		case 'h':
+		default:
+			return (-1);
+		}
+	}
+
+	if (optind != argc)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * now_sec:
+ *   The current time in seconds
+ */
+static double
+now_sec(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((double)tv.tv_sec + (double)tv.tv_usec / 1000000.0);
+}
+
+/*
+ * next_random:
+ *   Return the next number from a xorshift64* generator
+ */
+static unsigned long long
+next_random(unsigned long long *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return (*state * 2685821657736338717ULL);
+}
+
+/*
+ * random_fraction:
+ *   Return a random number in [0, 1)
+ */
+static double
+random_fraction(unsigned long long *state) {
+	return ((next_random(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * sample_latency:
+ *   Draw how long to hold a response, in seconds
+ */
+static double
+sample_latency(unsigned long long *state) {
+	double u, v;
+
+	switch (latency.type) {
+	case LATENCY_FIXED:
+		return (latency.a);
+	case LATENCY_UNIFORM:
+		return (latency.a + (latency.b - latency.a) *
+			random_fraction(state));
+	case LATENCY_EXP:
+		return (-latency.a * log(1.0 - random_fraction(state)));
+	case LATENCY_NORMAL:
+		/* Box-Muller, cut off at 0 */
+		u = 1.0 - random_fraction(state);
+		v = random_fraction(state);
+		u = latency.a + latency.b * sqrt(-2.0 * log(u)) *
+			cos(2.0 * M_PI * v);
+		return (u > 0.0 ? u : 0.0);
+	default:
+		return (0.0);
+	}
+}
+
+/*
+ * skip_name:
+ *   Find the end of an uncompressed name starting at p
+ *
+ *   Return NULL if it runs past end or is compressed
+ *   Return the first byte after it otherwise
+ */
+static const unsigned char *
+skip_name(const unsigned char *p, const unsigned char *end) {
+	while (p < end) {
+		if (*p == 0)
+			return (p + 1);
+		if ((*p & 0xc0) != 0)
+			return (NULL);
+		p += *p + 1;
+	}
+
+	return (NULL);
+}
+
+/*
+ * build_response:
+ *   Build the response to a query in resp: the query's header and
+ *   question, the configured rcode, a TXT answer of answer_size bytes
+ *   if the rcode is NOERROR, and an OPT record if the query had one.
+ *   Over UDP, a response too big for the client is truncated.
+ *
+ *   Return -1 if the query is to be ignored
+ *   Return the length of the response otherwise
+ */
+int
+build_response(const unsigned char *q, unsigned int qlen, int tcp,
+	       unsigned char *resp)
+{
+	const unsigned char *end = q + qlen, *qend, *p;
+	unsigned int limit = DEF_UDP_PAYLOAD, len, left, n;
+	int edns = FALSE, code = rcode;
+	unsigned char *r;
+
+	if (qlen < DNS_HEADERLEN || (q[2] & 0x80) != 0)
+		return (-1);
+
+	/* One question, and perhaps an OPT record after it */
+	qend = NULL;
+	if (q[4] == 0 && q[5] == 1 &&
+	    (qend = skip_name(q + DNS_HEADERLEN, end)) != NULL &&
+	    qend + 4 <= end) {
+		qend += 4;
+		p = qend;
+		if (q[6] == 0 && q[7] == 0 && q[8] == 0 && q[9] == 0 &&
+		    q[10] == 0 && q[11] == 1 && p + 11 <= end && p[0] == 0 &&
+		    p[1] == 0 && p[2] == T_OPT) {
+			edns = TRUE;
+			limit = (p[3] << 8) | p[4];
+			if (limit < DEF_UDP_PAYLOAD)
+				limit = DEF_UDP_PAYLOAD;
+			if (limit > MAX_UDP_LEN)
+				limit = MAX_UDP_LEN;
+		}
+	} else {
+		qend = q + DNS_HEADERLEN;
+		code = 1;	/* FORMERR */
+	}
+	if (tcp)
+		limit = MAX_MESSAGE_LEN;
+
+	len = qend - q;
+	memcpy(resp, q, len);
+	resp[2] = (q[2] & 0x79) | 0x84;	/* QR, AA; keep opcode and RD */
+	resp[3] = code & 0x0f;
+	resp[4] = 0;
+	resp[5] = (len > DNS_HEADERLEN) ? 1 : 0;
+	memset(resp + 6, 0, 6);
+
+	if (answer_size > 0 && code == 0 && len > DNS_HEADERLEN) {
+		if (len + 12 + answer_size + (edns ? 11 : 0) > limit) {
+			resp[2] |= 0x02;	/* TC */
+		} else {
+			r = resp + len;
+			*r++ = 0xc0;	/* the question name */
+			*r++ = DNS_HEADERLEN;
+			*r++ = 0;
+			*r++ = T_TXT;
+			*r++ = 0;
+			*r++ = C_IN;
+			*r++ = 0;	/* TTL 300 */
+			*r++ = 0;
+			*r++ = 300 >> 8;
+			*r++ = 300 & 0xff;
+			*r++ = answer_size >> 8;
+			*r++ = answer_size & 0xff;
+			for (left = answer_size; left > 0; left -= n + 1) {
+				n = (left - 1 > 255) ? 255 : left - 1;
+				*r++ = n;
+				memset(r, 'x', n);
+				r += n;
+			}
+			len = r - resp;
+			resp[7] = 1;	/* ancount */
+		}
+	}
+
+	if (edns) {
+		r = resp + len;
+		*r++ = 0;	/* root */
+		*r++ = 0;
+		*r++ = T_OPT;
+		*r++ = MAX_UDP_LEN >> 8;
+		*r++ = MAX_UDP_LEN & 0xff;
+		*r++ = 0;	/* extended rcode, version, flags */
+		*r++ = 0;
+		*r++ = 0;
+		*r++ = 0;
+		*r++ = 0;	/* rdlen */
+		*r++ = 0;
+		len = r - resp;
+		resp[11] = 1;	/* arcount */
+	}
+
+	return ((int)len);
+}
+
+/*
+ * queue_push:
+ *   Hold a response until it is due
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+queue_push(struct delay_queue *dq, struct pending *pd) {
+	struct pending **h, *t;
+	unsigned int i;
+
+	if (dq->count == dq->size) {
+		dq->size = dq->size ? dq->size * 2 : 1024;
+		h = realloc(dq->heap, dq->size * sizeof(dq->heap[0]));
+		if (h == NULL)
+			return (-1);
+		dq->heap = h;
+	}
+
+	h = dq->heap;
+	i = dq->count++;
+	h[i] = pd;
+	while (i > 0 && h[(i - 1) / 2]->due > h[i]->due) {
+		t = h[i];
+		h[i] = h[(i - 1) / 2];
+		h[(i - 1) / 2] = t;
+		i = (i - 1) / 2;
+	}
+
+	return (0);
+}
+
+/*
+ * queue_pop:
+ *   Take the response due first
+ */
+static struct pending *
+queue_pop(struct delay_queue *dq) {
+	struct pending **h = dq->heap, *top, *t;
+	unsigned int i = 0, c;
+
+	top = h[0];
+	h[0] = h[--dq->count];
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= dq->count)
+			break;
+		if (c + 1 < dq->count && h[c + 1]->due < h[c]->due)
+			c++;
+		if (h[i]->due <= h[c]->due)
+			break;
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+		i = c;
+	}
+
+	return (top);
+}
+
+/*
+ * write_tcp:
+ *   Write a length-prefixed response (len bytes after the prefix)
+ */
+static void
+write_tcp(int fd, unsigned char *msg, unsigned int len) {
+	ssize_t n;
+
+	msg[0] = len >> 8;
+	msg[1] = len & 0xff;
+	for (len += 2; len > 0; msg += n, len -= n) {
+		n = write(fd, msg, len);
+		if (n <= 0)
+			return;
+	}
+}
+
+/*
+ * send_response:
+ *   Send a response now, or queue it if there is latency to add.  fd is
+ *   the UDP socket, or the index of the TCP connection, whose responses
+ *   have room for the length prefix before msg.
+ */
+static void
+send_response(struct worker *w, int fd, int tcp, unsigned int generation,
+	      const struct sockaddr_storage *peer, socklen_t peer_len,
+	      unsigned char *msg, unsigned int len)
+{
+	struct pending *pd;
+	double delay;
+
+	delay = sample_latency(&w->random_state);
+	if (delay > 0.0) {
+		pd = malloc(sizeof(*pd) + len + 2);
+		if (pd != NULL) {
+			pd->due = now_sec() + delay;
+			pd->fd = fd;
+			pd->tcp = tcp;
+			pd->generation = generation;
+			if (peer != NULL)
+				memcpy(&pd->peer, peer, peer_len);
+			pd->peer_len = peer_len;
+			pd->len = len;
+			memcpy(pd->msg, msg, len + (tcp ? 2 : 0));
+			if (queue_push(&w->queue, pd) == 0)
+				return;
+			free(pd);
+		}
+		/* Out of memory: answer at once rather than not at all */
+	}
+
+	if (tcp)
+		write_tcp(tcp_connections[fd].fd, msg, len);
+	else if (sendto(fd, msg, len, 0, (const struct sockaddr *)peer,
+			peer_len) == -1)
+		return;
+	w->answered++;
+}
+
+/*
+ * send_due:
+ *   Send the held responses that are due
+ *
+ *   Return how long to wait for the next one, or IDLE_WAIT if none is
+ *   held.  A response due within SPIN_WAIT is polled for instead, since
+ *   select() may oversleep by that much.
+ */
+static double
+send_due(struct worker *w) {
+	struct pending *pd;
+	struct tcp_connection *tc;
+	double now = now_sec(), wait = IDLE_WAIT;
+
+	while (w->queue.count > 0) {
+		pd = w->queue.heap[0];
+		if (pd->due > now) {
+			wait = pd->due - now;
+			break;
+		}
+		queue_pop(&w->queue);
+		if (pd->tcp) {
+			/* Only if the connection is still the same one */
+			tc = &tcp_connections[pd->fd];
+			if (tc->fd != -1 && tc->generation == pd->generation) {
+				write_tcp(tc->fd, pd->msg, pd->len);
+				w->answered++;
+			}
+		} else if (sendto(pd->fd, pd->msg, pd->len, 0,
+				  (struct sockaddr *)&pd->peer,
+				  pd->peer_len) != -1)
+			w->answered++;
+		free(pd);
+	}
+
+	if (wait < SPIN_WAIT)
+		return (0.0);
+	return (wait > IDLE_WAIT ? IDLE_WAIT : wait - SPIN_WAIT / 2);
+}
+
+/*
+ * wait_readable:
+ *   Wait up to wait seconds for fd to become readable
+ *
+ *   Return TRUE if it is
+ *   Return FALSE otherwise
+ */
+static int
+wait_readable(int fd, double wait) {
+	struct timeval tv;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	tv.tv_sec = (long)wait;
+	tv.tv_usec = (long)((wait - tv.tv_sec) * 1000000.0);
+
+	return (select(fd + 1, &fds, NULL, NULL, &tv) > 0);
+}
+
+/*
+ * udp_worker_main:
+ *   Answer queries arriving on a UDP socket until told to stop
+ */
+static void *
+udp_worker_main(void *arg) {
+	struct worker *w = arg;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	unsigned char query[MAX_UDP_LEN], resp[MAX_MESSAGE_LEN];
+	unsigned int i;
+	double wait = IDLE_WAIT;
+	ssize_t n;
+	int len;
+
+	while (!stop) {
+		if (wait_readable(w->fd, wait)) {
+			for (i = 0; i < RECEIVE_BATCH; i++) {
+				peer_len = sizeof(peer);
+				n = recvfrom(w->fd, query, sizeof(query), 0,
+					     (struct sockaddr *)&peer,
+					     &peer_len);
+				if (n <= 0)
+					break;
+				w->received++;
+				len = build_response(query, n, FALSE, resp);
+				if (len == -1)
+					continue;
+				send_response(w, w->fd, FALSE, 0, &peer,
+					      peer_len, resp, len);
+			}
+		}
+		wait = send_due(w);
+	}
+
+	return (NULL);
+}
+
+/*
+ * tcp_read:
+ *   Read from a TCP connection and answer the whole queries received
+ *
+ *   Return -1 if the connection is to be closed
+ *   Return a non-negative integer otherwise
+ */
+static int
+tcp_read(struct worker *w, struct tcp_connection *tc, unsigned char *resp) {
+	unsigned int mlen, used = 0;
+	ssize_t n;
+	int len;
+
+	n = read(tc->fd, tc->buf + tc->len, sizeof(tc->buf) - tc->len);
+	if (n <= 0)
+		return (-1);
+	tc->len += n;
+
+	while (tc->len - used >= 2) {
+		mlen = (tc->buf[used] << 8) | tc->buf[used + 1];
+		if (tc->len - used - 2 < mlen)
+			break;
+		w->received++;
+		len = build_response(tc->buf + used + 2, mlen, TRUE,
+				     resp + 2);
+		used += 2 + mlen;
+		if (len == -1)
+			continue;
+		send_response(w, tc - tcp_connections, TRUE, tc->generation,
+			      NULL, 0, resp, len);
+	}
+
+	tc->len -= used;
+	memmove(tc->buf, tc->buf + used, tc->len);
+	return (0);
+}
+
+/*
+ * tcp_worker_main:
+ *   Accept TCP connections and answer the queries on them until told to
+ *   stop
+ */
+static void *
+tcp_worker_main(void *arg) {
+	int listen_fd = *(int *)arg, fd, maxfd, i;
+	static unsigned char resp[2 + MAX_MESSAGE_LEN];
+	struct tcp_connection *tc;
+	struct timeval tv;
+	unsigned int generation = 0;
+	double wait = IDLE_WAIT;
+	fd_set fds;
+
+	while (!stop) {
+		FD_ZERO(&fds);
+		FD_SET(listen_fd, &fds);
+		maxfd = listen_fd;
+		for (i = 0; i < MAX_TCP_CONNECTIONS; i++) {
+			if ((fd = tcp_connections[i].fd) == -1)
+				continue;
+			FD_SET(fd, &fds);
+			if (maxfd < fd)
+				maxfd = fd;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = (long)(wait * 1000000.0);
+
+		if (select(maxfd + 1, &fds, NULL, NULL, &tv) > 0) {
+			for (i = 0; i < MAX_TCP_CONNECTIONS; i++) {
+				tc = &tcp_connections[i];
+				if (tc->fd == -1 || !FD_ISSET(tc->fd, &fds))
+					continue;
+				if (tcp_read(&tcp_worker, tc, resp) == -1) {
+					close(tc->fd);
+					tc->fd = -1;
+				}
+			}
+			if (FD_ISSET(listen_fd, &fds) &&
+			    (fd = accept(listen_fd, NULL, NULL)) != -1) {
+				for (i = 0; i < MAX_TCP_CONNECTIONS; i++)
+					if (tcp_connections[i].fd == -1)
+						break;
+				if (i == MAX_TCP_CONNECTIONS)
+					close(fd);
+				else {
+					tc = &tcp_connections[i];
+					tc->fd = fd;
+					tc->generation = ++generation;
+					tc->len = 0;
+				}
+			}
+		}
+		wait = send_due(&tcp_worker);
+	}
+
+	return (NULL);
+}
+
+/*
+ * open_listener:
+ *   Open a socket of the given type bound to the address and port
+ *
+ *   Return -1 on failure
+ *   Return the socket otherwise
+ */
+int
+open_listener(int socktype) {
+	struct addrinfo hints, *res;
+	int fd, ret, on = 1, size = SOCKET_BUFFER_SIZE;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(address, port, &hints, &res)) != 0) {
+		fprintf(stderr, "Error resolving %s#%s: %s\n", address, port,
+			gai_strerror(ret));
+		return (-1);
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd != -1) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		/* Each UDP thread has its own socket on the port */
+		if (socktype == SOCK_DGRAM)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on,
+				   sizeof(on));
+#endif
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	if (fd == -1 || bind(fd, res->ai_addr, res->ai_addrlen) == -1 ||
+	    (socktype == SOCK_STREAM && listen(fd, 64) == -1) ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stderr, "Error listening on %s#%s: %s\n", address,
+			port, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		freeaddrinfo(res);
+		return (-1);
+	}
+	freeaddrinfo(res);
+
+	return (fd);
+}
+
+/*
+ * handle_signal:
+ *   Ask the threads to stop
+ */
+static void
+handle_signal(int sig) {
+	(void)sig;
+
+	stop = TRUE;
+}
+
+/*
+ * queryperf-reflector Program Mainline
+ */
+int
+main(int argc, char **argv) {
+	unsigned long long received, answered;
+	unsigned int i;
+	int tcp_fd = -1;
+#ifndef SO_REUSEPORT
+	int shared_fd = -1;
+#endif
+	double start, run_time;
+
+	if (parse_args(argc, argv) == -1) {
+		show_usage();
+		return (1);
+	}
+
+	if ((workers = calloc(num_threads, sizeof(workers[0]))) == NULL) {
+		fprintf(stderr, "Error allocating memory for threads\n");
+		return (1);
+	}
+	for (i = 0; i < num_threads; i++) {
+#ifdef SO_REUSEPORT
+		workers[i].fd = open_listener(SOCK_DGRAM);
+#else
+		/* The threads take turns on one socket */
+		if (shared_fd == -1)
+			shared_fd = open_listener(SOCK_DGRAM);
+		workers[i].fd = shared_fd;
+#endif
+		if (workers[i].fd == -1)
+			return (1);
+		workers[i].random_state = ((unsigned long long)time(NULL) <<
+					   32) ^ (getpid() + i * 7919ULL);
+	}
+
+	if (use_tcp) {
+		tcp_connections = calloc(MAX_TCP_CONNECTIONS,
+					 sizeof(tcp_connections[0]));
+		if (tcp_connections == NULL) {
+			fprintf(stderr, "Error allocating memory for "
+				"connections\n");
+			return (1);
+		}
+		for (i = 0; i < MAX_TCP_CONNECTIONS; i++)
+			tcp_connections[i].fd = -1;
+		if ((tcp_fd = open_listener(SOCK_STREAM)) == -1)
+			return (1);
+		tcp_worker.random_state = (unsigned long long)time(NULL) ^
+			~(unsigned long long)getpid();
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("[Status] Answering on %s#%s with %u UDP thread%s%s\n",
+	       address, port, num_threads, num_threads == 1 ? "" : "s",
+	       use_tcp ? " and TCP" : "");
+	fflush(stdout);
+	start = now_sec();
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, udp_worker_main,
+				   &workers[i]) != 0) {
+			fprintf(stderr, "Error: unable to start thread\n");
+			return (1);
+		}
+	}
+	if (use_tcp &&
+	    pthread_create(&tcp_worker.thread, NULL, tcp_worker_main,
+			   &tcp_fd) != 0) {
+		fprintf(stderr, "Error: unable to start TCP thread\n");
+		return (1);
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (use_tcp)
+		pthread_join(tcp_worker.thread, NULL);
+	run_time = now_sec() - start;
+
+	received = tcp_worker.received;
+	answered = tcp_worker.answered;
+	for (i = 0; i < num_threads; i++) {
+		received += workers[i].received;
+		answered += workers[i].answered;
+	}
+	printf("[Status] Received %llu queries (%llu over TCP), answered "
+	       "%llu, in %.3f seconds (%.1f qps)\n", received,
+	       tcp_worker.received, answered, run_time,
+	       run_time > 0.0 ? (double)received / run_time : 0.0);
+
+	return (0);
+}
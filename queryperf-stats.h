@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Definitions shared by queryperf and queryperf-top
+ ***/
+
+#ifndef QUERYPERF_STATS_H
+#define QUERYPERF_STATS_H 1
+
+#include <stdint.h>
+
+/*
+ * Live statistics, published by "queryperf -m name" in the POSIX shared
+ * memory object /name (/name.i for worker i with -N) and read by
+ * queryperf-top.  Integers are in host byte order.
+ *
+ * The counters are a snapshot under a sequence lock: seq is odd while
+ * queryperf is updating them, so a reader copies them out and retries if
+ * seq was odd or changed meanwhile.  The RTT histogram after them is the
+ * one queryperf counts into, so it is always current but is not covered
+ * by seq; each bucket is one aligned 32-bit word.
+ */
+#define STATS_MAGIC			0x51505354	/* "QPST" */
+#define STATS_VERSION			1
+
+struct stats_counters {
+	double first_query;	/* seconds since the epoch, 0 = none yet */
+	double updated;		/* when the snapshot was taken */
+	uint64_t sent;
+	uint64_t outstanding;
+	uint64_t timed_out;
+	uint64_t possibly_delayed;
+	uint64_t responses;
+	uint64_t rtt_overflows;
+	uint64_t input_stalls;
+	double rtt_total;
+	double rtt_min;
+	double rtt_max;
+	double input_stall_time;
+	uint32_t target_qps;
+	uint32_t max_outstanding;
+	uint32_t finished;	/* the run is over */
+	uint32_t reserved;
+	uint64_t rcodes[16];
+};
+
+struct stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t rtt_unit;	/* width of a histogram bucket in usec */
+	uint32_t rtt_buckets;	/* 0 if there is no histogram */
+	uint32_t pid;
+	struct stats_counters counters;
+	uint32_t histogram[1];	/* rtt_buckets of them */
+};
+
+#define STATS_SHM_SIZE(buckets) \
+	(sizeof(struct stats_shm) + ((buckets) > 0 ? (buckets) - 1 : 0) * \
+	 sizeof(uint32_t))
+
+#endif /* QUERYPERF_STATS_H */
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2000, 2001  Nominum, Inc.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM
+ * DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * INTERNET SOFTWARE CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/***
+ ***	Live Statistics Viewer for queryperf  (queryperf-top.c)
+ ***
+ ***	Attaches to the statistics published by "queryperf -m name" and
+ ***	prints the rates and RTT percentiles of each interval as it runs.
+ ***/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "queryperf-stats.h"
+
+/*
+ * Configuration defaults
+ */
+
+#define DEF_INTERVAL			1.0		/* in seconds */
+
+/*
+ * Other constants / definitions
+ */
+
+#define MAX_SOURCES			256
+#define HEADER_EVERY			20		/* report lines */
+#define MAX_NAME_LEN			256
+
+#define FALSE				0
+#define TRUE				1
+
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_READ(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/*
+ * A queryperf process being watched: one, or each worker of a -N run
+ */
+struct source {
+	char name[MAX_NAME_LEN];
+	const struct stats_shm *shm;
+};
+
+/*
+ * The counters of all the sources added up, with their histogram
+ */
+struct snapshot {
+	struct stats_counters c;
+	unsigned long long *histogram;
+};
+
+/*
+ * Configuration options (global)
+ */
+
+double interval = DEF_INTERVAL;
+unsigned int max_reports;				/* init 0 */
+
+/*
+ * Other global stuff
+ */
+
+struct source sources[MAX_SOURCES];
+unsigned int num_sources;				/* init 0 */
+unsigned int rtt_unit;					/* init 0 */
+unsigned int rtt_buckets;				/* init 0 */
+
+/*
+ * show_usage:
+ *   Print out usage/syntax information
+ */
+void
+show_usage(void) {
+	fprintf(stderr,
+"\n"
+"Usage: queryperf-top [-i interval] [-c count] name\n"
+"  -i seconds between reports (default: %.0f)\n"
+"  -c number of reports to print (default: until the run ends)\n"
+"  name is the one given to queryperf -m; the workers of a -N run are\n"
+"  found and added up\n"
+"\n",
+		DEF_INTERVAL);
+}
+
+/*
+ * parse_args:
+ *   Parse the command line
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_args(int argc, char **argv) {
+	int c;
+	char *end;
+
+	while ((c = getopt(argc, argv, "i:c:h")) != -1) {
+		switch (c) {
+		case 'i':
+			interval = strtod(optarg, &end);
+			if (*end != '\0' || interval <= 0.0) {
+				fprintf(stderr, "Invalid interval: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'c':
+			max_reports = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg) {
+				fprintf(stderr, "Invalid count: %s\n", optarg);
+				return (-1);
+			}
+			break;
+		case 'h':
+		default:
+			return (-1);
+		}
+	}
+
+	if (optind != argc - 1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * attach:
+ *   Map the statistics of one queryperf process
+ *
+ *   Return -1 on failure, with errno ENOENT if there is no such object
+ *   Return a non-negative integer otherwise
+ */
+int
+attach(const char *name) {
+	struct source *src;
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (num_sources == MAX_SOURCES) {
+		errno = EMFILE;
+		return (-1);
+	}
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return (-1);
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < STATS_SHM_SIZE(0)) {
+		close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (-1);
+
+	src = &sources[num_sources];
+	src->shm = p;
+	if (ATOMIC_LOAD(&src->shm->magic) != STATS_MAGIC ||
+	    src->shm->version != STATS_VERSION ||
+	    (size_t)st.st_size < STATS_SHM_SIZE(src->shm->rtt_buckets)) {
+		fprintf(stderr, "%s: not queryperf statistics of version %d\n",
+			name, STATS_VERSION);
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		return (-1);
+	}
+	if (num_sources == 0) {
+		rtt_unit = src->shm->rtt_unit;
+		rtt_buckets = src->shm->rtt_buckets;
+	} else if (src->shm->rtt_unit != rtt_unit ||
+		   src->shm->rtt_buckets != rtt_buckets) {
+		fprintf(stderr, "%s: RTT histogram differs from the others\n",
+			name);
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		return (-1);
+	}
+	snprintf(src->name, sizeof(src->name), "%s", name);
+	num_sources++;
+
+	return (0);
+}
+
+/*
+ * find_sources:
+ *   Attach to the statistics called name, or else to those of the
+ *   workers name.0, name.1, ...
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+find_sources(const char *arg) {
+	char name[MAX_NAME_LEN], worker[MAX_NAME_LEN + 16];
+	unsigned int i;
+
+	snprintf(name, sizeof(name), "%s%s", arg[0] == '/' ? "" : "/", arg);
+	if (attach(name) == 0)
+		return (0);
+	if (errno != ENOENT)
+		goto fail;
+
+	for (i = 0; i < MAX_SOURCES; i++) {
+		snprintf(worker, sizeof(worker), "%s.%u", name, i);
+		if (attach(worker) == -1) {
+			if (errno == ENOENT && i > 0)
+				return (0);
+			goto fail;
+		}
+	}
+
+	return (0);
+
+ fail:
+	if (errno == ENOENT)
+		fprintf(stderr, "No statistics called %s (is queryperf "
+			"running with -m?)\n", name);
+	else if (errno != EINVAL)
+		fprintf(stderr, "Error attaching to %s: %s\n", name,
+			strerror(errno));
+	return (-1);
+}
+
+/*
+ * read_counters:
+ *   Copy the counters of one source, consistently
+ */
+void
+read_counters(const struct stats_shm *shm, struct stats_counters *c) {
+	unsigned int seq;
+
+	for (;;) {
+		seq = ATOMIC_LOAD(&shm->seq);
+		if ((seq & 1) == 0) {
+			memcpy(c, (const void *)&shm->counters, sizeof(*c));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (ATOMIC_READ(&shm->seq) == seq)
+				return;
+		}
+		sched_yield();
+	}
+}
+
+/*
+ * take_snapshot:
+ *   Add up the counters and histograms of all the sources
+ */
+void
+take_snapshot(struct snapshot *snap) {
+	struct stats_counters c, *t = &snap->c;
+	unsigned int i, j;
+
+	memset(t, 0, sizeof(*t));
+	t->finished = TRUE;
+	t->rtt_min = -1;
+	t->rtt_max = -1;
+	memset(snap->histogram, 0, rtt_buckets * sizeof(snap->histogram[0]));
+
+	for (i = 0; i < num_sources; i++) {
+		read_counters(sources[i].shm, &c);
+		for (j = 0; j < rtt_buckets; j++)
+			snap->histogram[j] +=
+				ATOMIC_READ(&sources[i].shm->histogram[j]);
+
+		if (c.first_query > 0.0 &&
+		    (t->first_query == 0.0 || t->first_query > c.first_query))
+			t->first_query = c.first_query;
+		if (t->updated < c.updated)
+			t->updated = c.updated;
+		t->sent += c.sent;
+		t->outstanding += c.outstanding;
+		t->timed_out += c.timed_out;
+		t->possibly_delayed += c.possibly_delayed;
+		t->responses += c.responses;
+		t->rtt_overflows += c.rtt_overflows;
+		t->input_stalls += c.input_stalls;
+		t->rtt_total += c.rtt_total;
+		if (c.rtt_min >= 0 && (t->rtt_min < 0 || t->rtt_min > c.rtt_min))
+			t->rtt_min = c.rtt_min;
+		if (c.rtt_max >= 0 && (t->rtt_max < 0 || t->rtt_max < c.rtt_max))
+			t->rtt_max = c.rtt_max;
+		t->input_stall_time += c.input_stall_time;
+		t->target_qps += c.target_qps;
+		t->max_outstanding += c.max_outstanding;
+		if (!c.finished)
+			t->finished = FALSE;
+		for (j = 0; j < 16; j++)
+			t->rcodes[j] += c.rcodes[j];
+	}
+}
+
+/*
+ * percentile:
+ *   The RTT in msec below which the fraction q of the responses counted
+ *   in the histogram difference cur - prev fall (prev may be NULL)
+ */
+double
+percentile(const unsigned long long *cur, const unsigned long long *prev,
+	   double q)
+{
+	unsigned long long total = 0, seen = 0, need;
+	unsigned int i;
+
+	for (i = 0; i < rtt_buckets; i++)
+		total += cur[i] - (prev != NULL ? prev[i] : 0);
+	if (total == 0)
+		return (0.0);
+
+	need = (unsigned long long)(q * total);
+	if (need < q * total)
+		need++;
+	for (i = 0; i < rtt_buckets; i++) {
+		seen += cur[i] - (prev != NULL ? prev[i] : 0);
+		if (seen >= need)
+			break;
+	}
+
+	return (((double)i + 0.5) * rtt_unit / 1000.0);
+}
+
+/*
+ * print_header:
+ *   Print the column headings of the reports
+ */
+void
+print_header(void) {
+	printf("%8s %10s %10s %8s %8s %7s %8s %8s %8s %8s %8s\n",
+	       "time", "sent/s", "resp/s", "lost", "delayed", "outst",
+	       "avg ms", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms");
+}
+
+/*
+ * print_report:
+ *   Print the rates and RTTs over the interval from prev to cur
+ */
+void
+print_report(const struct snapshot *cur, const struct snapshot *prev) {
+	const struct stats_counters *c = &cur->c, *p = &prev->c;
+	double elapsed, since;
+	unsigned long long responses;
+
+	elapsed = c->updated - p->updated;
+	if (elapsed <= 0.0)
+		elapsed = interval;
+	since = c->first_query > 0.0 ? c->updated - c->first_query : 0.0;
+	responses = c->responses - p->responses;
+
+	printf("%8.1f %10.1f %10.1f %8llu %8llu %7llu %8.3f %8.3f %8.3f "
+	       "%8.3f %8.3f\n", since,
+	       (double)(c->sent - p->sent) / elapsed,
+	       (double)responses / elapsed,
+	       (unsigned long long)(c->timed_out - p->timed_out),
+	       (unsigned long long)(c->possibly_delayed - p->possibly_delayed),
+	       (unsigned long long)c->outstanding,
+	       responses > 0 ?
+	       (c->rtt_total - p->rtt_total) * 1000.0 / responses : 0.0,
+	       percentile(cur->histogram, prev->histogram, 0.5),
+	       percentile(cur->histogram, prev->histogram, 0.9),
+	       percentile(cur->histogram, prev->histogram, 0.99),
+	       percentile(cur->histogram, prev->histogram, 0.999));
+	fflush(stdout);
+}
+
+/*
+ * print_summary:
+ *   Print the totals of the whole run once it is over
+ */
+void
+print_summary(const struct snapshot *snap) {
+	const struct stats_counters *c = &snap->c;
+	double run_time = 0.0;
+
+	if (c->first_query > 0.0)
+		run_time = c->updated - c->first_query;
+
+	printf("\n");
+	printf("  Queries sent:         %llu\n", (unsigned long long)c->sent);
+	printf("  Responses:            %llu\n",
+	       (unsigned long long)c->responses);
+	printf("  Queries lost:         %llu\n",
+	       (unsigned long long)c->timed_out);
+	printf("  Responses per second: %.1f\n", run_time > 0.0 ?
+	       (double)c->responses / run_time : 0.0);
+	printf("  RTT min/avg/max:      %.3f/%.3f/%.3f ms\n",
+	       c->rtt_min < 0 ? 0.0 : c->rtt_min * 1000.0,
+	       c->responses > 0 ? c->rtt_total * 1000.0 / c->responses : 0.0,
+	       c->rtt_max < 0 ? 0.0 : c->rtt_max * 1000.0);
+	printf("  RTT p50/p90/p99/p99.9: %.3f/%.3f/%.3f/%.3f ms\n",
+	       percentile(snap->histogram, NULL, 0.5),
+	       percentile(snap->histogram, NULL, 0.9),
+	       percentile(snap->histogram, NULL, 0.99),
+	       percentile(snap->histogram, NULL, 0.999));
+}
+
+/*
+ * queryperf-top Program Mainline
+ */
+int
+main(int argc, char **argv) {
+	struct snapshot snaps[2], *cur, *prev;
+	struct timespec wait;
+	unsigned int reports = 0, i;
+
+	if (parse_args(argc, argv) == -1) {
+		show_usage();
+		return (1);
+	}
+
+	if (find_sources(argv[optind]) == -1)
+		return (1);
+
+	for (i = 0; i < 2; i++) {
+		snaps[i].histogram = calloc(rtt_buckets + 1,
+					    sizeof(snaps[i].histogram[0]));
+		if (snaps[i].histogram == NULL) {
+			fprintf(stderr, "Error allocating memory for "
+				"histograms\n");
+			return (1);
+		}
+	}
+
+	wait.tv_sec = (time_t)interval;
+	wait.tv_nsec = (long)((interval - wait.tv_sec) * 1000000000.0);
+
+	prev = &snaps[0];
+	cur = &snaps[1];
+	take_snapshot(prev);
+	while (!prev->c.finished &&
+	       (max_reports == 0 || reports < max_reports)) {
+		nanosleep(&wait, NULL);
+		take_snapshot(cur);
+		if (reports % HEADER_EVERY == 0)
+			print_header();
+		print_report(cur, prev);
+		reports++;
+		prev = cur;
+		cur = (cur == &snaps[0]) ? &snaps[1] : &snaps[0];
+	}
+
+	if (prev->c.finished)
+		print_summary(prev);
+
+	return (0);
+}
@@ -26,6 +26,11 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,10 +39,13 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <arpa/nameser.h>
-#include <resolv.h>
 #include <math.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -46,6 +54,22 @@
 #endif
 #endif
 
+#include "queryperf-corpus.h"
+#include "queryperf-stats.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_ZLIB
+#include <zlib.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(HAVE_OPENSSL_EVP_H) && defined(HAVE_LIBCRYPTO)
+#define USE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
 /*
  * Configuration defaults
  */
@@ -59,6 +83,8 @@
 #define DEF_RTTARRAY_SIZE		50000
 #define DEF_RTTARRAY_UNIT		100		/* in usec */
 
+#define DEF_WRITE_RATE			10		/* per second */
+
 /*
  * Other constants / definitions
  */
@@ -67,12 +93,57 @@
 #define CONFIG_CHAR			'#'
 #define MAX_PORT			65535
 #define MAX_INPUT_LEN			512
-#define MAX_DOMAIN_LEN			255
+#define MAX_QUESTION_LEN		(MAX_DOMAIN_LEN + 4)	/* qname, qtype, qclass */
 #define MAX_BUFFER_LEN			8192		/* in bytes */
 #define HARD_TIMEOUT_EXTRA		5		/* in seconds */
 #define RESPONSE_BLOCKING_WAIT_TIME	0.1		/* in seconds */
+#define INPUT_BUFFER_SIZE		(1024 * 1024)	/* in bytes */
+#define CAPTURE_MAX_PACKET		(256 * 1024)	/* in bytes */
+#define CAPTURE_MAX_INTERFACES		64
+#define TRACE_RING_SIZE			(4 * 1024 * 1024)	/* in bytes */
+#define TRACE_IDLE_WAIT			1000000		/* in nsec */
+#define VALIDATE_RING_SIZE		(4 * 1024 * 1024)	/* in bytes */
+#define VALIDATE_IDLE_WAIT		1000000		/* in nsec */
+#define MAX_POINTER_HOPS		64
+#define ANSWER_TABLE_MIN_SIZE		1024	/* power of 2 */
+#define DNS_PORT			53
+#define MAX_SERVERS			64
+#define SERVER_GONE			255	/* sent to a replaced list */
+#define MAX_IDENTITIES			64
+#define IDENTITY_SLOTS			128	/* power of 2, > 2x identities */
+#define MAX_IDENTITY_LEN		64
+#define MAX_WORKERS			256
+#define WORKER_START_DELAY		100000		/* in usec */
+#define MAX_CONTROL_CLIENTS		8
+#define CONTROL_LINE_LEN		1024
+#define METRICS_POLL_WAIT		100000		/* in usec */
+#define METRICS_BUFFER_SIZE		(64 * 1024)	/* in bytes */
+#define DEF_METRICS_ADDRESS		"127.0.0.1"
+#define STATS_PUBLISH_INTERVAL		0.1		/* in seconds */
+#define INPUT_RAW_BUFFER_SIZE		(64 * 1024)	/* in bytes */
+#define MAX_INPUT_PASSES_PER_BUFFER	1024
 #define EDNSLEN				11
+#define MAX_QUERY_LEN			1024	/* question, OPT and padding */
 #define DNS_HEADERLEN			12
+#define DNS_FLAG_RD			0x0100
+#define DNS_FLAG_AA			0x0400
+#define MAX_WRITE_LEN			512	/* before OPT and TSIG */
+
+/* EDNS options (RFC 5001, 7871, 7873, 7830) */
+#define EDNS_OPT_NSID			3
+#define EDNS_OPT_ECS			8
+#define EDNS_OPT_COOKIE			10
+#define EDNS_OPT_PADDING		12
+#define EDNS_TEMPLATE_LEN		(EDNSLEN + 4 + 4 + 4 + 16)
+#define EDNS_OPTIONS_HASH_SIZE		64
+#define DEF_EDNS_BUFSIZE		4096
+#define MAX_PADDING_BLOCK		512
+#define CLIENT_COOKIE_LEN		8
+#define MAX_SERVER_COOKIE_LEN		32
+
+/* Upper bounds of the response size classes, in bytes; then the rest */
+#define SIZE_CLASS_BOUNDS	{ 128, 256, 512, 1024, 1232, 1472, 4096 }
+#define NUM_SIZE_CLASSES	8
 
 #define FALSE				0
 #define TRUE				1
@@ -83,29 +154,6 @@ enum directives_enum	{ V_SERVER, V_PORT, V_MAXQUERIES, V_MAXWAIT };
 #define DIRECTIVES	{ "server", "port", "maxqueries", "maxwait" }
 #define DIR_VALUES	{ V_SERVER, V_PORT, V_MAXQUERIES, V_MAXWAIT }
 
-#define QTYPE_STRINGS { \
-	"A", "NS", "MD", "MF", "CNAME", "SOA", "MB", "MG", "MR", \
-	"NULL", "WKS", "PTR", "HINFO", "MINFO", "MX", "TXT", "RP", \
-	"AFSDB", "X25", "ISDN", "RT", "NSAP", "NSAP-PTR", "SIG", \
-	"KEY", "PX", "GPOS", "AAAA", "LOC", "NXT", "EID", "NIMLOC", \
-	"SRV", "ATMA", "NAPTR", "KX", "CERT", "A6", "DNAME", "SINK", \
-	"OPT", "APL", "DS", "SSHFP", "IPSECKEY", "RRSIG", "NSEC", \
-	"DNSKEY", "DHCID", "NSEC3", "NSEC3PARAM", "TLSA", "HIP", \
-	"NINFO", "RKEY", "TALINK", "CDS", "SPF", "UINFO", "UID", \
-	"GID", "UNSPEC", "NID", "L32", "L64", "LP", "TKEY", "TSIG", \
-	"IXFR", "AXFR", "MAILB", "MAILA", "URI", "CAA", "*", "ANY", \
-	"TA", "DLV" \
-}
-
-#define QTYPE_CODES { \
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, \
-	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, \
-	34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, \
-	49, 50, 51, 52, 55, 56, 57, 58, 59, 99, 100, 101, 102, 103, \
-	104, 105, 106, 107, 249, 250, 251, 252, 253, 254, 255, 255, \
-	256, 257, 32768, 32769 \
-}
-
 #define RCODE_STRINGS { \
 	"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", \
 	"NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET", \
@@ -113,34 +161,125 @@ enum directives_enum	{ V_SERVER, V_PORT, V_MAXQUERIES, V_MAXWAIT };
 	"rcode12", "rcode13", "rcode14", "rcode15" \
 }
 
+#define OPCODE_STRINGS { \
+	"QUERY", "IQUERY", "STATUS", "opcode3", \
+	"NOTIFY", "UPDATE", "opcode6", "opcode7", \
+	"opcode8", "opcode9", "opcode10", "opcode11", \
+	"opcode12", "opcode13", "opcode14", "opcode15" \
+}
+
 /*
  * Data type definitions
  */
 
-#define QUERY_STATUS_MAGIC	0x51535441U	/* QSTA */
-#define VALID_QUERY_STATUS(q)	((q) != NULL && \
-				 (q)->magic == QUERY_STATUS_MAGIC)
-
+/*
+ * Outstanding query records.  Only the fields needed to match a response
+ * or retire a query are kept here (32 bytes on LP64); the question itself
+ * lives in the query_questions slab and is identified by its hash, which
+ * is checked before the bytes are compared.
+ *
+ * Building with -DQUERY_STATUS_SOA stores each field in its own array
+ * instead, so that retire_old_queries() only walks in_use[] and
+ * sent_timestamp[].  Always access the records through QS().
+ */
+#ifdef QUERY_STATUS_SOA
+struct query_status {
+	struct timeval *sent_timestamp;
+	unsigned int *qhash;
+	unsigned int *qoffset;
+	unsigned short int *id;
+	unsigned short int *qtype;
+	unsigned short int *qlen;
+	unsigned char *in_use;
+	unsigned char *server;
+};
+#define QS(slot, field)		(status.field[slot])
+#else
 struct query_status {
-	unsigned int magic;
-	int in_use;
-	unsigned short int id;
 	struct timeval sent_timestamp;
-	char *desc;
-	int qtype;
-	char qname[MAX_DOMAIN_LEN + 1];
+	unsigned int qhash;	/* question_hash() of the question */
+	unsigned int qoffset;	/* offset of the question in the slab */
+	unsigned short int id;
+	unsigned short int qtype;
+	unsigned short int qlen;
+	unsigned char in_use;
+	unsigned char server;	/* index in servers[] */
 };
+#define QS(slot, field)		(status[slot].field)
+#endif
 
 struct query_mininfo {		/* minimum info for timeout queries */
-	int qtype;		/* use -1 if N/A */
 	struct timeval sent_timestamp;
-	char qname[MAX_DOMAIN_LEN + 1];
+	unsigned int qhash;
+	unsigned short int qtype;
+	unsigned short int qlen;	/* use 0 if N/A */
+	unsigned char server;
+};
+
+/*
+ * The servers queries are sent to, and their own statistics
+ */
+enum server_policy { POLICY_ROUND_ROBIN, POLICY_WEIGHTED, POLICY_HASH };
+
+struct server_info {
+	char name[NI_MAXHOST + NI_MAXSERV + 1];	/* numeric address#port */
+	unsigned int weight;
+	int current_weight;	/* for smooth weighted round-robin */
+	struct addrinfo *ai;
+	int sock;
+	unsigned int sent;
+	unsigned int rtt_counted;	/* responses, including late ones */
+	double rtt_total;
+	double rtt_max;
+	unsigned int *rttarray;
+	unsigned char cookie[MAX_SERVER_COOKIE_LEN];	/* learned from it */
+	unsigned int cookie_len;
+};
+
+/*
+ * The instances answering for a server, told apart with -I by the NSID
+ * of their responses or the first TXT record they answer with.  Each
+ * identity is interned once in identities[], through a small hash table
+ * of indexes into it, so finding that of a response costs one hash.
+ * identities[0] takes the responses without one, and the last entry
+ * those of the identities that found the table full.
+ */
+enum identity_source { IDENTITY_NONE, IDENTITY_NSID, IDENTITY_TXT };
+
+struct identity_stats {
+	unsigned int responses;
+	unsigned int late;	/* after the query timed out */
+	unsigned int rcodes[16];
+	double rtt_total;
+	double rtt_max;
+	double rtt_min;
+};
+
+struct identity_info {
+	unsigned char name[MAX_IDENTITY_LEN];
+	unsigned int len;
+	unsigned int hash;
+	struct identity_stats stats;
+	unsigned int *rttarray;
+};
+
+/*
+ * The same statistics for each opcode, so that UPDATE and NOTIFY messages
+ * sent alongside the queries are reported apart from them.  Responses are
+ * counted under the opcode they carry, which a server copies from the
+ * request.
+ */
+struct opcode_info {
+	unsigned int sent;
+	struct identity_stats stats;
+	unsigned int *rttarray;
 };
 
 /*
  * Forward declarations.
  */
 int is_uint(char *test_int, unsigned int *result);
+static void send_write(unsigned short int id, const char *desc);
 
 /*
  * Configuration options (global)
@@ -159,6 +298,36 @@ char *server_to_query;					/* init NULL */
 char *server_port;					/* init NULL */
 struct addrinfo *server_ai;				/* init NULL */
 
+/*
+ * server_to_query may list several servers, as name[#port][/weight],...
+ * server_ai and query_socket are those of the server the current query
+ * goes to, picked by select_server().
+ */
+struct server_info servers[MAX_SERVERS];
+unsigned int num_servers;				/* init 0 */
+unsigned int current_server;				/* init 0 */
+unsigned int total_server_weight;			/* init 0 */
+enum server_policy server_policy = POLICY_ROUND_ROBIN;
+
+enum identity_source identity_source = IDENTITY_NONE;
+struct identity_info identities[MAX_IDENTITIES];
+unsigned int num_identities = 1;	/* identities[0] is "none" */
+unsigned char identity_slots[IDENTITY_SLOTS];	/* index + 1, or 0 */
+struct identity_info *response_identity;		/* init NULL */
+
+struct opcode_info opcodes[16];
+unsigned int response_opcode;				/* init 0 */
+
+/*
+ * UPDATE and NOTIFY messages read with -F, sent in a loop at write_rate
+ * messages a second alongside the queries, whatever -T says
+ */
+char *write_file_name;					/* init NULL */
+struct template_list *write_list;			/* init NULL */
+unsigned int write_rate = DEF_WRITE_RATE;
+unsigned int write_next;				/* init 0 */
+unsigned int num_writes_sent;				/* init 0 */
+
 int run_only_once = FALSE;
 int use_timelimit = FALSE;
 unsigned int run_timelimit;				/* init 0 */
@@ -169,6 +338,7 @@ unsigned int target_qps;				/* init 0 */
 int serverset = FALSE, portset = FALSE;
 int queriesset = FALSE, timeoutset = FALSE;
 int edns = FALSE, dnssec = FALSE;
+char *edns_options_text;				/* init NULL */
 int countrcodes = FALSE;
 int rcodecounts[16] = {0};
 
@@ -181,10 +351,465 @@ int recurse = 1;
 
 int setup_phase = TRUE;
 
-FILE *datafile_ptr;					/* init NULL */
 unsigned int runs_through_file;				/* init 0 */
 
+/*
+ * Input is read ahead by a separate thread into two buffers, which are
+ * handed to the main loop in turn.  Each buffer holds whole lines only;
+ * when the input is to be run through more than once, the reader thread
+ * rewinds it itself and records where each pass ended.
+ */
+enum input_format { INPUT_PLAIN, INPUT_GZIP, INPUT_ZSTD };
+
+struct input_buffer {
+	char *data;		/* INPUT_BUFFER_SIZE + 1 bytes */
+	size_t len;
+	int full;		/* owned by the main loop while TRUE */
+	int final;		/* no input follows this buffer */
+	unsigned int neofs;
+	size_t eofs[MAX_INPUT_PASSES_PER_BUFFER];	/* end of each pass */
+};
+
+struct input_reader {
+	int fd;
+	enum input_format format;
+	unsigned char *raw;	/* undecoded input */
+	size_t raw_len, raw_pos;
+	int raw_whole;		/* raw holds the entire file */
+#ifdef USE_ZLIB
+	z_stream zs;
+#endif
+#ifdef USE_ZSTD
+	ZSTD_DStream *zds;
+#endif
+	char *carry;		/* partial line left over from a fill */
+	size_t carry_len;
+	size_t pass_bytes;	/* read since the start of this pass */
+	int is_stream;		/* not a regular file */
+	int detected;		/* binary has been decided */
+	int binary;		/* capture or corpus rather than text */
+	int loop;		/* rewind at end of input */
+	int shutdown;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled, emptied;
+	struct input_buffer buffers[2];
+
+	/* main loop side */
+	unsigned int current;
+	int have_buffer;
+	size_t pos;
+	unsigned int next_eof;
+};
+
+static struct input_reader input;		/* fd set to -1 in main */
+
+/*
+ * Packet capture (pcap or pcapng) input.  The DNS queries found in it are
+ * replayed as captured, apart from the message id, either as fast as
+ * possible or at replay_speed times their original rate.
+ */
+enum capture_format { CAPTURE_PCAP, CAPTURE_PCAPNG };
+
+struct capture_interface {
+	int linktype;
+	double tsunit;		/* seconds per timestamp tick */
+};
+
+struct capture_reader {
+	int in_pass;		/* file header of this pass has been read */
+	enum capture_format format;
+	int big_endian;
+	struct capture_interface pcap_if;
+	unsigned int nifaces;
+	struct capture_interface ifaces[CAPTURE_MAX_INTERFACES];
+	unsigned char *packet;	/* CAPTURE_MAX_PACKET bytes */
+	const unsigned char *tcp_next;	/* DNS messages left in a segment */
+	size_t tcp_left;
+	double tcp_ts;
+};
+
+struct corpus_query {
+	int qtype;
+	int namelen;
+	unsigned char question[MAX_QUESTION_LEN];
+};
+
+struct captured_query {
+	int valid;
+	int new_pass;		/* first query of a pass */
+	double ts;		/* capture timestamp */
+	double due;		/* when to send it, if replay_speed > 0 */
+	int len;
+	unsigned char msg[MAX_BUFFER_LEN];
+};
+
+int input_is_capture = FALSE;
+int input_is_corpus = FALSE;
+int corpus_corrupt = FALSE;		/* a corrupt corpus ended the run */
+double replay_speed;					/* init 0 */
+static struct capture_reader capture;
+static struct captured_query pending_capture;
+unsigned int capture_packets;				/* init 0 */
+unsigned int capture_queries;				/* init 0 */
+
+/*
+ * Trace of the queries sent and responses received, written as a pcap file
+ * with made-up IP and UDP headers.  The sender only copies each message
+ * into a single-producer, single-consumer ring; a writer thread drains it,
+ * so writing never blocks the run.  A full ring drops records instead.
+ */
+struct trace_record {
+	unsigned int size;	/* of the record; 0 = continue at start */
+	unsigned short msglen;
+	unsigned char response;
+	unsigned char family;
+	struct timeval ts;
+	unsigned char peer[16];	/* server address */
+	unsigned short peer_port;
+};
+
+#define TRACE_ALIGN(n)		(((n) + 7) & ~(size_t)7)
+
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_READ(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ATOMIC_SET(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+/* For counters with one writer: a plain load and store, no locked add */
+#define ATOMIC_BUMP(p, n)	ATOMIC_SET((p), *(p) + (n))
+
+struct trace_ring {
+	unsigned char *buf;
+	size_t head;		/* written by the sender only */
+	size_t tail;		/* written by the writer thread only */
+	int stop;
+	pthread_t thread;
+	FILE *fp;
+	unsigned int written;
+	unsigned int dropped;
+};
+
+char *trace_file_name;					/* init NULL */
+unsigned int trace_sample = 1;
+static struct trace_ring trace;
+
+/*
+ * Response validation (-V): each response is also queued, through a ring
+ * like the trace's, for a thread that parses the whole message, so the
+ * checks never delay the main loop or its RTTs.  With -o the answer of
+ * each distinct question is hashed and recorded, and with -O the answers
+ * are checked against the hashes recorded by such a reference run.  The
+ * hash covers the rcode and the answer records (less their TTLs, with
+ * names uncompressed and folded to lower case) in any order.  With -y,
+ * the MAC of the query follows the response in its record, since the
+ * main loop reuses the MACs kept by message id as it sends.
+ */
+struct validate_record {
+	unsigned int size;	/* of the record; 0 = continue at start */
+	unsigned short msglen;
+	unsigned short maclen;	/* of the query's MAC after the message */
+};
+
+struct validate_counters {
+	unsigned int checked;
+	unsigned int not_response;
+	unsigned int bad_opcode;
+	unsigned int bad_qdcount;
+	unsigned int malformed;
+	unsigned int truncated;
+	unsigned int dropped;
+	unsigned int recorded;
+	unsigned int matched;
+	unsigned int mismatched;
+	unsigned int unknown;
+	unsigned int tsig_verified;
+	unsigned int tsig_failed;
+	unsigned int tsig_missing;
+};
+
+struct validate_ring {
+	unsigned char *buf;
+	size_t head;		/* written by the receiver only */
+	size_t tail;		/* written by the validator thread only */
+	int stop;
+	pthread_t thread;
+	unsigned int dropped;
+};
+
+struct answer_entry {
+	unsigned char *question;	/* NULL = free */
+	unsigned long long ahash;
+	unsigned int qhash;
+	unsigned short qlen;
+	unsigned short rcode;	/* ANSWER_UNSET until one is seen */
+};
+
+#define ANSWER_UNSET		0xFFFF
+#define FNV64_INIT		14695981039346656037ULL
+#define FNV64_PRIME		1099511628211ULL
+
+struct answer_table {
+	struct answer_entry *slots;
+	unsigned int size;	/* power of 2 */
+	unsigned int count;
+};
+
+int validate_responses = FALSE;
+char *answers_record_file;				/* init NULL */
+char *answers_check_file;				/* init NULL */
+static struct validate_ring validation;
+struct validate_counters vstats;
+static struct answer_table answers;
+
+/*
+ * Metrics endpoint: a thread serving the live counters over HTTP, in the
+ * OpenMetrics text format.  The main loop is the only writer of those
+ * counters, with relaxed atomic stores (ATOMIC_BUMP, ATOMIC_SET), and the
+ * thread only reads them, with relaxed atomic loads, so the send path
+ * takes no locks and the thread never sees a torn value.
+ */
+#define METRICS_RTT_BUCKETS { \
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, \
+	0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 \
+}
+
+struct metrics_server {
+	int fd;
+	int stop;
+	pthread_t thread;
+	char *buf;		/* METRICS_BUFFER_SIZE bytes */
+	size_t len;
+};
+
+char *metrics_address;					/* init NULL */
+static struct metrics_server metrics;		/* fd set to -1 in main */
+
+/*
+ * Live statistics published in shared memory for queryperf-top, laid out
+ * as queryperf-stats.h says.  The RTT histogram is counted there directly;
+ * the other counters are copied there every STATS_PUBLISH_INTERVAL.
+ */
+char *stats_name;					/* init NULL */
+struct stats_shm *stats_shm;				/* init NULL */
+double stats_next_publish;				/* init 0 */
+
+/*
+ * Self-profiling (-k): the time the main loop spends in each phase, read
+ * from the CPU's cycle counter where there is one (the monotonic clock in
+ * nsec elsewhere).  When off, each phase costs one test of
+ * profile_phases.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CYCLE_COUNTER		1
+#endif
+
+enum phase_enum { PHASE_INPUT, PHASE_ENCODE, PHASE_SEND, PHASE_POLL,
+		  PHASE_RECEIVE, PHASE_MATCH, PHASE_RETIRE, PHASE_STATS,
+		  NUM_PHASES };
+#define PHASE_NAMES	{ "input", "encode", "send", "poll", "receive", \
+			  "match", "retire", "stats" }
+
+#define PROFILE_BEGIN(t) \
+	do { if (profile_phases) (t) = read_cycles(); } while (0)
+#define PROFILE_END(phase, t) \
+	do { if (profile_phases) profile_account((phase), (t), 1); } while (0)
+/* The same, for more of a call already counted */
+#define PROFILE_ADD(phase, t) \
+	do { if (profile_phases) profile_account((phase), (t), 0); } while (0)
+
+struct phase_counter {
+	unsigned long long ticks;
+	unsigned long long max_ticks;
+	unsigned long long calls;
+};
+
+/* A phase's totals in seconds, as reported and merged over workers */
+struct phase_report {
+	double time;
+	double max;
+	unsigned long long calls;
+};
+
+int profile_phases = FALSE;
+struct phase_counter phases[NUM_PHASES];
+unsigned long long profile_start_ticks;			/* init 0 */
+struct timeval profile_start_time;
+struct phase_report phase_totals[NUM_PHASES];
+double phase_loop_time;					/* init 0 */
+
+/*
+ * Sampled input: the whole query file is loaded into memory, and each
+ * query is drawn at random from it, with probability proportional to the
+ * weight=N given on its line, or following a Zipf distribution over the
+ * lines in file order.  Draws use Vose's alias method, so take O(1) time.
+ */
+#define WEIGHT_KEYWORD		"weight="
+
+int sample_weighted = FALSE;
+double zipf_exponent;					/* init 0 */
+char *corpus_text;					/* init NULL */
+size_t *corpus_lines;					/* init NULL */
+unsigned int corpus_count;				/* init 0 */
+unsigned int corpus_draws;				/* init 0 */
+double *alias_prob;					/* init NULL */
+unsigned int *alias_index;				/* init NULL */
+unsigned long long random_state;			/* init 0 */
+unsigned long long random_seed;				/* init 0 */
+int random_seed_set = FALSE;
+
+/*
+ * Query templates: a query line containing {rand:N}, {seq} or {list:file}
+ * has those fields replaced each time it is sent, by N random letters and
+ * digits, a counter, or a random line of the file.  Each distinct line is
+ * compiled into a list of parts and kept in a hash table, whose buckets
+ * hold at most TEMPLATE_BUCKET_MAX lines in most recently used order: a
+ * new line takes the place of the least recently used one of a full
+ * bucket, so that an input of many distinct lines cannot grow it forever.
+ */
+#define TEMPLATE_HASH_SIZE	256
+#define TEMPLATE_BUCKET_MAX	16
+#define TEMPLATE_MAX_PARTS	32
+
+enum template_part_type { TPART_TEXT, TPART_RAND, TPART_SEQ, TPART_LIST };
+
+struct template_list {
+	char *file_name;
+	char *text;
+	size_t *lines;
+	unsigned int count;
+	struct template_list *next;
+};
+
+struct template_part {
+	enum template_part_type type;
+	const char *text;	/* TPART_TEXT */
+	unsigned int len;	/* TPART_TEXT length, or TPART_RAND count */
+	struct template_list *list;
+};
+
+struct query_template {
+	char *line;
+	unsigned int hash;
+	int valid;
+	unsigned int nparts;
+	struct template_part parts[TEMPLATE_MAX_PARTS];
+	struct query_template *next;
+};
+
+struct query_template *templates[TEMPLATE_HASH_SIZE];
+struct template_list *template_lists;			/* init NULL */
+unsigned long long template_seq;			/* init 0 */
+
+/*
+ * RTTs of the responses whose size falls in one of SIZE_CLASS_BOUNDS
+ */
+struct size_class {
+	unsigned int counted;
+	double rtt_total;
+	double rtt_max;
+	double rtt_min;
+};
+
+/*
+ * Distributed runs: with -N, the process forks that many workers, each
+ * sending every Nth query of the input (or, when drawing at random, its
+ * share of them) with its own share of the -T rate and -q limit, on its
+ * own sockets.  The parent only coordinates: it starts the workers at the
+ * same moment and merges their counters and histograms into one report.
+ */
+struct worker_info {
+	pid_t pid;
+	int fd;			/* socketpair to the worker */
+};
+
+/*
+ * What each worker sends back at the end of its run, followed by its RTT
+ * histogram (if any), a worker_server_report for each server, its
+ * response sizes and, with -I, a worker_identity_report for each entry
+ * of identities[].
+ */
+struct worker_report {
+	unsigned int sent;
+	unsigned int timed_out;
+	unsigned int possibly_delayed;
+	unsigned int rtt_counted;
+	unsigned int rtt_overflows;
+	double rtt_max;
+	double rtt_min;
+	double rtt_total;
+	double input_stall_time;
+	unsigned int input_stalls;
+	unsigned int runs_through_file;
+	unsigned int capture_packets;
+	unsigned int capture_queries;
+	unsigned int trace_written;
+	unsigned int trace_dropped;
+	int rcodecounts[16];
+	struct timeval first_query;
+	struct timeval end_of_run;
+	struct timeval stop_sending;
+	int have_histogram;
+	unsigned int num_servers;
+	double loop_time;
+	struct phase_report phases[NUM_PHASES];
+	struct validate_counters validation;
+	unsigned long long query_bytes;
+	unsigned long long response_bytes;
+	struct size_class size_classes[NUM_SIZE_CLASSES];
+	unsigned int cookie_responses;
+	unsigned int cookie_missing;
+};
+
+struct worker_server_report {
+	unsigned int sent;
+	unsigned int rtt_counted;
+	double rtt_total;
+	double rtt_max;
+	int have_histogram;
+};
+
+struct worker_identity_report {
+	unsigned char name[MAX_IDENTITY_LEN];
+	unsigned int len;
+	struct identity_stats stats;
+	int have_histogram;
+};
+
+struct worker_opcode_report {
+	unsigned int sent;
+	struct identity_stats stats;
+	int have_histogram;
+};
+
+unsigned int num_workers = 1;
+int worker_index = -1;		/* -1 in the coordinator or a lone process */
+int worker_fd = -1;
+unsigned long long worker_query_count;			/* init 0 */
+struct worker_info workers[MAX_WORKERS];
+
+/*
+ * Control socket: a Unix-domain stream socket taking commands, one per
+ * line, to change the rate, window, timeout or servers mid-run, or to
+ * report the statistics so far.  It is polled with the query sockets.
+ */
+struct control_client {
+	int fd;			/* -1 if unused */
+	size_t len;
+	char line[CONTROL_LINE_LEN];
+};
+
+char *control_path;					/* init NULL */
+int control_fd = -1;
+struct control_client control_clients[MAX_CONTROL_CLIENTS];
+
+double input_stall_time;				/* init 0 */
+double input_stall_time_interval;
+unsigned int input_stalls;				/* init 0 */
+unsigned int input_stalls_interval;
+
 unsigned int num_queries_sent;				/* init 0 */
+/* The last message id used, shared by all kinds of input */
+unsigned short int use_query_id;			/* init 0 */
 unsigned int num_queries_sent_interval;
 unsigned int num_queries_outstanding;			/* init 0 */
 unsigned int num_queries_timed_out;			/* init 0 */
@@ -201,6 +826,8 @@ struct timeval time_of_stop_sending;
 
 struct timeval time_of_queryset_start;
 double query_interval;
+double rate_base_sec;	/* the target rate is kept from here ... */
+unsigned int rate_base_sent;	/* ... and this many queries sent */
 struct timeval time_of_next_queryset;
 
 double rtt_max = -1;
@@ -219,12 +846,120 @@ unsigned int rtt_counted;
 unsigned int rtt_counted_interval;
 char *rtt_histogram_file = NULL;
 
+/*
+ * Bytes on the wire (DNS messages only), the sizes of the responses, one
+ * count per size, and the RTTs of the responses in each size class
+ */
+unsigned long long query_bytes;				/* init 0 */
+unsigned long long query_bytes_interval;		/* init 0 */
+unsigned long long response_bytes;			/* init 0 */
+unsigned long long response_bytes_interval;		/* init 0 */
+unsigned int response_datagrams_interval;		/* init 0 */
+unsigned int response_sizes[MAX_BUFFER_LEN + 1];
+struct size_class size_classes[NUM_SIZE_CLASSES];
+
+#ifdef QUERY_STATUS_SOA
+struct query_status status;
+#else
 struct query_status *status;				/* init NULL */
+#endif
 unsigned int query_status_allocated;			/* init 0 */
 
+/*
+ * Free slots in status[], used as a stack, and the slot holding each
+ * query id (valid only while that slot is in use with the same id).
+ */
+unsigned int *free_slots;				/* init NULL */
+unsigned int num_free_slots;				/* init 0 */
+unsigned int *id_slots;					/* init NULL */
+
+/*
+ * Per-query storage, preallocated alongside status[] and indexed by the
+ * same slot number: the wire-format question of each outstanding query and,
+ * in verbose mode only, a copy of its input line.
+ */
+unsigned char *query_questions;				/* init NULL */
+char *query_descs;					/* init NULL */
+
+#define QUERY_QUESTION(slot)	(query_questions + QS(slot, qoffset))
+#define QUERY_DESC(slot)	(query_descs + (slot) * (MAX_INPUT_LEN + 1))
+
 int query_socket = -1;
 int socket4 = -1, socket6 = -1;
 
+/*
+ * The fixed part of every query: the header (without its id)
+ */
+unsigned char query_header_template[DNS_HEADERLEN];
+
+/*
+ * EDNS options: -E sets those of the whole run, and an "edns=" field on a
+ * query line adds to them for that line.  Each set is compiled once into
+ * an OPT record template with the fixed options in it; append_opt() only
+ * copies that, draws the address of a random client subnet, and adds the
+ * cookie (with the server cookie learned from the server the query goes
+ * to) and the padding.
+ */
+#define EDNS_KEYWORD		"edns="
+
+struct edns_options {
+	char *text;		/* as given, NULL for the run's */
+	unsigned int hash;
+	int valid;
+	int enabled;
+	unsigned int bufsize;
+	int dnssec;
+	int nsid;
+	int cookie;
+	unsigned int padding;	/* block size, 0 for none */
+	unsigned int ecs_family;	/* 1 (IPv4), 2 (IPv6), 0 for none */
+	unsigned int ecs_prefix;
+	int ecs_random;
+	unsigned char ecs_addr[16];
+	unsigned char opt[EDNS_TEMPLATE_LEN];
+	unsigned int opt_len;	/* 0 if EDNS is not enabled */
+	unsigned int ecs_offset;	/* of the address in opt */
+	struct edns_options *next;
+};
+
+struct edns_options run_edns;
+struct edns_options *query_edns = &run_edns;	/* the query being built */
+struct edns_options *line_edns_options[EDNS_OPTIONS_HASH_SIZE];
+int edns_cookies;					/* init FALSE */
+unsigned char client_cookie[CLIENT_COOKIE_LEN];
+unsigned int cookie_responses;				/* init 0 */
+unsigned int cookie_missing;				/* init 0 */
+
+/*
+ * TSIG (RFC 8945): with -y, every query queryperf builds is signed with
+ * the key given.  The digests of the key padded for HMAC are started
+ * once, so signing a query only copies those two digest states and runs
+ * the message through them.  With -V the MACs of the responses are
+ * checked on the validator thread, against that of the request with the
+ * same message id.
+ */
+#define DEF_TSIG_ALGORITHM	"hmac-sha256"
+#define TSIG_FUDGE		300		/* in seconds */
+#define MAX_TSIG_MAC_LEN	64
+
+struct tsig_key {
+	unsigned char name[MAX_DOMAIN_LEN];	/* lower case wire format */
+	unsigned int namelen;
+	unsigned char alg[MAX_DOMAIN_LEN];
+	unsigned int alglen;
+	unsigned int maclen;	/* 0 if not signing */
+#ifdef USE_OPENSSL
+	EVP_MD_CTX *inner;	/* started on the key ^ ipad */
+	EVP_MD_CTX *outer;	/* started on the key ^ opad */
+	EVP_MD_CTX *sign;	/* scratch, for the main loop */
+	EVP_MD_CTX *verify;	/* scratch, for the validator */
+#endif
+};
+
+char *tsig_key_spec;					/* init NULL */
+struct tsig_key tsig;
+unsigned char *tsig_request_macs;	/* by id, main loop, init NULL */
+
 static char *rcode_strings[] = RCODE_STRINGS;
 
 static struct query_mininfo *timeout_queries;
@@ -242,6 +977,119 @@ get_uint16(unsigned char *buf) {
 	return (ret);
 }
 
+/*
+ * question_length:
+ *   Find the length of the wire-format question (qname, qtype and qclass)
+ *   starting at q.  Compression pointers are not followed; a question
+ *   using one cannot match anything we have sent.
+ *
+ *   Return -1 if the question is malformed or runs past end
+ *   Return the length of the question otherwise
+ */
+static int
+question_length(const unsigned char *q, const unsigned char *end) {
+	const unsigned char *p = q;
+
+	while (p < end && *p != 0) {
+		if ((*p & 0xC0) != 0)
+			return (-1);
+		p += *p + 1;
+	}
+
+	if (p >= end || end - (p + 1) < 4 || (p + 1 + 4) - q > MAX_QUESTION_LEN)
+		return (-1);
+
+	return ((p + 1 + 4) - q);
+}
+
+/*
+ * question_equal:
+ *   Compare two wire-format questions of the same length.  Letters in the
+ *   owner name are compared case-insensitively; label length octets can
+ *   never be mistaken for letters, as they are at most 63.
+ *
+ *   Return TRUE if the questions match
+ *   Return FALSE otherwise
+ */
+static int
+question_equal(const unsigned char *q1, const unsigned char *q2,
+	       unsigned int len)
+{
+	unsigned int i;
+	unsigned char c1, c2;
+
+	for (i = 0; i < len - 4; i++) {
+		c1 = q1[i];
+		c2 = q2[i];
+		if (c1 == c2)
+			continue;
+		if (c1 >= 'A' && c1 <= 'Z')
+			c1 += 'a' - 'A';
+		if (c2 >= 'A' && c2 <= 'Z')
+			c2 += 'a' - 'A';
+		if (c1 != c2)
+			return (FALSE);
+	}
+
+	return (memcmp(q1 + i, q2 + i, 4) == 0);
+}
+
+/*
+ * name_hash:
+ *   FNV-1a hash of a wire-format name of len bytes, with its letters
+ *   folded to lower case
+ */
+static unsigned int
+name_hash(const unsigned char *name, unsigned int len) {
+	unsigned int i, h = 2166136261U;
+	unsigned char c;
+
+	for (i = 0; i < len; i++) {
+		c = name[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619U;
+	}
+
+	return (h);
+}
+
+/*
+ * question_hash:
+ *   FNV-1a hash of a wire-format question, with letters in the owner name
+ *   folded to lower case so that it agrees with question_equal().
+ */
+static unsigned int
+question_hash(const unsigned char *q, unsigned int len) {
+	unsigned int i, h = name_hash(q, len - 4);
+
+	/* Type and class as they are */
+	for (i = len - 4; i < len; i++)
+		h = (h ^ q[i]) * 16777619U;
+
+	return (h);
+}
+
+/*
+ * question_to_text:
+ *   Render the owner name of a wire-format question for diagnostics.
+ *   Only used on error paths.
+ */
+static void
+question_to_text(const unsigned char *q, char *buf, unsigned int buflen) {
+	unsigned int len, used = 0;
+
+	while ((len = *q++) != 0 && used + len + 2 <= buflen) {
+		memcpy(buf + used, q, len);
+		used += len;
+		buf[used++] = '.';
+		q += len;
+	}
+	if (used == 0)
+		buf[used++] = '.';
+	buf[used] = '\0';
+}
+
 /*
  * show_startup_info:
  *   Show name/version
@@ -265,9 +1113,14 @@ show_usage(void) {
 "Usage: queryperf [-d datafile] [-s server_addr] [-p port] [-q num_queries]\n"
 "                 [-b bufsize] [-t timeout] [-n] [-l limit] [-f family] [-1]\n"
 "                 [-i interval] [-r arraysize] [-u unit] [-H histfile]\n"
-"                 [-T qps] [-e] [-D] [-R] [-c] [-v] [-h]\n"
+"                 [-T qps] [-F writefile] [-U rate] [-S speed] [-w tracefile]\n"
+"                 [-x sample] [-W] [-Z exponent] [-g seed] [-P policy]\n"
+"                 [-I identity] [-N workers] [-C path] [-M [addr:]port]\n"
+"                 [-m name] [-V] [-o answers] [-O answers] [-e] [-E options]\n"
+"                 [-y [alg:]name:secret] [-D] [-R] [-c] [-k] [-v] [-h]\n"
 "  -d specifies the input data file (default: stdin)\n"
-"  -s sets the server to query (default: %s)\n"
+"  -s sets the server to query (default: %s); several may be given as\n"
+"     server[#port][/weight],...\n"
 "  -p sets the port on which to query the server (default: %s)\n"
 "  -q specifies the maximum number of queries outstanding (default: %d)\n"
 "  -t specifies the timeout for query completion in seconds (default: %d)\n"
@@ -281,16 +1134,46 @@ show_usage(void) {
 "  -u set RTT statistics time unit in usec (default: %d)\n"
 "  -H specifies RTT histogram data file (default: none)\n"
 "  -T specify the target qps (default: 0=unspecified)\n"
+"  -F send the UPDATE and NOTIFY messages in this file alongside the\n"
+"     queries, over and over\n"
+"  -U send the messages of -F at this rate per second (default: %d)\n"
+"  -S replay a packet capture at speed times its original rate\n"
+"     (default: as fast as possible, or as -T says)\n"
+"  -w write the queries and responses to a pcap file\n"
+"  -x trace only one in every sample queries and their responses\n"
+"     (default: 1)\n"
+"  -W pick queries at random, weighted by the weight=N on each line\n"
+"  -Z pick queries at random, Zipf-distributed over the lines in order\n"
+"  -g seed the random choices, so that -W, -Z and template runs can be\n"
+"     repeated (default: from the time)\n"
+"  -P how to spread queries over several servers: rr (weighted\n"
+"     round-robin), weighted (at random by weight) or hash (by qname)\n"
+"     (default: rr)\n"
+"  -I report by the instance answering, told by its nsid or first txt\n"
+"  -N split the load over this many worker processes (default: 1)\n"
+"  -C listen for control commands on this Unix-domain socket\n"
+"  -M serve live metrics over HTTP on this port (address default: %s)\n"
+"  -m publish live statistics in shared memory for queryperf-top\n"
+"  -V validate each response in full, on a thread of its own\n"
+"  -o record the hash of each question's answer in this file (implies -V)\n"
+"  -O check the answers against hashes recorded with -o (implies -V)\n"
 "  -e enable EDNS 0\n"
+"  -E EDNS options, comma separated (implies EDNS): bufsize:N, nsid,\n"
+"     ecs:address/prefix, ecs:random/prefix, ecs:random6/prefix, cookie,\n"
+"     padding:block, do\n"
+"  -y sign the queries with this TSIG key, the secret in base64\n"
+"     (default algorithm: %s)\n"
 "  -D set the DNSSEC OK bit (implies EDNS)\n"
 "  -R disable recursion\n"
 "  -c print the number of packets with each rcode\n"
+"  -k profile queryperf's own main loop, and report the time in each phase\n"
 "  -v verbose: report the RCODE of each response on stdout\n"
 "  -h print this usage\n"
 "\n",
 	        DEF_SERVER_TO_QUERY, DEF_SERVER_PORT,
 	        DEF_MAX_QUERIES_OUTSTANDING, DEF_QUERY_TIMEOUT,
-		DEF_BUFFER_SIZE, DEF_RTTARRAY_SIZE, DEF_RTTARRAY_UNIT);
+		DEF_BUFFER_SIZE, DEF_RTTARRAY_SIZE, DEF_RTTARRAY_UNIT,
+		DEF_WRITE_RATE, DEF_METRICS_ADDRESS, DEF_TSIG_ALGORITHM);
 }
 
 /*
@@ -407,10 +1290,22 @@ set_server_port(char *new_port) {
 	}
 }
 
+/*
+ * set_server_sa:
+ *   Resolve the server(s) listed in server_to_query, each written as
+ *   name[#port][/weight], replacing the current set of servers
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
 int
 set_server_sa(void) {
 	struct addrinfo hints, *res;
 	static struct protoent *proto;
+	struct server_info new_servers[MAX_SERVERS];
+	char *list, *item, *last, *port, *slash;
+	unsigned int i, n = 0, weight, total = 0;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
 	int error;
 
 	if (proto == NULL && (proto = getprotobyname("udp")) == NULL) {
@@ -418,22 +1313,110 @@ set_server_sa(void) {
 		return (-1);
 	}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = family;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = proto->p_proto;
-	if ((error = getaddrinfo(server_to_query, server_port,
-				 &hints, &res)) != 0) {
-		fprintf(stderr, "Error: getaddrinfo(%s, %s) failed\n",
-			server_to_query, server_port);
+	if ((list = strdup(server_to_query)) == NULL) {
+		fprintf(stderr, "Error allocating memory for server list\n");
 		return (-1);
 	}
 
-	/* replace the server's addrinfo */
-	if (server_ai != NULL)
-		freeaddrinfo(server_ai);
-	server_ai = res;
+	memset(new_servers, 0, sizeof(new_servers));
+	for (item = strtok_r(list, ",", &last); item != NULL;
+	     item = strtok_r(NULL, ",", &last)) {
+		if (n == MAX_SERVERS) {
+			fprintf(stderr, "Error: more than %d servers\n",
+				MAX_SERVERS);
+			goto fail;
+		}
+
+		weight = 1;
+		if ((slash = strchr(item, '/')) != NULL) {
+			*slash = '\0';
+			if (is_uint(slash + 1, &weight) == FALSE ||
+			    weight == 0 || weight > 1000000) {
+				fprintf(stderr, "Error: bad server weight: "
+					"%s\n", slash + 1);
+				goto fail;
+			}
+		}
+		port = server_port;
+		if ((slash = strchr(item, '#')) != NULL) {
+			*slash = '\0';
+			port = slash + 1;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = family;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = proto->p_proto;
+		if ((error = getaddrinfo(item, port, &hints, &res)) != 0) {
+			fprintf(stderr, "Error: getaddrinfo(%s, %s) failed\n",
+				item, port);
+			goto fail;
+		}
+
+		new_servers[n].ai = res;
+		new_servers[n].weight = weight;
+		new_servers[n].sock = -1;
+		new_servers[n].rtt_max = -1;
+		if (getnameinfo(res->ai_addr, res->ai_addrlen, host,
+				sizeof(host), serv, sizeof(serv),
+				NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+			snprintf(new_servers[n].name,
+				 sizeof(new_servers[n].name), "%s", item);
+		else
+			snprintf(new_servers[n].name,
+				 sizeof(new_servers[n].name), "%s#%s",
+				 host, serv);
+		total += weight;
+		n++;
+	}
+
+	if (n == 0) {
+		fprintf(stderr, "Error: no server given\n");
+		goto fail;
+	}
+
+	/* per-server RTT histograms, kept only when there are several */
+	for (i = 0; n > 1 && rttarray_size > 0 && i < n; i++) {
+		new_servers[i].rttarray =
+			calloc(rttarray_size, sizeof(rttarray[0]));
+		if (new_servers[i].rttarray == NULL) {
+			fprintf(stderr, "Error allocating memory for "
+				"server RTT histograms\n");
+			goto fail;
+		}
+	}
+	free(list);
+
+	/* replace the servers' addrinfo and statistics */
+	for (i = 0; i < num_servers; i++) {
+		freeaddrinfo(servers[i].ai);
+		free(servers[i].rttarray);
+	}
+	memcpy(servers, new_servers, sizeof(servers));
+	num_servers = n;
+	total_server_weight = total;
+	current_server = 0;
+	server_ai = servers[0].ai;
+
+	/*
+	 * The queries still outstanding, or timed out, were sent to the old
+	 * list: their responses now count in the totals only
+	 */
+	for (i = 0; i < query_status_allocated; i++)
+		if (QS(i, in_use) == TRUE)
+			QS(i, server) = SERVER_GONE;
+	for (i = 0; timeout_queries != NULL && i < 65536; i++)
+		timeout_queries[i].server = SERVER_GONE;
+
 	return (0);
+
+ fail:
+	for (i = 0; i < n; i++) {
+		freeaddrinfo(new_servers[i].ai);
+		free(new_servers[i].rttarray);
+	}
+	free(list);
+	return (-1);
 }
 
 /*
@@ -481,47 +1464,113 @@ is_uint(char *test_int, unsigned int *result) {
 }
 
 /*
- * set_max_queries:
- *   Set the maximum number of outstanding queries
+ * resize_query_status:
+ *   Grow the status[] records (each field array, if QUERY_STATUS_SOA) and
+ *   the free slot stack to hold new_max entries
  *
  *   Returns -1 on failure
  *   Returns a non-negative integer otherwise
  */
-int
-set_max_queries(unsigned int new_max) {
-	static unsigned int size_qs = sizeof(struct query_status);
+static int
+resize_query_status(unsigned int new_max) {
+	unsigned int *temp_free;
+#ifdef QUERY_STATUS_SOA
+	void *temp;
+
+#define RESIZE_QS_FIELD(field) \
+	do { \
+		temp = realloc(status.field, \
+			       new_max * sizeof(status.field[0])); \
+		if (temp == NULL) \
+			return (-1); \
+		status.field = temp; \
+	} while (0)
+
+	RESIZE_QS_FIELD(sent_timestamp);
+	RESIZE_QS_FIELD(qhash);
+	RESIZE_QS_FIELD(qoffset);
+	RESIZE_QS_FIELD(id);
+	RESIZE_QS_FIELD(qtype);
+	RESIZE_QS_FIELD(qlen);
+	RESIZE_QS_FIELD(in_use);
+	RESIZE_QS_FIELD(server);
+
+#undef RESIZE_QS_FIELD
+#else
 	struct query_status *temp_stat;
-	unsigned int count;
 
-	if (new_max > query_status_allocated) {
-		temp_stat = realloc(status, new_max * size_qs);
+	temp_stat = realloc(status, new_max * sizeof(struct query_status));
+	if (temp_stat == NULL)
+		return (-1);
+	status = temp_stat;
+#endif
 
-		if (temp_stat == NULL) {
-			fprintf(stderr, "Error resizing query_status\n");
-			return (-1);
-		} else {
-			status = temp_stat;
+	temp_free = realloc(free_slots, new_max * sizeof(free_slots[0]));
+	if (temp_free == NULL)
+		return (-1);
+	free_slots = temp_free;
 
-			/*
-			 * Be careful to only initialise between above
+	return (0);
+}
+
+/*
+ * set_max_queries:
+ *   Set the maximum number of outstanding queries
+ *
+ *   Returns -1 on failure
+ *   Returns a non-negative integer otherwise
+ */
+int
+set_max_queries(unsigned int new_max) {
+	unsigned char *temp_questions;
+	char *temp_descs;
+	unsigned int count;
+
+	if (new_max > query_status_allocated) {
+		temp_questions = realloc(query_questions,
+					 new_max * MAX_QUESTION_LEN);
+		if (temp_questions == NULL) {
+			fprintf(stderr, "Error resizing query question slab\n");
+			return (-1);
+		}
+		query_questions = temp_questions;
+
+		if (verbose) {
+			temp_descs = realloc(query_descs,
+					     new_max * (MAX_INPUT_LEN + 1));
+			if (temp_descs == NULL) {
+				fprintf(stderr, "Error resizing query "
+					"description slab\n");
+				return (-1);
+			}
+			query_descs = temp_descs;
+		}
+
+		if (resize_query_status(new_max) == -1) {
+			fprintf(stderr, "Error resizing query_status\n");
+			return (-1);
+		} else {
+
+			/*
+			 * Be careful to only initialise between above
 			 * the previously allocated space. Note that the
 			 * allocation may be larger than the current
 			 * max_queries_outstanding. We don't want to
 			 * "forget" any outstanding queries! We might
 			 * still have some above the bounds of the max.
 			 */
-			count = query_status_allocated;
-			for (; count < new_max; count++) {
-				status[count].in_use = FALSE;
-				status[count].magic = QUERY_STATUS_MAGIC;
-				status[count].desc = NULL;
+			count = new_max;
+			while (count-- > query_status_allocated) {
+				QS(count, in_use) = FALSE;
+				QS(count, qoffset) = count * MAX_QUESTION_LEN;
+				free_slots[num_free_slots++] = count;
 			}
 
 			query_status_allocated = new_max;
 		}
 	}
 
-	max_queries_outstanding = new_max;
+	ATOMIC_SET(&max_queries_outstanding, new_max);
 
 	return (0);
 }
@@ -536,10 +1585,11 @@ set_max_queries(unsigned int new_max) {
 int
 parse_args(int argc, char **argv) {
 	int c;
+	char *end;
 	unsigned int uint_arg_val;
 
 	while ((c = getopt(argc, argv,
-			   "f:q:t:i:nd:s:p:1l:b:eDcvr:RT:u:H:h")) != -1) {
+			   "f:q:t:i:nd:s:p:1l:b:eE:y:Dckvr:RT:F:U:S:u:H:w:x:WZ:g:P:I:N:C:M:m:Vo:O:h")) != -1) {
 		switch (c) {
 		case 'f':
 			if (strcmp(optarg, "inet") == 0)
@@ -644,6 +1694,13 @@ parse_args(int argc, char **argv) {
 		case 'e':
 			edns = TRUE;
 			break;
+		case 'E':
+			edns_options_text = optarg;
+			edns = TRUE;
+			break;
+		case 'y':
+			tsig_key_spec = optarg;
+			break;
 		case 'D':
 			dnssec = TRUE;
 			edns = TRUE;
@@ -696,6 +1753,116 @@ parse_args(int argc, char **argv) {
 				return (-1);
 			}
 			break;
+		case 'F':
+			write_file_name = optarg;
+			break;
+		case 'U':
+			if (is_uint(optarg, &uint_arg_val) == TRUE &&
+			    uint_arg_val > 0)
+				write_rate = uint_arg_val;
+			else {
+				fprintf(stderr, "Invalid write rate: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'w':
+			trace_file_name = optarg;
+			break;
+		case 'x':
+			if (is_uint(optarg, &uint_arg_val) == TRUE &&
+			    uint_arg_val > 0)
+				trace_sample = uint_arg_val;
+			else {
+				fprintf(stderr, "Invalid trace sample: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'P':
+			if (strcmp(optarg, "rr") == 0)
+				server_policy = POLICY_ROUND_ROBIN;
+			else if (strcmp(optarg, "weighted") == 0)
+				server_policy = POLICY_WEIGHTED;
+			else if (strcmp(optarg, "hash") == 0)
+				server_policy = POLICY_HASH;
+			else {
+				fprintf(stderr, "Invalid server policy: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'I':
+			if (strcmp(optarg, "nsid") == 0)
+				identity_source = IDENTITY_NSID;
+			else if (strcmp(optarg, "txt") == 0)
+				identity_source = IDENTITY_TXT;
+			else {
+				fprintf(stderr, "Invalid identity source: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'N':
+			if (is_uint(optarg, &uint_arg_val) == TRUE &&
+			    uint_arg_val > 0 && uint_arg_val <= MAX_WORKERS)
+				num_workers = uint_arg_val;
+			else {
+				fprintf(stderr, "Invalid number of workers "
+					"(1-%d): %s\n", MAX_WORKERS, optarg);
+				return (-1);
+			}
+			break;
+		case 'C':
+			control_path = optarg;
+			break;
+		case 'M':
+			metrics_address = optarg;
+			break;
+		case 'm':
+			stats_name = optarg;
+			break;
+		case 'k':
+			profile_phases = TRUE;
+			break;
+		case 'V':
+			validate_responses = TRUE;
+			break;
+		case 'o':
+			answers_record_file = optarg;
+			validate_responses = TRUE;
+			break;
+		case 'O':
+			answers_check_file = optarg;
+			validate_responses = TRUE;
+			break;
+		case 'W':
+			sample_weighted = TRUE;
+			break;
+		case 'g':
+			random_seed = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg) {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				return (-1);
+			}
+			random_seed_set = TRUE;
+			break;
+		case 'Z':
+			zipf_exponent = atof(optarg);
+			if (zipf_exponent <= 0.0) {
+				fprintf(stderr, "Invalid Zipf exponent: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
+		case 'S':
+			replay_speed = atof(optarg);
+			if (replay_speed <= 0.0) {
+				fprintf(stderr, "Invalid replay speed: %s\n",
+					optarg);
+				return (-1);
+			}
+			break;
 		case 'h':
 			return (-1);
 		default:
@@ -704,49 +1871,448 @@ parse_args(int argc, char **argv) {
 		}
 	}
 
+	if (sample_weighted && zipf_exponent > 0.0) {
+		fprintf(stderr, "-W and -Z cannot be used together\n");
+		return (-1);
+	}
+
+	if (control_path != NULL && num_workers > 1) {
+		fprintf(stderr, "-C cannot be used with -N\n");
+		return (-1);
+	}
+
+	if (answers_record_file != NULL && answers_check_file != NULL) {
+		fprintf(stderr, "-o and -O cannot be used together\n");
+		return (-1);
+	}
+
 	if (run_only_once == FALSE && use_timelimit == FALSE)
 		run_only_once = TRUE;
 
 	return (0);
 }
 
+/*
+ * input_source_init:
+ *   Look at the first bytes of the input to see whether it is compressed,
+ *   and set up the decompressor if so.  The bytes read stay in input.raw.
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+static int
+input_source_init(void) {
+	struct stat sb;
+	ssize_t n;
+
+	input.raw_pos = 0;
+	input.raw_len = 0;
+	do {
+		n = read(input.fd, input.raw + input.raw_len,
+			 INPUT_RAW_BUFFER_SIZE - input.raw_len);
+		if (n > 0)
+			input.raw_len += n;
+	} while ((n > 0 || (n == -1 && errno == EINTR)) && input.raw_len < 4);
+
+	/*
+	 * Small files are kept in memory, so that running through them
+	 * repeatedly costs no system calls.
+	 */
+	input.is_stream = (fstat(input.fd, &sb) == -1 || !S_ISREG(sb.st_mode));
+	input.raw_whole = (!input.is_stream &&
+			   (off_t)input.raw_len == sb.st_size);
+
+	input.format = INPUT_PLAIN;
+	if (input.raw_len >= 2 && input.raw[0] == 0x1f && input.raw[1] == 0x8b)
+		input.format = INPUT_GZIP;
+	else if (input.raw_len >= 4 && input.raw[0] == 0x28 &&
+		 input.raw[1] == 0xb5 && input.raw[2] == 0x2f &&
+		 input.raw[3] == 0xfd)
+		input.format = INPUT_ZSTD;
+
+	switch (input.format) {
+	case INPUT_GZIP:
+#ifdef USE_ZLIB
+		memset(&input.zs, 0, sizeof(input.zs));
+		if (inflateInit2(&input.zs, 16 + MAX_WBITS) != Z_OK) {
+			fprintf(stderr, "Error: unable to initialise gzip "
+				"decompression\n");
+			return (-1);
+		}
+		break;
+#else
+		fprintf(stderr, "Error: gzip compressed input is not "
+			"supported by this build\n");
+		return (-1);
+#endif
+	case INPUT_ZSTD:
+#ifdef USE_ZSTD
+		if ((input.zds = ZSTD_createDStream()) == NULL ||
+		    ZSTD_isError(ZSTD_initDStream(input.zds))) {
+			fprintf(stderr, "Error: unable to initialise zstd "
+				"decompression\n");
+			return (-1);
+		}
+		break;
+#else
+		fprintf(stderr, "Error: zstd compressed input is not "
+			"supported by this build\n");
+		return (-1);
+#endif
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * input_raw_fill:
+ *   Make sure there is undecoded input in input.raw, reading more if needed
+ *
+ *   Return -1 on error, 0 at end of input, a positive number otherwise
+ */
+static int
+input_raw_fill(void) {
+	ssize_t n;
+
+	if (input.raw_pos < input.raw_len)
+		return (1);
+	if (input.raw_whole)
+		return (0);
+
+	do {
+		n = read(input.fd, input.raw, INPUT_RAW_BUFFER_SIZE);
+	} while (n == -1 && errno == EINTR);
+
+	if (n <= 0)
+		return ((int)n);
+
+	input.raw_pos = 0;
+	input.raw_len = n;
+	return (1);
+}
+
+/*
+ * input_source_read:
+ *   Read up to n bytes of decoded input into dst
+ *
+ *   Return -1 on error, 0 at end of input, the number of bytes otherwise
+ */
+static ssize_t
+input_source_read(char *dst, size_t n) {
+	size_t done = 0;
+	ssize_t r;
+	int ret;
+
+	switch (input.format) {
+	case INPUT_PLAIN:
+		if (input.raw_pos < input.raw_len) {
+			done = input.raw_len - input.raw_pos;
+			if (done > n)
+				done = n;
+			memcpy(dst, input.raw + input.raw_pos, done);
+			input.raw_pos += done;
+			return (done);
+		}
+		if (input.raw_whole)
+			return (0);
+		do {
+			r = read(input.fd, dst, n);
+		} while (r == -1 && errno == EINTR);
+		return (r);
+#ifdef USE_ZLIB
+	case INPUT_GZIP:
+		input.zs.next_out = (unsigned char *)dst;
+		input.zs.avail_out = n;
+		while (input.zs.avail_out > 0) {
+			if ((ret = input_raw_fill()) <= 0) {
+				if (ret < 0)
+					return (-1);
+				break;
+			}
+			input.zs.next_in = input.raw + input.raw_pos;
+			input.zs.avail_in = input.raw_len - input.raw_pos;
+			ret = inflate(&input.zs, Z_NO_FLUSH);
+			input.raw_pos = input.raw_len - input.zs.avail_in;
+			if (ret == Z_STREAM_END)
+				inflateReset(&input.zs);  /* concatenated */
+			else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				fprintf(stderr, "Error decompressing input: "
+					"%s\n", input.zs.msg != NULL ?
+					input.zs.msg : "corrupt data");
+				return (-1);
+			}
+		}
+		return (n - input.zs.avail_out);
+#endif
+#ifdef USE_ZSTD
+	case INPUT_ZSTD:
+		while (done < n) {
+			ZSTD_inBuffer in;
+			ZSTD_outBuffer out;
+			size_t zret;
+
+			if ((ret = input_raw_fill()) <= 0) {
+				if (ret < 0)
+					return (-1);
+				break;
+			}
+			in.src = input.raw;
+			in.size = input.raw_len;
+			in.pos = input.raw_pos;
+			out.dst = dst;
+			out.size = n;
+			out.pos = done;
+			zret = ZSTD_decompressStream(input.zds, &out, &in);
+			if (ZSTD_isError(zret)) {
+				fprintf(stderr, "Error decompressing input: "
+					"%s\n", ZSTD_getErrorName(zret));
+				return (-1);
+			}
+			input.raw_pos = in.pos;
+			done = out.pos;
+		}
+		return (done);
+#endif
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * input_source_rewind:
+ *   Go back to the start of the input
+ *
+ *   Return -1 if the input cannot be rewound (e.g. it is a pipe)
+ *   Return non-negative integer on success
+ */
+static int
+input_source_rewind(void) {
+	input.raw_pos = 0;
+	if (!input.raw_whole) {
+		if (lseek(input.fd, 0, SEEK_SET) == -1)
+			return (-1);
+		input.raw_len = 0;
+	}
+
+#ifdef USE_ZLIB
+	if (input.format == INPUT_GZIP)
+		inflateReset(&input.zs);
+#endif
+#ifdef USE_ZSTD
+	if (input.format == INPUT_ZSTD)
+		ZSTD_initDStream(input.zds);
+#endif
+	return (0);
+}
+
+/*
+ * is_binary_magic:
+ *   Do the first four bytes of the input identify a pcap or pcapng file,
+ *   or a binary query corpus?
+ */
+static int
+is_binary_magic(const unsigned char *p) {
+	static const unsigned char magics[][4] = {
+		{ 0xd4, 0xc3, 0xb2, 0xa1 }, { 0xa1, 0xb2, 0xc3, 0xd4 },
+		{ 0x4d, 0x3c, 0xb2, 0xa1 }, { 0xa1, 0xb2, 0x3c, 0x4d },
+		{ 0x0a, 0x0d, 0x0d, 0x0a }, { 'Q', 'P', 'C', 'O' }
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(magics) / sizeof(magics[0]); i++)
+		if (memcmp(p, magics[i], 4) == 0)
+			return (TRUE);
+
+	return (FALSE);
+}
+
+/*
+ * input_fill_buffer:
+ *   Fill an input buffer with whole lines, starting with whatever was
+ *   left over from the previous fill.  At the end of the input, either
+ *   rewind (recording where the pass ended) or mark the buffer final.
+ *   Packet captures and binary corpora are passed through as they are.
+ */
+static void
+input_fill_buffer(struct input_buffer *b) {
+	size_t room;
+	ssize_t n;
+	char *nl;
+
+	memcpy(b->data, input.carry, input.carry_len);
+	b->len = input.carry_len;
+	input.carry_len = 0;
+	b->neofs = 0;
+	b->final = FALSE;
+
+	while (b->len < INPUT_BUFFER_SIZE) {
+		room = INPUT_BUFFER_SIZE - b->len;
+		n = input_source_read(b->data + b->len, room);
+		if (n > 0) {
+			b->len += n;
+			input.pass_bytes += n;
+			if (!input.detected && b->len >= 4) {
+				input.binary = is_binary_magic(
+					(unsigned char *)b->data);
+				input.detected = TRUE;
+			}
+			/* From a pipe, hand over whatever is there so far */
+			if (input.is_stream && (size_t)n < room)
+				break;
+			continue;
+		}
+
+		if (n == -1)
+			fprintf(stderr, "Error reading datafile\n");
+
+		/* End of input: terminate the last line and mark the pass */
+		input.detected = TRUE;
+		if (!input.binary && b->len > 0 && b->data[b->len - 1] != '\n')
+			b->data[b->len++] = '\n';
+		b->eofs[b->neofs++] = b->len;
+
+		if (n == -1 || input.loop == FALSE || input.pass_bytes == 0 ||
+		    input_source_rewind() == -1) {
+			b->final = TRUE;
+			return;
+		}
+		input.pass_bytes = 0;
+		if (b->neofs == MAX_INPUT_PASSES_PER_BUFFER)
+			return;
+	}
+
+	if (input.binary)
+		return;
+
+	/* Keep any incomplete line for the next buffer */
+	for (nl = b->data + b->len; nl > b->data && nl[-1] != '\n'; nl--)
+		;
+	if (nl > b->data) {
+		input.carry_len = b->len - (nl - b->data);
+		memcpy(input.carry, nl, input.carry_len);
+		b->len -= input.carry_len;
+	}
+}
+
+/*
+ * input_thread_main:
+ *   Read-ahead thread: keep both input buffers full
+ */
+static void *
+input_thread_main(void *arg) {
+	unsigned int i = 0;
+	struct input_buffer *b;
+
+	(void)arg;
+
+	for (;;) {
+		b = &input.buffers[i];
+
+		pthread_mutex_lock(&input.lock);
+		while (b->full && !input.shutdown)
+			pthread_cond_wait(&input.emptied, &input.lock);
+		pthread_mutex_unlock(&input.lock);
+		if (input.shutdown)
+			break;
+
+		input_fill_buffer(b);
+
+		pthread_mutex_lock(&input.lock);
+		b->full = TRUE;
+		pthread_cond_signal(&input.filled);
+		pthread_mutex_unlock(&input.lock);
+
+		if (b->final)
+			break;
+		i ^= 1;
+	}
+
+	return (NULL);
+}
+
 /*
  * open_datafile:
- *   Open the data file ready for reading
+ *   Open the data file ready for reading, and start reading ahead
  *
  *   Return -1 on failure
  *   Return non-negative integer on success
  */
 int
 open_datafile(void) {
-	if (use_stdin == TRUE) {
-		datafile_ptr = stdin;
-		return (0);
-	} else {
-		if ((datafile_ptr = fopen(datafile_name, "r")) == NULL) {
-			fprintf(stderr, "Error: unable to open datafile: %s\n",
-			        datafile_name);
-			return (-1);
-		} else
-			return (0);
+	int i;
+
+	if (use_stdin == TRUE)
+		input.fd = STDIN_FILENO;
+	else if ((input.fd = open(datafile_name, O_RDONLY)) == -1) {
+		fprintf(stderr, "Error: unable to open datafile: %s\n",
+		        datafile_name);
+		return (-1);
+	}
+
+	input.raw = malloc(INPUT_RAW_BUFFER_SIZE);
+	input.carry = malloc(INPUT_BUFFER_SIZE);
+	input.buffers[0].data = malloc(INPUT_BUFFER_SIZE + 1);
+	input.buffers[1].data = malloc(INPUT_BUFFER_SIZE + 1);
+	if (input.raw == NULL || input.carry == NULL ||
+	    input.buffers[0].data == NULL || input.buffers[1].data == NULL) {
+		fprintf(stderr, "Error allocating memory for input buffers\n");
+		return (-1);
+	}
+
+	if (input_source_init() == -1)
+		return (-1);
+
+	input.loop = !run_only_once;
+	for (i = 0; i < 2; i++)
+		input.buffers[i].full = FALSE;
+	pthread_mutex_init(&input.lock, NULL);
+	pthread_cond_init(&input.filled, NULL);
+	pthread_cond_init(&input.emptied, NULL);
+	if (pthread_create(&input.thread, NULL, input_thread_main,
+			   NULL) != 0) {
+		fprintf(stderr, "Error: unable to start input thread\n");
+		return (-1);
 	}
+
+	return (0);
 }
 
 /*
  * close_datafile:
- *   Close the data file if any is open
+ *   Stop reading ahead and close the data file if any is open
  *
  *   Return -1 on failure
  *   Return non-negative integer on success, including if not needed
  */
 int
 close_datafile(void) {
-	if ((use_stdin == FALSE) && (datafile_ptr != NULL)) {
-		if (fclose(datafile_ptr) != 0) {
+	if (input.fd == -1)
+		return (0);
+
+	pthread_mutex_lock(&input.lock);
+	input.shutdown = TRUE;
+	pthread_cond_signal(&input.emptied);
+	pthread_mutex_unlock(&input.lock);
+	pthread_join(input.thread, NULL);
+
+#ifdef USE_ZLIB
+	if (input.format == INPUT_GZIP)
+		inflateEnd(&input.zs);
+#endif
+#ifdef USE_ZSTD
+	if (input.format == INPUT_ZSTD)
+		ZSTD_freeDStream(input.zds);
+#endif
+
+	if (use_stdin == FALSE) {
+		if (close(input.fd) != 0) {
 			fprintf(stderr, "Error: unable to close datafile\n");
 			return (-1);
 		}
 	}
+	input.fd = -1;
 
 	return (0);
 }
@@ -760,16 +2326,16 @@ close_datafile(void) {
  *   Return the socket identifier
  */
 int
-open_socket(void) {
+open_socket(const struct addrinfo *ai) {
 	int sock;
 	int ret;
 	int bufsize;
 	struct addrinfo hints, *res;
 
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = server_ai->ai_family;
-	hints.ai_socktype = server_ai->ai_socktype;
-	hints.ai_protocol = server_ai->ai_protocol;
+	hints.ai_family = ai->ai_family;
+	hints.ai_socktype = ai->ai_socktype;
+	hints.ai_protocol = ai->ai_protocol;
 	hints.ai_flags = AI_PASSIVE;
 
 	if ((ret = getaddrinfo(NULL, "0", &hints, &res)) != 0) {
@@ -853,18 +2419,18 @@ close_socket(void) {
 }
 
 /*
- * change_socket:
- *   Choose an appropriate socket according to the address family of the
- *   current server.  Open a new socket if necessary.
+ * family_socket:
+ *   Find the socket for the address family of a server.  Open a new
+ *   socket if necessary.
  *
  *   Return -1 on failure
  *   Return the socket identifier
  */
 int
-change_socket(void) {
+family_socket(const struct addrinfo *ai) {
 	int s, *sockp;
 
-	switch (server_ai->ai_family) {
+	switch (ai->ai_family) {
 	case AF_INET:
 		sockp = &socket4;
 		break;
@@ -875,12 +2441,12 @@ change_socket(void) {
 #endif
 	default:
 		fprintf(stderr, "unexpected address family: %d\n",
-			server_ai->ai_family);
+			ai->ai_family);
 		exit(1);
 	}
 
 	if (*sockp == -1) {
-		if ((s = open_socket()) == -1)
+		if ((s = open_socket(ai)) == -1)
 			return (-1);
 		*sockp = s;
 	}
@@ -888,6 +2454,25 @@ change_socket(void) {
 	return (*sockp);
 }
 
+/*
+ * change_socket:
+ *   Choose an appropriate socket for each server according to its address
+ *   family.  Open a new socket if necessary.
+ *
+ *   Return -1 on failure
+ *   Return the socket identifier for the current server
+ */
+int
+change_socket(void) {
+	unsigned int i;
+
+	for (i = 0; i < num_servers; i++)
+		if ((servers[i].sock = family_socket(servers[i].ai)) == -1)
+			return (-1);
+
+	return (servers[current_server].sock);
+}
+
 /*
  * reset_rttarray:
  *   (re)allocate RTT array and zero-clear the whole buffer.
@@ -932,20 +2517,567 @@ reset_rttarray(int size) {
 }
 
 /*
- * set_query_interval:
- *   set the interval of consecutive queries if the target qps are specified.
- *   Returns -1 on failure
- *   Returns a non-negative integer otherwise
+ * alloc_histograms:
+ *   Allocate the RTT histograms of the breakdown tables up front, so
+ *   that register_rtt() never allocates on the response path
+ *
+ *   Return -1 on failure
+ *   Return 0 otherwise
  */
-int
-set_query_interval(unsigned int qps) {
-	if (qps == 0)
+static int
+alloc_histograms(void) {
+	int i;
+
+	if (rttarray_size <= 0)
 		return (0);
 
-	query_interval = (1.0 / (double)qps);
+	for (i = 0; identity_source != IDENTITY_NONE && i < MAX_IDENTITIES;
+	     i++) {
+		identities[i].rttarray = calloc(rttarray_size,
+						sizeof(rttarray[0]));
+		if (identities[i].rttarray == NULL) {
+			fprintf(stderr, "Error allocating memory for "
+				"identity RTT histograms\n");
+			return (-1);
+		}
+	}
 
-	return (0);
-}
+	for (i = 0; i < 16; i++) {
+		opcodes[i].rttarray = calloc(rttarray_size,
+					     sizeof(rttarray[0]));
+		if (opcodes[i].rttarray == NULL) {
+			fprintf(stderr, "Error allocating memory for "
+				"opcode RTT histograms\n");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * set_query_interval:
+ *   set the interval of consecutive queries if the target qps are specified.
+ *   Returns -1 on failure
+ *   Returns a non-negative integer otherwise
+ */
+int
+set_query_interval(unsigned int qps) {
+	if (qps == 0)
+		return (0);
+
+	query_interval = (1.0 / (double)qps);
+
+	return (0);
+}
+
+/*
+ * parse_ecs_option:
+ *   Set the client subnet of o from address/prefix, where the address may
+ *   be "random" or "random6" for a random IPv4 or IPv6 subnet per query
+ *
+ *   Return -1 if it is invalid
+ *   Return a non-negative integer otherwise
+ */
+static int
+parse_ecs_option(struct edns_options *o, char *arg) {
+	char *slash;
+	unsigned int i;
+
+	if ((slash = strrchr(arg, '/')) == NULL ||
+	    is_uint(slash + 1, &o->ecs_prefix) == FALSE)
+		return (-1);
+	*slash = '\0';
+
+	memset(o->ecs_addr, 0, sizeof(o->ecs_addr));
+	o->ecs_random = FALSE;
+	if (strcmp(arg, "random") == 0) {
+		o->ecs_family = 1;
+		o->ecs_random = TRUE;
+	} else if (strcmp(arg, "random6") == 0) {
+		o->ecs_family = 2;
+		o->ecs_random = TRUE;
+	} else if (inet_pton(AF_INET, arg, o->ecs_addr) == 1)
+		o->ecs_family = 1;
+	else if (inet_pton(AF_INET6, arg, o->ecs_addr) == 1)
+		o->ecs_family = 2;
+	else
+		return (-1);
+	if (o->ecs_prefix > (o->ecs_family == 1 ? 32 : 128))
+		return (-1);
+
+	/* Only the prefix is sent, and its trailing bits must be zero */
+	for (i = 0; i < sizeof(o->ecs_addr); i++) {
+		if (o->ecs_prefix <= i * 8)
+			o->ecs_addr[i] = 0;
+		else if (o->ecs_prefix < i * 8 + 8)
+			o->ecs_addr[i] &= 0xff << (i * 8 + 8 - o->ecs_prefix);
+	}
+
+	return (0);
+}
+
+/*
+ * parse_edns_options:
+ *   Add the EDNS options in text, len bytes of a comma separated list, to
+ *   those in o
+ *
+ *   Return -1 if one is invalid
+ *   Return a non-negative integer otherwise
+ */
+static int
+parse_edns_options(struct edns_options *o, const char *text, size_t len) {
+	char item[MAX_INPUT_LEN + 1], *arg;
+	const char *stop = text + len;
+	unsigned int val;
+	size_t n;
+
+	while (text < stop) {
+		for (n = 0; text + n < stop && text[n] != ','; n++)
+			;
+		if (n > MAX_INPUT_LEN)
+			n = MAX_INPUT_LEN;
+		memcpy(item, text, n);
+		item[n] = '\0';
+
+		if ((arg = strchr(item, ':')) != NULL)
+			*arg++ = '\0';
+		if (arg == NULL && strcmp(item, "nsid") == 0)
+			o->nsid = TRUE;
+		else if (arg == NULL && strcmp(item, "cookie") == 0)
+			o->cookie = TRUE;
+		else if (arg == NULL && strcmp(item, "do") == 0)
+			o->dnssec = TRUE;
+		else if (arg != NULL && strcmp(item, "bufsize") == 0 &&
+			 is_uint(arg, &val) == TRUE && val <= 65535)
+			o->bufsize = val;
+		else if (arg != NULL && strcmp(item, "padding") == 0 &&
+			 is_uint(arg, &val) == TRUE && val > 0 &&
+			 val <= MAX_PADDING_BLOCK)
+			o->padding = val;
+		else if (arg == NULL || strcmp(item, "ecs") != 0 ||
+			 parse_ecs_option(o, arg) == -1) {
+			fprintf(stderr, "Invalid EDNS option: %.*s\n", (int)n,
+				text);
+			return (-1);
+		}
+		text += n + 1;
+	}
+	o->enabled = TRUE;
+
+	return (0);
+}
+
+/*
+ * build_opt_template:
+ *   Precompute the OPT record of o with its fixed options: NSID and the
+ *   client subnet
+ */
+static void
+build_opt_template(struct edns_options *o) {
+	unsigned char *p = o->opt;
+	unsigned int addrlen;
+
+	o->opt_len = 0;
+	if (!o->enabled)
+		return;
+
+	*p++ = 0;	/* root name */
+	*p++ = 0;
+	*p++ = 41;	/* OPT */
+	*p++ = o->bufsize >> 8;	/* UDP payload size */
+	*p++ = o->bufsize & 0xff;
+	*p++ = 0;	/* extended rcode */
+	*p++ = 0;	/* version */
+	if (o->dnssec)
+		*p++ = 0x80;	/* upper flag bits - DO set */
+	else
+		*p++ = 0;	/* upper flag bits */
+	*p++ = 0;	/* lower flag bit */
+	*p++ = 0;
+	*p++ = 0;	/* rdlen, set by append_opt() */
+
+	if (o->nsid) {
+		*p++ = 0;
+		*p++ = EDNS_OPT_NSID;
+		*p++ = 0;
+		*p++ = 0;
+	}
+
+	if (o->ecs_family != 0) {
+		addrlen = (o->ecs_prefix + 7) / 8;
+		*p++ = 0;
+		*p++ = EDNS_OPT_ECS;
+		*p++ = 0;
+		*p++ = 4 + addrlen;
+		*p++ = 0;
+		*p++ = o->ecs_family;
+		*p++ = o->ecs_prefix;
+		*p++ = 0;	/* scope prefix */
+		o->ecs_offset = p - o->opt;
+		memcpy(p, o->ecs_addr, addrlen);
+		p += addrlen;
+	}
+
+	if (o->cookie)
+		edns_cookies = TRUE;
+
+	o->opt_len = p - o->opt;
+}
+
+/*
+ * find_edns_options:
+ *   Look up the compiled form of the EDNS options of a query line, len
+ *   bytes of text, compiling them the first time they are seen
+ *
+ *   Return NULL if they cannot be used
+ *   Return the options otherwise
+ */
+static struct edns_options *
+find_edns_options(const char *text, size_t len) {
+	struct edns_options *o;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)text[i]) * 16777619U;
+
+	for (o = line_edns_options[h % EDNS_OPTIONS_HASH_SIZE]; o != NULL;
+	     o = o->next) {
+		if (o->hash == h && strncmp(o->text, text, len) == 0 &&
+		    o->text[len] == '\0')
+			return (o->valid ? o : NULL);
+	}
+
+	if ((o = malloc(sizeof(*o))) == NULL)
+		goto nomem;
+	/* A line's options add to the run's */
+	memcpy(o, &run_edns, sizeof(*o));
+	if ((o->text = malloc(len + 1)) == NULL)
+		goto nomem;
+	memcpy(o->text, text, len);
+	o->text[len] = '\0';
+	o->hash = h;
+	/* Kept even when invalid, like templates in find_template() */
+	o->valid = (parse_edns_options(o, text, len) != -1);
+	build_opt_template(o);
+	o->next = line_edns_options[h % EDNS_OPTIONS_HASH_SIZE];
+	line_edns_options[h % EDNS_OPTIONS_HASH_SIZE] = o;
+
+	return (o->valid ? o : NULL);
+
+ nomem:
+	fprintf(stderr, "Error allocating memory for EDNS options\n");
+	free(o);
+	return (NULL);
+}
+
+/*
+ * build_query_templates:
+ *   Precompute the query header and the run's OPT record from the options
+ *   in effect
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+build_query_templates(void) {
+	unsigned int i;
+
+	memset(query_header_template, 0, sizeof(query_header_template));
+	if (recurse)
+		query_header_template[2] = DNS_FLAG_RD >> 8;
+	query_header_template[5] = 1;		/* qdcount */
+
+	memset(&run_edns, 0, sizeof(run_edns));
+	run_edns.valid = TRUE;
+	run_edns.enabled = edns;
+	run_edns.dnssec = dnssec;
+	run_edns.bufsize = DEF_EDNS_BUFSIZE;
+	if (edns_options_text != NULL &&
+	    parse_edns_options(&run_edns, edns_options_text,
+			       strlen(edns_options_text)) == -1)
+		return (-1);
+	if (identity_source == IDENTITY_NSID) {
+		run_edns.enabled = TRUE;
+		run_edns.nsid = TRUE;
+	}
+	build_opt_template(&run_edns);
+	if (run_edns.opt_len > 0)
+		query_header_template[11] = 1;		/* arcount */
+
+	for (i = 0; i < CLIENT_COOKIE_LEN; i++)
+		client_cookie[i] = next_random(&random_state) >> 56;
+
+	return (0);
+}
+
+#ifdef USE_OPENSSL
+/*
+ * base64_decode:
+ *   Decode base64 text into out, which holds outlen bytes
+ *
+ *   Return -1 if it is invalid or too long
+ *   Return the number of bytes decoded otherwise
+ */
+static int
+base64_decode(const char *in, unsigned char *out, unsigned int outlen) {
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int bits = 0, nbits = 0, len = 0;
+	const char *d;
+
+	for (; *in != '\0' && *in != '='; in++) {
+		if ((d = strchr(digits, *in)) == NULL)
+			return (-1);
+		bits = (bits << 6) | (d - digits);
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			if (len == outlen)
+				return (-1);
+			out[len++] = (bits >> nbits) & 0xff;
+		}
+	}
+
+	return (len);
+}
+#endif
+
+/*
+ * tsig_setup:
+ *   Set up the TSIG key given with -y as [alg:]name:secret: its name and
+ *   algorithm in wire format, and the HMAC digests started on the key
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+tsig_setup(void) {
+#ifdef USE_OPENSSL
+	static const char *algorithms[][3] = {
+		{ "hmac-md5", "hmac-md5.sig-alg.reg.int", "MD5" },
+		{ "hmac-sha1", "hmac-sha1", "SHA1" },
+		{ "hmac-sha224", "hmac-sha224", "SHA224" },
+		{ "hmac-sha256", "hmac-sha256", "SHA256" },
+		{ "hmac-sha384", "hmac-sha384", "SHA384" },
+		{ "hmac-sha512", "hmac-sha512", "SHA512" },
+	};
+	char spec[MAX_INPUT_LEN + 1], *alg = DEF_TSIG_ALGORITHM;
+	char *name = spec, *secret, *colon;
+	unsigned char key[MAX_INPUT_LEN], pad[EVP_MAX_MD_SIZE * 2];
+	const EVP_MD *md = NULL;
+	unsigned int i, n, block;
+	int namelen, alglen, keylen;
+
+	if (tsig_key_spec == NULL)
+		return (0);
+
+	if (strlen(tsig_key_spec) > MAX_INPUT_LEN ||
+	    (secret = strrchr(strcpy(spec, tsig_key_spec), ':')) == NULL)
+		goto invalid;
+	*secret++ = '\0';
+	if ((colon = strchr(spec, ':')) != NULL) {
+		*colon = '\0';
+		alg = spec;
+		name = colon + 1;
+	}
+
+	for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+		if (strcasecmp(alg, algorithms[i][0]) == 0) {
+			md = EVP_get_digestbyname(algorithms[i][2]);
+			break;
+		}
+	}
+	if (md == NULL) {
+		fprintf(stderr, "Unknown TSIG algorithm: %s\n", alg);
+		return (-1);
+	}
+	block = EVP_MD_block_size(md);
+
+	if ((namelen = encode_qname(name, tsig.name)) == -1 ||
+	    (alglen = encode_qname(algorithms[i][1], tsig.alg)) == -1 ||
+	    (keylen = base64_decode(secret, key, sizeof(key))) <= 0 ||
+	    block > sizeof(pad))
+		goto invalid;
+	tsig.namelen = namelen;
+	tsig.alglen = alglen;
+	/* Names go into the MAC in canonical form */
+	for (i = 0; i < tsig.namelen; i++)
+		if (tsig.name[i] >= 'A' && tsig.name[i] <= 'Z')
+			tsig.name[i] += 'a' - 'A';
+
+	if ((tsig.inner = EVP_MD_CTX_new()) == NULL ||
+	    (tsig.outer = EVP_MD_CTX_new()) == NULL ||
+	    (tsig.sign = EVP_MD_CTX_new()) == NULL ||
+	    (tsig.verify = EVP_MD_CTX_new()) == NULL)
+		goto fail;
+
+	/* A key longer than the block is replaced by its digest */
+	if ((unsigned int)keylen > block) {
+		if (EVP_Digest(key, keylen, key, &n, md, NULL) != 1)
+			goto fail;
+		keylen = n;
+	}
+	memset(pad, 0x36, block);
+	for (i = 0; i < (unsigned int)keylen; i++)
+		pad[i] ^= key[i];
+	if (EVP_DigestInit_ex(tsig.inner, md, NULL) != 1 ||
+	    EVP_DigestUpdate(tsig.inner, pad, block) != 1)
+		goto fail;
+	memset(pad, 0x5c, block);
+	for (i = 0; i < (unsigned int)keylen; i++)
+		pad[i] ^= key[i];
+	if (EVP_DigestInit_ex(tsig.outer, md, NULL) != 1 ||
+	    EVP_DigestUpdate(tsig.outer, pad, block) != 1)
+		goto fail;
+	tsig.maclen = EVP_MD_size(md);
+
+	if (validate_responses &&
+	    (tsig_request_macs = calloc(65536, MAX_TSIG_MAC_LEN)) == NULL) {
+		fprintf(stderr, "Error allocating memory for TSIG MACs\n");
+		return (-1);
+	}
+
+	return (0);
+
+ invalid:
+	fprintf(stderr, "Invalid TSIG key: %s\n", tsig_key_spec);
+	return (-1);
+
+ fail:
+	fprintf(stderr, "Error: unable to set up the TSIG key\n");
+	return (-1);
+#else
+	if (tsig_key_spec == NULL)
+		return (0);
+
+	fprintf(stderr, "Error: TSIG is not supported by this build\n");
+	return (-1);
+#endif
+}
+
+/*
+ * worker_share:
+ *   This worker's share of a total split over all the workers, at least 1
+ */
+static unsigned int
+worker_share(unsigned int total) {
+	unsigned int share;
+
+	share = total / num_workers;
+	if ((unsigned int)worker_index < total % num_workers)
+		share++;
+
+	return (share > 0 ? share : 1);
+}
+
+/*
+ * worker_takes_query:
+ *   Whether the next query of the input is this worker's to send; worker i
+ *   of N sends queries i, i + N, i + 2N and so on
+ */
+static int
+worker_takes_query(void) {
+	if (worker_index < 0)
+		return (TRUE);
+
+	return (worker_query_count++ % num_workers ==
+		(unsigned int)worker_index);
+}
+
+/*
+ * fork_workers:
+ *   Fork the -N worker processes, each connected to this one by a
+ *   socketpair, and give each its share of the load.  The workers return
+ *   with worker_index set; the coordinator with it still -1.
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+fork_workers(void) {
+	unsigned int i, j;
+	int sv[2];
+	pid_t pid;
+	char *name;
+
+	if (use_stdin == TRUE) {
+		fprintf(stderr, "-N needs a query file (-d)\n");
+		return (-1);
+	}
+
+	/* Or the children would print it again */
+	fflush(stdout);
+
+	for (i = 0; i < num_workers; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			fprintf(stderr, "Error: socketpair: %s\n",
+				strerror(errno));
+			return (-1);
+		}
+
+		pid = fork();
+		if (pid == -1) {
+			fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return (-1);
+		}
+
+		if (pid > 0) {
+			close(sv[1]);
+			workers[i].pid = pid;
+			workers[i].fd = sv[0];
+			continue;
+		}
+
+		for (j = 0; j < i; j++)
+			close(workers[j].fd);
+		close(sv[0]);
+		worker_fd = sv[1];
+		worker_index = i;
+
+		if (set_max_queries(worker_share(max_queries_outstanding))
+		    == -1)
+			return (-1);
+		if (target_qps > 0)
+			target_qps = worker_share(target_qps);
+		/* Worker i sends writes i, i + N, ... at its share of -U */
+		write_rate = worker_share(write_rate);
+		write_next = i;
+		print_interval = 0;
+
+		/* Make {seq} count i + 1, i + 1 + N, ... (mod 2^64) */
+		template_seq = i + 1 - (unsigned long long)num_workers;
+
+		if (trace_file_name != NULL) {
+			name = malloc(strlen(trace_file_name) + 12);
+			if (name == NULL) {
+				fprintf(stderr, "Error allocating memory for "
+					"trace file name\n");
+				return (-1);
+			}
+			sprintf(name, "%s.%u", trace_file_name, i);
+			trace_file_name = name;
+		}
+
+		if (answers_record_file != NULL) {
+			name = malloc(strlen(answers_record_file) + 12);
+			if (name == NULL) {
+				fprintf(stderr, "Error allocating memory for "
+					"answer file name\n");
+				return (-1);
+			}
+			sprintf(name, "%s.%u", answers_record_file, i);
+			answers_record_file = name;
+		}
+
+		return (0);
+	}
+
+	return (0);
+}
 
 /*
  * setup:
@@ -982,6 +3114,37 @@ setup(int argc, char **argv) {
 		return (-1);
 	}
 
+	if (num_workers > 1) {
+		if (fork_workers() == -1)
+			return (-1);
+		if (worker_index == -1) {
+			/* The coordinator only reports */
+			if (set_server_sa() == -1)
+				return (-1);
+			return (reset_rttarray(rttarray_size));
+		}
+	}
+
+	/* Each worker draws its own sequence from the seed */
+	if (random_seed_set)
+		random_state = random_seed +
+		    (worker_index + 1) * 0x9e3779b97f4a7c15ULL;
+	else
+		random_state = ((unsigned long long)time(NULL) << 32) ^
+		    getpid();
+	if (random_state == 0)
+		random_state = 1;
+
+	if (verbose && query_descs == NULL) {
+		query_descs = malloc(query_status_allocated *
+				     (MAX_INPUT_LEN + 1));
+		if (query_descs == NULL) {
+			fprintf(stderr, "%s: Unable to allocate query "
+				"descriptions\n", argv[0]);
+			return (-1);
+		}
+	}
+
 	if (open_datafile() == -1)
 		return (-1);
 
@@ -991,12 +3154,15 @@ setup(int argc, char **argv) {
 	if ((query_socket = change_socket()) == -1)
 		return (-1);
 
-	if (reset_rttarray(rttarray_size) == -1)
+	if (reset_rttarray(rttarray_size) == -1 || alloc_histograms() == -1)
 		return (-1);
 
 	if (set_query_interval(target_qps) == -1)
 		return (-1);
 
+	if (build_query_templates() == -1 || tsig_setup() == -1)
+		return (-1);
+
 	return (0);
 }
 
@@ -1047,6 +3213,85 @@ difftv(struct timeval tv1, struct timeval tv2) {
 	return (diff);
 }
 
+/*
+ * read_cycles:
+ *   Read the CPU's cycle (time stamp) counter, or where there is none,
+ *   the monotonic clock in nsec
+ */
+static unsigned long long
+read_cycles(void) {
+#ifdef HAVE_CYCLE_COUNTER
+	unsigned int lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (((unsigned long long)hi << 32) | lo);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+/*
+ * profile_account:
+ *   Charge the time since start (from read_cycles()) to a phase, and add
+ *   calls to the number of calls made of it
+ */
+static void
+profile_account(int phase, unsigned long long start, int calls) {
+	unsigned long long ticks = read_cycles() - start;
+
+	phases[phase].ticks += ticks;
+	phases[phase].calls += calls;
+	if (phases[phase].max_ticks < ticks)
+		phases[phase].max_ticks = ticks;
+}
+
+/*
+ * profile_start:
+ *   Start timing the main loop, if -k was given
+ */
+void
+profile_start(void) {
+	if (profile_phases == FALSE)
+		return;
+
+	memset(phases, 0, sizeof(phases));
+	set_timenow(&profile_start_time);
+	profile_start_ticks = read_cycles();
+}
+
+/*
+ * profile_stop:
+ *   Stop timing the main loop, and convert the counts of each phase to
+ *   seconds in phase_totals[], calibrating the counter against the clock
+ *   over the run
+ */
+void
+profile_stop(void) {
+	struct timeval now;
+	unsigned long long ticks;
+	double per_sec;
+	int i;
+
+	if (profile_phases == FALSE)
+		return;
+
+	ticks = read_cycles() - profile_start_ticks;
+	set_timenow(&now);
+	phase_loop_time = difftv(now, profile_start_time);
+	if (ticks == 0 || phase_loop_time <= 0.0)
+		return;
+	per_sec = (double)ticks / phase_loop_time;
+
+	for (i = 0; i < NUM_PHASES; i++) {
+		phase_totals[i].time = (double)phases[i].ticks / per_sec;
+		phase_totals[i].max = (double)phases[i].max_ticks / per_sec;
+		phase_totals[i].calls = phases[i].calls;
+	}
+}
+
 /*
  * timelimit_reached:
  *   Have we reached the time limit (if any)?
@@ -1101,7 +3346,7 @@ keep_sending(int *reached_end_input) {
 		return (TRUE);
 	else if ((*reached_end_input == TRUE) && (run_only_once == FALSE)
 	         && (timelimit_reached() == FALSE)) {
-		rewind(datafile_ptr);
+		/* The reader thread has already rewound the input */
 		*reached_end_input = FALSE;
 		runs_through_file++;
 		return (TRUE);
@@ -1125,47 +3370,738 @@ queries_outstanding(void) {
 	return (num_queries_outstanding);
 }
 
+/*
+ * input_wait_buffer:
+ *   Wait for the reader thread to fill the current input buffer, counting
+ *   the time spent waiting once queries are being sent.
+ */
+static void
+input_wait_buffer(struct input_buffer *b) {
+	struct timeval start, end;
+	double stall;
+
+	pthread_mutex_lock(&input.lock);
+	if (!b->full) {
+		set_timenow(&start);
+		while (!b->full)
+			pthread_cond_wait(&input.filled, &input.lock);
+		set_timenow(&end);
+		if (setup_phase == FALSE) {
+			stall = difftv(end, start);
+			input_stall_time += stall;
+			input_stall_time_interval += stall;
+			ATOMIC_BUMP(&input_stalls, 1);
+			input_stalls_interval++;
+		}
+	}
+	pthread_mutex_unlock(&input.lock);
+}
+
 /*
  * next_input_line:
  *   Get the next non-comment line from the input file
  *
- *   Put text in line, up to max of n chars. Skip comment lines.
- *   Skip empty lines.
+ *   The line is returned in place in the input buffer, NUL-terminated
+ *   and without its newline, and stays valid until the next call.  Lines
+ *   longer than MAX_INPUT_LEN are truncated.  Skip comment lines.  Skip
+ *   empty lines.
  *
- *   Return line length on success
- *   Return 0 if cannot read a non-comment line (EOF or error)
+ *   Set *lenp to the line length and return the line on success
+ *   Return NULL at the end of a pass through the input (or on error)
  */
-int
-next_input_line(char *line, int n) {
-	char *result;
+char *
+next_input_line(int *lenp) {
+	struct input_buffer *b;
+	char *line, *end;
+	size_t len;
+
+	for (;;) {
+		b = &input.buffers[input.current];
+		if (!input.have_buffer) {
+			input_wait_buffer(b);
+			input.have_buffer = TRUE;
+			input.pos = 0;
+			input.next_eof = 0;
+		}
 
-	do {
-		result = fgets(line, n, datafile_ptr);
-	} while ((result != NULL) &&
-	         ((line[0] == COMMENT_CHAR) || (line[0] == '\n')));
+		if (input.next_eof < b->neofs &&
+		    input.pos == b->eofs[input.next_eof]) {
+			input.next_eof++;
+			return (NULL);
+		}
 
-	if (result == NULL)
-		return (0);
-	else
-		return (strlen(line));
+		if (input.pos >= b->len) {
+			if (b->final)
+				return (NULL);
+			pthread_mutex_lock(&input.lock);
+			b->full = FALSE;
+			pthread_cond_signal(&input.emptied);
+			pthread_mutex_unlock(&input.lock);
+			input.current ^= 1;
+			input.have_buffer = FALSE;
+			continue;
+		}
+
+		line = b->data + input.pos;
+		end = memchr(line, '\n', b->len - input.pos);
+		if (end == NULL)
+			end = b->data + b->len;
+		*end = '\0';
+		len = end - line;
+		input.pos += len + 1;
+
+		if (len == 0 || line[0] == COMMENT_CHAR)
+			continue;
+
+		if (len > MAX_INPUT_LEN) {
+			fprintf(stderr, "Warning: input line truncated to %d "
+				"characters\n", MAX_INPUT_LEN);
+			len = MAX_INPUT_LEN;
+			line[len] = '\0';
+		}
+
+		*lenp = (int)len;
+		return (line);
+	}
 }
 
 /*
- * identify_directive:
- *   Gives us a numerical value equivelant for a directive string
+ * input_read:
+ *   Copy the next n bytes of (binary) input to dst
  *
- *   Returns the value for the directive
- *   Returns -1 if not a valid directive
+ *   Return the number of bytes copied, which is less than n only at the
+ *   end of a pass through the input; 0 means the end was reached
  */
-int
-identify_directive(char *dir) {
-	static char *directives[] = DIRECTIVES;
-	static int dir_values[] = DIR_VALUES;
-	unsigned int index, num_directives;
+static size_t
+input_read(unsigned char *dst, size_t n) {
+	struct input_buffer *b;
+	size_t done = 0, avail, limit;
+
+	while (done < n) {
+		b = &input.buffers[input.current];
+		if (!input.have_buffer) {
+			input_wait_buffer(b);
+			input.have_buffer = TRUE;
+			input.pos = 0;
+			input.next_eof = 0;
+		}
 
-	num_directives = sizeof(directives) / sizeof(directives[0]);
+		limit = (input.next_eof < b->neofs) ?
+			b->eofs[input.next_eof] : b->len;
+		if (input.pos == limit) {
+			if (input.next_eof < b->neofs) {
+				if (done == 0)
+					input.next_eof++;
+				return (done);
+			}
+			if (b->final)
+				return (done);
+			pthread_mutex_lock(&input.lock);
+			b->full = FALSE;
+			pthread_cond_signal(&input.emptied);
+			pthread_mutex_unlock(&input.lock);
+			input.current ^= 1;
+			input.have_buffer = FALSE;
+			continue;
+		}
 
-	if (num_directives > (sizeof(dir_values) / sizeof(int)))
+		avail = limit - input.pos;
+		if (avail > n - done)
+			avail = n - done;
+		memcpy(dst + done, b->data + input.pos, avail);
+		input.pos += avail;
+		done += avail;
+	}
+
+	return (done);
+}
+
+/*
+ * input_skip:
+ *   Discard the next n bytes of (binary) input
+ *
+ *   Return TRUE if they were all there
+ *   Return FALSE otherwise
+ */
+static int
+input_skip(size_t n) {
+	unsigned char junk[4096];
+	size_t chunk;
+
+	while (n > 0) {
+		chunk = n < sizeof(junk) ? n : sizeof(junk);
+		if (input_read(junk, chunk) != chunk)
+			return (FALSE);
+		n -= chunk;
+	}
+
+	return (TRUE);
+}
+
+/*
+ * check_input_format:
+ *   Find out whether the input is a packet capture or a binary corpus
+ *   rather than text (this waits for the first input to arrive), and set
+ *   input_is_capture or input_is_corpus accordingly
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+check_input_format(void) {
+	struct input_buffer *b = &input.buffers[input.current];
+
+	input_wait_buffer(b);
+	if (!input.binary)
+		return (0);
+
+	if (memcmp(b->data, CORPUS_MAGIC, 4) == 0) {
+		if (b->len < CORPUS_HEADER_LEN ||
+		    memcmp(b->data, CORPUS_MAGIC, CORPUS_MAGIC_LEN) != 0 ||
+		    get_uint16((unsigned char *)b->data + 8) != 0 ||
+		    get_uint16((unsigned char *)b->data + 10) !=
+		    CORPUS_VERSION) {
+			fprintf(stderr, "Error: not a version %d query "
+				"corpus\n", CORPUS_VERSION);
+			return (-1);
+		}
+		input_is_corpus = TRUE;
+		return (0);
+	}
+
+	input_is_capture = TRUE;
+	capture.packet = malloc(CAPTURE_MAX_PACKET);
+	if (capture.packet == NULL) {
+		fprintf(stderr, "Error allocating memory for capture input\n");
+		return (-1);
+	}
+
+	return (0);
+}
+
+static unsigned int
+capture_u16(const unsigned char *p) {
+	if (capture.big_endian)
+		return ((p[0] << 8) | p[1]);
+	else
+		return ((p[1] << 8) | p[0]);
+}
+
+static unsigned int
+capture_u32(const unsigned char *p) {
+	if (capture.big_endian)
+		return (((unsigned int)p[0] << 24) | (p[1] << 16) |
+			(p[2] << 8) | p[3]);
+	else
+		return (((unsigned int)p[3] << 24) | (p[2] << 16) |
+			(p[1] << 8) | p[0]);
+}
+
+/*
+ * capture_start_pass:
+ *   Read the pcap file header, or check for a pcapng section header, at
+ *   the start of a pass through the capture
+ *
+ *   Return -1 on failure or at end of input
+ *   Return non-negative integer on success
+ */
+static int
+capture_start_pass(void) {
+	unsigned char hdr[24];
+
+	if (input_read(hdr, 4) != 4)
+		return (-1);
+
+	if (memcmp(hdr, "\x0a\x0d\x0d\x0a", 4) == 0) {
+		/* pcapng: the section header is parsed as a block */
+		capture.format = CAPTURE_PCAPNG;
+		capture.nifaces = 0;
+		return (0);
+	}
+
+	if (input_read(hdr + 4, 20) != 20) {
+		fprintf(stderr, "Error: truncated pcap file header\n");
+		return (-1);
+	}
+
+	capture.format = CAPTURE_PCAP;
+	capture.big_endian = (hdr[0] == 0xa1);
+	capture.pcap_if.linktype = capture_u32(hdr + 20) & 0xffff;
+	if ((hdr[0] == 0x4d && hdr[1] == 0x3c) ||
+	    (hdr[2] == 0x3c && hdr[3] == 0x4d))
+		capture.pcap_if.tsunit = 1e-9;
+	else
+		capture.pcap_if.tsunit = 1e-6;
+
+	return (0);
+}
+
+/*
+ * capture_pcapng_interface:
+ *   Record the link type and timestamp resolution from a pcapng
+ *   Interface Description Block body
+ */
+static void
+capture_pcapng_interface(const unsigned char *body, size_t len) {
+	struct capture_interface *ifp;
+	size_t off = 8, olen;
+	unsigned int code, v;
+
+	if (len < 8 || capture.nifaces == CAPTURE_MAX_INTERFACES)
+		return;
+
+	ifp = &capture.ifaces[capture.nifaces++];
+	ifp->linktype = capture_u16(body);
+	ifp->tsunit = 1e-6;
+
+	while (off + 4 <= len) {
+		code = capture_u16(body + off);
+		olen = capture_u16(body + off + 2);
+		if (code == 0 || off + 4 + olen > len)
+			break;
+		if (code == 9 && olen >= 1) {		/* if_tsresol */
+			v = body[off + 4];
+			if (v & 0x80)
+				ifp->tsunit = ldexp(1.0, -(int)(v & 0x7f));
+			else
+				ifp->tsunit = pow(10.0, -(double)v);
+		}
+		off += 4 + ((olen + 3) & ~3U);
+	}
+}
+
+/*
+ * capture_next_packet:
+ *   Read the next captured packet
+ *
+ *   Return 0 at the end of the pass, -1 on error, 1 otherwise, setting
+ *   *datap, *lenp, *linktypep and *tsp
+ */
+static int
+capture_next_packet(const unsigned char **datap, size_t *lenp,
+		    int *linktypep, double *tsp)
+{
+	unsigned char hdr[16];
+	size_t caplen, blen;
+	unsigned int type, ifid;
+	unsigned long long ts;
+	const unsigned char *body = capture.packet;
+	int first;
+
+	if (capture.format == CAPTURE_PCAP) {
+		if (input_read(hdr, 16) != 16)
+			return (0);
+		caplen = capture_u32(hdr + 8);
+		if (caplen > CAPTURE_MAX_PACKET) {
+			if (input_skip(caplen) == FALSE)
+				return (0);
+			*lenp = 0;
+			return (1);
+		}
+		if (input_read(capture.packet, caplen) != caplen)
+			return (0);
+		*datap = capture.packet;
+		*lenp = caplen;
+		*linktypep = capture.pcap_if.linktype;
+		*tsp = capture_u32(hdr) + capture_u32(hdr + 4) *
+			capture.pcap_if.tsunit;
+		return (1);
+	}
+
+	for (;;) {
+		/* The first block of a pass has its type consumed already */
+		first = !capture.in_pass;
+		if (first) {
+			memcpy(hdr, "\x0a\x0d\x0d\x0a", 4);
+			if (input_read(hdr + 4, 4) != 4)
+				return (0);
+			capture.in_pass = TRUE;
+		} else if (input_read(hdr, 8) != 8)
+			return (0);
+
+		if (memcmp(hdr, "\x0a\x0d\x0d\x0a", 4) == 0) {
+			/* Section header: fix the byte order from its magic */
+			if (input_read(hdr + 8, 4) != 4)
+				return (0);
+			capture.big_endian = (hdr[8] == 0x1a);
+			capture.nifaces = 0;
+			blen = capture_u32(hdr + 4);
+			if (blen < 16 || input_skip(blen - 12) == FALSE)
+				return (0);
+			continue;
+		}
+
+		type = capture_u32(hdr);
+		blen = capture_u32(hdr + 4);
+		if (blen < 12 || (blen & 3) != 0) {
+			fprintf(stderr, "Error: corrupt pcapng block\n");
+			return (-1);
+		}
+		blen -= 12;
+		if (blen > CAPTURE_MAX_PACKET) {
+			if (input_skip(blen + 4) == FALSE)
+				return (0);
+			continue;
+		}
+		if (input_read(capture.packet, blen) != blen ||
+		    input_read(hdr + 8, 4) != 4)
+			return (0);
+
+		switch (type) {
+		case 1:		/* Interface Description Block */
+			capture_pcapng_interface(body, blen);
+			break;
+		case 6:		/* Enhanced Packet Block */
+			if (blen < 20)
+				break;
+			ifid = capture_u32(body);
+			if (ifid >= capture.nifaces)
+				break;
+			caplen = capture_u32(body + 12);
+			if (caplen > blen - 20)
+				break;
+			ts = ((unsigned long long)capture_u32(body + 4) << 32) |
+				capture_u32(body + 8);
+			*datap = body + 20;
+			*lenp = caplen;
+			*linktypep = capture.ifaces[ifid].linktype;
+			*tsp = (double)ts * capture.ifaces[ifid].tsunit;
+			return (1);
+		case 3:		/* Simple Packet Block (no timestamp) */
+			if (blen < 4 || capture.nifaces == 0)
+				break;
+			caplen = capture_u32(body);
+			if (caplen > blen - 4)
+				caplen = blen - 4;
+			*datap = body + 4;
+			*lenp = caplen;
+			*linktypep = capture.ifaces[0].linktype;
+			*tsp = 0.0;
+			return (1);
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * capture_transport_payload:
+ *   Find the UDP or TCP payload sent to the DNS port in a captured packet
+ *
+ *   Return NULL if the packet is not DNS traffic to port 53
+ *   Return the payload otherwise, setting *lenp and *tcpp
+ */
+static const unsigned char *
+capture_transport_payload(const unsigned char *p, size_t len, int linktype,
+			  size_t *lenp, int *tcpp)
+{
+	unsigned int ethertype = 0, proto, hlen, iplen;
+
+	switch (linktype) {
+	case 1:			/* Ethernet */
+		if (len < 14)
+			return (NULL);
+		ethertype = (p[12] << 8) | p[13];
+		p += 14;
+		len -= 14;
+		while ((ethertype == 0x8100 || ethertype == 0x88a8) &&
+		       len >= 4) {
+			ethertype = (p[2] << 8) | p[3];
+			p += 4;
+			len -= 4;
+		}
+		if (ethertype != 0x0800 && ethertype != 0x86dd)
+			return (NULL);
+		break;
+	case 0:			/* BSD loopback */
+	case 108:		/* OpenBSD loopback */
+		if (len < 4)
+			return (NULL);
+		p += 4;
+		len -= 4;
+		break;
+	case 113:		/* Linux cooked */
+		if (len < 16)
+			return (NULL);
+		p += 16;
+		len -= 16;
+		break;
+	case 276:		/* Linux cooked v2 */
+		if (len < 20)
+			return (NULL);
+		p += 20;
+		len -= 20;
+		break;
+	case 12:
+	case 14:
+	case 101:		/* raw IP */
+	case 228:		/* IPv4 */
+	case 229:		/* IPv6 */
+		break;
+	default:
+		return (NULL);
+	}
+
+	if (len < 1)
+		return (NULL);
+
+	if ((p[0] >> 4) == 4) {
+		if (len < 20)
+			return (NULL);
+		hlen = (p[0] & 0x0f) * 4;
+		iplen = (p[2] << 8) | p[3];
+		/* Skip fragments */
+		if (((p[6] << 8) | p[7]) & 0x3fff)
+			return (NULL);
+		proto = p[9];
+		if (hlen < 20 || iplen < hlen || len < hlen)
+			return (NULL);
+		if (iplen < len)
+			len = iplen;
+		p += hlen;
+		len -= hlen;
+	} else if ((p[0] >> 4) == 6) {
+		if (len < 40)
+			return (NULL);
+		iplen = ((p[4] << 8) | p[5]) + 40;
+		proto = p[6];
+		if (iplen < len)
+			len = iplen;
+		p += 40;
+		len -= 40;
+		/* Skip hop-by-hop, routing and destination options */
+		while (proto == 0 || proto == 43 || proto == 60) {
+			if (len < 8 || len < (size_t)(p[1] + 1) * 8)
+				return (NULL);
+			hlen = (p[1] + 1) * 8;
+			proto = p[0];
+			p += hlen;
+			len -= hlen;
+		}
+	} else
+		return (NULL);
+
+	if (proto == IPPROTO_UDP) {
+		if (len < 8 || ((p[2] << 8) | p[3]) != DNS_PORT)
+			return (NULL);
+		*tcpp = FALSE;
+		*lenp = len - 8;
+		return (p + 8);
+	} else if (proto == IPPROTO_TCP) {
+		if (len < 20 || ((p[2] << 8) | p[3]) != DNS_PORT)
+			return (NULL);
+		hlen = (p[12] >> 4) * 4;
+		if (hlen < 20 || hlen > len)
+			return (NULL);
+		*tcpp = TRUE;
+		*lenp = len - hlen;
+		return (p + hlen);
+	}
+
+	return (NULL);
+}
+
+/*
+ * schedule_captured_query:
+ *   Work out when a captured query is due, keeping the original spacing
+ *   divided by replay_speed.  Each pass continues where the last one ended.
+ */
+static void
+schedule_captured_query(struct captured_query *cq) {
+	static int started = FALSE;
+	static double pass_start, first_ts, last_due;
+	struct timeval now;
+
+	if (started == FALSE || cq->new_pass) {
+		if (started == FALSE) {
+			set_timenow(&now);
+			last_due = (double)now.tv_sec +
+				(double)now.tv_usec / 1000000.0;
+			started = TRUE;
+		}
+		pass_start = last_due;
+		first_ts = cq->ts;
+	}
+
+	cq->due = pass_start + (cq->ts - first_ts) / replay_speed;
+	if (cq->due > last_due)
+		last_due = cq->due;
+}
+
+/*
+ * capture_take_query:
+ *   Keep a captured DNS message in cq if it is a query we can replay:
+ *   QR clear, one question, and fits in MAX_BUFFER_LEN
+ *
+ *   Return TRUE if it was taken
+ *   Return FALSE otherwise
+ */
+static int
+capture_take_query(struct captured_query *cq, const unsigned char *msg,
+		   size_t len, double ts)
+{
+	if (len < DNS_HEADERLEN || len > MAX_BUFFER_LEN ||
+	    (msg[2] & 0x80) != 0 || get_uint16((unsigned char *)msg + 4) != 1 ||
+	    question_length(msg + DNS_HEADERLEN, msg + len) == -1)
+		return (FALSE);
+
+	if (worker_takes_query() == FALSE)
+		return (FALSE);
+
+	memcpy(cq->msg, msg, len);
+	cq->len = (int)len;
+	cq->ts = ts;
+	cq->valid = TRUE;
+	capture_queries++;
+	if (replay_speed > 0.0)
+		schedule_captured_query(cq);
+	return (TRUE);
+}
+
+/*
+ * next_captured_query:
+ *   Get the next replayable DNS query from the capture input.  UDP
+ *   datagrams and TCP segments holding whole length-prefixed messages are
+ *   used; TCP streams are not reassembled.
+ *
+ *   Return NULL at the end of a pass through the capture (or on error)
+ *   Return the query otherwise, which stays pending until sent
+ */
+struct captured_query *
+next_captured_query(void) {
+	struct captured_query *cq = &pending_capture;
+	const unsigned char *pkt, *payload;
+	size_t len, plen, mlen;
+	int linktype, tcp, ret;
+	double ts;
+
+	if (cq->valid)
+		return (cq);
+
+	cq->new_pass = FALSE;
+	if (capture.in_pass == FALSE) {
+		if (capture_start_pass() == -1)
+			return (NULL);
+		if (capture.format == CAPTURE_PCAP)
+			capture.in_pass = TRUE;
+		capture.tcp_left = 0;
+		cq->new_pass = TRUE;
+	}
+
+	for (;;) {
+		while (capture.tcp_left >= 2) {
+			mlen = (capture.tcp_next[0] << 8) | capture.tcp_next[1];
+			if (mlen + 2 > capture.tcp_left) {
+				capture.tcp_left = 0;
+				break;
+			}
+			payload = capture.tcp_next + 2;
+			capture.tcp_next += mlen + 2;
+			capture.tcp_left -= mlen + 2;
+			if (capture_take_query(cq, payload, mlen,
+					       capture.tcp_ts))
+				return (cq);
+		}
+
+		ret = capture_next_packet(&pkt, &len, &linktype, &ts);
+		if (ret <= 0) {
+			capture.in_pass = FALSE;
+			return (NULL);
+		}
+		capture_packets++;
+		if (len == 0)
+			continue;
+
+		payload = capture_transport_payload(pkt, len, linktype,
+						    &plen, &tcp);
+		if (payload == NULL)
+			continue;
+
+		if (tcp) {
+			capture.tcp_next = payload;
+			capture.tcp_left = plen;
+			capture.tcp_ts = ts;
+			continue;
+		}
+
+		if (capture_take_query(cq, payload, plen, ts))
+			return (cq);
+	}
+}
+
+/*
+ * next_corpus_query:
+ *   Read the next query record from a binary corpus.  A corrupt corpus
+ *   ends the run, since the records after it cannot be found: it sets
+ *   corpus_corrupt and run_only_once, so that the caller stops sending
+ *   at the NULL it gets.
+ *
+ *   Return NULL at the end of a pass through the corpus (or on error)
+ *   Return the query otherwise
+ */
+struct corpus_query *
+next_corpus_query(void) {
+	static struct corpus_query cq;
+	static int in_pass = FALSE;
+	unsigned char rh[CORPUS_HEADER_LEN];
+	size_t n;
+
+	if (in_pass == FALSE) {
+		if (input_read(rh, CORPUS_HEADER_LEN) != CORPUS_HEADER_LEN)
+			return (NULL);
+		in_pass = TRUE;
+	}
+
+ next:
+	n = input_read(rh, CORPUS_RECORD_HEADER_LEN);
+	if (n == 0) {
+		in_pass = FALSE;
+		return (NULL);
+	}
+	cq.qtype = get_uint16(rh);
+	cq.namelen = rh[2];
+	if (n != CORPUS_RECORD_HEADER_LEN || cq.namelen == 0 ||
+	    input_read(cq.question, cq.namelen) != (size_t)cq.namelen)
+		goto corrupt;
+
+	/* Check the name with the rest of the question after it */
+	cq.question[cq.namelen] = cq.qtype >> 8;
+	cq.question[cq.namelen + 1] = cq.qtype & 0xff;
+	cq.question[cq.namelen + 2] = 0;
+	cq.question[cq.namelen + 3] = C_IN;
+	if (question_length(cq.question, cq.question + cq.namelen + 4) !=
+	    cq.namelen + 4)
+		goto corrupt;
+
+	if (worker_takes_query() == FALSE)
+		goto next;
+
+	return (&cq);
+
+ corrupt:
+	fprintf(stderr, "Error: corrupt query corpus, stopping the run\n");
+	corpus_corrupt = TRUE;
+	run_only_once = TRUE;
+	in_pass = FALSE;
+	return (NULL);
+}
+
+/*
+ * identify_directive:
+ *   Gives us a numerical value equivelant for a directive string
+ *
+ *   Returns the value for the directive
+ *   Returns -1 if not a valid directive
+ */
+int
+identify_directive(char *dir) {
+	static char *directives[] = DIRECTIVES;
+	static int dir_values[] = DIR_VALUES;
+	unsigned int index, num_directives;
+
+	num_directives = sizeof(directives) / sizeof(directives[0]);
+
+	if (num_directives > (sizeof(dir_values) / sizeof(int)))
 		num_directives = sizeof(dir_values) / sizeof(int);
 
 	for (index = 0; index < num_directives; index++) {
@@ -1187,7 +4123,6 @@ update_config(char *config_change_desc) {
 	unsigned int uint_val;
 	int directive_number;
 	int check;
-	int old_af;
 
 	if (ignore_config_changes == TRUE) {
 		fprintf(stderr, "Ignoring configuration change: %s",
@@ -1247,21 +4182,18 @@ update_config(char *config_change_desc) {
 			return;
 		}
 
-		old_af = server_ai->ai_family;
 		if (set_server_sa() == -1) {
 			fprintf(stderr, "Set server error: unable to resolve "
 				"a new server '%s'\n",
 				config_value);
 			return;
 		}
-		if (old_af != server_ai->ai_family) {
-			if ((query_socket = change_socket()) == -1) {
-				/* XXX: this is fatal */
-				fprintf(stderr, "Set server error: "
-					"unable to open a new socket "
-					"for '%s'\n", config_value);
-				exit(1);
-			}
+		if ((query_socket = change_socket()) == -1) {
+			/* XXX: this is fatal */
+			fprintf(stderr, "Set server error: "
+				"unable to open a new socket "
+				"for '%s'\n", config_value);
+			exit(1);
 		}
 
 		break;
@@ -1285,6 +4217,11 @@ update_config(char *config_change_desc) {
 						"Failed to set a new port\n");
 					return;
 				}
+				if ((query_socket = change_socket()) == -1) {
+					fprintf(stderr, "Failed to open a "
+						"socket for the new port\n");
+					exit(1);
+				}
 			}
 		} else
 			fprintf(stderr, "Invalid config: Bad value for "
@@ -1301,6 +4238,8 @@ update_config(char *config_change_desc) {
 		check = is_uint(config_value, &uint_val);
 
 		if ((check == TRUE) && (uint_val > 0)) {
+			if (worker_index >= 0)
+				uint_val = worker_share(uint_val);
 			set_max_queries(uint_val);
 		} else
 			fprintf(stderr, "Invalid config: Bad value for "
@@ -1331,435 +4270,3672 @@ update_config(char *config_change_desc) {
 }
 
 /*
- * parse_query:
- *   Parse a query line from the input file
+ * line_weight:
+ *   Find the weight=N field of a query line
  *
- *   Set qname to be the domain to query (up to a max of qnlen chars)
- *   Set qtype to be the type of the query
+ *   Return -1 if it is malformed
+ *   Return the weight otherwise (1 if there is none)
+ */
+static double
+line_weight(const char *line) {
+	const char *p;
+	char *end;
+	double w;
+
+	for (p = line; (p = strstr(p, WEIGHT_KEYWORD)) != NULL; p++) {
+		if (p != line && strchr(WHITESPACE, p[-1]) == NULL)
+			continue;
+		w = strtod(p + sizeof(WEIGHT_KEYWORD) - 1, &end);
+		if (end == p + sizeof(WEIGHT_KEYWORD) - 1 || w < 0 ||
+		    (*end != '\0' && strchr(WHITESPACE, *end) == NULL))
+			return (-1);
+		return (w);
+	}
+
+	return (1.0);
+}
+
+/*
+ * line_edns:
+ *   Find the EDNS options for a query line: those of its edns= field
+ *   added to the run's, or the run's if it has none
+ *
+ *   Return NULL if they are invalid
+ *   Return the options otherwise
+ */
+static struct edns_options *
+line_edns(const char *line) {
+	const char *p;
+
+	for (p = line; (p = strstr(p, EDNS_KEYWORD)) != NULL; p++) {
+		if (p != line && strchr(WHITESPACE, p[-1]) == NULL)
+			continue;
+		p += sizeof(EDNS_KEYWORD) - 1;
+		return (find_edns_options(p, strcspn(p, WHITESPACE)));
+	}
+
+	return (&run_edns);
+}
+
+/*
+ * load_corpus:
+ *   Read the whole input into memory for sampling, applying any
+ *   configuration lines as they are met, and build the alias table
  *
  *   Return -1 on failure
  *   Return a non-negative integer otherwise
  */
 int
-parse_query(char *input, char *qname, unsigned int qnlen, int *qtype) {
-	static char *qtype_strings[] = QTYPE_STRINGS;
-	static int qtype_codes[] = QTYPE_CODES;
-	unsigned int num_types, index;
-	int found = FALSE;
-	char incopy[MAX_INPUT_LEN + 1];
-	char *domain_str, *type_str, *last;
-
-	num_types = sizeof(qtype_strings) / sizeof(qtype_strings[0]);
-	if (num_types > (sizeof(qtype_codes) / sizeof(int)))
-		num_types = sizeof(qtype_codes) / sizeof(int);
+load_corpus(void) {
+	size_t text_len = 0, text_size = 0, lines_size = 0;
+	double *weights = NULL, w;
+	char *line, *p;
+	void *np;
+	unsigned int i;
+	int len;
+
+	while ((line = next_input_line(&len)) != NULL) {
+		if (line[0] == CONFIG_CHAR) {
+			update_config(line);
+			continue;
+		}
 
-	strcpy(incopy, input);
+		w = zipf_exponent > 0.0 ? 1.0 : line_weight(line);
+		if (w < 0) {
+			fprintf(stderr, "Invalid query weight: %s\n", line);
+			goto fail;
+		}
 
-	domain_str = strtok_r(incopy, WHITESPACE, &last);
-	type_str = strtok_r(NULL, WHITESPACE, &last);
+		if (corpus_count == lines_size) {
+			lines_size = lines_size ? lines_size * 2 : 4096;
+			np = realloc(corpus_lines,
+				     lines_size * sizeof(corpus_lines[0]));
+			if (np == NULL)
+				goto nomem;
+			corpus_lines = np;
+			np = realloc(weights, lines_size * sizeof(weights[0]));
+			if (np == NULL)
+				goto nomem;
+			weights = np;
+		}
+		if (text_len + len + 1 > text_size) {
+			text_size = text_size ? text_size * 2 : 65536;
+			while (text_len + len + 1 > text_size)
+				text_size *= 2;
+			if ((p = realloc(corpus_text, text_size)) == NULL)
+				goto nomem;
+			corpus_text = p;
+		}
 
-	if ((domain_str == NULL) || (type_str == NULL)) {
-		fprintf(stderr, "Invalid query input format: %s\n", input);
-		return (-1);
+		memcpy(corpus_text + text_len, line, len + 1);
+		corpus_lines[corpus_count] = text_len;
+		weights[corpus_count] = w;
+		text_len += len + 1;
+		corpus_count++;
 	}
 
-	if (strlen(domain_str) > qnlen) {
-		fprintf(stderr, "Query domain too long: %s\n", domain_str);
-		return (-1);
+	if (corpus_count == 0) {
+		fprintf(stderr, "Error: no queries in the input\n");
+		goto fail;
 	}
 
-	for (index = 0; (index < num_types) && (found == FALSE); index++) {
-		if (strcasecmp(type_str, qtype_strings[index]) == 0) {
-			*qtype = qtype_codes[index];
-			found = TRUE;
-		}
+	/* Zipf: the n-th line in the file is the n-th most popular */
+	if (zipf_exponent > 0.0) {
+		for (i = 0; i < corpus_count; i++)
+			weights[i] = pow(i + 1.0, -zipf_exponent);
 	}
 
-	if (found == FALSE) {
-		fprintf(stderr, "Query type not understood: %s\n", type_str);
-		return (-1);
+	if (build_alias_table(weights, corpus_count, &alias_prob,
+			      &alias_index) == -1)
+		goto fail;
+	free(weights);
+
+	if (worker_index <= 0)
+		printf("[Status] Loaded %u queries for sampling\n",
+		       corpus_count);
+	return (0);
+
+ nomem:
+	fprintf(stderr, "Error allocating memory for the query corpus\n");
+ fail:
+	free(weights);
+	return (-1);
+}
+
+/*
+ * next_sampled_line:
+ *   Draw a query line from the corpus.  A pass through the input is as
+ *   many draws as there are lines in it.
+ *
+ *   Return NULL at the end of a pass
+ *   Return the line otherwise
+ */
+char *
+next_sampled_line(int *lenp) {
+	unsigned long long r;
+	unsigned int i;
+	char *line;
+
+	if (corpus_draws == corpus_count) {
+		corpus_draws = 0;
+		return (NULL);
 	}
+	corpus_draws++;
 
-	strcpy(qname, domain_str);
+	r = next_random(&random_state);
+	i = (unsigned int)(((r >> 32) * corpus_count) >> 32);
+	if ((double)(r & 0xffffffff) * (1.0 / 4294967296.0) >= alias_prob[i])
+		i = alias_index[i];
 
-	return (0);
+	line = corpus_text + corpus_lines[i];
+	*lenp = strlen(line);
+	return (line);
 }
 
 /*
- * dispatch_query:
- *   Send the query packet for the entry 
+ * load_template_list:
+ *   Find the word list read from file_name, reading it if need be
  *
- *   Return -1 on failure
- *   Return a non-negative integer otherwise
+ *   Return NULL on failure
+ *   Return the list otherwise
  */
-int
-dispatch_query(unsigned short int id, char *dom, int qt, u_char **pktp,
-	       int *pktlenp)
-{
-	static u_char packet_buffer[PACKETSZ + 1];
-	int buffer_len = PACKETSZ;
-	int bytes_sent;
-	unsigned short int net_id = htons(id);
-	char *id_ptr = (char *)&net_id;
-	HEADER *hp = (HEADER *)packet_buffer;
+static struct template_list *
+load_template_list(const char *file_name, size_t name_len) {
+	struct template_list *tl;
+	char buf[MAX_INPUT_LEN + 2];
+	size_t len, text_len = 0, text_size = 0, lines_size = 0;
+	FILE *fp;
+	void *np;
 
-	buffer_len = res_mkquery(QUERY, dom, C_IN, qt, NULL, 0,
-				 NULL, packet_buffer, PACKETSZ);
-	if (buffer_len == -1) {
-		fprintf(stderr, "Failed to create query packet: %s %d\n",
-		        dom, qt);
-		return (-1);
+	for (tl = template_lists; tl != NULL; tl = tl->next) {
+		if (strlen(tl->file_name) == name_len &&
+		    memcmp(tl->file_name, file_name, name_len) == 0)
+			return (tl);
 	}
-	hp->rd = recurse;
-	if (edns) {
-		unsigned char *p;
-		if (buffer_len + EDNSLEN >= PACKETSZ) {
-			fprintf(stderr, "Failed to add OPT to query packet\n");
-			return (-1);
-		}
-		packet_buffer[11] = 1;
-		p = &packet_buffer[buffer_len];
-		*p++ = 0;	/* root name */
-		*p++ = 0;
-		*p++ = 41;	/* OPT */
-		*p++ = 16;	
-		*p++ = 0;	/* UDP payload size (4K) */
-		*p++ = 0;	/* extended rcode */
-		*p++ = 0;	/* version */
-		if (dnssec)
-			*p++ = 0x80;	/* upper flag bits - DO set */
-		else
-			*p++ = 0;	/* upper flag bits */
-		*p++ = 0;	/* lower flag bit */
-		*p++ = 0;
-		*p++ = 0;	/* rdlen == 0 */
-		buffer_len += EDNSLEN;
+
+	if ((tl = calloc(1, sizeof(*tl))) == NULL ||
+	    (tl->file_name = malloc(name_len + 1)) == NULL) {
+		fprintf(stderr, "Error allocating memory for template list\n");
+		free(tl);
+		return (NULL);
 	}
+	memcpy(tl->file_name, file_name, name_len);
+	tl->file_name[name_len] = '\0';
 
-	packet_buffer[0] = id_ptr[0];
-	packet_buffer[1] = id_ptr[1];
+	if ((fp = fopen(tl->file_name, "r")) == NULL) {
+		fprintf(stderr, "Error: unable to open template list %s: %s\n",
+			tl->file_name, strerror(errno));
+		goto fail;
+	}
 
-	bytes_sent = sendto(query_socket, packet_buffer, buffer_len, 0,
-			    server_ai->ai_addr, server_ai->ai_addrlen);
-	if (bytes_sent == -1) {
-		fprintf(stderr, "Failed to send query packet: %s %d\n",
-		        dom, qt);
-		return (-1);
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		len = strcspn(buf, "\r\n");
+		buf[len] = '\0';
+		if (len == 0 || buf[0] == COMMENT_CHAR)
+			continue;
+
+		if (tl->count == lines_size) {
+			lines_size = lines_size ? lines_size * 2 : 256;
+			np = realloc(tl->lines, lines_size * sizeof(size_t));
+			if (np == NULL)
+				goto nomem;
+			tl->lines = np;
+		}
+		if (text_len + len + 1 > text_size) {
+			text_size = text_size ? text_size * 2 : 4096;
+			while (text_len + len + 1 > text_size)
+				text_size *= 2;
+			if ((np = realloc(tl->text, text_size)) == NULL)
+				goto nomem;
+			tl->text = np;
+		}
+		memcpy(tl->text + text_len, buf, len + 1);
+		tl->lines[tl->count++] = text_len;
+		text_len += len + 1;
 	}
+	fclose(fp);
 
-	if (bytes_sent != buffer_len)
-		fprintf(stderr, "Warning: incomplete packet sent: %s %d\n",
-		        dom, qt);
+	if (tl->count == 0) {
+		fprintf(stderr, "Error: template list %s is empty\n",
+			tl->file_name);
+		goto fail;
+	}
 
-	*pktp = packet_buffer;
-	*pktlenp = buffer_len;
+	tl->next = template_lists;
+	template_lists = tl;
+	return (tl);
 
-	return (0);
+ nomem:
+	fprintf(stderr, "Error allocating memory for template list %s\n",
+		tl->file_name);
+	fclose(fp);
+ fail:
+	free(tl->lines);
+	free(tl->text);
+	free(tl->file_name);
+	free(tl);
+	return (NULL);
 }
 
 /*
- * send_query:
- *   Send a query based on a line of input
+ * compile_template:
+ *   Split the template t->line into literal text and fields
+ *
+ *   Return -1 if it is invalid
+ *   Return a non-negative integer otherwise
  */
-void
-send_query(char *query_desc) {
-	static unsigned short int use_query_id = 0;
-	static int qname_len = MAX_DOMAIN_LEN;
-	static char domain[MAX_DOMAIN_LEN + 1];
-	u_char *qpkt;
-	char serveraddr[NI_MAXHOST];
-	int query_type, qpkt_len;
-	unsigned int count;
-
-	use_query_id++;
+static int
+compile_template(struct query_template *t) {
+	struct template_part *part;
+	const char *p = t->line, *start, *end;
+	unsigned int n;
+	char *num_end;
+
+	while (*p != '\0') {
+		if (t->nparts == TEMPLATE_MAX_PARTS) {
+			fprintf(stderr, "Too many template fields: %s\n",
+				t->line);
+			return (-1);
+		}
+		part = &t->parts[t->nparts++];
+
+		if (*p != '{') {
+			/* Literal text; "\{" stays for encode_qname() */
+			start = p;
+			while (*p != '\0' && *p != '{') {
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				p++;
+			}
+			part->type = TPART_TEXT;
+			part->text = start;
+			part->len = p - start;
+			continue;
+		}
 
-	if (parse_query(query_desc, domain, qname_len, &query_type) == -1) {
-		fprintf(stderr, "Error parsing query: %s\n", query_desc);
-		return;
+		start = p + 1;
+		if ((end = strchr(start, '}')) == NULL) {
+			fprintf(stderr, "Unterminated template field: %s\n",
+				t->line);
+			return (-1);
+		}
+		p = end + 1;
+
+		if (end - start == 3 && memcmp(start, "seq", 3) == 0) {
+			part->type = TPART_SEQ;
+		} else if (end - start > 5 && memcmp(start, "rand:", 5) == 0) {
+			n = strtoul(start + 5, &num_end, 10);
+			if (num_end != end || n == 0 || n > MAX_LABEL_LEN) {
+				fprintf(stderr, "Invalid template field "
+					"{%.*s}: %s\n", (int)(end - start),
+					start, t->line);
+				return (-1);
+			}
+			part->type = TPART_RAND;
+			part->len = n;
+		} else if (end - start > 5 && memcmp(start, "list:", 5) == 0) {
+			part->type = TPART_LIST;
+			part->list = load_template_list(start + 5,
+							end - start - 5);
+			if (part->list == NULL)
+				return (-1);
+		} else {
+			fprintf(stderr, "Unknown template field {%.*s}: %s\n",
+				(int)(end - start), start, t->line);
+			return (-1);
+		}
 	}
 
-	if (dispatch_query(use_query_id, domain, query_type,
-			   &qpkt, &qpkt_len) == -1) {
-		char *addrstr;
-
-		if (getnameinfo(server_ai->ai_addr, server_ai->ai_addrlen,
-				serveraddr, sizeof(serveraddr), NULL, 0,
-				NI_NUMERICHOST) == 0) {
-			addrstr = serveraddr;
-		} else
-			addrstr = "???"; /* XXX: this should not happen */
-		fprintf(stderr, "Error sending query to %s: %s\n",
-			addrstr, query_desc);
-		return;
-	}
+	return (0);
+}
 
-	if (setup_phase == TRUE) {
-		set_timenow(&time_of_first_query);
-		time_of_first_query_sec = (double)time_of_first_query.tv_sec +
-			((double)time_of_first_query.tv_usec / 1000000.0);
-		setup_phase = FALSE;
-		if (getnameinfo(server_ai->ai_addr, server_ai->ai_addrlen,
-				serveraddr, sizeof(serveraddr), NULL, 0,
-				NI_NUMERICHOST) != 0) {
-			fprintf(stderr, "Error printing server address\n");
-			return;
+/*
+ * find_template:
+ *   Look up the compiled form of a template line, compiling it if it is
+ *   not in the cache
+ *
+ *   Return NULL if it cannot be used
+ *   Return the template otherwise
+ */
+static struct query_template *
+find_template(const char *line) {
+	struct query_template *t, **tp, **bucket;
+	unsigned int h = 2166136261U, n = 0;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)line; *p != '\0'; p++)
+		h = (h ^ *p) * 16777619U;
+
+	bucket = &templates[h % TEMPLATE_HASH_SIZE];
+	for (tp = bucket; (t = *tp) != NULL; tp = &t->next, n++) {
+		if (t->hash == h && strcmp(t->line, line) == 0) {
+			*tp = t->next;
+			t->next = *bucket;
+			*bucket = t;
+			return (t->valid ? t : NULL);
 		}
-		printf("[Status] Sending queries (beginning with %s)\n",
-		       serveraddr);
 	}
 
-	/* Find the first slot in status[] that is not in use */
-	for (count = 0; (status[count].in_use == TRUE)
-	     && (count < max_queries_outstanding); count++);
+	if (n == TEMPLATE_BUCKET_MAX) {
+		for (tp = bucket; (*tp)->next != NULL; tp = &(*tp)->next)
+			;
+		free((*tp)->line);
+		free(*tp);
+		*tp = NULL;
+	}
 
-	if (status[count].in_use == TRUE) {
-		fprintf(stderr, "Unexpected error: We have run out of "
-			"status[] space!\n");
-		return;
+	if ((t = calloc(1, sizeof(*t))) == NULL ||
+	    (t->line = strdup(line)) == NULL) {
+		fprintf(stderr, "Error allocating memory for template\n");
+		free(t);
+		return (NULL);
 	}
+	t->hash = h;
+	/*
+	 * Invalid templates are cached too, so the error is reported once,
+	 * or again only if the line is evicted and comes back
+	 */
+	t->valid = (compile_template(t) != -1);
+	t->next = *bucket;
+	*bucket = t;
 
-	/* Register the query in status[] */
-	status[count].id = use_query_id;
-	if (verbose)
-		status[count].desc = strdup(query_desc);
-	set_timenow(&status[count].sent_timestamp);
-	status[count].qtype = query_type;
-	if (dn_expand(qpkt, qpkt + qpkt_len, qpkt + DNS_HEADERLEN,
-		      status[count].qname, MAX_DOMAIN_LEN) == -1) {
-		fprintf(stderr, "Unexpected error: "
-			"query message doesn't have qname?\n");
-		return;
+	return (t->valid ? t : NULL);
+}
+
+/*
+ * expand_template:
+ *   Expand the template fields in a query line into buf, which holds
+ *   MAX_INPUT_LEN + 1 bytes
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+expand_template(const char *line, char *buf) {
+	static const char rand_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	struct query_template *t;
+	struct template_part *part;
+	struct template_list *tl;
+	unsigned long long r = 0;
+	unsigned int i, j, len = 0;
+	const char *src = NULL;
+	char *p = buf, seqbuf[24];
+
+	if ((t = find_template(line)) == NULL)
+		return (-1);
+
+	template_seq += num_workers;
+	for (i = 0; i < t->nparts; i++) {
+		part = &t->parts[i];
+		switch (part->type) {
+		case TPART_TEXT:
+			src = part->text;
+			len = part->len;
+			break;
+		case TPART_SEQ:
+			len = snprintf(seqbuf, sizeof(seqbuf), "%llu",
+				       template_seq);
+			src = seqbuf;
+			break;
+		case TPART_LIST:
+			tl = part->list;
+			src = tl->text +
+			    tl->lines[random_below(&random_state, tl->count)];
+			len = strlen(src);
+			break;
+		case TPART_RAND:
+			if (p + part->len > buf + MAX_INPUT_LEN)
+				goto toolong;
+			/* Each character takes 32 bits of a random value */
+			for (j = 0; j < part->len; j++) {
+				if ((j & 1) == 0)
+					r = next_random(&random_state);
+				*p++ = rand_chars[((r & 0xffffffff) * 36) >> 32];
+				r >>= 32;
+			}
+			continue;
+		}
+		if (p + len > buf + MAX_INPUT_LEN)
+			goto toolong;
+		memcpy(p, src, len);
+		p += len;
 	}
-	status[count].in_use = TRUE;
+	*p = '\0';
 
-	if (num_queries_sent_interval == 0)
-		set_timenow(&time_of_first_query_interval);
+	return (0);
 
-	num_queries_sent++;
-	num_queries_sent_interval++;
-	num_queries_outstanding++;
+ toolong:
+	fprintf(stderr, "Expanded template too long: %s\n", line);
+	return (-1);
 }
 
-void
-register_rtt(struct timeval *timestamp, char *qname, int qtype,
-	     unsigned int rcode)
-{
+/*
+ * qtype_to_text:
+ *   Return the mnemonic of a query type, or its RFC 3597 form in buf
+ */
+const char *
+qtype_to_text(int qtype, char *buf, size_t buflen) {
+	static char *qtype_strings[] = QTYPE_STRINGS;
+	static int qtype_codes[] = QTYPE_CODES;
 	int i;
-	int oldquery = FALSE;
-	struct timeval now;
-	double rtt;
-
-	set_timenow(&now);
-	rtt = difftv(now, *timestamp);
 
-	if (difftv(*timestamp, time_of_first_query_interval) < 0)
-		oldquery = TRUE;
+	/* Backwards, so that 255 is "ANY" rather than "*" */
+	for (i = sizeof(qtype_codes) / sizeof(qtype_codes[0]) - 1; i >= 0; i--)
+		if (qtype_codes[i] == qtype)
+			return (qtype_strings[i]);
 
-	if (rtt_max < 0 || rtt_max < rtt)
-		rtt_max = rtt;
+	snprintf(buf, buflen, "%s%d", QTYPE_GENERIC_PREFIX, qtype);
+	return (buf);
+}
 
-	if (rtt_min < 0 || rtt_min > rtt)
-		rtt_min = rtt;
+/*
+ * parse_query:
+ *   Parse a query line from the input file
+ *
+ *   The line is scanned in place; only the domain is copied out.
+ *
+ *   Set qname to be the domain to query (up to a max of qnlen chars)
+ *   Set qtype to be the type of the query
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+parse_query(char *input, char *qname, unsigned int qnlen, int *qtype) {
+	char *domain_str, *type_str;
+	size_t domain_len, type_len;
 
-	rtt_total += rtt;
-	rtt_counted++;
+	domain_str = input + strspn(input, WHITESPACE);
+	domain_len = strcspn(domain_str, WHITESPACE);
+	type_str = domain_str + domain_len;
+	type_str += strspn(type_str, WHITESPACE);
+	type_len = strcspn(type_str, WHITESPACE);
 
-	if (!oldquery) {
-		if (rtt_max_interval < 0 || rtt_max_interval < rtt)
-			rtt_max_interval = rtt;
+	if ((domain_len == 0) || (type_len == 0)) {
+		fprintf(stderr, "Invalid query input format: %s\n", input);
+		return (-1);
+	}
 
-		if (rtt_min_interval < 0 || rtt_min_interval > rtt)
-			rtt_min_interval = rtt;
+	if (domain_len > qnlen) {
+		fprintf(stderr, "Query domain too long: %.*s\n",
+			(int)domain_len, domain_str);
+		return (-1);
+	}
 
-		rtt_total_interval += rtt;
-		rtt_counted_interval++;
+	if ((*qtype = lookup_qtype(type_str, type_len)) == -1) {
+		fprintf(stderr, "Query type not understood: %.*s\n",
+			(int)type_len, type_str);
+		return (-1);
 	}
 
-	if (rttarray == NULL)
-		return;
+	memcpy(qname, domain_str, domain_len);
+	qname[domain_len] = '\0';
 
-	i = (int)(rtt * (1000000.0 / rttarray_unit));
-	if (i < rttarray_size) {
-		rttarray[i]++;
-		if (!oldquery)
-			rttarray_interval[i]++;
-	} else {
-		fprintf(stderr, "Warning: RTT is out of range: %.6lf "
-			"[query=%s/%d, rcode=%u]\n", rtt, qname, qtype, rcode);
-		rtt_overflows++;
-		if (!oldquery)
-			rtt_overflows_interval++;
-	}
+	return (0);
 }
 
 /*
- * register_response:
- *   Register receipt of a query
+ * append_opt:
+ *   Append the OPT record for the EDNS options o, if any, to the message
+ *   at msg, whose question ends at p, for the current server
  *
- *   Removes (sets in_use = FALSE) the record for the given query id in
- *   status[] if any exists.
+ *   Return the end of the message
  */
-void
-register_response(unsigned short int id, unsigned int rcode, char *qname,
-	int qtype)
+static unsigned char *
+append_opt(const struct edns_options *o, unsigned char *msg,
+	   unsigned char *p)
 {
-	unsigned int ct = 0;
-	int found = FALSE;
-	struct timeval now;
-	double rtt;
-
-	if (timeout_queries != NULL) {
-		struct query_mininfo *qi = &timeout_queries[id];
-
-		if (qi->qtype == qtype && strcasecmp(qi->qname, qname) == 0) {
-			register_rtt(&qi->sent_timestamp, qname, qtype, rcode);
-			qi->qtype = -1;
-			found = TRUE;
+	const struct server_info *srv = &servers[current_server];
+	unsigned char *opt = p, *addr;
+	unsigned long long r = 0;
+	unsigned int i, len;
+
+	msg[11] = (o->opt_len > 0);		/* arcount */
+	if (o->opt_len == 0)
+		return (p);
+
+	memcpy(p, o->opt, o->opt_len);
+	if (o->ecs_random) {
+		addr = p + o->ecs_offset;
+		len = (o->ecs_prefix + 7) / 8;
+		for (i = 0; i < len; i++) {
+			if ((i & 7) == 0)
+				r = next_random(&random_state);
+			addr[i] = r & 0xff;
+			r >>= 8;
 		}
+		if ((o->ecs_prefix & 7) != 0)
+			addr[len - 1] &= 0xff << (8 - (o->ecs_prefix & 7));
 	}
+	p += o->opt_len;
 
-	for (; (ct < query_status_allocated) && (found == FALSE); ct++) {
-		if (status[ct].in_use == TRUE && status[ct].id == id &&
-		    status[ct].qtype == qtype &&
-		    strcasecmp(status[ct].qname, qname) == 0) {
-			status[ct].in_use = FALSE;
-			num_queries_outstanding--;
-			found = TRUE;
-
-			register_rtt(&status[ct].sent_timestamp, qname, qtype,
-				     rcode);
+	if (o->cookie) {
+		len = CLIENT_COOKIE_LEN + srv->cookie_len;
+		*p++ = 0;
+		*p++ = EDNS_OPT_COOKIE;
+		*p++ = 0;
+		*p++ = len;
+		memcpy(p, client_cookie, CLIENT_COOKIE_LEN);
+		memcpy(p + CLIENT_COOKIE_LEN, srv->cookie, srv->cookie_len);
+		p += len;
+	}
 
-			if (status[ct].desc) {
-				printf("> %s %s\n", rcode_strings[rcode],
-				       status[ct].desc);
-				free(status[ct].desc);
-			}
-		}
+	if (o->padding) {
+		/* Pad the whole message to a multiple of the block size */
+		len = (p + 4 - msg) % o->padding;
+		len = len > 0 ? o->padding - len : 0;
+		*p++ = 0;
+		*p++ = EDNS_OPT_PADDING;
+		*p++ = len >> 8;
+		*p++ = len & 0xff;
+		memset(p, 0, len);
+		p += len;
 	}
 
-	if (countrcodes && (found == TRUE || target_qps > 0))
-		rcodecounts[rcode]++;
+	len = p - opt - EDNSLEN;
+	opt[9] = len >> 8;
+	opt[10] = len & 0xff;
 
-	if (found == FALSE) {
-		if (target_qps > 0) {
-			num_queries_possiblydelayed++;
-			num_queries_possiblydelayed_interval++;
-		} else {
-			fprintf(stderr,
-				"Warning: Received a response with an "
-				"unexpected (maybe timed out) id: %u\n", id);
-		}
-	}
+	return (p);
 }
 
 /*
- * process_single_response:
- *   Receive from the given socket & process an invididual response packet.
- *   Remove it from the list of open queries (status[]) and decrement the
- *   number of outstanding queries if it matches an open query.
+ * build_query:
+ *   Build a query message for dom/qt with the given id in buf, which must
+ *   hold at least MAX_QUERY_LEN bytes.  The header and OPT record are
+ *   copied from the precomputed templates, so this takes a single pass
+ *   over the name.
+ *
+ *   Set *qlenp to the length of the question section.
+ *
+ *   Return -1 on failure
+ *   Return the length of the message otherwise
  */
-void
-process_single_response(int sockfd) {
-	struct sockaddr_storage from_addr_ss;
-	struct sockaddr *from_addr;
-	static unsigned char in_buf[MAX_BUFFER_LEN];
- 	char qname[MAX_DOMAIN_LEN + 1];
- 	int numbytes, addr_len, resp_id, qnamelen;
- 	int qtype, flags;
+int
+build_query(unsigned short int id, const char *dom, int qt,
+	    unsigned char *buf, int *qlenp)
+{
+	unsigned char *p;
+	int len;
 
-	memset(&from_addr_ss, 0, sizeof(from_addr_ss));
-	from_addr = (struct sockaddr *)&from_addr_ss;
-	addr_len = sizeof(from_addr_ss);
+	memcpy(buf, query_header_template, DNS_HEADERLEN);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
 
-	if ((numbytes = recvfrom(sockfd, in_buf, MAX_BUFFER_LEN,
-	     0, from_addr, &addr_len)) == -1) {
-		fprintf(stderr, "Error receiving datagram\n");
-		return;
-	}
+	p = buf + DNS_HEADERLEN;
+	if ((len = encode_qname(dom, p)) == -1)
+		return (-1);
+	p += len;
+	*p++ = qt >> 8;
+	*p++ = qt & 0xff;
+	*p++ = 0;
+	*p++ = C_IN;
+	*qlenp = p - (buf + DNS_HEADERLEN);
 
-	if (numbytes < DNS_HEADERLEN) {
-		if (verbose)
-			fprintf(stderr, "Malformed response\n");
-		return;
-	}
-	resp_id = get_uint16(in_buf);
-	flags = get_uint16(in_buf + 2);
-	qnamelen = dn_expand(in_buf, in_buf + numbytes, in_buf + DNS_HEADERLEN,
-			     qname, MAX_DOMAIN_LEN);
-	if (qnamelen == -1) {
-		if (verbose)
-			fprintf(stderr,
-				"Failed to retrieve qname from response\n");
-		return;
-	}
-	if (numbytes < DNS_HEADERLEN + qnamelen + 2) {
-		if (verbose)
-			fprintf(stderr, "Malformed response\n");
-		return;
-	}
-	qtype = get_uint16(in_buf + DNS_HEADERLEN + qnamelen);
+	p = append_opt(query_edns, buf, p);
 
-	register_response(resp_id, flags & 0xF, qname, qtype);
+	return (p - buf);
 }
 
 /*
- * data_available:
- *   Is there data available on the given file descriptor?
+ * build_query_question:
+ *   Build a query message with the given id around a question section
+ *   already in wire format, qlen bytes long, in buf (as build_query())
  *
- *   Return TRUE if there is
- *   Return FALSE otherwise
+ *   Return the length of the message
  */
 int
-data_available(double wait) {
-	fd_set read_fds;
-	struct timeval tv;
-	int retval;
-	int available = FALSE;
-	int maxfd = -1;
-
-	/* Set list of file descriptors */
-	FD_ZERO(&read_fds);
-	if (socket4 != -1) {
-		FD_SET(socket4, &read_fds);
-		maxfd = socket4;
-	}
-	if (socket6 != -1) {
-		FD_SET(socket6, &read_fds);
-		if (maxfd == -1 || maxfd < socket6)
-			maxfd = socket6;
-	}
-
-	if ((wait > 0.0) && (wait < (double)LONG_MAX)) {
-		tv.tv_sec = (long)floor(wait);
-		tv.tv_usec = (long)(1000000.0 * (wait - floor(wait)));
-	} else {
-		tv.tv_sec = 0;
-		tv.tv_usec = 0;
-	}
+build_query_question(unsigned short int id, const unsigned char *question,
+		     int qlen, unsigned char *buf)
+{
+	unsigned char *p;
 
-	retval = select(maxfd + 1, &read_fds, NULL, NULL, &tv);
+	memcpy(buf, query_header_template, DNS_HEADERLEN);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
 
-	if (socket4 != -1 && FD_ISSET(socket4, &read_fds)) {
-		available = TRUE;
-		process_single_response(socket4);
-	}
-	if (socket6 != -1 && FD_ISSET(socket6, &read_fds)) {
-		available = TRUE;
-		process_single_response(socket6);
-	}
+	p = buf + DNS_HEADERLEN;
+	memcpy(p, question, qlen);
+	p += qlen;
+	p = append_opt(&run_edns, buf, p);
 
-	return (available);
+	return (p - buf);
 }
 
 /*
- * process_responses:
- *   Go through any/all received responses and remove them from the list of
- *   open queries (set in_use = FALSE for their entry in status[]), also
- *   decrementing the number of outstanding queries.
+ * next_field:
+ *   Split the next field, up to white space, off the text at *p
+ *
+ *   Return NULL if there is none
+ *   Return the field, terminated, otherwise, with *p moved past it
  */
-void
+static char *
+next_field(char **p) {
+	char *field = *p + strspn(*p, WHITESPACE);
+	size_t len = strcspn(field, WHITESPACE);
+
+	if (len == 0)
+		return (NULL);
+	*p = field + len;
+	if (**p != '\0')
+		*(*p)++ = '\0';
+
+	return (field);
+}
+
+/*
+ * hex_digit:
+ *   Return the value of a hex digit, or -1 if c is not one
+ */
+static int
+hex_digit(int c) {
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+
+	return (-1);
+}
+
+/*
+ * parse_rdata:
+ *   Convert the data of a record of the given type from presentation
+ *   format into wire format in buf, which must hold MAX_WRITE_LEN bytes.
+ *   A, AAAA, NS, CNAME, PTR, DNAME, MX and TXT are understood, and any
+ *   type in the RFC 3597 generic form, "\# length hex".
+ *
+ *   Return -1 if it is invalid
+ *   Return the length of the data otherwise
+ */
+static int
+parse_rdata(int type, char *text, unsigned char *buf) {
+	char *field, *end;
+	unsigned long value;
+	unsigned int len = 0, pref;
+	int n, hi, lo, quoted;
+
+	text += strspn(text, WHITESPACE);
+	if (text[0] == '\\' && text[1] == '#') {
+		value = strtoul(text + 2, &end, 10);
+		if (end == text + 2 || value > MAX_WRITE_LEN)
+			return (-1);
+		for (text = end; *text != '\0'; text++) {
+			if (strchr(WHITESPACE, *text) != NULL)
+				continue;
+			if ((hi = hex_digit(text[0])) == -1 ||
+			    (lo = hex_digit(text[1])) == -1 || len == value)
+				return (-1);
+			buf[len++] = hi << 4 | lo;
+			text++;
+		}
+		return (len == value ? (int)len : -1);
+	}
+
+	switch (type) {
+	case T_A:
+	case T_AAAA:
+		if ((field = next_field(&text)) == NULL ||
+		    next_field(&text) != NULL ||
+		    inet_pton(type == T_A ? AF_INET : AF_INET6, field,
+			      buf) != 1)
+			return (-1);
+		return (type == T_A ? 4 : 16);
+	case T_MX:
+		if ((field = next_field(&text)) == NULL ||
+		    is_uint(field, &pref) == FALSE || pref > 65535)
+			return (-1);
+		buf[0] = pref >> 8;
+		buf[1] = pref & 0xff;
+		len = 2;
+		/* FALLTHROUGH */
+	case T_NS:
+	case T_CNAME:
+	case T_PTR:
+	case T_DNAME:
+		if ((field = next_field(&text)) == NULL ||
+		    next_field(&text) != NULL ||
+		    (n = encode_qname(field, buf + len)) == -1)
+			return (-1);
+		return (len + n);
+	case T_TXT:
+		/* Character strings, quoted or up to white space */
+		while (*(text += strspn(text, WHITESPACE)) != '\0') {
+			if ((quoted = (*text == '"')))
+				text++;
+			if (len == MAX_WRITE_LEN)
+				return (-1);
+			n = len++;
+			for (; *text != '\0'; text++) {
+				if (quoted ? *text == '"' :
+				    strchr(WHITESPACE, *text) != NULL)
+					break;
+				if (*text == '\\' && text[1] != '\0')
+					text++;
+				if (len == MAX_WRITE_LEN || len - n > 255)
+					return (-1);
+				buf[len++] = *text;
+			}
+			if (quoted && *text++ != '"')
+				return (-1);
+			buf[n] = len - n - 1;
+		}
+		return (len > 0 ? (int)len : -1);
+	}
+
+	return (-1);
+}
+
+/*
+ * is_write_line:
+ *   Whether a line of input is an UPDATE or NOTIFY message, which starts
+ *   with "update" or "notify" and a zone.  A type after either makes it a
+ *   query for that name instead.
+ */
+static int
+is_write_line(const char *line) {
+	const char *zone;
+
+	if ((line[0] | 0x20) != 'u' && (line[0] | 0x20) != 'n')
+		return (FALSE);
+	if ((strncasecmp(line, "update", 6) != 0 &&
+	     strncasecmp(line, "notify", 6) != 0) ||
+	    line[6] == '\0' || strchr(WHITESPACE, line[6]) == NULL)
+		return (FALSE);
+
+	zone = line + 6 + strspn(line + 6, WHITESPACE);
+	return (lookup_qtype(zone, strcspn(zone, WHITESPACE)) == -1);
+}
+
+/*
+ * build_write:
+ *   Build the UPDATE or NOTIFY message of a line of input with the given
+ *   id in buf, which must hold at least MAX_QUERY_LEN bytes:
+ *
+ *     notify zone
+ *     update zone add name ttl type data
+ *     update zone delete name [type [data]]
+ *
+ *   The zone goes in the zone (question) section, as SOA; an UPDATE makes
+ *   one change to it, adding a record, or deleting all the records of a
+ *   name, an RRset or a single record.
+ *
+ *   Set *qlenp to the length of the zone section.
+ *
+ *   Return -1 on failure
+ *   Return the length of the message otherwise
+ */
+static int
+build_write(unsigned short int id, const char *line, unsigned char *buf,
+	    int *qlenp)
+{
+	char text[MAX_INPUT_LEN + 1], *p = text, *keyword, *zone, *op;
+	char *name, *field;
+	unsigned char rdata[MAX_WRITE_LEN], *q;
+	unsigned int flags, ttl = 0, class = C_IN;
+	int len, type = T_ANY, rdlen = 0;
+
+	strncpy(text, line, MAX_INPUT_LEN);
+	text[MAX_INPUT_LEN] = '\0';
+	keyword = next_field(&p);
+	if ((zone = next_field(&p)) == NULL)
+		goto invalid;
+
+	memset(buf, 0, DNS_HEADERLEN);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[5] = 1;				/* zone count */
+	q = buf + DNS_HEADERLEN;
+	if ((len = encode_qname(zone, q)) == -1)
+		goto invalid;
+	q += len;
+	*q++ = 0;
+	*q++ = T_SOA;
+	*q++ = 0;
+	*q++ = C_IN;
+	*qlenp = q - (buf + DNS_HEADERLEN);
+
+	if (strcasecmp(keyword, "notify") == 0) {
+		if (next_field(&p) != NULL)
+			goto invalid;
+		flags = NS_NOTIFY_OP << 11 | DNS_FLAG_AA;
+		buf[2] = flags >> 8;
+		buf[3] = flags & 0xff;
+		return (q - buf);
+	}
+
+	if ((op = next_field(&p)) == NULL || (name = next_field(&p)) == NULL)
+		goto invalid;
+	if (strcasecmp(op, "add") == 0) {
+		if ((field = next_field(&p)) == NULL ||
+		    is_uint(field, &ttl) == FALSE ||
+		    (field = next_field(&p)) == NULL)
+			goto invalid;
+		if ((type = lookup_qtype(field, strlen(field))) == -1)
+			goto badtype;
+		if ((rdlen = parse_rdata(type, p, rdata)) == -1)
+			goto baddata;
+	} else if (strcasecmp(op, "delete") == 0) {
+		class = C_ANY;
+		if ((field = next_field(&p)) != NULL) {
+			if ((type = lookup_qtype(field, strlen(field))) == -1)
+				goto badtype;
+			if (p[strspn(p, WHITESPACE)] != '\0') {
+				class = C_NONE;
+				if ((rdlen = parse_rdata(type, p, rdata)) == -1)
+					goto baddata;
+			}
+		}
+	} else
+		goto invalid;
+
+	if ((len = encode_qname(name, q)) == -1)
+		goto invalid;
+	q += len;
+	if (q + 10 + rdlen > buf + MAX_WRITE_LEN) {
+		fprintf(stderr, "UPDATE too long: %s\n", line);
+		return (-1);
+	}
+	*q++ = type >> 8;
+	*q++ = type & 0xff;
+	*q++ = class >> 8;
+	*q++ = class & 0xff;
+	*q++ = ttl >> 24;
+	*q++ = ttl >> 16;
+	*q++ = ttl >> 8;
+	*q++ = ttl & 0xff;
+	*q++ = rdlen >> 8;
+	*q++ = rdlen & 0xff;
+	memcpy(q, rdata, rdlen);
+	q += rdlen;
+
+	flags = NS_UPDATE_OP << 11;
+	buf[2] = flags >> 8;
+	buf[3] = flags & 0xff;
+	buf[9] = 1;				/* update count */
+
+	return (q - buf);
+
+ invalid:
+	fprintf(stderr, "Invalid UPDATE or NOTIFY: %s\n", line);
+	return (-1);
+
+ badtype:
+	fprintf(stderr, "Record type not understood: %s\n", line);
+	return (-1);
+
+ baddata:
+	fprintf(stderr, "Invalid record data: %s\n", line);
+	return (-1);
+}
+
+/*
+ * load_write_file:
+ *   Read the UPDATE and NOTIFY messages to send with -F, checking each
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+load_write_file(void) {
+	unsigned char buf[MAX_QUERY_LEN];
+	const char *line;
+	unsigned int i;
+	int qlen;
+
+	if (write_file_name == NULL)
+		return (0);
+
+	write_list = load_template_list(write_file_name,
+					strlen(write_file_name));
+	if (write_list == NULL)
+		return (-1);
+
+	for (i = 0; i < write_list->count; i++) {
+		line = write_list->text + write_list->lines[i];
+		if (is_write_line(line) == FALSE) {
+			fprintf(stderr, "Not an UPDATE or NOTIFY in %s: %s\n",
+				write_file_name, line);
+			return (-1);
+		}
+		/* Templates are checked as they are expanded */
+		if (strchr(line, '{') == NULL &&
+		    build_write(0, line, buf, &qlen) == -1)
+			return (-1);
+	}
+	write_next %= write_list->count;
+
+	return (0);
+}
+
+#ifdef USE_OPENSSL
+/*
+ * tsig_variables:
+ *   Add the TSIG variables to a MAC being computed: the key name, class
+ *   and TTL, the algorithm name, the time signed and fudge, and the error
+ *   and other data, the last three as they appear in the record
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+tsig_variables(EVP_MD_CTX *ctx, const unsigned char *timefudge,
+	       const unsigned char *errother, int errotherlen)
+{
+	static const unsigned char classttl[6] = { 0, C_ANY, 0, 0, 0, 0 };
+
+	if (EVP_DigestUpdate(ctx, tsig.name, tsig.namelen) != 1 ||
+	    EVP_DigestUpdate(ctx, classttl, sizeof(classttl)) != 1 ||
+	    EVP_DigestUpdate(ctx, tsig.alg, tsig.alglen) != 1 ||
+	    EVP_DigestUpdate(ctx, timefudge, 8) != 1 ||
+	    EVP_DigestUpdate(ctx, errother, errotherlen) != 1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * tsig_finish:
+ *   Finish the HMAC begun by copying tsig.inner into ctx, putting
+ *   tsig.maclen bytes in mac
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+tsig_finish(EVP_MD_CTX *ctx, unsigned char *mac) {
+	unsigned char inner[EVP_MAX_MD_SIZE];
+
+	if (EVP_DigestFinal_ex(ctx, inner, NULL) != 1 ||
+	    EVP_MD_CTX_copy_ex(ctx, tsig.outer) != 1 ||
+	    EVP_DigestUpdate(ctx, inner, tsig.maclen) != 1 ||
+	    EVP_DigestFinal_ex(ctx, mac, NULL) != 1)
+		return (-1);
+
+	return (0);
+}
+#endif
+
+/*
+ * sign_query:
+ *   Append a TSIG record signing the query of len bytes in msg, which
+ *   must hold MAX_QUERY_LEN bytes, if a key was given with -y.  The MAC
+ *   is kept by message id, for validate_packet() to pass on with the
+ *   response.
+ *
+ *   Return -1 on failure
+ *   Return the new length of the query otherwise
+ */
+int
+sign_query(unsigned char *msg, int len) {
+#ifdef USE_OPENSSL
+	unsigned char *p = msg + len, *rdata, *mac;
+	unsigned int arcount;
+	time_t now;
+
+	if (tsig.maclen == 0)
+		return (len);
+	if (len + tsig.namelen + 10 + tsig.alglen + 16 + tsig.maclen >
+	    MAX_QUERY_LEN) {
+		fprintf(stderr, "Error: query too long to sign\n");
+		return (-1);
+	}
+
+	memcpy(p, tsig.name, tsig.namelen);
+	p += tsig.namelen;
+	*p++ = 0;
+	*p++ = T_TSIG;
+	*p++ = 0;
+	*p++ = C_ANY;
+	memset(p, 0, 4);		/* TTL */
+	p += 4;
+	*p++ = (tsig.alglen + 16 + tsig.maclen) >> 8;
+	*p++ = (tsig.alglen + 16 + tsig.maclen) & 0xff;
+	rdata = p;
+	memcpy(p, tsig.alg, tsig.alglen);
+	p += tsig.alglen;
+	now = time(NULL);
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = now >> 24;
+	*p++ = now >> 16;
+	*p++ = now >> 8;
+	*p++ = now & 0xff;
+	*p++ = TSIG_FUDGE >> 8;
+	*p++ = TSIG_FUDGE & 0xff;
+	*p++ = tsig.maclen >> 8;
+	*p++ = tsig.maclen & 0xff;
+	mac = p;
+	p += tsig.maclen;
+	*p++ = msg[0];			/* original id */
+	*p++ = msg[1];
+	memset(p, 0, 4);		/* error, other length */
+	p += 4;
+
+	if (EVP_MD_CTX_copy_ex(tsig.sign, tsig.inner) != 1 ||
+	    EVP_DigestUpdate(tsig.sign, msg, len) != 1 ||
+	    tsig_variables(tsig.sign, rdata + tsig.alglen, p - 4, 4) == -1 ||
+	    tsig_finish(tsig.sign, mac) == -1) {
+		fprintf(stderr, "Error: unable to sign the query\n");
+		return (-1);
+	}
+	if (tsig_request_macs != NULL)
+		memcpy(tsig_request_macs + get_uint16(msg) * MAX_TSIG_MAC_LEN,
+		       mac, tsig.maclen);
+
+	arcount = get_uint16(msg + 10) + 1;
+	msg[10] = arcount >> 8;
+	msg[11] = arcount & 0xff;
+
+	return (p - msg);
+#else
+	return (len);
+#endif
+}
+
+/*
+ * trace_packet:
+ *   Queue a copy of a query sent or a response received for the trace
+ *   file, if its message id is in the sample
+ */
+static void
+trace_packet(int response, const unsigned char *msg, int len,
+	     const struct sockaddr *peer)
+{
+	struct trace_record *rec;
+	size_t need, pos, contig, tail, head = trace.head;
+
+	if (trace.buf == NULL || get_uint16((unsigned char *)msg) %
+	    trace_sample != 0)
+		return;
+
+	need = TRACE_ALIGN(sizeof(*rec) + len);
+	tail = ATOMIC_LOAD(&trace.tail);
+	pos = head & (TRACE_RING_SIZE - 1);
+	contig = TRACE_RING_SIZE - pos;
+	if (contig < need) {
+		if (TRACE_RING_SIZE - (head - tail) < contig + need) {
+			trace.dropped++;
+			return;
+		}
+		((struct trace_record *)(trace.buf + pos))->size = 0;
+		head += contig;
+		pos = 0;
+	} else if (TRACE_RING_SIZE - (head - tail) < need) {
+		trace.dropped++;
+		return;
+	}
+
+	rec = (struct trace_record *)(trace.buf + pos);
+	rec->size = need;
+	rec->msglen = len;
+	rec->response = response;
+	rec->family = peer->sa_family;
+	set_timenow(&rec->ts);
+	if (peer->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const void *)peer;
+
+		memcpy(rec->peer, &sin->sin_addr, 4);
+		rec->peer_port = ntohs(sin->sin_port);
+	}
+#ifdef AF_INET6
+	else if (peer->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void *)peer;
+
+		memcpy(rec->peer, &sin6->sin6_addr, 16);
+		rec->peer_port = ntohs(sin6->sin6_port);
+	}
+#endif
+	memcpy(rec + 1, msg, len);
+
+	ATOMIC_STORE(&trace.head, head + need);
+}
+
+/*
+ * trace_checksum:
+ *   Add len bytes at p to a ones' complement checksum sum
+ */
+static unsigned int
+trace_checksum(unsigned int sum, const unsigned char *p, size_t len) {
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len > 0)
+		sum += p[0] << 8;
+
+	return (sum);
+}
+
+static unsigned int
+trace_checksum_fold(unsigned int sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (~sum & 0xffff);
+}
+
+/*
+ * trace_write_record:
+ *   Write one queued message to the trace file as a raw IP packet
+ */
+static void
+trace_write_record(const struct trace_record *rec, unsigned char *out) {
+	static struct sockaddr_storage local[2];
+	static int have_local[2];
+	struct sockaddr_storage *lss;
+	socklen_t llen;
+	unsigned char *ip = out + 16, *udp, *src, *dst;
+	unsigned int iplen, srcport, dstport, sum, v6;
+	unsigned char *local_addr;
+	unsigned short local_port;
+
+	v6 = (rec->family != AF_INET);
+
+	/* The local address is known once the socket has sent something */
+	lss = &local[v6];
+	if (!have_local[v6]) {
+		llen = sizeof(*lss);
+		if (getsockname(v6 ? socket6 : socket4,
+				(struct sockaddr *)lss, &llen) == 0)
+			have_local[v6] = TRUE;
+	}
+	if (v6) {
+#ifdef AF_INET6
+		local_addr = (unsigned char *)
+			&((struct sockaddr_in6 *)lss)->sin6_addr;
+		local_port = ntohs(((struct sockaddr_in6 *)lss)->sin6_port);
+#endif
+	} else {
+		local_addr = (unsigned char *)
+			&((struct sockaddr_in *)lss)->sin_addr;
+		local_port = ntohs(((struct sockaddr_in *)lss)->sin_port);
+	}
+
+	if (rec->response) {
+		src = (unsigned char *)rec->peer;
+		srcport = rec->peer_port;
+		dst = local_addr;
+		dstport = local_port;
+	} else {
+		src = local_addr;
+		srcport = local_port;
+		dst = (unsigned char *)rec->peer;
+		dstport = rec->peer_port;
+	}
+
+	if (v6) {
+		iplen = 40 + 8 + rec->msglen;
+		memset(ip, 0, 40);
+		ip[0] = 0x60;
+		ip[4] = (iplen - 40) >> 8;
+		ip[5] = (iplen - 40) & 0xff;
+		ip[6] = IPPROTO_UDP;
+		ip[7] = 64;
+		memcpy(ip + 8, src, 16);
+		memcpy(ip + 24, dst, 16);
+		udp = ip + 40;
+	} else {
+		iplen = 20 + 8 + rec->msglen;
+		memset(ip, 0, 20);
+		ip[0] = 0x45;
+		ip[2] = iplen >> 8;
+		ip[3] = iplen & 0xff;
+		ip[8] = 64;
+		ip[9] = IPPROTO_UDP;
+		memcpy(ip + 12, src, 4);
+		memcpy(ip + 16, dst, 4);
+		sum = trace_checksum_fold(trace_checksum(0, ip, 20));
+		ip[10] = sum >> 8;
+		ip[11] = sum & 0xff;
+		udp = ip + 20;
+	}
+
+	udp[0] = srcport >> 8;
+	udp[1] = srcport & 0xff;
+	udp[2] = dstport >> 8;
+	udp[3] = dstport & 0xff;
+	udp[4] = (8 + rec->msglen) >> 8;
+	udp[5] = (8 + rec->msglen) & 0xff;
+	udp[6] = udp[7] = 0;
+	memcpy(udp + 8, rec + 1, rec->msglen);
+
+	if (v6) {
+		/* The UDP checksum is mandatory over IPv6 */
+		sum = trace_checksum(0, ip + 8, 32);
+		sum += IPPROTO_UDP + 8 + rec->msglen;
+		sum = trace_checksum_fold(trace_checksum(sum, udp,
+							 8 + rec->msglen));
+		if (sum == 0)
+			sum = 0xffff;
+		udp[6] = sum >> 8;
+		udp[7] = sum & 0xff;
+	}
+
+	/* pcap record header, in host byte order like the file header */
+	((unsigned int *)out)[0] = rec->ts.tv_sec;
+	((unsigned int *)out)[1] = rec->ts.tv_usec;
+	((unsigned int *)out)[2] = iplen;
+	((unsigned int *)out)[3] = iplen;
+
+	if (fwrite(out, 16 + iplen, 1, trace.fp) == 1)
+		trace.written++;
+}
+
+/*
+ * trace_thread_main:
+ *   Drain the trace ring into the trace file until told to stop
+ */
+static void *
+trace_thread_main(void *arg) {
+	static unsigned char out[16 + 48 + MAX_BUFFER_LEN];
+	struct timespec idle;
+	struct trace_record *rec;
+	size_t head, pos, tail = 0;
+	int stop;
+
+	(void)arg;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = TRACE_IDLE_WAIT;
+
+	for (;;) {
+		stop = ATOMIC_LOAD(&trace.stop);
+		head = ATOMIC_LOAD(&trace.head);
+		if (tail == head) {
+			if (stop)
+				break;
+			fflush(trace.fp);
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		while (tail != head) {
+			pos = tail & (TRACE_RING_SIZE - 1);
+			rec = (struct trace_record *)(trace.buf + pos);
+			if (rec->size == 0) {
+				tail += TRACE_RING_SIZE - pos;
+				continue;
+			}
+			trace_write_record(rec, out);
+			tail += rec->size;
+		}
+		ATOMIC_STORE(&trace.tail, tail);
+	}
+
+	return (NULL);
+}
+
+/*
+ * trace_start:
+ *   Open the trace file, if one was asked for, and start its writer
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+trace_start(void) {
+	unsigned int hdr[6];
+
+	if (trace_file_name == NULL)
+		return (0);
+
+	if ((trace.fp = fopen(trace_file_name, "wb")) == NULL) {
+		fprintf(stderr, "Error: unable to open trace file %s: %s\n",
+			trace_file_name, strerror(errno));
+		return (-1);
+	}
+	setvbuf(trace.fp, NULL, _IOFBF, 1024 * 1024);
+
+	hdr[0] = 0xa1b2c3d4;
+	((unsigned short *)hdr)[2] = 2;	/* version 2.4 */
+	((unsigned short *)hdr)[3] = 4;
+	hdr[2] = 0;
+	hdr[3] = 0;
+	hdr[4] = 65535;
+	hdr[5] = 101;			/* LINKTYPE_RAW */
+	if (fwrite(hdr, sizeof(hdr), 1, trace.fp) != 1) {
+		fprintf(stderr, "Error: unable to write trace file %s\n",
+			trace_file_name);
+		return (-1);
+	}
+
+	if ((trace.buf = malloc(TRACE_RING_SIZE)) == NULL) {
+		fprintf(stderr, "Error allocating memory for trace ring\n");
+		return (-1);
+	}
+
+	if (pthread_create(&trace.thread, NULL, trace_thread_main,
+			   NULL) != 0) {
+		fprintf(stderr, "Error: unable to start trace writer\n");
+		free(trace.buf);
+		trace.buf = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * trace_stop:
+ *   Let the writer drain the trace ring, and close the trace file
+ */
+void
+trace_stop(void) {
+	if (trace.buf == NULL)
+		return;
+
+	ATOMIC_STORE(&trace.stop, TRUE);
+	pthread_join(trace.thread, NULL);
+	if (fclose(trace.fp) != 0)
+		fprintf(stderr, "Error: unable to write trace file %s\n",
+			trace_file_name);
+}
+
+/*
+ * validate_packet:
+ *   Queue a copy of a response received for the validator thread, with
+ *   the MAC of the query of its id if the queries are signed
+ */
+static void
+validate_packet(const unsigned char *msg, int len) {
+	struct validate_record *rec;
+	size_t need, pos, contig, tail, head = validation.head;
+	unsigned int maclen = 0;
+
+	if (validation.buf == NULL)
+		return;
+
+	if (tsig_request_macs != NULL && len >= 2)
+		maclen = tsig.maclen;
+	need = TRACE_ALIGN(sizeof(*rec) + len + maclen);
+	tail = ATOMIC_LOAD(&validation.tail);
+	pos = head & (VALIDATE_RING_SIZE - 1);
+	contig = VALIDATE_RING_SIZE - pos;
+	if (contig < need) {
+		if (VALIDATE_RING_SIZE - (head - tail) < contig + need) {
+			validation.dropped++;
+			return;
+		}
+		((struct validate_record *)(validation.buf + pos))->size = 0;
+		head += contig;
+		pos = 0;
+	} else if (VALIDATE_RING_SIZE - (head - tail) < need) {
+		validation.dropped++;
+		return;
+	}
+
+	rec = (struct validate_record *)(validation.buf + pos);
+	rec->size = need;
+	rec->msglen = len;
+	rec->maclen = maclen;
+	memcpy(rec + 1, msg, len);
+	if (maclen > 0)
+		memcpy((unsigned char *)(rec + 1) + len, tsig_request_macs +
+		       get_uint16((unsigned char *)msg) * MAX_TSIG_MAC_LEN,
+		       maclen);
+
+	ATOMIC_STORE(&validation.head, head + need);
+}
+
+/*
+ * hash_bytes:
+ *   Continue an FNV-1a hash over len bytes
+ */
+static unsigned long long
+hash_bytes(unsigned long long h, const unsigned char *p, unsigned int len) {
+	while (len-- > 0)
+		h = (h ^ *p++) * FNV64_PRIME;
+
+	return (h);
+}
+
+/*
+ * name_end:
+ *   Walk the possibly compressed name at off in a message of len bytes,
+ *   and if h is not NULL, hash it, uncompressed and in lower case, into *h.
+ *   Compression pointers must point backwards.
+ *
+ *   Return -1 if the name is malformed
+ *   Return the offset just past the name where it is written otherwise
+ */
+static int
+name_end(const unsigned char *msg, int len, int off, unsigned long long *h) {
+	int end = -1, hops = 0, ptr;
+	unsigned int c, i, ch;
+
+	for (;;) {
+		if (off >= len)
+			return (-1);
+		c = msg[off];
+		if ((c & 0xC0) == 0xC0) {
+			if (off + 1 >= len || ++hops > MAX_POINTER_HOPS)
+				return (-1);
+			ptr = ((c & 0x3F) << 8) | msg[off + 1];
+			if (ptr >= off)
+				return (-1);
+			if (end == -1)
+				end = off + 2;
+			off = ptr;
+			continue;
+		}
+		if ((c & 0xC0) != 0 || off + 1 + (int)c > len)
+			return (-1);
+		if (h != NULL) {
+			*h = (*h ^ c) * FNV64_PRIME;
+			for (i = 1; i <= c; i++) {
+				ch = msg[off + i];
+				if (ch >= 'A' && ch <= 'Z')
+					ch += 'a' - 'A';
+				*h = (*h ^ ch) * FNV64_PRIME;
+			}
+		}
+		off += c + 1;
+		if (c == 0)
+			break;
+	}
+
+	return (end == -1 ? off : end);
+}
+
+/*
+ * hash_rdata:
+ *   Hash the rdlen bytes of record data at off, of the given type,
+ *   uncompressing the names in the types whose data may be compressed
+ *   (RFC 3597 section 4)
+ *
+ *   Return -1 if the data is malformed
+ *   Return a non-negative integer otherwise
+ */
+static int
+hash_rdata(const unsigned char *msg, int off, int rdlen, int type,
+	   unsigned long long *h)
+{
+	int end = off + rdlen, names = 0, prefix = 0;
+
+	switch (type) {
+	case 2:		/* NS */
+	case 5:		/* CNAME */
+	case 12:	/* PTR */
+		names = 1;
+		break;
+	case 15:	/* MX */
+		prefix = 2;
+		names = 1;
+		break;
+	case 6:		/* SOA */
+		names = 2;
+		break;
+	}
+
+	if (prefix > rdlen)
+		return (-1);
+	*h = hash_bytes(*h, msg + off, prefix);
+	off += prefix;
+	while (names-- > 0)
+		if ((off = name_end(msg, end, off, h)) == -1)
+			return (-1);
+	*h = hash_bytes(*h, msg + off, end - off);
+
+	return (0);
+}
+
+/*
+ * answer_table_grow:
+ *   Double the size of the table of answer hashes (or create it)
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+answer_table_grow(void) {
+	struct answer_entry *old = answers.slots;
+	unsigned int i, j, old_size = answers.size;
+
+	answers.size = old_size ? old_size * 2 : ANSWER_TABLE_MIN_SIZE;
+	answers.slots = calloc(answers.size, sizeof(answers.slots[0]));
+	if (answers.slots == NULL) {
+		fprintf(stderr, "Error allocating memory for answer hashes\n");
+		answers.slots = old;
+		answers.size = old_size;
+		return (-1);
+	}
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].question == NULL)
+			continue;
+		for (j = old[i].qhash & (answers.size - 1);
+		     answers.slots[j].question != NULL;
+		     j = (j + 1) & (answers.size - 1))
+			;
+		answers.slots[j] = old[i];
+	}
+	free(old);
+
+	return (0);
+}
+
+/*
+ * answer_lookup:
+ *   Find the entry for a wire-format question of qlen bytes in the table
+ *   of answer hashes, adding one (with no answer yet) if insert is TRUE
+ *
+ *   Return NULL if there is none (or on failure)
+ *   Return the entry otherwise
+ */
+static struct answer_entry *
+answer_lookup(const unsigned char *question, unsigned int qlen, int insert) {
+	struct answer_entry *e;
+	unsigned int i, h = question_hash(question, qlen);
+
+	if (insert && (answers.count + 1) * 2 > answers.size &&
+	    answer_table_grow() == -1)
+		return (NULL);
+	if (answers.size == 0)
+		return (NULL);
+
+	for (i = h & (answers.size - 1);; i = (i + 1) & (answers.size - 1)) {
+		e = &answers.slots[i];
+		if (e->question == NULL)
+			break;
+		if (e->qhash == h && e->qlen == qlen &&
+		    question_equal(e->question, question, qlen))
+			return (e);
+	}
+	if (insert == FALSE || (e->question = malloc(qlen)) == NULL)
+		return (NULL);
+
+	memcpy(e->question, question, qlen);
+	e->qhash = h;
+	e->qlen = qlen;
+	e->rcode = ANSWER_UNSET;
+	answers.count++;
+
+	return (e);
+}
+
+/*
+ * verify_tsig:
+ *   Check the TSIG record of a response to a signed query, which starts
+ *   at start with its rdata of rdlen bytes at rdoff (start is -1 if the
+ *   response has none), against request, the MAC of the query (NULL if
+ *   unknown).  The outcome is counted in vstats.
+ */
+static void
+verify_tsig(const unsigned char *msg, int len, int start, int rdoff,
+	    unsigned int rdlen, const unsigned char *request)
+{
+#ifdef USE_OPENSSL
+	unsigned char header[DNS_HEADERLEN], mac[EVP_MAX_MD_SIZE];
+	const unsigned char *p, *end = msg + rdoff + rdlen;
+	unsigned int maclen, id, otherlen;
+	int off;
+
+	if (start == -1) {
+		vstats.tsig_missing++;
+		return;
+	}
+
+	off = name_end(msg, len, rdoff, NULL);
+	if (off == -1 || end - (msg + off) < 10)
+		goto failed;
+	p = msg + off;
+	maclen = get_uint16((unsigned char *)p + 8);
+	if (maclen != tsig.maclen || end - p < 16 + maclen)
+		goto failed;
+	id = get_uint16((unsigned char *)p + 10 + maclen);
+	otherlen = get_uint16((unsigned char *)p + 14 + maclen);
+	if (end - p != 16 + maclen + otherlen || request == NULL)
+		goto failed;
+
+	/* The MAC covers the response as it was before it was signed */
+	memcpy(header, msg, DNS_HEADERLEN);
+	header[0] = id >> 8;
+	header[1] = id & 0xff;
+	id = get_uint16(header + 10) - 1;
+	header[10] = id >> 8;
+	header[11] = id & 0xff;
+	mac[0] = maclen >> 8;
+	mac[1] = maclen & 0xff;
+
+	if (EVP_MD_CTX_copy_ex(tsig.verify, tsig.inner) != 1 ||
+	    EVP_DigestUpdate(tsig.verify, mac, 2) != 1 ||
+	    EVP_DigestUpdate(tsig.verify, request, maclen) != 1 ||
+	    EVP_DigestUpdate(tsig.verify, header, DNS_HEADERLEN) != 1 ||
+	    EVP_DigestUpdate(tsig.verify, msg + DNS_HEADERLEN,
+			     start - DNS_HEADERLEN) != 1 ||
+	    tsig_variables(tsig.verify, p, p + 12 + maclen,
+			   4 + otherlen) == -1 ||
+	    tsig_finish(tsig.verify, mac) == -1 ||
+	    memcmp(mac, p + 10, maclen) != 0)
+		goto failed;
+
+	vstats.tsig_verified++;
+	return;
+
+ failed:
+	vstats.tsig_failed++;
+#endif
+}
+
+/*
+ * validate_message:
+ *   Check a whole response: that it is a response to a standard query,
+ *   NOTIFY or UPDATE with one question (or zone), that its sections hold
+ *   as many well-formed records as its header says and nothing after
+ *   them, its TSIG record if the query was signed, and whether it was
+ *   truncated.  Then record its answer hash, or check it against the
+ *   recorded one.  request is the MAC of the query, if it was signed.
+ *   The outcome is counted in vstats.
+ */
+static void
+validate_message(const unsigned char *msg, int len,
+		 const unsigned char *request)
+{
+	unsigned int flags, count, section, i, rdlen;
+	unsigned long long ahash = 0, rrhash;
+	struct answer_entry *e;
+	int off, qlen, rcode, opcode, start, tsig_start = -1, tsig_rdoff = 0;
+	unsigned int tsig_rdlen = 0;
+
+	vstats.checked++;
+	if (len < DNS_HEADERLEN) {
+		vstats.malformed++;
+		return;
+	}
+
+	flags = get_uint16((unsigned char *)msg + 2);
+	if ((flags & 0x8000) == 0) {
+		vstats.not_response++;
+		return;
+	}
+	opcode = (flags >> 11) & 0xF;
+	if (opcode != ns_o_query && opcode != NS_NOTIFY_OP &&
+	    opcode != NS_UPDATE_OP) {
+		vstats.bad_opcode++;
+		return;
+	}
+	if (get_uint16((unsigned char *)msg + 4) != 1) {
+		vstats.bad_qdcount++;
+		return;
+	}
+	rcode = flags & 0xF;
+
+	qlen = question_length(msg + DNS_HEADERLEN, msg + len);
+	if (qlen == -1) {
+		vstats.malformed++;
+		return;
+	}
+	off = DNS_HEADERLEN + qlen;
+
+	/* Answer, authority and additional sections */
+	for (section = 1; section < 4; section++) {
+		count = get_uint16((unsigned char *)msg + 4 + 2 * section);
+		for (i = 0; i < count; i++) {
+			rrhash = FNV64_INIT;
+			start = off;
+			off = name_end(msg, len, off,
+				       section == 1 ? &rrhash : NULL);
+			if (off == -1 || len - off < 10) {
+				vstats.malformed++;
+				return;
+			}
+			rdlen = get_uint16((unsigned char *)msg + off + 8);
+			if ((unsigned int)(len - off - 10) < rdlen) {
+				vstats.malformed++;
+				return;
+			}
+			if (section == 1) {
+				/* Type and class, but not the TTL */
+				rrhash = hash_bytes(rrhash, msg + off, 4);
+				if (hash_rdata(msg, off + 10, rdlen,
+					       get_uint16((unsigned char *)
+							  msg + off),
+					       &rrhash) == -1) {
+					vstats.malformed++;
+					return;
+				}
+				/* The sum does not depend on the order */
+				ahash += rrhash;
+			} else if (section == 3 && i == count - 1 &&
+				   get_uint16((unsigned char *)msg + off) ==
+				   T_TSIG) {
+				tsig_start = start;
+				tsig_rdoff = off + 10;
+				tsig_rdlen = rdlen;
+			}
+			off += 10 + rdlen;
+		}
+	}
+	if (off != len) {
+		vstats.malformed++;
+		return;
+	}
+
+	if (tsig.maclen > 0)
+		verify_tsig(msg, len, tsig_start, tsig_rdoff, tsig_rdlen,
+			    request);
+
+	if ((flags & 0x0200) != 0) {
+		vstats.truncated++;
+		return;
+	}
+
+	/* Only queries have answers to record */
+	if (opcode != ns_o_query)
+		return;
+
+	if (answers_record_file != NULL) {
+		e = answer_lookup(msg + DNS_HEADERLEN, qlen, TRUE);
+		if (e != NULL && e->rcode == ANSWER_UNSET) {
+			e->rcode = rcode;
+			e->ahash = ahash;
+			vstats.recorded++;
+		}
+	} else if (answers_check_file != NULL) {
+		e = answer_lookup(msg + DNS_HEADERLEN, qlen, FALSE);
+		if (e == NULL)
+			vstats.unknown++;
+		else if (e->rcode == rcode && e->ahash == ahash)
+			vstats.matched++;
+		else
+			vstats.mismatched++;
+	}
+}
+
+/*
+ * validate_thread_main:
+ *   Validate the responses queued in the ring until told to stop
+ */
+static void *
+validate_thread_main(void *arg) {
+	struct timespec idle;
+	struct validate_record *rec;
+	const unsigned char *msg;
+	size_t head, pos, tail = 0;
+	int stop;
+
+	(void)arg;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = VALIDATE_IDLE_WAIT;
+
+	for (;;) {
+		stop = ATOMIC_LOAD(&validation.stop);
+		head = ATOMIC_LOAD(&validation.head);
+		if (tail == head) {
+			if (stop)
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		while (tail != head) {
+			pos = tail & (VALIDATE_RING_SIZE - 1);
+			rec = (struct validate_record *)(validation.buf + pos);
+			if (rec->size == 0) {
+				tail += VALIDATE_RING_SIZE - pos;
+				continue;
+			}
+			msg = (unsigned char *)(rec + 1);
+			validate_message(msg, rec->msglen, rec->maclen > 0 ?
+					 msg + rec->msglen : NULL);
+			tail += rec->size;
+		}
+		ATOMIC_STORE(&validation.tail, tail);
+	}
+
+	return (NULL);
+}
+
+/*
+ * question_name_text:
+ *   Render the owner name of a wire-format question as encode_qname()
+ *   reads it back, escaping what needs it; buf must hold at least
+ *   4 * MAX_DOMAIN_LEN + 2 bytes
+ */
+static void
+question_name_text(const unsigned char *q, char *buf) {
+	unsigned int len, c;
+	char *p = buf;
+
+	while ((len = *q++) != 0) {
+		while (len-- > 0) {
+			c = *q++;
+			if (c == '.' || c == '\\' || c == ';')
+				p += sprintf(p, "\\%c", c);
+			else if (c <= ' ' || c >= 0x7F)
+				p += sprintf(p, "\\%03u", c);
+			else
+				*p++ = c;
+		}
+		*p++ = '.';
+	}
+	if (p == buf)
+		*p++ = '.';
+	*p = '\0';
+}
+
+/*
+ * answers_load:
+ *   Read the answer hashes recorded by a reference run, one
+ *   "name type class rcode hash" line per question
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+answers_load(const char *file_name) {
+	char line[4 * MAX_DOMAIN_LEN + 128], name[4 * MAX_DOMAIN_LEN + 2];
+	char tbuf[32], rbuf[16];
+	unsigned char question[MAX_QUESTION_LEN];
+	unsigned long long ahash;
+	unsigned int qclass, lineno = 0;
+	struct answer_entry *e;
+	int n, qtype, rcode;
+	FILE *fp;
+
+	if ((fp = fopen(file_name, "r")) == NULL) {
+		fprintf(stderr, "Error: unable to open %s: %s\n", file_name,
+			strerror(errno));
+		return (-1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (line[0] == COMMENT_CHAR || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%1021s %31s %u %15s %llx", name, tbuf,
+			   &qclass, rbuf, &ahash) != 5)
+			goto bad;
+		for (rcode = 0; rcode < 16; rcode++)
+			if (strcmp(rbuf, rcode_strings[rcode]) == 0)
+				break;
+		if (rcode == 16 || qclass > 65535 ||
+		    (qtype = lookup_qtype(tbuf, strlen(tbuf))) == -1 ||
+		    (n = encode_qname(name, question)) == -1)
+			goto bad;
+		question[n] = qtype >> 8;
+		question[n + 1] = qtype & 0xff;
+		question[n + 2] = qclass >> 8;
+		question[n + 3] = qclass & 0xff;
+		if ((e = answer_lookup(question, n + 4, TRUE)) == NULL) {
+			fclose(fp);
+			return (-1);
+		}
+		e->rcode = rcode;
+		e->ahash = ahash;
+	}
+	fclose(fp);
+
+	return (0);
+
+ bad:
+	fprintf(stderr, "Error: %s:%u: invalid answer hash\n", file_name,
+		lineno);
+	fclose(fp);
+	return (-1);
+}
+
+/*
+ * answers_save:
+ *   Write the answer hashes recorded in this run
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+answers_save(const char *file_name) {
+	char name[4 * MAX_DOMAIN_LEN + 2], tbuf[16];
+	struct answer_entry *e;
+	unsigned int i;
+	FILE *fp;
+
+	if ((fp = fopen(file_name, "w")) == NULL) {
+		fprintf(stderr, "Error: unable to open %s: %s\n", file_name,
+			strerror(errno));
+		return (-1);
+	}
+
+	fprintf(fp, "; queryperf answer hashes: name type class rcode hash\n");
+	for (i = 0; i < answers.size; i++) {
+		e = &answers.slots[i];
+		if (e->question == NULL || e->rcode == ANSWER_UNSET)
+			continue;
+		question_name_text(e->question, name);
+		fprintf(fp, "%s %s %u %s %016llx\n", name,
+			qtype_to_text(get_uint16(e->question + e->qlen - 4),
+				      tbuf, sizeof(tbuf)),
+			get_uint16(e->question + e->qlen - 2),
+			rcode_strings[e->rcode], e->ahash);
+	}
+
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Error: unable to write %s\n", file_name);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * validate_start:
+ *   Load the reference answer hashes, if any, and start the validator
+ *   thread, if -V (or -o or -O) was given
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+validate_start(void) {
+	if (validate_responses == FALSE)
+		return (0);
+
+	if (answers_check_file != NULL &&
+	    answers_load(answers_check_file) == -1)
+		return (-1);
+
+	if ((validation.buf = malloc(VALIDATE_RING_SIZE)) == NULL) {
+		fprintf(stderr, "Error allocating memory for validation "
+			"ring\n");
+		return (-1);
+	}
+
+	if (pthread_create(&validation.thread, NULL, validate_thread_main,
+			   NULL) != 0) {
+		fprintf(stderr, "Error: unable to start validator\n");
+		free(validation.buf);
+		validation.buf = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * validate_stop:
+ *   Let the validator drain its ring, and save the answer hashes if -o
+ *   was given
+ */
+void
+validate_stop(void) {
+	if (validation.buf == NULL)
+		return;
+
+	ATOMIC_STORE(&validation.stop, TRUE);
+	pthread_join(validation.thread, NULL);
+	vstats.dropped = validation.dropped;
+
+	if (answers_record_file != NULL)
+		(void)answers_save(answers_record_file);
+}
+
+/*
+ * metrics_append:
+ *   Add formatted text to the metrics response being built
+ */
+static void
+metrics_append(const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	if (metrics.len >= METRICS_BUFFER_SIZE - 1)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(metrics.buf + metrics.len,
+			METRICS_BUFFER_SIZE - metrics.len, fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		metrics.len += len;
+	if (metrics.len > METRICS_BUFFER_SIZE - 1)
+		metrics.len = METRICS_BUFFER_SIZE - 1;
+}
+
+/*
+ * metrics_family:
+ *   Start a metric family in the response
+ */
+static void
+metrics_family(const char *name, const char *type, const char *help) {
+	metrics_append("# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/*
+ * metrics_render:
+ *   Build the OpenMetrics exposition of the counters as they are now
+ */
+static void
+metrics_render(void) {
+	static const double bounds[] = METRICS_RTT_BUCKETS;
+	unsigned long long cum = 0;
+	unsigned int i, b, counted, count;
+	double sum, limit;
+
+	metrics.len = 0;
+
+	metrics_family("queryperf_queries_sent", "counter", "Queries sent.");
+	metrics_append("queryperf_queries_sent_total %u\n",
+		       ATOMIC_READ(&num_queries_sent));
+	metrics_family("queryperf_queries_outstanding", "gauge",
+		       "Queries waiting for a response.");
+	metrics_append("queryperf_queries_outstanding %u\n",
+		       ATOMIC_READ(&num_queries_outstanding));
+	metrics_family("queryperf_queries_timed_out", "counter",
+		       "Queries that got no response in time.");
+	metrics_append("queryperf_queries_timed_out_total %u\n",
+		       ATOMIC_READ(&num_queries_timed_out));
+	metrics_family("queryperf_queries_possibly_delayed", "counter",
+		       "Responses that came after their query timed out.");
+	metrics_append("queryperf_queries_possibly_delayed_total %u\n",
+		       ATOMIC_READ(&num_queries_possiblydelayed));
+
+	metrics_family("queryperf_responses", "counter",
+		       "Responses received, by rcode.");
+	for (i = 0; i < 16; i++) {
+		count = ATOMIC_READ(&rcodecounts[i]);
+		if (count == 0 && i != 0)
+			continue;
+		metrics_append("queryperf_responses_total{rcode=\"%s\"} %u\n",
+			       rcode_strings[i], count);
+	}
+
+	metrics_family("queryperf_sent_bytes", "counter",
+		       "Bytes of query messages sent.");
+	metrics_append("# UNIT queryperf_sent_bytes bytes\n");
+	metrics_append("queryperf_sent_bytes_total %llu\n",
+		       ATOMIC_READ(&query_bytes));
+	metrics_family("queryperf_received_bytes", "counter",
+		       "Bytes of response messages received.");
+	metrics_append("# UNIT queryperf_received_bytes bytes\n");
+	metrics_append("queryperf_received_bytes_total %llu\n",
+		       ATOMIC_READ(&response_bytes));
+
+	metrics_family("queryperf_input_stalls", "counter",
+		       "Times the sender waited for input.");
+	metrics_append("queryperf_input_stalls_total %u\n",
+		       ATOMIC_READ(&input_stalls));
+	metrics_family("queryperf_target_qps", "gauge",
+		       "Target query rate, 0 if none.");
+	metrics_append("queryperf_target_qps %u\n", ATOMIC_READ(&target_qps));
+	metrics_family("queryperf_max_queries_outstanding", "gauge",
+		       "Most queries allowed outstanding.");
+	metrics_append("queryperf_max_queries_outstanding %u\n",
+		       ATOMIC_READ(&max_queries_outstanding));
+
+	/*
+	 * The RTT histogram, folded into fixed buckets.  Reads of the
+	 * buckets and the count are not one snapshot, so +Inf is whichever
+	 * is larger to keep the buckets cumulative.
+	 */
+	metrics_family("queryperf_rtt_seconds", "histogram",
+		       "Round trip time of the responses.");
+	metrics_append("# UNIT queryperf_rtt_seconds seconds\n");
+	i = 0;
+	for (b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+		limit = bounds[b] * 1000000.0;
+		while (rttarray != NULL && i < (unsigned int)rttarray_size &&
+		       (double)(i + 1) * rttarray_unit <= limit)
+			cum += ATOMIC_READ(&rttarray[i++]);
+		metrics_append("queryperf_rtt_seconds_bucket{le=\"%g\"} %llu\n",
+			       bounds[b], cum);
+	}
+	counted = ATOMIC_READ(&rtt_counted);
+	if (cum < counted)
+		cum = counted;
+	__atomic_load(&rtt_total, &sum, __ATOMIC_RELAXED);
+	metrics_append("queryperf_rtt_seconds_bucket{le=\"+Inf\"} %llu\n", cum);
+	metrics_append("queryperf_rtt_seconds_count %llu\n", cum);
+	metrics_append("queryperf_rtt_seconds_sum %.6lf\n", sum);
+
+	metrics_append("# EOF\n");
+}
+
+/*
+ * metrics_serve:
+ *   Answer one HTTP request on a metrics connection
+ */
+static void
+metrics_serve(int fd) {
+	char req[1024], head[256];
+	struct timeval tv;
+	const char *p;
+	size_t got = 0, left;
+	ssize_t n;
+	int len, found;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* Only the request line matters; wait for the end of the header */
+	req[0] = '\0';
+	while (got < sizeof(req) - 1 &&
+	       (n = read(fd, req + got, sizeof(req) - 1 - got)) > 0) {
+		got += n;
+		req[got] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL ||
+		    strstr(req, "\n\n") != NULL)
+			break;
+	}
+
+	found = (strncmp(req, "GET /metrics ", 13) == 0 ||
+		 strncmp(req, "GET / ", 6) == 0);
+	if (found) {
+		metrics_render();
+		len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+			       "Content-Type: application/openmetrics-text; "
+			       "version=1.0.0; charset=utf-8\r\n"
+			       "Content-Length: %lu\r\n\r\n",
+			       (unsigned long)metrics.len);
+	} else
+		len = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found"
+			       "\r\nContent-Length: 0\r\n\r\n");
+
+	if (write(fd, head, len) != len || !found)
+		return;
+	for (p = metrics.buf, left = metrics.len; left > 0;
+	     p += n, left -= n) {
+		n = write(fd, p, left);
+		if (n <= 0)
+			break;
+	}
+}
+
+/*
+ * metrics_thread_main:
+ *   Serve metrics requests, one at a time, until told to stop
+ */
+static void *
+metrics_thread_main(void *arg) {
+	struct timeval tv;
+	fd_set fds;
+	int fd;
+
+	(void)arg;
+
+	while (ATOMIC_LOAD(&metrics.stop) == FALSE) {
+		FD_ZERO(&fds);
+		FD_SET(metrics.fd, &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = METRICS_POLL_WAIT;
+		if (select(metrics.fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+		if ((fd = accept(metrics.fd, NULL, NULL)) == -1)
+			continue;
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return (NULL);
+}
+
+/*
+ * metrics_start:
+ *   Start serving metrics, if asked to.  With -N, worker i listens on
+ *   the given port plus i.
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+metrics_start(void) {
+	struct addrinfo hints, *res;
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	const char *colon;
+	unsigned int port_num;
+	int ret, on = 1;
+
+	if (metrics_address == NULL)
+		return (0);
+
+	if ((colon = strrchr(metrics_address, ':')) == NULL) {
+		strcpy(host, DEF_METRICS_ADDRESS);
+		colon = metrics_address - 1;
+	} else if (metrics_address[0] == '[' && colon[-1] == ']' &&
+		   colon - metrics_address - 2 < (int)sizeof(host)) {
+		memcpy(host, metrics_address + 1, colon - metrics_address - 2);
+		host[colon - metrics_address - 2] = '\0';
+	} else if (colon - metrics_address < (int)sizeof(host)) {
+		memcpy(host, metrics_address, colon - metrics_address);
+		host[colon - metrics_address] = '\0';
+	} else
+		goto invalid;
+	if (is_uint((char *)colon + 1, &port_num) == FALSE ||
+	    port_num + (worker_index > 0 ? worker_index : 0) > MAX_PORT)
+		goto invalid;
+	snprintf(port, sizeof(port), "%u",
+		 port_num + (worker_index > 0 ? worker_index : 0));
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "Error resolving metrics address %s: %s\n",
+			metrics_address, gai_strerror(ret));
+		return (-1);
+	}
+
+	metrics.fd = socket(res->ai_family, res->ai_socktype,
+			    res->ai_protocol);
+	if (metrics.fd != -1)
+		setsockopt(metrics.fd, SOL_SOCKET, SO_REUSEADDR, &on,
+			   sizeof(on));
+	if (metrics.fd == -1 ||
+	    bind(metrics.fd, res->ai_addr, res->ai_addrlen) == -1 ||
+	    listen(metrics.fd, 16) == -1) {
+		fprintf(stderr, "Error listening for metrics on %s#%s: %s\n",
+			host, port, strerror(errno));
+		freeaddrinfo(res);
+		goto fail;
+	}
+	freeaddrinfo(res);
+
+	if ((metrics.buf = malloc(METRICS_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Error allocating memory for metrics\n");
+		goto fail;
+	}
+
+	/* A scraper going away must not kill the run */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pthread_create(&metrics.thread, NULL, metrics_thread_main,
+			   NULL) != 0) {
+		fprintf(stderr, "Error: unable to start metrics thread\n");
+		goto fail;
+	}
+
+	return (0);
+
+ invalid:
+	fprintf(stderr, "Invalid metrics address: %s\n", metrics_address);
+	return (-1);
+
+ fail:
+	if (metrics.fd != -1)
+		close(metrics.fd);
+	metrics.fd = -1;
+	return (-1);
+}
+
+/*
+ * metrics_stop:
+ *   Stop serving metrics
+ */
+void
+metrics_stop(void) {
+	if (metrics.fd == -1)
+		return;
+
+	ATOMIC_STORE(&metrics.stop, TRUE);
+	pthread_join(metrics.thread, NULL);
+	close(metrics.fd);
+}
+
+/*
+ * stats_open:
+ *   Create the shared memory object to publish live statistics in, if
+ *   asked to, and move the RTT histogram into it
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+stats_open(void) {
+	unsigned int buckets = (rttarray != NULL) ? rttarray_size : 0;
+	size_t size = STATS_SHM_SIZE(buckets);
+	char *name;
+	void *p;
+	int fd;
+
+	if (stats_name == NULL)
+		return (0);
+
+	if ((name = malloc(strlen(stats_name) + 13)) == NULL) {
+		fprintf(stderr, "Error allocating memory for statistics "
+			"name\n");
+		return (-1);
+	}
+	sprintf(name, "%s%s", stats_name[0] == '/' ? "" : "/", stats_name);
+	if (worker_index >= 0)
+		sprintf(name + strlen(name), ".%d", worker_index);
+	stats_name = name;
+
+	fd = shm_open(stats_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, size) == -1) {
+		fprintf(stderr, "Error creating shared memory %s: %s\n",
+			stats_name, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			shm_unlink(stats_name);
+		}
+		return (-1);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Error mapping shared memory %s: %s\n",
+			stats_name, strerror(errno));
+		shm_unlink(stats_name);
+		return (-1);
+	}
+
+	stats_shm = p;
+	stats_shm->version = STATS_VERSION;
+	stats_shm->rtt_unit = rttarray_unit;
+	stats_shm->rtt_buckets = buckets;
+	stats_shm->pid = getpid();
+	if (buckets > 0) {
+		/* Nothing has been counted yet */
+		free(rttarray);
+		rttarray = (unsigned int *)stats_shm->histogram;
+	}
+	ATOMIC_STORE(&stats_shm->magic, STATS_MAGIC);
+
+	return (0);
+}
+
+/*
+ * stats_publish:
+ *   Copy the counters into shared memory, if it is time to or the run has
+ *   finished
+ */
+void
+stats_publish(int finished) {
+	struct stats_counters c;
+	struct timeval now;
+	unsigned int i, seq;
+	double t;
+
+	if (stats_shm == NULL)
+		return;
+
+	set_timenow(&now);
+	t = (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+	if (finished == FALSE && t < stats_next_publish)
+		return;
+	stats_next_publish = t + STATS_PUBLISH_INTERVAL;
+
+	memset(&c, 0, sizeof(c));
+	c.first_query = setup_phase ? 0.0 : time_of_first_query_sec;
+	c.updated = t;
+	c.sent = num_queries_sent;
+	c.outstanding = num_queries_outstanding;
+	c.timed_out = num_queries_timed_out;
+	c.possibly_delayed = num_queries_possiblydelayed;
+	c.responses = rtt_counted;
+	c.rtt_overflows = rtt_overflows;
+	c.input_stalls = input_stalls;
+	c.rtt_total = rtt_total;
+	c.rtt_min = rtt_min;
+	c.rtt_max = rtt_max;
+	c.input_stall_time = input_stall_time;
+	c.target_qps = target_qps;
+	c.max_outstanding = max_queries_outstanding;
+	c.finished = finished;
+	for (i = 0; i < 16; i++)
+		c.rcodes[i] = rcodecounts[i];
+
+	/* Sequence lock: odd while the counters are being changed */
+	seq = stats_shm->seq;
+	__atomic_store_n(&stats_shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&stats_shm->counters, &c, sizeof(c));
+	ATOMIC_STORE(&stats_shm->seq, seq + 2);
+}
+
+/*
+ * stats_close:
+ *   Publish the final counters and remove the shared memory object.  It
+ *   stays mapped, since the histogram is still used for the report.
+ */
+void
+stats_close(void) {
+	if (stats_shm == NULL)
+		return;
+
+	stats_publish(TRUE);
+	shm_unlink(stats_name);
+}
+
+/*
+ * select_server:
+ *   Pick the server for a query with the given wire-format question,
+ *   according to server_policy, and make it current
+ */
+static void
+select_server(const unsigned char *question, int qlen) {
+	unsigned int i, best = 0, point;
+
+	if (num_servers <= 1)
+		return;
+
+	switch (server_policy) {
+	case POLICY_ROUND_ROBIN:
+		/* Smooth weighted round-robin, as in nginx */
+		for (i = 0; i < num_servers; i++) {
+			servers[i].current_weight += servers[i].weight;
+			if (servers[i].current_weight >
+			    servers[best].current_weight)
+				best = i;
+		}
+		servers[best].current_weight -= total_server_weight;
+		break;
+	case POLICY_WEIGHTED:
+	case POLICY_HASH:
+		if (server_policy == POLICY_WEIGHTED)
+			point = random_below(&random_state,
+					     total_server_weight);
+		else
+			/* The name only, so all its types go together */
+			point = name_hash(question, qlen - 4) %
+				total_server_weight;
+		for (best = 0; point >= servers[best].weight; best++)
+			point -= servers[best].weight;
+		break;
+	}
+
+	current_server = best;
+	server_ai = servers[best].ai;
+	query_socket = servers[best].sock;
+}
+
+/*
+ * dispatch_query:
+ *   Send the query packet for the entry 
+ *
+ *   Set *pktp and *pktlenp to the packet sent, and *qlenp to the length of
+ *   its question section, which starts right after the header.
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+int
+dispatch_query(unsigned short int id, char *dom, int qt, u_char **pktp,
+	       int *pktlenp, int *qlenp)
+{
+	static u_char packet_buffer[MAX_QUERY_LEN];
+	unsigned long long t = 0;
+	int buffer_len;
+	int bytes_sent;
+
+	PROFILE_BEGIN(t);
+	buffer_len = build_query(id, dom, qt, packet_buffer, qlenp);
+	PROFILE_END(PHASE_ENCODE, t);
+	if (buffer_len == -1) {
+		fprintf(stderr, "Failed to create query packet: %s %d\n",
+		        dom, qt);
+		return (-1);
+	}
+
+	select_server(packet_buffer + DNS_HEADERLEN, *qlenp);
+	if (query_edns->cookie && num_servers > 1) {
+		/* The server cookie must be that of the server chosen */
+		buffer_len = append_opt(query_edns, packet_buffer,
+					packet_buffer + DNS_HEADERLEN +
+					*qlenp) - packet_buffer;
+	}
+	PROFILE_BEGIN(t);
+	buffer_len = sign_query(packet_buffer, buffer_len);
+	PROFILE_ADD(PHASE_ENCODE, t);
+	if (buffer_len == -1)
+		return (-1);
+
+	PROFILE_BEGIN(t);
+	bytes_sent = sendto(query_socket, packet_buffer, buffer_len, 0,
+			    server_ai->ai_addr, server_ai->ai_addrlen);
+	PROFILE_END(PHASE_SEND, t);
+	if (bytes_sent == -1) {
+		fprintf(stderr, "Failed to send query packet: %s %d\n",
+		        dom, qt);
+		return (-1);
+	}
+
+	if (bytes_sent != buffer_len)
+		fprintf(stderr, "Warning: incomplete packet sent: %s %d\n",
+		        dom, qt);
+
+	ATOMIC_BUMP(&query_bytes, bytes_sent);
+	query_bytes_interval += bytes_sent;
+	trace_packet(FALSE, packet_buffer, bytes_sent, server_ai->ai_addr);
+
+	*pktp = packet_buffer;
+	*pktlenp = buffer_len;
+
+	return (0);
+}
+
+/*
+ * server_address_text:
+ *   Return the numeric address of the server, for messages
+ */
+static const char *
+server_address_text(void) {
+	static char serveraddr[NI_MAXHOST];
+
+	if (getnameinfo(server_ai->ai_addr, server_ai->ai_addrlen,
+			serveraddr, sizeof(serveraddr), NULL, 0,
+			NI_NUMERICHOST) != 0)
+		return (NULL);
+
+	return (serveraddr);
+}
+
+/*
+ * register_query:
+ *   Record a query that has just been sent in status[], starting the
+ *   clock if it was the first one.  pkt is the message sent, whose
+ *   question section is qlen bytes long, and query_desc describes it.
+ */
+static void
+register_query(unsigned short int id, const unsigned char *pkt, int qlen,
+	       int query_type, const char *query_desc)
+{
+	const char *serveraddr;
+	unsigned int count;
+
+	if (setup_phase == TRUE) {
+		set_timenow(&time_of_first_query);
+		time_of_first_query_sec = (double)time_of_first_query.tv_sec +
+			((double)time_of_first_query.tv_usec / 1000000.0);
+		rate_base_sec = time_of_first_query_sec;
+		rate_base_sent = 0;
+		setup_phase = FALSE;
+		if ((serveraddr = server_address_text()) == NULL) {
+			fprintf(stderr, "Error printing server address\n");
+			return;
+		}
+		if (worker_index <= 0)
+			printf("[Status] Sending queries (beginning with "
+			       "%s)\n", serveraddr);
+	}
+
+	/* Take a free slot in status[] */
+	if (num_free_slots == 0) {
+		fprintf(stderr, "Unexpected error: We have run out of "
+			"status[] space!\n");
+		return;
+	}
+	count = free_slots[num_free_slots - 1];
+
+	if (qlen <= 0 || qlen > MAX_QUESTION_LEN) {
+		fprintf(stderr, "Unexpected error: "
+			"query message doesn't have qname?\n");
+		return;
+	}
+
+	/* Register the query in status[] */
+	num_free_slots--;
+	id_slots[id] = count;
+	QS(count, id) = id;
+	if (query_descs != NULL) {
+		strncpy(QUERY_DESC(count), query_desc, MAX_INPUT_LEN);
+		QUERY_DESC(count)[MAX_INPUT_LEN] = '\0';
+	}
+	set_timenow(&QS(count, sent_timestamp));
+	QS(count, qtype) = query_type;
+	memcpy(QUERY_QUESTION(count), pkt + DNS_HEADERLEN, qlen);
+	QS(count, qlen) = qlen;
+	QS(count, qhash) = question_hash(pkt + DNS_HEADERLEN, qlen);
+	QS(count, in_use) = TRUE;
+	QS(count, server) = current_server;
+	servers[current_server].sent++;
+	opcodes[(pkt[2] >> 3) & 0xF].sent++;
+
+	if (num_queries_sent_interval == 0)
+		set_timenow(&time_of_first_query_interval);
+
+	ATOMIC_BUMP(&num_queries_sent, 1);
+	num_queries_sent_interval++;
+	ATOMIC_BUMP(&num_queries_outstanding, 1);
+}
+
+/*
+ * send_query:
+ *   Send a query based on a line of input
+ */
+void
+send_query(char *query_desc) {
+	static int qname_len = MAX_DOMAIN_LEN;
+	static char domain[MAX_DOMAIN_LEN + 1];
+	static char expanded[MAX_INPUT_LEN + 1];
+	u_char *qpkt;
+	const char *addrstr;
+	unsigned long long t = 0;
+	int query_type, qpkt_len, qlen, ret;
+
+	use_query_id++;
+
+	PROFILE_BEGIN(t);
+	if (strchr(query_desc, '{') != NULL) {
+		if (expand_template(query_desc, expanded) == -1) {
+			PROFILE_ADD(PHASE_INPUT, t);
+			return;
+		}
+		query_desc = expanded;
+	}
+
+	if (is_write_line(query_desc)) {
+		PROFILE_ADD(PHASE_INPUT, t);
+		send_write(use_query_id, query_desc);
+		return;
+	}
+
+	ret = parse_query(query_desc, domain, qname_len, &query_type);
+	if (ret != -1 && (query_edns = line_edns(query_desc)) == NULL) {
+		/* Reported when first seen */
+		query_edns = &run_edns;
+		PROFILE_ADD(PHASE_INPUT, t);
+		return;
+	}
+	PROFILE_ADD(PHASE_INPUT, t);
+	if (ret == -1) {
+		fprintf(stderr, "Error parsing query: %s\n", query_desc);
+		return;
+	}
+
+	if (dispatch_query(use_query_id, domain, query_type,
+			   &qpkt, &qpkt_len, &qlen) == -1) {
+		if ((addrstr = server_address_text()) == NULL)
+			addrstr = "???"; /* XXX: this should not happen */
+		fprintf(stderr, "Error sending query to %s: %s\n",
+			addrstr, query_desc);
+		return;
+	}
+
+	PROFILE_BEGIN(t);
+	register_query(use_query_id, qpkt, qlen, query_type, query_desc);
+	PROFILE_ADD(PHASE_SEND, t);
+}
+
+/*
+ * send_packet:
+ *   Send a query message that is ready to go to the current server, and
+ *   trace it
+ *
+ *   Return -1 on failure
+ *   Return a non-negative integer otherwise
+ */
+static int
+send_packet(const unsigned char *pkt, int len) {
+	const char *addrstr;
+	unsigned long long t = 0;
+	int bytes_sent;
+
+	PROFILE_BEGIN(t);
+	bytes_sent = sendto(query_socket, pkt, len, 0,
+			    server_ai->ai_addr, server_ai->ai_addrlen);
+	PROFILE_END(PHASE_SEND, t);
+	if (bytes_sent == -1) {
+		if ((addrstr = server_address_text()) == NULL)
+			addrstr = "???";
+		fprintf(stderr, "Error sending query to %s\n", addrstr);
+		return (-1);
+	}
+	if (bytes_sent != len)
+		fprintf(stderr, "Warning: incomplete packet sent\n");
+
+	ATOMIC_BUMP(&query_bytes, bytes_sent);
+	query_bytes_interval += bytes_sent;
+	trace_packet(FALSE, pkt, bytes_sent, server_ai->ai_addr);
+
+	return (0);
+}
+
+/*
+ * describe_question:
+ *   Put the name and type of a wire-format question into desc, for
+ *   verbose output
+ */
+static void
+describe_question(const unsigned char *question, int qtype, char *desc) {
+	char qname[MAX_DOMAIN_LEN + 1], tbuf[16];
+
+	if (query_descs == NULL) {
+		desc[0] = '\0';
+		return;
+	}
+
+	question_to_text(question, qname, sizeof(qname));
+	snprintf(desc, MAX_INPUT_LEN + 1, "%s %s", qname,
+		 qtype_to_text(qtype, tbuf, sizeof(tbuf)));
+}
+
+/*
+ * send_captured_query:
+ *   Send a query taken from a packet capture as it was captured, apart
+ *   from a new message id
+ */
+void
+send_captured_query(struct captured_query *cq) {
+	char desc[MAX_INPUT_LEN + 1];
+	unsigned long long t = 0;
+	int qlen, query_type;
+
+	use_query_id++;
+	cq->valid = FALSE;
+
+	PROFILE_BEGIN(t);
+	cq->msg[0] = use_query_id >> 8;
+	cq->msg[1] = use_query_id & 0xff;
+	qlen = question_length(cq->msg + DNS_HEADERLEN, cq->msg + cq->len);
+	query_type = get_uint16(cq->msg + DNS_HEADERLEN + qlen - 4);
+	describe_question(cq->msg + DNS_HEADERLEN, query_type, desc);
+	PROFILE_END(PHASE_ENCODE, t);
+
+	select_server(cq->msg + DNS_HEADERLEN, qlen);
+	if (send_packet(cq->msg, cq->len) == -1)
+		return;
+
+	PROFILE_BEGIN(t);
+	register_query(use_query_id, cq->msg, qlen, query_type, desc);
+	PROFILE_ADD(PHASE_SEND, t);
+}
+
+/*
+ * send_corpus_query:
+ *   Send a query read from a binary corpus
+ */
+void
+send_corpus_query(struct corpus_query *cq) {
+	static unsigned char packet_buffer[MAX_QUERY_LEN];
+	char desc[MAX_INPUT_LEN + 1];
+	unsigned long long t = 0;
+	int len, qlen = cq->namelen + 4;
+
+	use_query_id++;
+
+	/* First, so that the OPT record is built for the server chosen */
+	select_server(cq->question, qlen);
+
+	PROFILE_BEGIN(t);
+	len = build_query_question(use_query_id, cq->question, qlen,
+				   packet_buffer);
+	len = sign_query(packet_buffer, len);
+	describe_question(cq->question, cq->qtype, desc);
+	PROFILE_END(PHASE_ENCODE, t);
+
+	if (len == -1 || send_packet(packet_buffer, len) == -1)
+		return;
+
+	PROFILE_BEGIN(t);
+	register_query(use_query_id, packet_buffer, qlen, cq->qtype, desc);
+	PROFILE_ADD(PHASE_SEND, t);
+}
+
+/*
+ * send_write:
+ *   Send the UPDATE or NOTIFY message of a line of input, with the given
+ *   message id
+ */
+static void
+send_write(unsigned short int id, const char *desc) {
+	static unsigned char packet_buffer[MAX_QUERY_LEN];
+	unsigned long long t = 0;
+	int len, qlen;
+
+	PROFILE_BEGIN(t);
+	len = build_write(id, desc, packet_buffer, &qlen);
+	if (len != -1) {
+		select_server(packet_buffer + DNS_HEADERLEN, qlen);
+		len = append_opt(&run_edns, packet_buffer,
+				 packet_buffer + len) - packet_buffer;
+		len = sign_query(packet_buffer, len);
+	}
+	PROFILE_END(PHASE_ENCODE, t);
+
+	if (len == -1 || send_packet(packet_buffer, len) == -1)
+		return;
+
+	PROFILE_BEGIN(t);
+	register_query(id, packet_buffer, qlen, T_SOA, desc);
+	PROFILE_ADD(PHASE_SEND, t);
+}
+
+/*
+ * send_due_writes:
+ *   Send the messages read with -F that are due by now at write_rate,
+ *   from the first query on, as far as the window allows
+ *
+ *   Return how long until the next one is due, in seconds
+ */
+static double
+send_due_writes(void) {
+	struct timeval now;
+	double due, t;
+
+	if (setup_phase == TRUE)
+		return (RESPONSE_BLOCKING_WAIT_TIME);
+
+	set_timenow(&now);
+	t = (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+	for (;;) {
+		due = time_of_first_query_sec +
+			(double)num_writes_sent / write_rate;
+		if (due > t)
+			return (due - t);
+		/* A response frees a slot soon enough */
+		if (queries_outstanding() >= max_queries_outstanding)
+			return (RESPONSE_BLOCKING_WAIT_TIME);
+		send_query(write_list->text + write_list->lines[write_next]);
+		num_writes_sent++;
+		write_next = (write_next + num_workers) % write_list->count;
+	}
+}
+
+void
+register_rtt(struct timeval *timestamp, const unsigned char *question,
+	     int qtype, unsigned int rcode, unsigned int server,
+	     unsigned int size)
+{
+	static const unsigned int bounds[] = SIZE_CLASS_BOUNDS;
+	int i;
+	int oldquery = FALSE;
+	struct timeval now;
+	double rtt, total;
+	struct server_info *srv = NULL;
+	struct size_class *sc;
+	struct identity_info *id;
+	struct opcode_info *op = &opcodes[response_opcode];
+
+	set_timenow(&now);
+	rtt = difftv(now, *timestamp);
+
+	if (num_servers > 1 && server < num_servers) {
+		srv = &servers[server];
+		srv->rtt_counted++;
+		srv->rtt_total += rtt;
+		if (srv->rtt_max < rtt)
+			srv->rtt_max = rtt;
+	}
+
+	if (difftv(*timestamp, time_of_first_query_interval) < 0)
+		oldquery = TRUE;
+
+	if (rtt_max < 0 || rtt_max < rtt)
+		rtt_max = rtt;
+
+	if (rtt_min < 0 || rtt_min > rtt)
+		rtt_min = rtt;
+
+	total = rtt_total + rtt;
+	__atomic_store(&rtt_total, &total, __ATOMIC_RELAXED);
+	ATOMIC_BUMP(&rtt_counted, 1);
+
+	for (i = 0; i < NUM_SIZE_CLASSES - 1 && size > bounds[i]; i++)
+		;
+	sc = &size_classes[i];
+	if (sc->counted == 0 || sc->rtt_min > rtt)
+		sc->rtt_min = rtt;
+	if (sc->rtt_max < rtt)
+		sc->rtt_max = rtt;
+	sc->rtt_total += rtt;
+	sc->counted++;
+
+	if ((id = response_identity) != NULL) {
+		if (id->stats.responses == 0 || id->stats.rtt_min > rtt)
+			id->stats.rtt_min = rtt;
+		if (id->stats.rtt_max < rtt)
+			id->stats.rtt_max = rtt;
+		id->stats.rtt_total += rtt;
+		id->stats.responses++;
+		id->stats.rcodes[rcode & 0xF]++;
+	}
+
+	if (op->stats.responses == 0 || op->stats.rtt_min > rtt)
+		op->stats.rtt_min = rtt;
+	if (op->stats.rtt_max < rtt)
+		op->stats.rtt_max = rtt;
+	op->stats.rtt_total += rtt;
+	op->stats.responses++;
+	op->stats.rcodes[rcode & 0xF]++;
+
+	if (!oldquery) {
+		if (rtt_max_interval < 0 || rtt_max_interval < rtt)
+			rtt_max_interval = rtt;
+
+		if (rtt_min_interval < 0 || rtt_min_interval > rtt)
+			rtt_min_interval = rtt;
+
+		rtt_total_interval += rtt;
+		rtt_counted_interval++;
+	}
+
+	if (rttarray == NULL)
+		return;
+
+	i = (int)(rtt * (1000000.0 / rttarray_unit));
+	if (i < rttarray_size) {
+		ATOMIC_BUMP(&rttarray[i], 1);
+		if (!oldquery)
+			rttarray_interval[i]++;
+		if (srv != NULL && srv->rttarray != NULL)
+			srv->rttarray[i]++;
+		if (id != NULL && id->rttarray != NULL)
+			id->rttarray[i]++;
+		if (op->rttarray != NULL)
+			op->rttarray[i]++;
+	} else {
+		char qname[MAX_DOMAIN_LEN + 1];
+
+		question_to_text(question, qname, sizeof(qname));
+		fprintf(stderr, "Warning: RTT is out of range: %.6lf "
+			"[query=%s/%d, rcode=%u]\n", rtt, qname, qtype, rcode);
+		rtt_overflows++;
+		if (!oldquery)
+			rtt_overflows_interval++;
+	}
+}
+
+/*
+ * register_response:
+ *   Register receipt of a query
+ *
+ *   Removes (sets in_use = FALSE) the record for the given query id in
+ *   status[] if any exists.  The response is matched by comparing its
+ *   wire-format question (qlen bytes at question) with the one we sent.
+ *   A late response, to a query already retired, is matched on the
+ *   length, qtype and 32-bit hash of the question only, since the
+ *   question itself is not kept once its slot is reused.
+ */
+void
+register_response(unsigned short int id, unsigned int rcode,
+	const unsigned char *question, unsigned int qlen, unsigned int size)
+{
+	unsigned int ct;
+	int found = FALSE;
+	int qtype = get_uint16((unsigned char *)question + qlen - 4);
+	unsigned int qhash = question_hash(question, qlen);
+
+	if (timeout_queries != NULL) {
+		struct query_mininfo *qi = &timeout_queries[id];
+
+		if (qi->qlen == qlen && qi->qhash == qhash &&
+		    qi->qtype == qtype) {
+			register_rtt(&qi->sent_timestamp, question, qtype,
+				     rcode, qi->server, size);
+			if (response_identity != NULL)
+				response_identity->stats.late++;
+			opcodes[response_opcode].stats.late++;
+			qi->qlen = 0;
+			found = TRUE;
+		}
+	}
+
+	ct = id_slots[id];
+	if (found == FALSE && ct < query_status_allocated &&
+	    QS(ct, in_use) == TRUE && QS(ct, id) == id &&
+	    QS(ct, qlen) == qlen && QS(ct, qhash) == qhash &&
+	    question_equal(QUERY_QUESTION(ct), question, qlen)) {
+		QS(ct, in_use) = FALSE;
+		free_slots[num_free_slots++] = ct;
+		ATOMIC_BUMP(&num_queries_outstanding, -1);
+		found = TRUE;
+
+		register_rtt(&QS(ct, sent_timestamp), question, qtype, rcode,
+			     QS(ct, server), size);
+
+		if (query_descs != NULL)
+			printf("> %s %s\n", rcode_strings[rcode],
+			       QUERY_DESC(ct));
+	}
+
+	if ((countrcodes || metrics.fd != -1 || stats_shm != NULL) &&
+	    (found == TRUE || target_qps > 0))
+		ATOMIC_BUMP(&rcodecounts[rcode], 1);
+
+	if (found == FALSE) {
+		if (target_qps > 0) {
+			ATOMIC_BUMP(&num_queries_possiblydelayed, 1);
+			num_queries_possiblydelayed_interval++;
+		} else {
+			fprintf(stderr,
+				"Warning: Received a response with an "
+				"unexpected (maybe timed out) id: %u\n", id);
+		}
+	}
+}
+
+/*
+ * response_record:
+ *   Find the first record of the given type in a section (1 for the
+ *   answer, 3 for the additional section) of a response of len bytes, and
+ *   set *rdlenp to the length of its data
+ *
+ *   Return -1 if there is none or the response is malformed
+ *   Return the offset of its data otherwise
+ */
+static int
+response_record(const unsigned char *msg, int len, unsigned int want,
+		unsigned int type, unsigned int *rdlenp)
+{
+	unsigned int count, section, i, rdlen;
+	int off, qlen;
+
+	if (len < DNS_HEADERLEN ||
+	    get_uint16((unsigned char *)msg + 4 + 2 * want) == 0 ||
+	    get_uint16((unsigned char *)msg + 4) != 1 ||
+	    (qlen = question_length(msg + DNS_HEADERLEN, msg + len)) == -1)
+		return (-1);
+	off = DNS_HEADERLEN + qlen;
+
+	for (section = 1; section <= want; section++) {
+		count = get_uint16((unsigned char *)msg + 4 + 2 * section);
+		for (i = 0; i < count; i++) {
+			off = name_end(msg, len, off, NULL);
+			if (off == -1 || len - off < 10)
+				return (-1);
+			rdlen = get_uint16((unsigned char *)msg + off + 8);
+			if ((unsigned int)(len - off - 10) < rdlen)
+				return (-1);
+			if (section == want &&
+			    get_uint16((unsigned char *)msg + off) == type) {
+				*rdlenp = rdlen;
+				return (off + 10);
+			}
+			off += 10 + rdlen;
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * response_option:
+ *   Find an EDNS option by its code in the data of an OPT record, rdlen
+ *   bytes at off, and set *lenp to its length
+ *
+ *   Return -1 if there is none or the record is malformed
+ *   Return the offset of the option's data otherwise
+ */
+static int
+response_option(const unsigned char *msg, int off, unsigned int rdlen,
+		unsigned int code, unsigned int *lenp)
+{
+	int end = off + rdlen;
+	unsigned int optlen;
+
+	for (; off + 4 <= end; off += 4 + optlen) {
+		optlen = get_uint16((unsigned char *)msg + off + 2);
+		if (off + 4 + (int)optlen > end)
+			return (-1);
+		if (get_uint16((unsigned char *)msg + off) == code) {
+			*lenp = optlen;
+			return (off + 4);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * server_of_address:
+ *   Find the server a response came from
+ *
+ *   Return -1 if it is none of them
+ *   Return its index in servers[] otherwise
+ */
+static int
+server_of_address(const struct sockaddr *sa) {
+	const struct sockaddr *s;
+	unsigned int i;
+
+	if (num_servers <= 1)
+		return (0);
+
+	for (i = 0; i < num_servers; i++) {
+		s = servers[i].ai->ai_addr;
+		if (s->sa_family != sa->sa_family)
+			continue;
+		if (sa->sa_family == AF_INET &&
+		    ((const struct sockaddr_in *)s)->sin_port ==
+		    ((const struct sockaddr_in *)sa)->sin_port &&
+		    memcmp(&((const struct sockaddr_in *)s)->sin_addr,
+			   &((const struct sockaddr_in *)sa)->sin_addr,
+			   sizeof(struct in_addr)) == 0)
+			return (i);
+		if (sa->sa_family == AF_INET6 &&
+		    ((const struct sockaddr_in6 *)s)->sin6_port ==
+		    ((const struct sockaddr_in6 *)sa)->sin6_port &&
+		    memcmp(&((const struct sockaddr_in6 *)s)->sin6_addr,
+			   &((const struct sockaddr_in6 *)sa)->sin6_addr,
+			   sizeof(struct in6_addr)) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * learn_server_cookie:
+ *   Keep the server cookie of a response that echoes our client cookie,
+ *   to send in the following queries to the server it came from
+ */
+static void
+learn_server_cookie(const unsigned char *msg, int len,
+		    const struct sockaddr *from)
+{
+	struct server_info *srv;
+	unsigned int rdlen, optlen;
+	int off, server;
+
+	if ((off = response_record(msg, len, 3, T_OPT, &rdlen)) == -1 ||
+	    (off = response_option(msg, off, rdlen, EDNS_OPT_COOKIE,
+				   &optlen)) == -1 ||
+	    optlen <= CLIENT_COOKIE_LEN ||
+	    optlen > CLIENT_COOKIE_LEN + MAX_SERVER_COOKIE_LEN ||
+	    memcmp(msg + off, client_cookie, CLIENT_COOKIE_LEN) != 0 ||
+	    (server = server_of_address(from)) == -1) {
+		cookie_missing++;
+		return;
+	}
+
+	srv = &servers[server];
+	srv->cookie_len = optlen - CLIENT_COOKIE_LEN;
+	memcpy(srv->cookie, msg + off + CLIENT_COOKIE_LEN, srv->cookie_len);
+	cookie_responses++;
+}
+
+/*
+ * intern_identity:
+ *   Find the entry of identities[] for an instance identity of len bytes
+ *   (only the first MAX_IDENTITY_LEN count), adding it if it is new
+ *
+ *   Return the entry
+ */
+static struct identity_info *
+intern_identity(const unsigned char *name, unsigned int len) {
+	struct identity_info *id;
+	unsigned int h = 2166136261U, i, slot;
+
+	if (len > MAX_IDENTITY_LEN)
+		len = MAX_IDENTITY_LEN;
+	for (i = 0; i < len; i++)
+		h = (h ^ name[i]) * 16777619U;
+
+	for (slot = h & (IDENTITY_SLOTS - 1); identity_slots[slot] != 0;
+	     slot = (slot + 1) & (IDENTITY_SLOTS - 1)) {
+		id = &identities[identity_slots[slot] - 1];
+		if (id->hash == h && id->len == len &&
+		    memcmp(id->name, name, len) == 0)
+			return (id);
+	}
+
+	if (num_identities == MAX_IDENTITIES - 1)
+		return (&identities[MAX_IDENTITIES - 1]);
+
+	id = &identities[num_identities++];
+	memcpy(id->name, name, len);
+	id->len = len;
+	id->hash = h;
+	identity_slots[slot] = num_identities;
+
+	return (id);
+}
+
+/*
+ * find_identity:
+ *   Find the identity of the instance that sent a response: its NSID,
+ *   or the text of the first string of the first TXT answer
+ *
+ *   Return the entry of identities[] for it (identities[0] if none)
+ */
+static struct identity_info *
+find_identity(const unsigned char *msg, int len) {
+	unsigned int rdlen, idlen;
+	int off;
+
+	if (identity_source == IDENTITY_NSID) {
+		if ((off = response_record(msg, len, 3, T_OPT, &rdlen)) == -1 ||
+		    (off = response_option(msg, off, rdlen, EDNS_OPT_NSID,
+					   &idlen)) == -1 || idlen == 0)
+			return (&identities[0]);
+	} else {
+		if ((off = response_record(msg, len, 1, T_TXT, &rdlen)) == -1 ||
+		    rdlen == 0 || (idlen = msg[off++]) == 0 || idlen >= rdlen)
+			return (&identities[0]);
+	}
+
+	return (intern_identity(msg + off, idlen));
+}
+
+/*
+ * process_single_response:
+ *   Receive from the given socket & process an invididual response packet.
+ *   Remove it from the list of open queries (status[]) and decrement the
+ *   number of outstanding queries if it matches an open query.
+ */
+void
+process_single_response(int sockfd) {
+	struct sockaddr_storage from_addr_ss;
+	struct sockaddr *from_addr;
+	static unsigned char in_buf[MAX_BUFFER_LEN];
+	unsigned long long t = 0;
+ 	int numbytes, addr_len, resp_id, qlen;
+ 	int flags;
+
+	memset(&from_addr_ss, 0, sizeof(from_addr_ss));
+	from_addr = (struct sockaddr *)&from_addr_ss;
+	addr_len = sizeof(from_addr_ss);
+
+	PROFILE_BEGIN(t);
+	numbytes = recvfrom(sockfd, in_buf, MAX_BUFFER_LEN, 0, from_addr,
+			    &addr_len);
+	PROFILE_END(PHASE_RECEIVE, t);
+	if (numbytes == -1) {
+		fprintf(stderr, "Error receiving datagram\n");
+		return;
+	}
+	validate_packet(in_buf, numbytes);
+	ATOMIC_BUMP(&response_bytes, numbytes);
+	response_bytes_interval += numbytes;
+	response_datagrams_interval++;
+	response_sizes[numbytes]++;
+
+	if (numbytes < DNS_HEADERLEN) {
+		if (verbose)
+			fprintf(stderr, "Malformed response\n");
+		return;
+	}
+	trace_packet(TRUE, in_buf, numbytes, from_addr);
+	if (edns_cookies)
+		learn_server_cookie(in_buf, numbytes, from_addr);
+	if (identity_source != IDENTITY_NONE)
+		response_identity = find_identity(in_buf, numbytes);
+	resp_id = get_uint16(in_buf);
+	flags = get_uint16(in_buf + 2);
+	response_opcode = (flags >> 11) & 0xF;
+	qlen = question_length(in_buf + DNS_HEADERLEN, in_buf + numbytes);
+	if (qlen == -1) {
+		if (verbose)
+			fprintf(stderr,
+				"Failed to retrieve question from response\n");
+		return;
+	}
+
+	PROFILE_BEGIN(t);
+	register_response(resp_id, flags & 0xF, in_buf + DNS_HEADERLEN, qlen,
+			  numbytes);
+	PROFILE_END(PHASE_MATCH, t);
+}
+
+/*
+ * next_send_time:
+ *   When the next query is due to keep to the target rate
+ */
+static double
+next_send_time(void) {
+	return (rate_base_sec + query_interval *
+		(num_queries_sent - num_writes_sent - rate_base_sent));
+}
+
+/*
+ * control_open:
+ *   Start listening on the control socket, if one was asked for
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+control_open(void) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+		control_clients[i].fd = -1;
+
+	if (control_path == NULL)
+		return (0);
+
+	if (strlen(control_path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Control socket path too long: %s\n",
+			control_path);
+		return (-1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, control_path);
+
+	/* Replace a socket left behind by an earlier run */
+	if (stat(control_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		(void)unlink(control_path);
+
+	if ((control_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(control_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(control_fd, MAX_CONTROL_CLIENTS) == -1 ||
+	    fcntl(control_fd, F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stderr, "Error opening control socket %s: %s\n",
+			control_path, strerror(errno));
+		if (control_fd != -1)
+			close(control_fd);
+		control_fd = -1;
+		return (-1);
+	}
+
+	/* A client going away must not kill the run */
+	signal(SIGPIPE, SIG_IGN);
+
+	return (0);
+}
+
+/*
+ * control_close:
+ *   Close the control socket and its connections, and remove it
+ */
+void
+control_close(void) {
+	int i;
+
+	if (control_fd == -1)
+		return;
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		if (control_clients[i].fd != -1)
+			close(control_clients[i].fd);
+		control_clients[i].fd = -1;
+	}
+	close(control_fd);
+	control_fd = -1;
+	(void)unlink(control_path);
+}
+
+/*
+ * control_set_fds:
+ *   Add the control socket and its connections to a select() set
+ */
+static void
+control_set_fds(fd_set *fds, int *maxfd) {
+	int i, fd;
+
+	FD_SET(control_fd, fds);
+	if (*maxfd < control_fd)
+		*maxfd = control_fd;
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		fd = control_clients[i].fd;
+		if (fd == -1)
+			continue;
+		FD_SET(fd, fds);
+		if (*maxfd < fd)
+			*maxfd = fd;
+	}
+}
+
+/*
+ * control_reply:
+ *   Send a line of output to a control client.  Output the client is too
+ *   slow to take is dropped rather than holding up the run.
+ */
+static void
+control_reply(struct control_client *cc, const char *fmt, ...) {
+	char buf[CONTROL_LINE_LEN];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+
+	(void)write(cc->fd, buf, len);
+}
+
+/*
+ * control_stats:
+ *   Report the statistics so far to a control client
+ */
+static void
+control_stats(struct control_client *cc) {
+	struct timeval now;
+	double run_time = 0.0;
+
+	if (setup_phase == FALSE) {
+		set_timenow(&now);
+		run_time = difftv(now, time_of_first_query);
+	}
+
+	control_reply(cc, "run-time %.6lf", run_time);
+	control_reply(cc, "queries-sent %u", num_queries_sent);
+	control_reply(cc, "queries-outstanding %u", queries_outstanding());
+	control_reply(cc, "queries-lost %u", num_queries_timed_out);
+	control_reply(cc, "queries-delayed %u", num_queries_possiblydelayed);
+	control_reply(cc, "responses %u", rtt_counted);
+	control_reply(cc, "responses-per-second %.6lf", run_time > 0.0 ?
+		      (double)rtt_counted / run_time : 0.0);
+	control_reply(cc, "rtt-min %.6lf", rtt_min < 0 ? 0.0 : rtt_min);
+	control_reply(cc, "rtt-average %.6lf", rtt_counted > 0 ?
+		      rtt_total / rtt_counted : 0.0);
+	control_reply(cc, "rtt-max %.6lf", rtt_max < 0 ? 0.0 : rtt_max);
+	control_reply(cc, "target-qps %u", target_qps);
+	control_reply(cc, "window %u", max_queries_outstanding);
+	control_reply(cc, "timeout %u", query_timeout);
+	control_reply(cc, "server %s", server_to_query);
+}
+
+/*
+ * control_command:
+ *   Carry out one command line from a control client
+ *
+ *   Return -1 if the client asked to close the connection
+ *   Return non-negative integer otherwise
+ */
+static int
+control_command(struct control_client *cc, char *line) {
+	char *command, *arg, *last;
+	unsigned int uint_val;
+	struct timeval now;
+
+	if ((command = strtok_r(line, WHITESPACE, &last)) == NULL)
+		return (0);
+	arg = strtok_r(NULL, WHITESPACE, &last);
+
+	if (strcmp(command, "quit") == 0)
+		return (-1);
+
+	if (strcmp(command, "help") == 0) {
+		control_reply(cc, "qps N       set the target rate (0 = none)");
+		control_reply(cc, "window N    set the maximum queries "
+			      "outstanding");
+		control_reply(cc, "timeout N   set the query timeout in "
+			      "seconds");
+		control_reply(cc, "server LIST set the servers to query, "
+			      "as for -s");
+		control_reply(cc, "stats       report the statistics so far");
+		control_reply(cc, "quit        close this connection");
+	} else if (strcmp(command, "stats") == 0) {
+		control_stats(cc);
+	} else if (strcmp(command, "qps") == 0) {
+		if (arg == NULL || is_uint(arg, &uint_val) == FALSE) {
+			control_reply(cc, "error: qps needs a number");
+			return (0);
+		}
+		ATOMIC_SET(&target_qps, uint_val);
+		set_query_interval(target_qps);
+		/* Keep to the new rate from now on, without catching up */
+		set_timenow(&now);
+		rate_base_sec = (double)now.tv_sec +
+			(double)now.tv_usec / 1000000.0;
+		rate_base_sent = num_queries_sent - num_writes_sent;
+	} else if (strcmp(command, "window") == 0) {
+		if (arg == NULL || is_uint(arg, &uint_val) == FALSE ||
+		    uint_val == 0) {
+			control_reply(cc, "error: window needs a positive "
+				      "number");
+			return (0);
+		}
+		if (set_max_queries(uint_val) == -1) {
+			control_reply(cc, "error: cannot resize the window");
+			return (0);
+		}
+	} else if (strcmp(command, "timeout") == 0) {
+		if (arg == NULL || is_uint(arg, &uint_val) == FALSE ||
+		    uint_val == 0) {
+			control_reply(cc, "error: timeout needs a positive "
+				      "number");
+			return (0);
+		}
+		query_timeout = uint_val;
+	} else if (strcmp(command, "server") == 0) {
+		if (arg == NULL || set_server(arg) == -1 ||
+		    set_server_sa() == -1) {
+			control_reply(cc, "error: cannot use server %s",
+				      arg == NULL ? "(none)" : arg);
+			return (0);
+		}
+		if ((query_socket = change_socket()) == -1) {
+			/* XXX: this is fatal */
+			fprintf(stderr, "Set server error: unable to open a "
+				"new socket for '%s'\n", arg);
+			exit(1);
+		}
+	} else {
+		control_reply(cc, "error: unknown command %s (try help)",
+			      command);
+		return (0);
+	}
+
+	control_reply(cc, "ok");
+	return (0);
+}
+
+/*
+ * control_process:
+ *   Accept control connections and carry out the commands received on
+ *   them, given the descriptors select() found readable
+ */
+static void
+control_process(fd_set *fds) {
+	struct control_client *cc;
+	char *p, *nl;
+	ssize_t n;
+	int i, fd;
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		cc = &control_clients[i];
+		if (cc->fd == -1 || !FD_ISSET(cc->fd, fds))
+			continue;
+
+		n = read(cc->fd, cc->line + cc->len,
+			 sizeof(cc->line) - 1 - cc->len);
+		if (n <= 0) {
+			if (n == -1 && errno == EAGAIN)
+				continue;
+			goto drop;
+		}
+		cc->len += n;
+		cc->line[cc->len] = '\0';
+
+		p = cc->line;
+		while ((nl = strchr(p, '\n')) != NULL) {
+			*nl = '\0';
+			if (control_command(cc, p) == -1)
+				goto drop;
+			p = nl + 1;
+		}
+		cc->len -= p - cc->line;
+		memmove(cc->line, p, cc->len);
+		if (cc->len == sizeof(cc->line) - 1) {
+			control_reply(cc, "error: line too long");
+			goto drop;
+		}
+		continue;
+
+ drop:
+		close(cc->fd);
+		cc->fd = -1;
+	}
+
+	if (!FD_ISSET(control_fd, fds))
+		return;
+	while ((fd = accept(control_fd, NULL, NULL)) != -1) {
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+			if (control_clients[i].fd == -1)
+				break;
+		if (i == MAX_CONTROL_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		control_clients[i].fd = fd;
+		control_clients[i].len = 0;
+	}
+}
+
+/*
+ * data_available:
+ *   Is there data available on the given file descriptor?
+ *
+ *   Return TRUE if there is
+ *   Return FALSE otherwise
+ */
+int
+data_available(double wait) {
+	fd_set read_fds;
+	struct timeval tv;
+	unsigned long long t = 0;
+	int retval;
+	int available = FALSE;
+	int maxfd = -1;
+
+	/* Set list of file descriptors */
+	FD_ZERO(&read_fds);
+	if (socket4 != -1) {
+		FD_SET(socket4, &read_fds);
+		maxfd = socket4;
+	}
+	if (socket6 != -1) {
+		FD_SET(socket6, &read_fds);
+		if (maxfd == -1 || maxfd < socket6)
+			maxfd = socket6;
+	}
+	if (control_fd != -1)
+		control_set_fds(&read_fds, &maxfd);
+
+	if ((wait > 0.0) && (wait < (double)LONG_MAX)) {
+		tv.tv_sec = (long)floor(wait);
+		tv.tv_usec = (long)(1000000.0 * (wait - floor(wait)));
+	} else {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	}
+
+	PROFILE_BEGIN(t);
+	retval = select(maxfd + 1, &read_fds, NULL, NULL, &tv);
+	PROFILE_END(PHASE_POLL, t);
+	if (retval <= 0)
+		return (FALSE);
+
+	if (control_fd != -1)
+		control_process(&read_fds);
+
+	if (socket4 != -1 && FD_ISSET(socket4, &read_fds)) {
+		available = TRUE;
+		process_single_response(socket4);
+	}
+	if (socket6 != -1 && FD_ISSET(socket6, &read_fds)) {
+		available = TRUE;
+		process_single_response(socket6);
+	}
+
+	return (available);
+}
+
+/*
+ * process_responses:
+ *   Go through any/all received responses and remove them from the list of
+ *   open queries (set in_use = FALSE for their entry in status[]), also
+ *   decrementing the number of outstanding queries.
+ */
+void
 process_responses(int adjust_rate) {
-	double wait;
+	double wait, write_wait;
 	struct timeval now, waituntil;
 	double first_packet_wait = RESPONSE_BLOCKING_WAIT_TIME;
 	unsigned int outstanding = queries_outstanding();
@@ -1767,8 +7943,10 @@ process_responses(int adjust_rate) {
 	if (adjust_rate == TRUE) {
 		double u;
 
-		u = time_of_first_query_sec +
-			query_interval * num_queries_sent;
+		if (replay_speed > 0.0 && pending_capture.valid)
+			u = pending_capture.due;
+		else
+			u = next_send_time();
 		waituntil.tv_sec = (long)floor(u);
 		waituntil.tv_usec = (long)(1000000.0 * (u - waituntil.tv_sec));
 
@@ -1781,6 +7959,12 @@ process_responses(int adjust_rate) {
 			wait = difftv(waituntil, now);
 			if (wait <= 0)
 				wait = 0.0;
+			if (write_list != NULL &&
+			    (write_wait = send_due_writes()) < wait) {
+				/* Wake up for the next write, then wait on */
+				data_available(write_wait);
+				continue;
+			}
 			if (data_available(wait) != TRUE)
 				break;
 
@@ -1821,9 +8005,10 @@ process_responses(int adjust_rate) {
 void
 retire_old_queries(int sending) {
 	unsigned int count = 0;
-	struct timeval curr_time;
+	struct timeval curr_time, cutoff;
 	double timeout = query_timeout;
 	int timeout_reduced = FALSE;
+	long timeout_usec;
 
 	/*
 	 * If we have target qps and would not be able to send any packets
@@ -1835,8 +8020,7 @@ retire_old_queries(int sending) {
 		struct timeval next, now;
 		double n;
 
-		n = time_of_first_query_sec +
-			query_interval * num_queries_sent;
+		n = next_send_time();
 		next.tv_sec = (long)floor(n);
 		next.tv_usec = (long)(1000000.0 * (n - next.tv_sec));
 
@@ -1847,42 +8031,58 @@ retire_old_queries(int sending) {
 		}
 	}
 
+	if (queries_outstanding() == 0)
+		return;
+
+	/*
+	 * Work out the latest send time that has expired once, rather than
+	 * computing each query's age in floating point.
+	 */
 	set_timenow(&curr_time);
+	timeout_usec = (long)(timeout * 1000000.0);
+	cutoff.tv_sec = curr_time.tv_sec - timeout_usec / 1000000;
+	cutoff.tv_usec = curr_time.tv_usec - timeout_usec % 1000000;
+	if (cutoff.tv_usec < 0) {
+		cutoff.tv_sec--;
+		cutoff.tv_usec += 1000000;
+	}
 
 	for (; count < query_status_allocated; count++) {
-		if ((status[count].in_use == TRUE) &&
-		    (difftv(curr_time,
-			    status[count].sent_timestamp) >= (double)timeout))
+		if ((QS(count, in_use) == TRUE) &&
+		    (QS(count, sent_timestamp).tv_sec < cutoff.tv_sec ||
+		     (QS(count, sent_timestamp).tv_sec == cutoff.tv_sec &&
+		      QS(count, sent_timestamp).tv_usec <= cutoff.tv_usec)))
 		{
-			status[count].in_use = FALSE;
-			num_queries_outstanding--;
+			QS(count, in_use) = FALSE;
+			free_slots[num_free_slots++] = count;
+			ATOMIC_BUMP(&num_queries_outstanding, -1);
 
 			if (timeout_queries != NULL) {
 				struct query_mininfo *qi;
 
-				qi = &timeout_queries[status[count].id];
-				if (qi->qtype != -1) {
+				qi = &timeout_queries[QS(count, id)];
+				if (qi->qlen != 0) {
 					/* now really retire this query */
-					num_queries_timed_out++;
+					ATOMIC_BUMP(&num_queries_timed_out, 1);
 					num_queries_timed_out_interval++;
 				}
-				qi->qtype = status[count].qtype;
-				qi->sent_timestamp =
-					status[count].sent_timestamp;
-				strcpy(qi->qname, status[count].qname);
+				qi->sent_timestamp = QS(count, sent_timestamp);
+				qi->qhash = QS(count, qhash);
+				qi->qtype = QS(count, qtype);
+				qi->qlen = QS(count, qlen);
+				qi->server = QS(count, server);
 			} else {
-				num_queries_timed_out++;
+				ATOMIC_BUMP(&num_queries_timed_out, 1);
 				num_queries_timed_out_interval++;
 			}
 
 			if (timeout_reduced == FALSE) {
-				if (status[count].desc) {
-					printf("> T %s\n", status[count].desc);
-					free(status[count].desc);
+				if (query_descs != NULL) {
+					printf("> T %s\n", QUERY_DESC(count));
 				} else {
 					printf("[Timeout] Query timed out: "
 					       "msg id %u\n",
-					       status[count].id);
+					       QS(count, id));
 				}
 			}
 		}
@@ -1917,7 +8117,52 @@ print_histogram(unsigned int total) {
 			ratio);
 	}
 
-	(void)fclose(fp);
+	(void)fclose(fp);
+}
+
+/*
+ * rtt_percentile:
+ *   Estimate the RTT below which the fraction q of the counted responses
+ *   fall, from an RTT histogram.  The histogram only knows the bucket, so
+ *   the estimate is capped at max, the largest RTT seen.
+ */
+static double
+rtt_percentile(const unsigned int *rarray, unsigned int counted, double q,
+	       double max)
+{
+	unsigned long long need, seen = 0;
+	double rtt;
+	int i;
+
+	if (rarray == NULL || counted == 0)
+		return (0.0);
+
+	need = (unsigned long long)ceil(q * counted);
+	rtt = (double)rttarray_size * rttarray_unit / 1000000.0;
+	for (i = 0; i < rttarray_size; i++) {
+		seen += rarray[i];
+		if (seen >= need) {
+			rtt = ((double)i + 0.5) * rttarray_unit / 1000000.0;
+			break;
+		}
+	}
+
+	return (rtt > max ? max : rtt);
+}
+
+/*
+ * datagrams_received:
+ *   Return the number of datagrams received, matched or not, as counted
+ *   in response_sizes[]
+ */
+unsigned int
+datagrams_received(void) {
+	unsigned int i, count = 0;
+
+	for (i = 0; i <= MAX_BUFFER_LEN; i++)
+		count += response_sizes[i];
+
+	return (count);
 }
 
 /*
@@ -1931,13 +8176,16 @@ print_statistics(int intermediate, unsigned int sent, unsigned int timed_out,
 		 struct timeval *program_start,
 		 struct timeval *end_perf, struct timeval *end_query,
 		 unsigned int rcounted, double rmax, double rmin, double rtotal,
-		 unsigned int roverflows, unsigned int *rarray)
+		 unsigned int roverflows, unsigned int *rarray,
+		 double istall, unsigned int istalls,
+		 unsigned long long qbytes, unsigned long long rbytes,
+		 unsigned int rdatagrams)
 {
 	unsigned int num_queries_completed;
 	double per_lost, per_completed, per_lost2, per_completed2; 
 	double run_time, queries_per_sec, queries_per_sec2;
-	double queries_per_sec_total;
-	double rtt_average, rtt_stddev;
+	double queries_per_sec_total, send_time;
+	double rtt_average, rtt_stddev, p99;
 	struct timeval start_time;
 
 	num_queries_completed = sent - timed_out;
@@ -1964,6 +8212,7 @@ print_statistics(int intermediate, unsigned int sent, unsigned int timed_out,
 		queries_per_sec = 0.0;
 		queries_per_sec2 = 0.0;
 		queries_per_sec_total = 0.0;
+		send_time = 0.0;
 	} else {
 		start_time.tv_sec = first_query->tv_sec;
 		start_time.tv_usec = first_query->tv_usec;
@@ -1972,159 +8221,992 @@ print_statistics(int intermediate, unsigned int sent, unsigned int timed_out,
 		queries_per_sec2 = (double)(num_queries_completed +
 					    possibly_delayed) / run_time;
 
-		queries_per_sec_total = (double)sent /
-			difftv(*end_query, *first_query);
+		send_time = difftv(*end_query, *first_query);
+		queries_per_sec_total = (double)sent / send_time;
+	}
+
+	if (rcounted > 0) {
+		int i;
+		double sum = 0;
+
+		rtt_average = rtotal / (double)rcounted;
+		for (i = 0; i < rttarray_size; i++) {
+			if (rarray[i] != 0) {
+				double mean, diff;
+
+				mean = (double)(i * rttarray_unit) +
+				(double)rttarray_unit / 2;
+				diff = rtt_average - (mean / 1000000.0);
+				sum += (diff * diff) * rarray[i];
+			}
+		}
+		rtt_stddev = sqrt(sum / (double)rcounted);
+	} else {
+		rtt_average = 0.0;
+		rtt_stddev = 0.0;
+	}
+
+	printf("\n");
+
+	printf("%sStatistics:\n", intermediate ? "Intermediate " : "");
+
+	printf("\n");
+
+	if (!intermediate) {
+		printf("  Parse input file:     %s\n",
+		       ((run_only_once == TRUE) ? "once" : "multiple times"));
+		if (use_timelimit)
+			printf("  Run time limit:       %u seconds\n",
+			       run_timelimit);
+		if (run_only_once == FALSE)
+			printf("  Ran through file:     %u times\n",
+			       runs_through_file);
+		else
+			printf("  Ended due to:         reaching %s\n",
+			       ((runs_through_file == 0) ? "time limit"
+				: "end of file"));
+
+		printf("\n");
+	}
+
+	printf("  Queries sent:         %u queries\n", sent);
+	printf("  Queries completed:    %u queries\n", num_queries_completed);
+	printf("  Queries lost:         %u queries\n", timed_out);
+	printf("  Queries delayed(?):   %u queries\n", possibly_delayed);
+
+	printf("\n");
+
+	printf("  RTT max:         	%3.6lf sec\n", rmax);
+	printf("  RTT min:              %3.6lf sec\n", rmin);
+	printf("  RTT average:          %3.6lf sec\n", rtt_average);
+	printf("  RTT std deviation:    %3.6lf sec\n", rtt_stddev);
+	if (rarray != NULL) {
+		p99 = rtt_percentile(rarray, rcounted, 0.99, rmax);
+		printf("  RTT 99th percentile:  %3.6lf sec\n", p99);
+	}
+	printf("  RTT out of range:     %u queries\n", roverflows);
+
+	printf("\n");
+
+	printf("  Input stall time:     %3.6lf sec (%u stalls)\n",
+	       istall, istalls);
+	if (!intermediate && input_is_capture)
+		printf("  Capture packets read: %u (%u queries)\n",
+		       capture_packets, capture_queries);
+	if (!intermediate && trace_file_name != NULL)
+		printf("  Trace packets:        %u written (%u dropped)\n",
+		       trace.written, trace.dropped);
+
+	if (!intermediate)	/* XXX should we print this case also? */
+		print_histogram(num_queries_completed);
+
+	printf("\n");
+
+	if (countrcodes) {
+		unsigned int i;
+
+		for (i = 0; i < 16; i++) {
+			if (rcodecounts[i] == 0)
+				continue;
+			printf("  Returned %8s:    %u queries\n",
+			       rcode_strings[i], rcodecounts[i]);
+		}
+		printf("\n");
+	}
+
+	printf("  Percentage completed: %6.2lf%%\n", per_completed);
+	if (possibly_delayed > 0)
+		printf("     (w/ delayed qrys): %6.2lf%%\n", per_completed2);
+	printf("  Percentage lost:      %6.2lf%%\n", per_lost);
+	if (possibly_delayed > 0)
+		printf("    (w/o delayed qrys): %6.2lf%%\n", per_lost2);
+
+	printf("\n");
+
+	printf("  Started at:           %s",
+	       ctime((const time_t *)&start_time.tv_sec));
+	printf("  Finished at:          %s",
+	       ctime((const time_t *)&end_perf->tv_sec));
+	printf("  Ran for:              %.6lf seconds\n", run_time);
+
+	printf("\n");
+
+	printf("  Queries per second:   %.6lf qps\n", queries_per_sec);
+	if (possibly_delayed > 0) {
+		printf("   (w/ delayed qrys):   %.6lf qps\n",
+		       queries_per_sec2);
+	}
+	if (target_qps > 0) {
+		printf("  Total QPS/target:     %.6lf/%d qps\n",
+		       queries_per_sec_total, target_qps);		
+	}
+
+	printf("\n");
+
+	printf("  Query bytes sent:     %llu bytes (%.1lf average)\n",
+	       qbytes, sent > 0 ? (double)qbytes / sent : 0.0);
+	printf("  Response bytes:       %llu bytes (%.1lf average)\n",
+	       rbytes, rdatagrams > 0 ? (double)rbytes / rdatagrams : 0.0);
+	/* Queries go out until end_query, responses come in until end_perf */
+	printf("  Bandwidth out:        %.6lf Mbit/s\n",
+	       send_time > 0 ? qbytes * 8 / send_time / 1000000.0 : 0.0);
+	printf("  Bandwidth in:         %.6lf Mbit/s\n",
+	       run_time > 0 ? rbytes * 8 / run_time / 1000000.0 : 0.0);
+
+	printf("\n");
+}
+
+void
+print_interval_statistics() {
+	struct timeval time_now;
+
+	if (use_timelimit == FALSE)
+		return;
+
+	if (setup_phase == TRUE)
+		return;
+
+	if (print_interval == 0)
+		return;
+
+	if (timelimit_reached() == TRUE)
+		return;
+
+	set_timenow(&time_now);
+	if (difftv(time_now, time_of_first_query_interval)
+	    <= (double)print_interval)
+		return;
+
+	/* Don't count currently outstanding queries */
+	num_queries_sent_interval -= queries_outstanding();
+	print_statistics(TRUE, num_queries_sent_interval,
+			 num_queries_timed_out_interval,
+			 num_queries_possiblydelayed_interval,
+			 &time_of_first_query_interval,
+			 &time_of_first_query_interval, &time_now, &time_now,
+			 rtt_counted_interval, rtt_max_interval,
+			 rtt_min_interval, rtt_total_interval,
+			 rtt_overflows_interval, rttarray_interval,
+			 input_stall_time_interval, input_stalls_interval,
+			 query_bytes_interval, response_bytes_interval,
+			 response_datagrams_interval);
+
+	/* Reset intermediate counters */
+	num_queries_sent_interval = 0;
+	num_queries_timed_out_interval = 0;
+	num_queries_possiblydelayed_interval = 0;
+	rtt_max_interval = -1;
+	rtt_min_interval = -1;
+	rtt_total_interval = 0.0;
+	rtt_counted_interval = 0.0;
+	rtt_overflows_interval = 0;
+	input_stall_time_interval = 0.0;
+	input_stalls_interval = 0;
+	query_bytes_interval = 0;
+	response_bytes_interval = 0;
+	response_datagrams_interval = 0;
+	if (rttarray_interval != NULL) {
+		memset(rttarray_interval, 0,
+		       sizeof(rttarray_interval[0]) * rttarray_size);
+	}
+}
+
+/*
+ * print_server_statistics:
+ *   Print the statistics kept for each server, if there are several
+ */
+void
+print_server_statistics(void) {
+	struct server_info *srv;
+	unsigned int i;
+	double p99;
+
+	if (num_servers <= 1)
+		return;
+
+	printf("  %-32s %10s %10s %8s %10s %10s %10s\n", "Server", "Sent",
+	       "Completed", "Lost", "RTT avg", "RTT p99", "RTT max");
+	for (i = 0; i < num_servers; i++) {
+		srv = &servers[i];
+		if (srv->rtt_max < 0)
+			srv->rtt_max = 0.0;
+		p99 = rtt_percentile(srv->rttarray, srv->rtt_counted, 0.99,
+				     srv->rtt_max);
+		printf("  %-32s %10u %10u %8u %10.6lf %10.6lf %10.6lf\n",
+		       srv->name, srv->sent, srv->rtt_counted,
+		       srv->sent - srv->rtt_counted, srv->rtt_counted > 0 ?
+		       srv->rtt_total / srv->rtt_counted : 0.0,
+		       p99, srv->rtt_max);
+	}
+	printf("\n");
+}
+
+/*
+ * identity_to_text:
+ *   Render an instance identity for the report: as text if it is all
+ *   printable, or else in hex
+ */
+static void
+identity_to_text(const struct identity_info *id, char *buf) {
+	unsigned int i;
+
+	for (i = 0; i < id->len; i++)
+		if (id->name[i] < 0x20 || id->name[i] > 0x7e)
+			break;
+	if (i == id->len) {
+		memcpy(buf, id->name, id->len);
+		buf[id->len] = '\0';
+		return;
+	}
+	for (i = 0; i < id->len; i++)
+		sprintf(buf + 2 * i, "%02x", id->name[i]);
+}
+
+/*
+ * print_identity_statistics:
+ *   Print the statistics kept for each instance identity, if -I was given
+ */
+void
+print_identity_statistics(void) {
+	struct identity_info *id;
+	char name[2 * MAX_IDENTITY_LEN + 1];
+	unsigned int i, r, total = 0;
+	double p99;
+
+	if (identity_source == IDENTITY_NONE)
+		return;
+
+	for (i = 0; i < MAX_IDENTITIES; i++)
+		total += identities[i].stats.responses;
+
+	printf("  %-32s %10s %7s %8s %10s %10s %10s  %s\n", "Instance",
+	       "Responses", "Share", "Late", "RTT avg", "RTT p99", "RTT max",
+	       "Rcodes");
+	for (i = 0; i < MAX_IDENTITIES; i++) {
+		id = &identities[i];
+		if (id->stats.responses == 0)
+			continue;
+		if (i == 0)
+			strcpy(name, identity_source == IDENTITY_NSID ?
+			       "(no nsid)" : "(no txt)");
+		else if (i == MAX_IDENTITIES - 1)
+			strcpy(name, "(others)");
+		else
+			identity_to_text(id, name);
+		p99 = rtt_percentile(id->rttarray, id->stats.responses, 0.99,
+				     id->stats.rtt_max);
+		printf("  %-32s %10u %6.2lf%% %8u %10.6lf %10.6lf %10.6lf ",
+		       name, id->stats.responses,
+		       100.0 * id->stats.responses / total, id->stats.late,
+		       id->stats.rtt_total / id->stats.responses, p99,
+		       id->stats.rtt_max);
+		for (r = 0; r < 16; r++)
+			if (id->stats.rcodes[r] > 0)
+				printf(" %s %u", rcode_strings[r],
+				       id->stats.rcodes[r]);
+		printf("\n");
+	}
+	printf("\n");
+}
+
+/*
+ * print_opcode_statistics:
+ *   Print the statistics kept for each opcode, if anything but queries
+ *   was sent
+ */
+void
+print_opcode_statistics(void) {
+	static char *opcode_strings[] = OPCODE_STRINGS;
+	struct opcode_info *op;
+	unsigned int i, r, others = 0;
+	double p99;
+
+	for (i = 1; i < 16; i++)
+		others += opcodes[i].sent + opcodes[i].stats.responses;
+	if (others == 0)
+		return;
+
+	printf("  %-10s %10s %10s %8s %8s %10s %10s %10s  %s\n", "Opcode",
+	       "Sent", "Completed", "Lost", "Late", "RTT avg", "RTT p99",
+	       "RTT max", "Rcodes");
+	for (i = 0; i < 16; i++) {
+		op = &opcodes[i];
+		if (op->sent == 0 && op->stats.responses == 0)
+			continue;
+		p99 = rtt_percentile(op->rttarray, op->stats.responses, 0.99,
+				     op->stats.rtt_max);
+		printf("  %-10s %10u %10u %8u %8u %10.6lf %10.6lf %10.6lf ",
+		       opcode_strings[i], op->sent, op->stats.responses,
+		       op->sent > op->stats.responses ?
+		       op->sent - op->stats.responses : 0, op->stats.late,
+		       op->stats.responses > 0 ?
+		       op->stats.rtt_total / op->stats.responses : 0.0,
+		       p99, op->stats.rtt_max);
+		for (r = 0; r < 16; r++)
+			if (op->stats.rcodes[r] > 0)
+				printf(" %s %u", rcode_strings[r],
+				       op->stats.rcodes[r]);
+		printf("\n");
+	}
+	printf("\n");
+}
+
+/*
+ * print_size_statistics:
+ *   Print the distribution of response sizes, and the RTT of the responses
+ *   in each class of size
+ */
+void
+print_size_statistics(void) {
+	static const unsigned int bounds[] = SIZE_CLASS_BOUNDS;
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	unsigned long long total = 0, seen = 0, need;
+	unsigned int counted = 0, min = 0, max = 0;
+	unsigned int i, q;
+	struct size_class *sc;
+	char label[32];
+
+	for (i = 0; i <= MAX_BUFFER_LEN; i++) {
+		if (response_sizes[i] == 0)
+			continue;
+		if (counted == 0)
+			min = i;
+		max = i;
+		counted += response_sizes[i];
+		total += (unsigned long long)i * response_sizes[i];
+	}
+	if (counted == 0)
+		return;
+
+	printf("  Response size:        %.1lf average, %u min, %u max bytes\n",
+	       (double)total / counted, min, max);
+	for (q = 0, i = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+		need = (unsigned long long)ceil(quantiles[q] * counted);
+		for (; i <= MAX_BUFFER_LEN; i++) {
+			if (seen + response_sizes[i] >= need)
+				break;
+			seen += response_sizes[i];
+		}
+		printf("  Response size p%-2g:    %u bytes\n",
+		       quantiles[q] * 100, i);
+	}
+
+	printf("\n");
+
+	printf("  %-12s %10s %7s %10s %10s %10s\n", "Size", "Responses",
+	       "Share", "RTT avg", "RTT min", "RTT max");
+	for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+		sc = &size_classes[i];
+		if (sc->counted == 0)
+			continue;
+		if (i == 0)
+			snprintf(label, sizeof(label), "<= %u", bounds[0]);
+		else if (i == NUM_SIZE_CLASSES - 1)
+			snprintf(label, sizeof(label), "> %u", bounds[i - 1]);
+		else
+			snprintf(label, sizeof(label), "%u-%u",
+				 bounds[i - 1] + 1, bounds[i]);
+		printf("  %-12s %10u %6.2lf%% %10.6lf %10.6lf %10.6lf\n",
+		       label, sc->counted, 100.0 * sc->counted / rtt_counted,
+		       sc->rtt_total / sc->counted, sc->rtt_min, sc->rtt_max);
+	}
+	printf("\n");
+}
+
+/*
+ * print_edns_statistics:
+ *   Print how the server dealt with the EDNS options sent, if any
+ */
+void
+print_edns_statistics(void) {
+	if (!edns_cookies)
+		return;
+
+	printf("  Server cookies:       %u responses (%u without)\n",
+	       cookie_responses, cookie_missing);
+	printf("\n");
+}
+
+/*
+ * print_validation_statistics:
+ *   Print what validation found wrong with the responses, if -V was given
+ */
+void
+print_validation_statistics(void) {
+	unsigned int compared = vstats.matched + vstats.mismatched;
+
+	if (validate_responses == FALSE)
+		return;
+
+	printf("  Responses validated:  %u responses", vstats.checked);
+	if (vstats.dropped > 0)
+		printf(" (%u not: validator behind)", vstats.dropped);
+	printf("\n");
+	printf("  Not a response:       %u responses\n", vstats.not_response);
+	printf("  Wrong opcode:         %u responses\n", vstats.bad_opcode);
+	printf("  Wrong question count: %u responses\n", vstats.bad_qdcount);
+	printf("  Malformed:            %u responses\n", vstats.malformed);
+	printf("  Truncated:            %u responses\n", vstats.truncated);
+	if (tsig_key_spec != NULL) {
+		printf("  TSIG verified:        %u responses\n",
+		       vstats.tsig_verified);
+		printf("  TSIG failed:          %u responses\n",
+		       vstats.tsig_failed);
+		printf("  TSIG missing:         %u responses\n",
+		       vstats.tsig_missing);
+	}
+	if (answers_record_file != NULL)
+		printf("  Answers recorded:     %u questions\n",
+		       vstats.recorded);
+	if (answers_check_file != NULL) {
+		printf("  Answers matched:      %u responses\n",
+		       vstats.matched);
+		printf("  Answers mismatched:   %u responses (%.2lf%%)\n",
+		       vstats.mismatched, compared > 0 ?
+		       100.0 * vstats.mismatched / compared : 0.0);
+		printf("  Answers unknown:      %u responses\n",
+		       vstats.unknown);
+	}
+	printf("\n");
+}
+
+/*
+ * print_phase_profile:
+ *   Print where the main loop spent its time, if -k was given: the total,
+ *   share, average and longest (the worst stall) of each phase.  With -N
+ *   the times are summed, and the longest taken, over the workers.
+ */
+void
+print_phase_profile(void) {
+	static const char *names[NUM_PHASES] = PHASE_NAMES;
+	struct phase_report *p;
+	double accounted = 0.0;
+	int i;
+
+	if (profile_phases == FALSE || phase_loop_time <= 0.0)
+		return;
+
+	printf("  %-10s %12s %8s %12s %14s %14s\n", "Phase", "Time (sec)",
+	       "Share", "Calls", "Average (usec)", "Longest (usec)");
+	for (i = 0; i < NUM_PHASES; i++) {
+		p = &phase_totals[i];
+		accounted += p->time;
+		printf("  %-10s %12.6lf %7.2lf%% %12llu %14.3lf %14.3lf\n",
+		       names[i], p->time, 100.0 * p->time / phase_loop_time,
+		       p->calls, p->calls > 0 ?
+		       p->time * 1000000.0 / p->calls : 0.0,
+		       p->max * 1000000.0);
+	}
+	if (accounted > phase_loop_time)
+		accounted = phase_loop_time;
+	printf("  %-10s %12.6lf %7.2lf%%\n", "other",
+	       phase_loop_time - accounted,
+	       100.0 * (phase_loop_time - accounted) / phase_loop_time);
+	printf("  %-10s %12.6lf\n", "total", phase_loop_time);
+	printf("\n");
+}
+
+/*
+ * worker_write:
+ *   Write all of buf to the worker socket fd
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+static int
+worker_write(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/*
+ * worker_read:
+ *   Read exactly len bytes from the worker socket fd into buf
+ *
+ *   Return -1 on failure, including if the other end has gone
+ *   Return non-negative integer on success
+ */
+static int
+worker_read(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		p += n;
+		len -= n;
 	}
 
-	if (rcounted > 0) {
-		int i;
-		double sum = 0;
+	return (0);
+}
 
-		rtt_average = rtotal / (double)rcounted;
-		for (i = 0; i < rttarray_size; i++) {
-			if (rarray[i] != 0) {
-				double mean, diff;
+/*
+ * worker_wait_start:
+ *   Tell the coordinator this worker is ready, and wait for the moment
+ *   it gives for all the workers to start sending
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+worker_wait_start(void) {
+	struct timeval start, now;
+	struct timespec wait;
+	double delay;
+	char ready = 'R';
+
+	if (worker_write(worker_fd, &ready, 1) == -1 ||
+	    worker_read(worker_fd, &start, sizeof(start)) == -1) {
+		fprintf(stderr, "Error: worker %d lost its coordinator\n",
+			worker_index);
+		return (-1);
+	}
 
-				mean = (double)(i * rttarray_unit) +
-				(double)rttarray_unit / 2;
-				diff = rtt_average - (mean / 1000000.0);
-				sum += (diff * diff) * rarray[i];
-			}
-		}
-		rtt_stddev = sqrt(sum / (double)rcounted);
-	} else {
-		rtt_average = 0.0;
-		rtt_stddev = 0.0;
+	set_timenow(&now);
+	delay = difftv(start, now);
+	if (delay > 0) {
+		wait.tv_sec = (time_t)delay;
+		wait.tv_nsec = (long)((delay - wait.tv_sec) * 1000000000.0);
+		while (nanosleep(&wait, &wait) == -1 && errno == EINTR)
+			;
 	}
 
-	printf("\n");
+	return (0);
+}
 
-	printf("%sStatistics:\n", intermediate ? "Intermediate " : "");
+/*
+ * worker_send_report:
+ *   Send the coordinator this worker's counters and histograms
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+int
+worker_send_report(void) {
+	struct worker_report r;
+	struct worker_server_report sr;
+	struct worker_identity_report ir;
+	struct worker_opcode_report orep;
+	struct server_info *srv;
+	struct identity_info *id;
+	struct opcode_info *op;
+	unsigned int i;
+
+	memset(&r, 0, sizeof(r));
+	r.sent = num_queries_sent;
+	r.timed_out = num_queries_timed_out;
+	r.possibly_delayed = num_queries_possiblydelayed;
+	r.rtt_counted = rtt_counted;
+	r.rtt_overflows = rtt_overflows;
+	r.rtt_max = rtt_max;
+	r.rtt_min = rtt_min;
+	r.rtt_total = rtt_total;
+	r.input_stall_time = input_stall_time;
+	r.input_stalls = input_stalls;
+	r.runs_through_file = runs_through_file;
+	r.capture_packets = capture_packets;
+	r.capture_queries = capture_queries;
+	r.trace_written = trace.written;
+	r.trace_dropped = trace.dropped;
+	memcpy(r.rcodecounts, rcodecounts, sizeof(r.rcodecounts));
+	r.first_query = time_of_first_query;
+	r.end_of_run = time_of_end_of_run;
+	r.stop_sending = time_of_stop_sending;
+	r.have_histogram = (rttarray != NULL);
+	r.num_servers = num_servers;
+	r.loop_time = phase_loop_time;
+	memcpy(r.phases, phase_totals, sizeof(r.phases));
+	r.validation = vstats;
+	r.query_bytes = query_bytes;
+	r.response_bytes = response_bytes;
+	memcpy(r.size_classes, size_classes, sizeof(r.size_classes));
+	r.cookie_responses = cookie_responses;
+	r.cookie_missing = cookie_missing;
+
+	if (worker_write(worker_fd, &r, sizeof(r)) == -1)
+		goto fail;
+	if (rttarray != NULL &&
+	    worker_write(worker_fd, rttarray,
+			 rttarray_size * sizeof(rttarray[0])) == -1)
+		goto fail;
 
-	printf("\n");
+	for (i = 0; i < num_servers; i++) {
+		srv = &servers[i];
+		memset(&sr, 0, sizeof(sr));
+		sr.sent = srv->sent;
+		sr.rtt_counted = srv->rtt_counted;
+		sr.rtt_total = srv->rtt_total;
+		sr.rtt_max = srv->rtt_max;
+		sr.have_histogram = (srv->rttarray != NULL);
+		if (worker_write(worker_fd, &sr, sizeof(sr)) == -1)
+			goto fail;
+		if (srv->rttarray != NULL &&
+		    worker_write(worker_fd, srv->rttarray,
+				 rttarray_size * sizeof(srv->rttarray[0])) == -1)
+			goto fail;
+	}
+	if (worker_write(worker_fd, response_sizes,
+			 sizeof(response_sizes)) == -1)
+		goto fail;
 
-	if (!intermediate) {
-		printf("  Parse input file:     %s\n",
-		       ((run_only_once == TRUE) ? "once" : "multiple times"));
-		if (use_timelimit)
-			printf("  Run time limit:       %u seconds\n",
-			       run_timelimit);
-		if (run_only_once == FALSE)
-			printf("  Ran through file:     %u times\n",
-			       runs_through_file);
-		else
-			printf("  Ended due to:         reaching %s\n",
-			       ((runs_through_file == 0) ? "time limit"
-				: "end of file"));
+	for (i = 0; identity_source != IDENTITY_NONE && i < MAX_IDENTITIES;
+	     i++) {
+		id = &identities[i];
+		memset(&ir, 0, sizeof(ir));
+		memcpy(ir.name, id->name, id->len);
+		ir.len = id->len;
+		ir.stats = id->stats;
+		ir.have_histogram = (id->rttarray != NULL &&
+				     id->stats.responses > 0);
+		if (worker_write(worker_fd, &ir, sizeof(ir)) == -1)
+			goto fail;
+		if (ir.have_histogram &&
+		    worker_write(worker_fd, id->rttarray,
+				 rttarray_size * sizeof(id->rttarray[0])) == -1)
+			goto fail;
+	}
 
-		printf("\n");
+	for (i = 0; i < 16; i++) {
+		op = &opcodes[i];
+		memset(&orep, 0, sizeof(orep));
+		orep.sent = op->sent;
+		orep.stats = op->stats;
+		orep.have_histogram = (op->rttarray != NULL &&
+				       op->stats.responses > 0);
+		if (worker_write(worker_fd, &orep, sizeof(orep)) == -1)
+			goto fail;
+		if (orep.have_histogram &&
+		    worker_write(worker_fd, op->rttarray,
+				 rttarray_size * sizeof(op->rttarray[0])) == -1)
+			goto fail;
 	}
 
-	printf("  Queries sent:         %u queries\n", sent);
-	printf("  Queries completed:    %u queries\n", num_queries_completed);
-	printf("  Queries lost:         %u queries\n", timed_out);
-	printf("  Queries delayed(?):   %u queries\n", possibly_delayed);
+	close(worker_fd);
+	return (0);
 
-	printf("\n");
+ fail:
+	fprintf(stderr, "Error: worker %d could not send its report\n",
+		worker_index);
+	return (-1);
+}
 
-	printf("  RTT max:         	%3.6lf sec\n", rmax);
-	printf("  RTT min:              %3.6lf sec\n", rmin);
-	printf("  RTT average:          %3.6lf sec\n", rtt_average);
-	printf("  RTT std deviation:    %3.6lf sec\n", rtt_stddev);
-	printf("  RTT out of range:     %u queries\n", roverflows);
+/*
+ * merge_histogram:
+ *   Read a histogram from fd and add it into *into, allocating that if
+ *   need be
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+static int
+merge_histogram(int fd, unsigned int **into, unsigned int *buf) {
+	int i;
 
-	if (!intermediate)	/* XXX should we print this case also? */
-		print_histogram(num_queries_completed);
+	if (worker_read(fd, buf, rttarray_size * sizeof(buf[0])) == -1)
+		return (-1);
+	if (*into == NULL &&
+	    (*into = calloc(rttarray_size, sizeof(buf[0]))) == NULL)
+		return (-1);
+	for (i = 0; i < rttarray_size; i++)
+		(*into)[i] += buf[i];
 
-	printf("\n");
+	return (0);
+}
 
-	if (countrcodes) {
-		unsigned int i;
+/*
+ * merge_worker_report:
+ *   Read a worker's report from fd and add it to the totals, which the
+ *   coordinator keeps in the same variables as a lone process would
+ *
+ *   Return -1 on failure
+ *   Return non-negative integer on success
+ */
+static int
+merge_worker_report(int fd, struct worker_report *r, unsigned int *buf) {
+	static unsigned int sizes[MAX_BUFFER_LEN + 1];
+	struct worker_server_report sr;
+	struct worker_identity_report ir;
+	struct worker_opcode_report orep;
+	struct server_info *srv;
+	struct identity_info *id;
+	struct opcode_info *op;
+	struct size_class *sc;
+	unsigned int i, j;
+
+	if (worker_read(fd, r, sizeof(*r)) == -1 ||
+	    r->num_servers != num_servers)
+		return (-1);
+	if (r->have_histogram && merge_histogram(fd, &rttarray, buf) == -1)
+		return (-1);
 
-		for (i = 0; i < 16; i++) {
-			if (rcodecounts[i] == 0)
-				continue;
-			printf("  Returned %8s:    %u queries\n",
-			       rcode_strings[i], rcodecounts[i]);
-		}
-		printf("\n");
+	for (i = 0; i < num_servers; i++) {
+		srv = &servers[i];
+		if (worker_read(fd, &sr, sizeof(sr)) == -1)
+			return (-1);
+		if (sr.have_histogram &&
+		    merge_histogram(fd, &srv->rttarray, buf) == -1)
+			return (-1);
+		srv->sent += sr.sent;
+		srv->rtt_counted += sr.rtt_counted;
+		srv->rtt_total += sr.rtt_total;
+		if (srv->rtt_max < sr.rtt_max)
+			srv->rtt_max = sr.rtt_max;
 	}
+	if (worker_read(fd, sizes, sizeof(sizes)) == -1)
+		return (-1);
+	for (i = 0; i <= MAX_BUFFER_LEN; i++)
+		response_sizes[i] += sizes[i];
 
-	printf("  Percentage completed: %6.2lf%%\n", per_completed);
-	if (possibly_delayed > 0)
-		printf("     (w/ delayed qrys): %6.2lf%%\n", per_completed2);
-	printf("  Percentage lost:      %6.2lf%%\n", per_lost);
-	if (possibly_delayed > 0)
-		printf("    (w/o delayed qrys): %6.2lf%%\n", per_lost2);
-
-	printf("\n");
-
-	printf("  Started at:           %s",
-	       ctime((const time_t *)&start_time.tv_sec));
-	printf("  Finished at:          %s",
-	       ctime((const time_t *)&end_perf->tv_sec));
-	printf("  Ran for:              %.6lf seconds\n", run_time);
+	for (i = 0; identity_source != IDENTITY_NONE && i < MAX_IDENTITIES;
+	     i++) {
+		if (worker_read(fd, &ir, sizeof(ir)) == -1)
+			return (-1);
+		if (i == 0 || i == MAX_IDENTITIES - 1)
+			id = &identities[i];
+		else if (ir.stats.responses > 0 || ir.stats.late > 0)
+			id = intern_identity(ir.name, ir.len);
+		else
+			continue;
+		if (ir.have_histogram &&
+		    merge_histogram(fd, &id->rttarray, buf) == -1)
+			return (-1);
+		id->stats.late += ir.stats.late;
+		if (ir.stats.responses == 0)
+			continue;
+		if (id->stats.responses == 0 ||
+		    id->stats.rtt_min > ir.stats.rtt_min)
+			id->stats.rtt_min = ir.stats.rtt_min;
+		if (id->stats.rtt_max < ir.stats.rtt_max)
+			id->stats.rtt_max = ir.stats.rtt_max;
+		id->stats.rtt_total += ir.stats.rtt_total;
+		id->stats.responses += ir.stats.responses;
+		for (j = 0; j < 16; j++)
+			id->stats.rcodes[j] += ir.stats.rcodes[j];
+	}
 
-	printf("\n");
+	for (i = 0; i < 16; i++) {
+		op = &opcodes[i];
+		if (worker_read(fd, &orep, sizeof(orep)) == -1)
+			return (-1);
+		if (orep.have_histogram &&
+		    merge_histogram(fd, &op->rttarray, buf) == -1)
+			return (-1);
+		op->sent += orep.sent;
+		if (orep.stats.responses == 0)
+			continue;
+		if (op->stats.responses == 0 ||
+		    op->stats.rtt_min > orep.stats.rtt_min)
+			op->stats.rtt_min = orep.stats.rtt_min;
+		if (op->stats.rtt_max < orep.stats.rtt_max)
+			op->stats.rtt_max = orep.stats.rtt_max;
+		op->stats.rtt_total += orep.stats.rtt_total;
+		op->stats.responses += orep.stats.responses;
+		op->stats.late += orep.stats.late;
+		for (j = 0; j < 16; j++)
+			op->stats.rcodes[j] += orep.stats.rcodes[j];
+	}
 
-	printf("  Queries per second:   %.6lf qps\n", queries_per_sec);
-	if (possibly_delayed > 0) {
-		printf("   (w/ delayed qrys):   %.6lf qps\n",
-		       queries_per_sec2);
+	num_queries_sent += r->sent;
+	num_queries_timed_out += r->timed_out;
+	num_queries_possiblydelayed += r->possibly_delayed;
+	rtt_counted += r->rtt_counted;
+	rtt_overflows += r->rtt_overflows;
+	rtt_total += r->rtt_total;
+	if (r->rtt_max >= 0 && (rtt_max < 0 || rtt_max < r->rtt_max))
+		rtt_max = r->rtt_max;
+	if (r->rtt_min >= 0 && (rtt_min < 0 || rtt_min > r->rtt_min))
+		rtt_min = r->rtt_min;
+	input_stall_time += r->input_stall_time;
+	input_stalls += r->input_stalls;
+	/* Each worker reads all of a capture, and keeps only its share */
+	if (capture_packets < r->capture_packets)
+		capture_packets = r->capture_packets;
+	capture_queries += r->capture_queries;
+	if (r->capture_packets > 0)
+		input_is_capture = TRUE;
+	trace.written += r->trace_written;
+	trace.dropped += r->trace_dropped;
+	for (i = 0; i < 16; i++)
+		rcodecounts[i] += r->rcodecounts[i];
+	phase_loop_time += r->loop_time;
+	if (r->validation.checked > 0 || r->validation.dropped > 0)
+		validate_responses = TRUE;
+	vstats.checked += r->validation.checked;
+	vstats.not_response += r->validation.not_response;
+	vstats.bad_opcode += r->validation.bad_opcode;
+	vstats.bad_qdcount += r->validation.bad_qdcount;
+	vstats.malformed += r->validation.malformed;
+	vstats.truncated += r->validation.truncated;
+	vstats.dropped += r->validation.dropped;
+	vstats.recorded += r->validation.recorded;
+	vstats.matched += r->validation.matched;
+	vstats.mismatched += r->validation.mismatched;
+	vstats.unknown += r->validation.unknown;
+	vstats.tsig_verified += r->validation.tsig_verified;
+	vstats.tsig_failed += r->validation.tsig_failed;
+	vstats.tsig_missing += r->validation.tsig_missing;
+	query_bytes += r->query_bytes;
+	response_bytes += r->response_bytes;
+	if (r->cookie_responses > 0 || r->cookie_missing > 0)
+		edns_cookies = TRUE;
+	cookie_responses += r->cookie_responses;
+	cookie_missing += r->cookie_missing;
+	for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+		sc = &size_classes[i];
+		if (r->size_classes[i].counted == 0)
+			continue;
+		if (sc->counted == 0 || sc->rtt_min > r->size_classes[i].rtt_min)
+			sc->rtt_min = r->size_classes[i].rtt_min;
+		if (sc->rtt_max < r->size_classes[i].rtt_max)
+			sc->rtt_max = r->size_classes[i].rtt_max;
+		sc->rtt_total += r->size_classes[i].rtt_total;
+		sc->counted += r->size_classes[i].counted;
 	}
-	if (target_qps > 0) {
-		printf("  Total QPS/target:     %.6lf/%d qps\n",
-		       queries_per_sec_total, target_qps);		
+	for (i = 0; i < NUM_PHASES; i++) {
+		phase_totals[i].time += r->phases[i].time;
+		phase_totals[i].calls += r->phases[i].calls;
+		if (phase_totals[i].max < r->phases[i].max)
+			phase_totals[i].max = r->phases[i].max;
 	}
 
-	printf("\n");
+	/* The run goes from the first worker's start to the last's end */
+	if (r->sent > 0 && (time_of_first_query.tv_sec == 0 ||
+			    difftv(r->first_query, time_of_first_query) < 0))
+		time_of_first_query = r->first_query;
+	if (difftv(r->end_of_run, time_of_end_of_run) > 0)
+		time_of_end_of_run = r->end_of_run;
+	if (difftv(r->stop_sending, time_of_stop_sending) > 0)
+		time_of_stop_sending = r->stop_sending;
+
+	return (0);
 }
 
-void
-print_interval_statistics() {
-	struct timeval time_now;
+/*
+ * coordinate_workers:
+ *   Run the coordinator side of -N: start all the workers together once
+ *   they are ready, then gather their reports and print the statistics
+ *   for the whole run
+ *
+ *   Return -1 on failure
+ *   Return 1 if a worker exited abnormally, e.g. on a corrupt corpus
+ *   Return 0 otherwise
+ */
+int
+coordinate_workers(void) {
+	static struct worker_report reports[MAX_WORKERS];
+	struct worker_report *r;
+	struct timeval start, delay;
+	unsigned int i, *buf = NULL;
+	int status, failed = FALSE;
+	char ready;
+
+	for (i = 0; i < num_workers; i++) {
+		if (worker_read(workers[i].fd, &ready, 1) == -1) {
+			fprintf(stderr, "Error: worker %u failed to start\n",
+				i);
+			goto fail;
+		}
+	}
 
-	if (use_timelimit == FALSE)
-		return;
+	set_timenow(&start);
+	delay.tv_sec = 0;
+	delay.tv_usec = WORKER_START_DELAY;
+	addtv(&start, &delay, &start);
+	for (i = 0; i < num_workers; i++) {
+		if (worker_write(workers[i].fd, &start, sizeof(start)) == -1) {
+			fprintf(stderr, "Error: lost worker %u\n", i);
+			goto fail;
+		}
+	}
 
-	if (setup_phase == TRUE)
-		return;
+	printf("[Status] Processing input data with %u workers\n",
+	       num_workers);
+	fflush(stdout);
 
-	if (print_interval == 0)
-		return;
+	if (rttarray_size > 0 &&
+	    (buf = malloc(rttarray_size * sizeof(buf[0]))) == NULL) {
+		fprintf(stderr, "Error: allocating memory for RTT array\n");
+		goto fail;
+	}
+	runs_through_file = UINT_MAX;
+	for (i = 0; i < num_workers; i++) {
+		r = &reports[i];
+		if (merge_worker_report(workers[i].fd, r, buf) == -1) {
+			fprintf(stderr, "Error: no report from worker %u\n",
+				i);
+			goto fail;
+		}
+		/* Every worker has been through its share that often */
+		if (runs_through_file > r->runs_through_file)
+			runs_through_file = r->runs_through_file;
+	}
+	free(buf);
 
-	if (timelimit_reached() == TRUE)
-		return;
+	for (i = 0; i < num_workers; i++) {
+		close(workers[i].fd);
+		if (waitpid(workers[i].pid, &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = TRUE;
+	}
+	if (failed)
+		fprintf(stderr, "Warning: a worker exited abnormally\n");
 
-	set_timenow(&time_now);
-	if (difftv(time_now, time_of_first_query_interval)
-	    <= (double)print_interval)
-		return;
+	printf("[Status] Testing complete\n");
 
-	/* Don't count currently outstanding queries */
-	num_queries_sent_interval -= queries_outstanding();
-	print_statistics(TRUE, num_queries_sent_interval,
-			 num_queries_timed_out_interval,
-			 num_queries_possiblydelayed_interval,
-			 &time_of_first_query_interval,
-			 &time_of_first_query_interval, &time_now, &time_now,
-			 rtt_counted_interval, rtt_max_interval,
-			 rtt_min_interval, rtt_total_interval,
-			 rtt_overflows_interval, rttarray_interval);
+	print_statistics(FALSE, num_queries_sent, num_queries_timed_out,
+			 num_queries_possiblydelayed,
+			 &time_of_first_query, &time_of_program_start,
+			 &time_of_end_of_run, &time_of_stop_sending,
+			 rtt_counted, rtt_max, rtt_min, rtt_total,
+			 rtt_overflows, rttarray,
+			 input_stall_time, input_stalls,
+			 query_bytes, response_bytes, datagrams_received());
+	print_server_statistics();
+	print_identity_statistics();
+	print_opcode_statistics();
+	print_size_statistics();
+	print_edns_statistics();
+	print_validation_statistics();
+	print_phase_profile();
+
+	printf("  %-8s %10s %10s %8s %14s\n", "Worker", "Sent", "Completed",
+	       "Lost", "QPS");
+	for (i = 0; i < num_workers; i++) {
+		r = &reports[i];
+		printf("  %-8u %10u %10u %8u %14.6lf\n", i, r->sent,
+		       r->sent - r->timed_out, r->timed_out, r->sent > 0 ?
+		       (r->sent - r->timed_out) /
+		       difftv(r->end_of_run, r->first_query) : 0.0);
+	}
+	printf("\n");
 
-	/* Reset intermediate counters */
-	num_queries_sent_interval = 0;
-	num_queries_timed_out_interval = 0;
-	num_queries_possiblydelayed_interval = 0;
-	rtt_max_interval = -1;
-	rtt_min_interval = -1;
-	rtt_total_interval = 0.0;
-	rtt_counted_interval = 0.0;
-	rtt_overflows_interval = 0;
-	if (rttarray_interval != NULL) {
-		memset(rttarray_interval, 0,
-		       sizeof(rttarray_interval[0]) * rttarray_size);
+	return (failed ? 1 : 0);
+
+ fail:
+	free(buf);
+	for (i = 0; i < num_workers; i++) {
+		kill(workers[i].pid, SIGTERM);
+		close(workers[i].fd);
 	}
+	for (i = 0; i < num_workers; i++)
+		(void)waitpid(workers[i].pid, NULL, 0);
+	return (-1);
 }
 
 /*
@@ -2135,8 +9217,12 @@ main(int argc, char **argv) {
 	int adjust_rate;
 	int sending = FALSE;
 	int got_eof = FALSE;
-	int input_length = MAX_INPUT_LEN;
-	char input_line[MAX_INPUT_LEN + 1];
+	char *input_line;
+	struct captured_query *cq;
+	struct corpus_query *cr;
+	struct timeval now;
+	unsigned long long t = 0;
+	int len;
 
 	set_timenow(&time_of_program_start);
 	time_of_first_query.tv_sec = 0;
@@ -2145,31 +9231,73 @@ main(int argc, char **argv) {
 	time_of_first_query_interval.tv_usec = 0;
 	time_of_end_of_run.tv_sec = 0;
 	time_of_end_of_run.tv_usec = 0;
-
-	input_line[0] = '\0';
+	input.fd = -1;
+	metrics.fd = -1;
 
 	show_startup_info();
 
 	if (setup(argc, argv) == -1)
 		return (-1);
 
+	if (worker_index == -1 && num_workers > 1)
+		return (coordinate_workers());
+
 	/* XXX: move this to setup: */
-	timeout_queries = malloc(sizeof(struct query_mininfo) * 65536);
-	if (timeout_queries == NULL) {
+	timeout_queries = calloc(65536, sizeof(struct query_mininfo));
+	id_slots = calloc(65536, sizeof(id_slots[0]));
+	if (timeout_queries == NULL || id_slots == NULL) {
 		fprintf(stderr,
 			"failed to allocate memory for timeout queries\n");
 		return (-1);
-	} else {
-		int i;
-		for (i = 0; i < 65536; i++)
-			timeout_queries[i].qtype = -1;
 	}
 
-	printf("[Status] Processing input data\n");
+	if (check_input_format() == -1)
+		return (-1);
+
+	if (replay_speed > 0.0 && input_is_capture == FALSE) {
+		fprintf(stderr, "-S needs packet capture input\n");
+		return (-1);
+	}
+
+	if (sample_weighted || zipf_exponent > 0.0) {
+		if (input.binary) {
+			fprintf(stderr, "-W and -Z need a text query file\n");
+			return (-1);
+		}
+		if (load_corpus() == -1)
+			return (-1);
+	}
+
+	if (load_write_file() == -1)
+		return (-1);
+
+	if (trace_start() == -1)
+		return (-1);
+
+	if (validate_start() == -1)
+		return (-1);
+
+	if (control_open() == -1)
+		return (-1);
+
+	if (metrics_start() == -1)
+		return (-1);
+
+	if (stats_open() == -1)
+		return (-1);
+
+	if (worker_index >= 0) {
+		if (worker_wait_start() == -1)
+			return (-1);
+	} else
+		printf("[Status] Processing input data\n");
 
+	profile_start();
 	while ((sending = keep_sending(&got_eof)) == TRUE ||
 	       queries_outstanding() > 0)
 	{
+		PROFILE_BEGIN(t);
+		stats_publish(FALSE);
 		if (num_queries_sent_interval > 0){
 			/*
 			 * After statistics are printed, send_query()
@@ -2178,34 +9306,74 @@ main(int argc, char **argv) {
 			 */
 			print_interval_statistics();
 		}
+		PROFILE_END(PHASE_STATS, t);
 		adjust_rate = FALSE;
 
+		if (write_list != NULL && sending == TRUE)
+			send_due_writes();
+
 		while ((sending = keep_sending(&got_eof)) == TRUE &&
 		       queries_outstanding() < max_queries_outstanding)
 		{
-			int len = next_input_line(input_line, input_length);
-			if (len == 0) {
+			if (input_is_capture) {
+				PROFILE_BEGIN(t);
+				cq = next_captured_query();
+				PROFILE_END(PHASE_INPUT, t);
+				if (cq == NULL) {
+					got_eof = TRUE;
+					continue;
+				}
+				if (replay_speed > 0.0) {
+					set_timenow(&now);
+					if (cq->due > (double)now.tv_sec +
+					    (double)now.tv_usec / 1000000.0) {
+						adjust_rate = TRUE;
+						break;
+					}
+				}
+				send_captured_query(cq);
+				if (target_qps > 0 && replay_speed == 0.0 &&
+				    ((num_queries_sent - num_writes_sent) %
+				     max_queries_outstanding) == 0)
+					adjust_rate = TRUE;
+				continue;
+			}
+
+			if (input_is_corpus) {
+				PROFILE_BEGIN(t);
+				cr = next_corpus_query();
+				PROFILE_END(PHASE_INPUT, t);
+				if (cr == NULL) {
+					got_eof = TRUE;
+					continue;
+				}
+				send_corpus_query(cr);
+				if (target_qps > 0 &&
+				    ((num_queries_sent - num_writes_sent) %
+				     max_queries_outstanding) == 0)
+					adjust_rate = TRUE;
+				continue;
+			}
+
+			PROFILE_BEGIN(t);
+			if (corpus_count > 0)
+				input_line = next_sampled_line(&len);
+			else
+				input_line = next_input_line(&len);
+			PROFILE_END(PHASE_INPUT, t);
+			if (input_line == NULL) {
 				got_eof = TRUE;
 			} else {
-				/* Zap the trailing newline */
-				if (input_line[len - 1] == '\n')
-					input_line[len - 1] = '\0';
-
-				/*
-				 * TODO: Should test if we got a whole line
-				 * and flush to the next \n in input if not
-				 * here... Add this later. Only do the next
-				 * few lines if we got a whole line, else
-				 * print a warning. Alternative: Make the
-				 * max line size really big. BAD! :)
-				 */
-
 				if (input_line[0] == CONFIG_CHAR)
 					update_config(input_line);
+				else if (corpus_count == 0 &&
+					 worker_takes_query() == FALSE)
+					continue;
 				else {
 					send_query(input_line);
 					if (target_qps > 0 &&
-					    (num_queries_sent %
+					    ((num_queries_sent -
+					      num_writes_sent) %
 					     max_queries_outstanding) == 0) {
 						adjust_rate = TRUE;
 					}
@@ -2214,22 +9382,43 @@ main(int argc, char **argv) {
 		}
 
 		process_responses(adjust_rate);
+		PROFILE_BEGIN(t);
 		retire_old_queries(sending);
+		PROFILE_END(PHASE_RETIRE, t);
 	}
 
 	set_timenow(&time_of_end_of_run);
+	profile_stop();
+	stats_close();
 
-	printf("[Status] Testing complete\n");
+	if (worker_index == -1)
+		printf("[Status] Testing complete\n");
 
+	trace_stop();
+	validate_stop();
+	metrics_stop();
+	control_close();
 	close_socket();
 	close_datafile();
 
+	if (worker_index >= 0)
+		return (worker_send_report() == -1 || corpus_corrupt ? 1 : 0);
+
 	print_statistics(FALSE, num_queries_sent, num_queries_timed_out,
 			 num_queries_possiblydelayed,
 			 &time_of_first_query, &time_of_program_start,
 			 &time_of_end_of_run, &time_of_stop_sending,
 			 rtt_counted, rtt_max, rtt_min, rtt_total,
-			 rtt_overflows, rttarray);
-
-	return (0);
+			 rtt_overflows, rttarray,
+			 input_stall_time, input_stalls,
+			 query_bytes, response_bytes, datagrams_received());
+	print_server_statistics();
+	print_identity_statistics();
+	print_opcode_statistics();
+	print_size_statistics();
+	print_edns_statistics();
+	print_validation_statistics();
+	print_phase_profile();
+
+	return (corpus_corrupt ? 1 : 0);
 }
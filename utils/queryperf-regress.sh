@@ -0,0 +1,321 @@
+#!/bin/sh
+#
+# Run queryperf through a fixed matrix of scenarios - EDNS off and on,
+# each -q window, each -T rate (0 for as fast as possible) and, with -y,
+# unsigned and TSIG signed queries - several times over, against
+# queryperf-reflector or a given server, and write the throughput, 99th
+# percentile RTT and losses of every run as JSON.  With -B, or in compare
+# mode (-C), the results are compared with a saved baseline, and the
+# scenarios whose throughput fell or whose p99 RTT rose, by more than the
+# threshold and significantly by Welch's t-test over the runs (one-sided,
+# at the 5% level), are reported as regressions, with an exit status
+# of 2.
+#
+# Usage: queryperf-regress.sh [-l seconds] [-n runs] [-q windows]
+#                             [-T rates] [-e edns] [-d datafile]
+#                             [-s server] [-p port] [-S command]
+#                             [-j threads] [-y key] [-o results]
+#                             [-B baseline] [-t percent] [builddir]
+#        queryperf-regress.sh -C [-t percent] baseline results
+#
+
+seconds=3
+runs=5
+windows="20 200"
+rates="0 10000"
+ednses="off on"
+datafile=
+server=
+port=53535
+command=
+threads=1
+results=queryperf-regress.json
+baseline=
+threshold=2
+tsigkey=
+tsigs=off
+compare=
+# Enough socket buffer (in kB) for the responses to a full window of
+# queries arriving back to back
+bufsize=4096
+
+usage() {
+	echo "Usage: $0 [-l seconds] [-n runs] [-q windows] [-T rates]" >&2
+	echo "          [-e edns] [-d datafile] [-s server] [-p port]" >&2
+	echo "          [-S command] [-j threads] [-y key] [-o results]" >&2
+	echo "          [-B baseline] [-t percent] [builddir]" >&2
+	echo "       $0 -C [-t percent] baseline results" >&2
+	exit 1
+}
+
+while getopts l:n:q:T:e:d:s:p:S:j:y:o:B:t:Ch opt; do
+	case $opt in
+	l) seconds=$OPTARG ;;
+	n) runs=$OPTARG ;;
+	q) windows=$OPTARG ;;
+	T) rates=$OPTARG ;;
+	e) ednses=$OPTARG ;;
+	d) datafile=$OPTARG ;;
+	s) server=$OPTARG ;;
+	p) port=$OPTARG ;;
+	S) command=$OPTARG ;;
+	j) threads=$OPTARG ;;
+	y) tsigkey=$OPTARG; tsigs="off on" ;;
+	o) results=$OPTARG ;;
+	B) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	C) compare=yes ;;
+	*) usage ;;
+	esac
+done
+shift `expr $OPTIND - 1`
+
+# compare baseline results: report the changes between two result files
+compare() {
+	for file in "$1" "$2"; do
+		if [ ! -r "$file" ]; then
+			echo "$0: cannot read $file" >&2
+			exit 1
+		fi
+	done
+	awk -v threshold=$threshold '
+		# value key: a number from a run line
+		function value(key,    s) {
+			if (!match($0, "\"" key "\": *[-0-9.e+]+"))
+				return ("")
+			s = substr($0, RSTART, RLENGTH)
+			sub(/^[^:]*: */, "", s)
+			return (s + 0)
+		}
+		# tcrit df: one-sided 5% critical value of the t distribution
+		# (Cornish-Fisher expansion about the normal)
+		function tcrit(df,    z, t) {
+			z = 1.644854
+			t = z + (z^3 + z) / (4 * df)
+			t += (5 * z^5 + 16 * z^3 + 3 * z) / (96 * df^2)
+			t += (3 * z^7 + 19 * z^5 + 17 * z^3 - 15 * z) / \
+				(384 * df^3)
+			return (t)
+		}
+		# report scenario metric worse: compare a metric, for which
+		# worse is the sign of a regression
+		function report(s, m, worse,    n1, n2, m1, m2, v1, v2, se,
+				t, df, change, verdict) {
+			n1 = n[1, s, m]; n2 = n[2, s, m]
+			m1 = sum[1, s, m] / n1; m2 = sum[2, s, m] / n2
+			v1 = n1 > 1 ? (sq[1, s, m] - n1 * m1^2) / (n1 - 1) : 0
+			v2 = n2 > 1 ? (sq[2, s, m] - n2 * m2^2) / (n2 - 1) : 0
+			if (v1 < 0) v1 = 0
+			if (v2 < 0) v2 = 0
+			change = m1 != 0 ? (m2 / m1 - 1) * 100 : 0
+			se = sqrt(v1 / n1 + v2 / n2)
+			if (n1 < 2 || n2 < 2) {
+				t = "-"; verdict = "too few runs"
+			} else {
+				if (se > 0) {
+					t = (m2 - m1) / se
+					df = (v1 / n1)^2 / (n1 - 1)
+					df += (v2 / n2)^2 / (n2 - 1)
+					df = se^4 / df
+				} else {
+					t = m2 == m1 ? 0 : (m2 > m1 ? 1e9 : -1e9)
+					df = n1 + n2 - 2
+				}
+				verdict = "ok"
+				if (worse * t > tcrit(df) &&
+				    worse * change > threshold) {
+					verdict = "REGRESSION"
+					regressions++
+				} else if (-worse * t > tcrit(df) &&
+					   -worse * change > threshold)
+					verdict = "improved"
+				t = sprintf("%.2f", t)
+			}
+			printf("%-32s %-4s %12.6g %12.6g %+8.2f%% %8s  %s\n",
+			       s, m, m1, m2, change, t, verdict)
+		}
+		FNR == 1 { file++ }
+		/"scenario":/ {
+			match($0, /"scenario": *"[^"]*"/)
+			s = substr($0, RSTART, RLENGTH)
+			sub(/^"scenario": *"/, "", s); sub(/"$/, "", s)
+			if (!(s in seen)) {
+				seen[s] = 1
+				order[++scenarios] = s
+			}
+			for (i = 1; i <= 2; i++) {
+				m = i == 1 ? "qps" : "p99"
+				v = value(m)
+				if (v == "")
+					continue
+				n[file, s, m]++
+				sum[file, s, m] += v
+				sq[file, s, m] += v * v
+			}
+		}
+		END {
+			printf("%-32s %-4s %12s %12s %9s %8s  %s\n", "Scenario",
+			       "", "Baseline", "Current", "Change", "t", "")
+			for (i = 1; i <= scenarios; i++) {
+				s = order[i]
+				if (n[1, s, "qps"] == 0 || n[2, s, "qps"] == 0) {
+					where = n[1, s, "qps"] ? "baseline" : "results"
+					printf("%-32s only in %s\n", s, where)
+					continue
+				}
+				report(s, "qps", -1)
+				if (n[1, s, "p99"] > 0 && n[2, s, "p99"] > 0)
+					report(s, "p99", 1)
+			}
+			printf("\n%d regression(s) beyond %s%%\n", regressions,
+			       threshold)
+			exit (regressions > 0 ? 2 : 0)
+		}' "$1" "$2"
+}
+
+if [ -n "$compare" ]; then
+	[ $# -eq 2 ] || usage
+	compare "$1" "$2"
+	exit $?
+fi
+
+[ $# -le 1 ] || usage
+bin=${1:-.}
+
+for prog in queryperf queryperf-reflector queryperf-gen; do
+	if [ ! -x "$bin/$prog" ]; then
+		echo "$0: $bin/$prog not found (run make first)" >&2
+		exit 1
+	fi
+done
+
+tmp=`mktemp -d ${TMPDIR:-/tmp}/qpregress.XXXXXX` || exit 1
+daemon=
+cleanup() {
+	[ -n "$daemon" ] && kill $daemon 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+if [ -z "$datafile" ]; then
+	datafile=$tmp/queries
+	"$bin/queryperf-gen" -n 100000 -p 1 -T A:80,AAAA:20 -s 1 \
+		-o "$datafile" || exit 1
+fi
+
+if [ -n "$server" ]; then
+	target="$server#$port"
+else
+	server=127.0.0.1
+	if [ -n "$command" ]; then
+		target="$command"
+		sh -c "exec $command" > $tmp/server.out 2>&1 &
+	else
+		target="queryperf-reflector, $threads thread(s)"
+		"$bin/queryperf-reflector" -p $port -j $threads -U \
+			> $tmp/server.out 2>&1 &
+	fi
+	daemon=$!
+	sleep 1
+	if ! kill -0 $daemon 2>/dev/null; then
+		echo "$0: the server did not start:" >&2
+		cat $tmp/server.out >&2
+		exit 1
+	fi
+fi
+
+# stat label: a value from the queryperf report
+stat() {
+	sed -n "s/^  $1: *\([0-9.]*\).*/\1/p" $tmp/run.out | head -1
+}
+
+echo "Server: $target on $server#$port"
+echo "$runs run(s) of ${seconds}s per scenario"
+echo
+
+{
+	echo "{"
+	echo "  \"version\": 1,"
+	echo "  \"date\": \"`date -u +%Y-%m-%dT%H:%M:%SZ`\","
+	echo "  \"host\": \"`uname -n`\","
+	echo "  \"server\": \"`echo "$target" | sed 's/["\\]/\\\\&/g'`\","
+	echo "  \"seconds\": $seconds,"
+	echo "  \"runs\": ["
+} > $tmp/results
+
+modes=
+for edns in $ednses; do
+	for tsig in $tsigs; do
+		modes="$modes $edns/$tsig"
+	done
+done
+
+# The runs of a scenario are spread over the whole time, not back to
+# back, so that drift in the machine's load affects all scenarios alike
+sep=
+run=1
+while [ $run -le $runs ]; do
+	for mode in $modes; do
+		edns=${mode%/*}
+		tsig=${mode#*/}
+		for window in $windows; do
+			for rate in $rates; do
+				scenario="edns=$edns,q=$window,T=$rate"
+				flags="-q $window -b $bufsize"
+				[ "$edns" = on ] && flags="$flags -e"
+				[ "$rate" -gt 0 ] && flags="$flags -T $rate"
+				if [ -n "$tsigkey" ]; then
+					# Kept apart from the unsigned
+					# scenarios of results without -y
+					scenario="$scenario,tsig=$tsig"
+					[ "$tsig" = on ] &&
+						flags="$flags -y $tsigkey"
+				fi
+				"$bin/queryperf" -d "$datafile" -s $server \
+					-p $port -l $seconds $flags \
+					> $tmp/run.out 2>&1
+				qps=`stat "Queries per second"`
+				p99=`stat "RTT 99th percentile"`
+				lost=`stat "Queries lost"`
+				if [ -z "$qps" ]; then
+					echo "$0: queryperf failed in" \
+					     "$scenario:" >&2
+					tail -5 $tmp/run.out >&2
+					exit 1
+				fi
+				printf "%-32s run %d: %12s qps, p99 %s sec," \
+				       "$scenario" $run $qps $p99
+				echo " $lost lost"
+				printf "%s    { \"scenario\": \"%s\"," "$sep" \
+				       "$scenario" >> $tmp/results
+				printf " \"edns\": %s, \"window\": %d," \
+				       `[ $edns = on ] && echo true ||
+					echo false` $window >> $tmp/results
+				printf " \"target\": %d, \"run\": %d," \
+				       $rate $run >> $tmp/results
+				printf " \"qps\": %s, \"p99\": %s," \
+				       $qps ${p99:-0} >> $tmp/results
+				printf " \"lost\": %s }" $lost >> $tmp/results
+				sep=",
+"
+			done
+		done
+	done
+	run=`expr $run + 1`
+done
+
+{
+	echo
+	echo "  ]"
+	echo "}"
+} >> $tmp/results
+cp $tmp/results "$results" || exit 1
+echo
+echo "Results written to $results"
+
+if [ -n "$baseline" ]; then
+	echo
+	compare "$baseline" "$results"
+	exit $?
+fi
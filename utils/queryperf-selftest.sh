@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Measure what queryperf itself can do on this machine, against
+# queryperf-reflector on the loopback interface: its maximum query rate,
+# how closely it keeps to a target rate, and how accurately it measures
+# a known latency.  Run it from the build directory, or give that as the
+# argument.
+#
+# Usage: queryperf-selftest.sh [-l seconds] [-j threads] [-d datafile]
+#                              [-L msec] [-p port] [builddir]
+#
+
+seconds=10
+threads=1
+datafile=
+latency=1
+port=53535
+
+usage() {
+	echo "Usage: $0 [-l seconds] [-j threads] [-d datafile] [-L msec]" >&2
+	echo "          [-p port] [builddir]" >&2
+	exit 1
+}
+
+while getopts l:j:d:L:p:h opt; do
+	case $opt in
+	l) seconds=$OPTARG ;;
+	j) threads=$OPTARG ;;
+	d) datafile=$OPTARG ;;
+	L) latency=$OPTARG ;;
+	p) port=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift `expr $OPTIND - 1`
+[ $# -le 1 ] || usage
+bin=${1:-.}
+
+for prog in queryperf queryperf-reflector queryperf-gen; do
+	if [ ! -x "$bin/$prog" ]; then
+		echo "$0: $bin/$prog not found (run make first)" >&2
+		exit 1
+	fi
+done
+
+tmp=`mktemp -d ${TMPDIR:-/tmp}/qpselftest.XXXXXX` || exit 1
+reflector=
+cleanup() {
+	[ -n "$reflector" ] && kill $reflector 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+if [ -z "$datafile" ]; then
+	datafile=$tmp/queries
+	"$bin/queryperf-gen" -n 100000 -p 1 -T A:80,AAAA:20 -s 1 \
+		-o "$datafile" || exit 1
+fi
+
+# start_reflector [options]: (re)start the reflector with these options
+start_reflector() {
+	[ -n "$reflector" ] && kill $reflector 2>/dev/null && wait $reflector
+	"$bin/queryperf-reflector" -p $port -j $threads -U "$@" \
+		> $tmp/reflector.out &
+	reflector=$!
+	sleep 1
+}
+
+# run_queryperf name [options]: run queryperf, keeping its output
+run_queryperf() {
+	name=$1
+	shift
+	"$bin/queryperf" -d "$datafile" -s 127.0.0.1 -p $port -l $seconds \
+		-b 4096 "$@" > $tmp/$name.out 2>&1
+}
+
+# stat name label: a value from a queryperf report
+stat() {
+	sed -n "s/^  $2: *\([0-9.]*\).*/\1/p" $tmp/$1.out | head -1
+}
+
+echo "Reflector: $threads thread(s) on 127.0.0.1#$port, ${seconds}s per test"
+echo
+
+start_reflector
+run_queryperf max -q 500
+max=`stat max "Queries per second"`
+echo "Maximum rate:          $max qps (`stat max "Queries lost"` lost)"
+
+target=`echo $max | awk '{ printf "%d", $1 / 2 }'`
+if [ "$target" -gt 0 ]; then
+	run_queryperf rate -q 500 -T $target
+	achieved=`sed -n 's/^  Total QPS\/target: *\([0-9.]*\).*/\1/p' \
+		$tmp/rate.out`
+	echo "Rate at half maximum:  $achieved qps of $target" |
+		awk '{ printf "%s (%+.2f%%)\n", $0, ($5 / $8 - 1) * 100 }'
+fi
+
+start_reflector -l fixed:$latency
+run_queryperf latency -q 100 -T 1000
+echo "RTT of a ${latency}ms reflector at 1000 qps:"
+awk -v want=$latency '
+	/^  RTT min:/ { min = $3 }
+	/^  RTT average:/ { avg = $3 }
+	/^  RTT std deviation:/ { sd = $4 }
+	END {
+		printf "  min %.3fms, average %.3fms (%+.3fms), " \
+		       "std deviation %.3fms\n", min * 1000, avg * 1000, \
+		       avg * 1000 - want, sd * 1000
+	}' $tmp/latency.out